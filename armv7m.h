@@ -56,6 +56,9 @@ class SCB
         static bool sysTickIntrPending(void) { return *_s_icsr & SCB_ICSR_PENDSTSET; }
         static void setSleepDeep(void) { *_s_scr |= SCB_SCR_SLEEPDEEP; }
         static void clearSleepDeep(void) { *_s_scr &= ~SCB_SCR_SLEEPDEEP; }
+
+        // Sleeps until the next interrupt, deep sleeps if set above
+        static void waitForInterrupt(void) { __asm__ volatile ("wfi"); }
         static int executionPriority(void);
 
     private:
@@ -0,0 +1,767 @@
+#include "audio.h"
+#include "file.h"
+#include "types.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Tags ////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int AudioTags::skip(File * fp, int audio)
+{
+    int front = (audio < 0) ? AudioTags::front(fp) : audio;
+    if ((front < 0) || ((uint32_t)front > fp->size()))
+        return -1;
+
+    uint32_t size = fp->size();
+    uint32_t start = front, end = size;
+    uint8_t buf[_s_ape_len];
+
+    // ID3v1 is the last 128 bytes and starts with "TAG"
+    if ((end - start) >= _s_id3v1_len)
+    {
+        if (!read(fp, end - _s_id3v1_len, buf, 3))
+            return -1;
+
+        if ((buf[0] == 'T') && (buf[1] == 'A') && (buf[2] == 'G'))
+            end -= _s_id3v1_len;
+    }
+
+    // APE comes before ID3v1 if there are both.  The size in the footer counts
+    // the items and the footer, and there's a header too if bit 31 of the
+    // flags is set.
+    if ((end - start) >= _s_ape_len)
+    {
+        if (!read(fp, end - _s_ape_len, buf, _s_ape_len))
+            return -1;
+
+        if (memcmp(buf, "APETAGEX", 8) == 0)
+        {
+            uint32_t len = le32(&buf[12]);
+
+            if (le32(&buf[20]) & 0x80000000)
+                len += _s_ape_len;
+
+            if (len <= (end - start))
+                end -= len;
+        }
+    }
+
+    if (!fp->trim(end) || !fp->seek(start))
+        return -1;
+
+    return start + (size - end);
+}
+
+// ID3v2, sometimes more than one.  The size is syncsafe, 7 bits to a byte,
+// and doesn't count the header or the footer, which only v2.4 can have.
+int AudioTags::front(File * fp)
+{
+    if ((fp == nullptr) || !fp->valid())
+        return -1;
+
+    uint32_t start = 0, end = fp->size();
+    uint8_t buf[_s_id3v2_len];
+
+    while ((end - start) >= _s_id3v2_len)
+    {
+        if (!read(fp, start, buf, _s_id3v2_len))
+            return -1;
+
+        if ((buf[0] != 'I') || (buf[1] != 'D') || (buf[2] != '3')
+                || (buf[3] == 0xFF) || (buf[4] == 0xFF)
+                || ((buf[6] | buf[7] | buf[8] | buf[9]) & 0x80))
+            break;
+
+        uint32_t len = _s_id3v2_len + (((uint32_t)buf[6] << 21)
+                | ((uint32_t)buf[7] << 14) | ((uint32_t)buf[8] << 7) | buf[9]);
+
+        if (buf[5] & 0x10)
+            len += _s_id3v2_len;
+
+        if (len > (end - start))
+            break;
+
+        start += len;
+    }
+
+    return start;
+}
+
+bool AudioTags::read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len)
+{
+    return fp->seek(offset) && (fp->read(buf, len) == len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Atoms ///////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int AudioAtoms::plan(File * fp, SpanFile & view)
+{
+    if ((fp == nullptr) || !fp->valid())
+        return -1;
+
+    uint32_t size = fp->size();
+    Atom ftyp = {}, moov = {}, mdat = {}, atom;
+    uint32_t type, dropped = 0;
+    bool reorder = false;
+    int err;
+
+    for (uint32_t off = 0; off < size; off += atom.len)
+    {
+        if ((err = header(fp, off, size, atom, type)) <= 0)
+            return err;
+
+        switch (type)
+        {
+            case fourcc("ftyp"):
+                if (ftyp.len != 0) return 0;
+                ftyp = atom;
+                break;
+
+            case fourcc("moov"):
+                if (moov.len != 0) return 0;
+                moov = atom;
+                break;
+
+            case fourcc("mdat"):
+                // More than one and the offsets can't be moved by the one amount
+                if (mdat.len != 0) return 0;
+                mdat = atom;
+                reorder = (moov.len == 0);
+                break;
+
+            default:
+                dropped += atom.len;
+                break;
+        }
+    }
+
+    if ((ftyp.len == 0) || (moov.len == 0) || (mdat.len == 0) || (ftyp.offset != 0))
+        return 0;
+
+    // Children of moov that are kept, less udta and free space
+    Atom kids[_s_max_children];
+    uint8_t num_kids = 0;
+    uint32_t moov_len = moov.hlen;
+
+    for (uint32_t off = moov.offset + moov.hlen; off < (moov.offset + moov.len); off += atom.len)
+    {
+        if ((err = header(fp, off, moov.offset + moov.len, atom, type)) <= 0)
+            return err;
+
+        if ((type == fourcc("udta")) || (type == fourcc("free")) || (type == fourcc("skip")))
+        {
+            dropped += atom.len;
+            continue;
+        }
+
+        if (num_kids == _s_max_children)
+            return 0;
+
+        kids[num_kids++] = atom;
+        moov_len += atom.len;
+    }
+
+    // A 64 bit moov header is left as is rather than rewritten
+    if ((moov_len != moov.len) && (moov.hlen != 8))
+    {
+        dropped -= moov.len - moov_len;
+        moov_len = moov.len;
+        num_kids = 0;
+    }
+
+    if (!reorder && (dropped == 0))
+        return 0;
+
+    Table tabs[_s_max_tables];
+    uint8_t num_tabs = 0;
+
+    if ((err = tables(fp, moov, tabs, num_tabs)) <= 0)
+        return err;
+
+    // Nothing to say where the samples are so don't move them
+    if (num_tabs == 0)
+        return 0;
+
+    int32_t delta = (int32_t)((ftyp.len + moov_len) - mdat.offset);
+
+    if (!view.open(fp))
+        return 0;
+
+    bool ok = view.add(ftyp.offset, ftyp.len);
+
+    if (moov_len == moov.len)
+    {
+        ok = ok && view.add(moov.offset, moov.len);
+    }
+    else
+    {
+        uint8_t head[8] = {
+            (uint8_t)(moov_len >> 24), (uint8_t)(moov_len >> 16),
+            (uint8_t)(moov_len >> 8), (uint8_t)moov_len, 'm', 'o', 'o', 'v' };
+
+        ok = ok && view.add(0, 0, head, sizeof(head));
+        for (uint8_t i = 0; ok && (i < num_kids); i++)
+            ok = view.add(kids[i].offset, kids[i].len);
+    }
+
+    ok = ok && view.add(mdat.offset, mdat.len);
+
+    for (uint8_t i = 0; ok && (i < num_tabs); i++)
+        ok = view.patch(tabs[i].offset, tabs[i].len, tabs[i].width, delta);
+
+    if (!ok)
+    {
+        view.detach();
+        return 0;
+    }
+
+    return 1;
+}
+
+// Returns 0 if it doesn't look like an atom
+int AudioAtoms::header(File * fp, uint32_t offset, uint32_t end, Atom & atom, uint32_t & type)
+{
+    uint8_t buf[16];
+
+    if ((end - offset) < 8)
+        return 0;
+
+    if (!read(fp, offset, buf, 8))
+        return -1;
+
+    uint32_t len = be32(&buf[0]);
+    type = be32(&buf[4]);
+
+    atom.offset = offset;
+    atom.hlen = 8;
+
+    if (len == 1)
+    {
+        if ((end - offset) < 16)
+            return 0;
+
+        if (!read(fp, offset + 8, &buf[8], 8))
+            return -1;
+
+        // Over 4GB
+        if (be32(&buf[8]) != 0)
+            return 0;
+
+        len = be32(&buf[12]);
+        atom.hlen = 16;
+    }
+    else if (len == 0)
+    {
+        len = end - offset;
+    }
+
+    if ((len < atom.hlen) || (len > (end - offset)))
+        return 0;
+
+    atom.len = len;
+
+    return 1;
+}
+
+// Finds the chunk offset tables under moov by way of trak, mdia, minf and stbl.
+// Returns 0 if anything unexpected turns up.
+int AudioAtoms::tables(File * fp, Atom const & parent, Table * tabs, uint8_t & num)
+{
+    struct Level { uint32_t off; uint32_t end; };
+
+    Level stack[_s_max_depth];
+    uint8_t depth = 0;
+
+    stack[depth++] = { parent.offset + parent.hlen, parent.offset + parent.len };
+
+    while (depth != 0)
+    {
+        Level & lvl = stack[depth - 1];
+
+        if (lvl.off >= lvl.end)
+        {
+            depth--;
+            continue;
+        }
+
+        Atom atom;
+        uint32_t type;
+        int err;
+
+        if ((err = header(fp, lvl.off, lvl.end, atom, type)) <= 0)
+            return err;
+
+        lvl.off += atom.len;
+
+        if ((type == fourcc("trak")) || (type == fourcc("mdia"))
+                || (type == fourcc("minf")) || (type == fourcc("stbl")))
+        {
+            if (depth == _s_max_depth)
+                return 0;
+
+            stack[depth++] = { atom.offset + atom.hlen, atom.offset + atom.len };
+        }
+        else if ((type == fourcc("stco")) || (type == fourcc("co64")))
+        {
+            // Version and flags, entry count, then the entries
+            uint8_t buf[8];
+            uint8_t width = (type == fourcc("stco")) ? 4 : 8;
+
+            if ((atom.len - atom.hlen) < sizeof(buf))
+                return 0;
+
+            if (!read(fp, atom.offset + atom.hlen, buf, sizeof(buf)))
+                return -1;
+
+            uint32_t count = be32(&buf[4]);
+            uint32_t start = atom.offset + atom.hlen + sizeof(buf);
+
+            if ((num == _s_max_tables) || (count > ((atom.offset + atom.len - start) / width)))
+                return 0;
+
+            tabs[num++] = { start, count * width, width };
+        }
+    }
+
+    return 1;
+}
+
+bool AudioAtoms::read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len)
+{
+    return fp->seek(offset) && (fp->read(buf, len) == len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3 Index ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+bool Mp3Index::init(File * fp)
+{
+    _type = NONE;
+    _ref = 0;
+    _toc_at = 0;
+
+    int start = AudioTags::front(fp);
+    if (start < 0)
+        return false;
+
+    uint32_t hdr;
+    int first = find(fp, start, hdr);
+
+    Frame f;
+    if ((first < 0) || !frame(hdr, f))
+        return false;
+
+    _ref = hdr;
+    _first = first;
+    _bytes = fp->size() - _first;
+    _bitrate = f.bitrate;
+
+    if (xing(fp, f) || vbri(fp, f))
+        return true;
+
+    _secs = ((uint64_t)_bytes * 8) / _bitrate;
+    _type = CBR;
+
+    return true;
+}
+
+// Falls back to parsing the file if the TOC can't be got from where the
+// scan found it.
+bool Mp3Index::init(File * fp, TrackMeta const & meta)
+{
+    Frame f;
+
+    _type = NONE;
+    _ref = 0;
+    _toc_at = 0;
+
+    if ((meta.codec != TrackMeta::CODEC_MP3) || (meta.index == NONE) || (meta.index > TOC)
+            || (meta.duration == 0) || !frame(meta.ref, f) || ((meta.first + meta.bytes) > fp->size()))
+        return init(fp);
+
+    _ref = meta.ref;
+    _first = meta.first;
+    _bytes = meta.bytes;
+    _secs = meta.duration;
+    _bitrate = meta.bitrate;
+
+    if (meta.index != TOC)
+    {
+        _type = (type_e)meta.index;
+        return true;
+    }
+
+    if (meta.toc == 0)
+    {
+        if (vbri(fp, f) && (_type == TOC))
+            return true;
+
+        return init(fp);
+    }
+
+    for (uint8_t i = 0; i < _s_toc_len; i += 16)
+    {
+        uint8_t len = ((_s_toc_len - i) < 16) ? _s_toc_len - i : 16;
+
+        if (!read(fp, meta.toc + i, &_toc[i], len))
+            return init(fp);
+    }
+
+    _toc_at = meta.toc;
+    _type = TOC;
+
+    return true;
+}
+
+void Mp3Index::save(TrackMeta & meta) const
+{
+    Frame f;
+
+    meta.index = _type;
+
+    if (!valid() || !frame(_ref, f))
+        return;
+
+    meta.first = _first;
+    meta.bytes = _bytes;
+    meta.duration = _secs;
+    meta.bitrate = ((_type == CBR) || (_secs == 0)) ? _bitrate : (uint32_t)(((uint64_t)_bytes * 8) / _secs);
+    meta.samplerate = f.samplerate;
+    meta.ref = _ref;
+    meta.toc = _toc_at;
+}
+
+uint32_t Mp3Index::offset(uint32_t secs) const
+{
+    if (!valid() || (_secs == 0))
+        return _first;
+
+    if (secs >= _secs)
+        return _first + _bytes;
+
+    uint64_t pos;
+
+    if (_type == CBR)
+    {
+        pos = ((uint64_t)secs * _bitrate) / 8;
+    }
+    else if (_type == AVG)
+    {
+        pos = ((uint64_t)secs * _bytes) / _secs;
+    }
+    else
+    {
+        // Percent to thousandths and interpolate between the entries
+        uint32_t x = (uint32_t)(((uint64_t)secs * _s_toc_len * 1000) / _secs);
+        uint32_t i = x / 1000, frac = x % 1000;
+        uint32_t a = _toc[i];
+        uint32_t b = (i < (_s_toc_len - 1)) ? _toc[i + 1] : 256;
+
+        if (b < a)
+            b = a;
+
+        pos = ((uint64_t)_bytes * ((a * 1000) + ((b - a) * frac))) / (256 * 1000);
+    }
+
+    if (pos > _bytes)
+        pos = _bytes;
+
+    return _first + (uint32_t)pos;
+}
+
+bool Mp3Index::sync(File * fp, uint32_t offset) const
+{
+    if (!valid())
+        return false;
+
+    uint32_t hdr;
+    int at = find(fp, offset, hdr);
+
+    return (at >= 0) && fp->seek(at);
+}
+
+// Looks for a header like the first frame's, checking there's another where
+// the frame ends so a stray sync pattern in the audio isn't taken for one.
+// Before the first frame is known any valid header does.
+int Mp3Index::find(File * fp, uint32_t offset, uint32_t & hdr) const
+{
+    uint32_t size = fp->size();
+    uint32_t end = ((size - offset) > _s_sync_window) ? offset + _s_sync_window : size;
+    uint8_t buf[64];
+
+    while ((offset + 4) <= end)
+    {
+        uint32_t len = end - offset;
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+
+        if (!read(fp, offset, buf, len))
+            return -1;
+
+        for (uint32_t i = 0; (i + 4) <= len; i++)
+        {
+            if ((buf[i] != 0xFF) || ((buf[i + 1] & 0xE0) != 0xE0))
+                continue;
+
+            Frame f;
+            uint32_t h = be32(&buf[i]);
+
+            if (((_ref != 0) && !match(h)) || !frame(h, f))
+                continue;
+
+            uint32_t at = offset + i;
+            uint8_t next[4];
+
+            if ((at + f.len + 4) <= size)
+            {
+                if (!read(fp, at + f.len, next, sizeof(next)))
+                    return -1;
+
+                uint32_t nh = be32(next);
+                if ((nh & _s_ref_mask) != (h & _s_ref_mask))
+                    continue;
+            }
+
+            hdr = h;
+            return at;
+        }
+
+        // Keep the last 3 bytes in case a header straddles the reads
+        offset += len - 3;
+    }
+
+    return -1;
+}
+
+bool Mp3Index::frame(uint32_t hdr, Frame & f)
+{
+    // Kbps by [version is MPEG1][layer - 1][index]
+    static uint16_t const bitrates[2][3][15] = {
+        {   // MPEG2 and 2.5
+            { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+            { 0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160 },
+            { 0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160 },
+        },
+        {   // MPEG1
+            { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+            { 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+            { 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 },
+        },
+    };
+
+    static uint16_t const samplerates[3] = { 44100, 48000, 32000 };
+
+    if ((hdr & 0xFFE00000) != 0xFFE00000)
+        return false;
+
+    uint8_t version = (hdr >> 19) & 0x03;  // 0 - 2.5, 1 - reserved, 2 - 2, 3 - 1
+    uint8_t layer = 4 - ((hdr >> 17) & 0x03);  // 4 is reserved
+    uint8_t br = (hdr >> 12) & 0x0F;
+    uint8_t sr = (hdr >> 10) & 0x03;
+    uint8_t pad = (hdr >> 9) & 0x01;
+    bool mono = ((hdr >> 6) & 0x03) == 0x03;
+    bool v1 = (version == 3);
+
+    if ((version == 1) || (layer == 4) || (br == 0) || (br == 15) || (sr == 3))
+        return false;
+
+    f.bitrate = (uint32_t)bitrates[v1][layer - 1][br] * 1000;
+    f.samplerate = samplerates[sr] >> (v1 ? 0 : ((version == 2) ? 1 : 2));
+
+    if (layer == 1)
+    {
+        f.samples = 384;
+        f.len = (((12 * f.bitrate) / f.samplerate) + pad) * 4;
+    }
+    else if ((layer == 2) || v1)
+    {
+        f.samples = 1152;
+        f.len = ((144 * f.bitrate) / f.samplerate) + pad;
+    }
+    else
+    {
+        f.samples = 576;
+        f.len = ((72 * f.bitrate) / f.samplerate) + pad;
+    }
+
+    f.side = (layer != 3) ? 0 : (v1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+
+    return true;
+}
+
+// Xing, or Info for CBR, follows the side info of the first frame.  Flags say
+// which of frame count, byte count, TOC and quality are there, in that order.
+bool Mp3Index::xing(File * fp, Frame const & f)
+{
+    uint8_t buf[16];
+    uint32_t at = _first + 4 + f.side;
+
+    if (!read(fp, at, buf, 8))
+        return false;
+
+    bool info = (memcmp(buf, "Info", 4) == 0);
+    if (!info && (memcmp(buf, "Xing", 4) != 0))
+        return false;
+
+    uint32_t flags = be32(&buf[4]);
+    at += 8;
+
+    if (!(flags & 0x01))
+        return false;
+
+    if (!read(fp, at, buf, 4))
+        return false;
+
+    uint32_t frames = be32(buf);
+    at += 4;
+
+    if (flags & 0x02)
+    {
+        if (!read(fp, at, buf, 4))
+            return false;
+
+        uint32_t bytes = be32(buf);
+        if ((bytes != 0) && (bytes <= _bytes))
+            _bytes = bytes;
+
+        at += 4;
+    }
+
+    _secs = ((uint64_t)frames * f.samples) / f.samplerate;
+    if (_secs == 0)
+        return false;
+
+    _type = info ? CBR : AVG;
+
+    if (info || !(flags & 0x04))
+        return true;
+
+    uint8_t const chunk = sizeof(buf);
+
+    for (uint8_t i = 0; i < _s_toc_len; i += chunk)
+    {
+        uint8_t len = ((_s_toc_len - i) < chunk) ? _s_toc_len - i : chunk;
+
+        if (!read(fp, at + i, &_toc[i], len))
+            return true;  // Still have the average
+    }
+
+    _toc_at = at;
+    _type = TOC;
+
+    return true;
+}
+
+// VBRI is always 32 bytes after the header.  Its TOC gives the bytes in each
+// run of frames, which is turned into a Xing style one.
+bool Mp3Index::vbri(File * fp, Frame const & f)
+{
+    uint8_t buf[26];
+    uint32_t at = _first + 4 + 32;
+
+    if (!read(fp, at, buf, sizeof(buf)) || (memcmp(buf, "VBRI", 4) != 0))
+        return false;
+
+    uint32_t bytes = be32(&buf[10]);
+    uint32_t frames = be32(&buf[14]);
+    uint16_t entries = ((uint16_t)buf[18] << 8) | buf[19];
+    uint16_t scale = ((uint16_t)buf[20] << 8) | buf[21];
+    uint8_t width = buf[23];
+
+    if ((bytes != 0) && (bytes <= _bytes))
+        _bytes = bytes;
+
+    _secs = ((uint64_t)frames * f.samples) / f.samplerate;
+    if (_secs == 0)
+        return false;
+
+    _type = AVG;
+
+    if ((entries == 0) || (width == 0) || (width > 4))
+        return true;
+
+    at += sizeof(buf);
+
+    uint64_t sum = 0;
+    uint8_t p = 0;
+
+    for (uint16_t i = 0; i < entries; i++)
+    {
+        // Entry i starts at i / entries of the way through
+        while ((p < _s_toc_len) && (((uint32_t)p * entries) / _s_toc_len) <= i)
+            _toc[p++] = (sum >= _bytes) ? 255 : (uint8_t)((sum * 256) / _bytes);
+
+        if (!read(fp, at, buf, width))
+            return true;
+
+        at += width;
+
+        uint32_t val = 0;
+        for (uint8_t j = 0; j < width; j++)
+            val = (val << 8) | buf[j];
+
+        sum += (uint64_t)val * scale;
+        if (sum > _bytes)
+            sum = _bytes;
+    }
+
+    while (p < _s_toc_len)
+        _toc[p++] = 255;
+
+    _type = TOC;
+
+    return true;
+}
+
+bool Mp3Index::read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len)
+{
+    return fp->seek(offset) && (fp->read(buf, len) == len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Track Sniffer ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int TrackSniffer::sniff(File * fp, uint8_t * meta, uint16_t len)
+{
+    TrackMeta m;
+
+    if ((fp == nullptr) || (meta == nullptr) || (len < sizeof(m)))
+        return 0;
+
+    memset(&m, 0, sizeof(m));
+    m.version = TrackMeta::VERSION;
+
+    if (is(fp, "MP3"))
+    {
+        int start = AudioTags::front(fp);
+        if (start < 0)
+            return 0;
+
+        m.codec = TrackMeta::CODEC_MP3;
+        m.start = start;
+
+        if (_index.init(fp))
+            _index.save(m);
+    }
+    else if (is(fp, "M4A"))
+    {
+        m.codec = TrackMeta::CODEC_AAC;
+        m.bytes = fp->size();
+    }
+    else
+    {
+        return 0;
+    }
+
+    memcpy(meta, &m, sizeof(m));
+
+    return sizeof(m);
+}
+
+bool TrackSniffer::is(File const * fp, char const * ext)
+{
+    String < NS > const & name = fp->name();
+    int index = name.rfind((chr_t *)ext);
+
+    return (index > 0) && (name[index-1] == '.') && ((name.len() - (uint16_t)strlen(ext)) == index);
+}
@@ -7,6 +7,7 @@
 #include "file.h"
 #include "spi.h"
 #include "spi_cta.h"
+#include "dma.h"
 #include "vs1053_plugins.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -68,6 +69,173 @@ class DevAmplifier : public DevPin < PinOut, PIN >
         DevAmplifier(void) { if (!this->valid()) return; this->_pin.clear(); }
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Tags ////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Finds the audio in an MP3 file - past any ID3v2 tags at the front and short
+// of APE and ID3v1 tags at the back - and seeks and trims the file to it so
+// none of the tag data, mostly embedded artwork, goes over SDI.
+class AudioTags
+{
+    public:
+        // Returns the number of bytes left out or -1 if the file couldn't be read.
+        // Pass audio if where it begins is already known.
+        static int skip(File * fp, int audio = -1);
+
+        // Where the audio starts, i.e. past any ID3v2 tags, or -1
+        static int front(File * fp);
+
+    private:
+        static bool read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len);
+        static uint32_t le32(uint8_t const * p)
+        { return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0]; }
+
+        static constexpr uint8_t const _s_id3v2_len = 10;   // Header and footer
+        static constexpr uint8_t const _s_id3v1_len = 128;
+        static constexpr uint8_t const _s_ape_len = 32;     // Header and footer
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Atoms ///////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Walks the atom headers of an MP4/M4A file and lays out a view of it for the
+// decoder: ftyp, then moov less its udta (where the artwork is) and any free
+// space, then mdat.  Every other top level atom is left out.  The decoder
+// can't seek so a moov that comes after mdat has to be sent first anyway.
+// The chunk offsets in stco/co64 are adjusted as they're read to where mdat
+// ends up.
+class AudioAtoms
+{
+    public:
+        // Returns 1 if view was set up on fp, 0 if fp is best sent as it is
+        // and -1 if the atoms couldn't be read
+        static int plan(File * fp, SpanFile & view);
+
+    private:
+        struct Atom
+        {
+            uint32_t offset;
+            uint32_t len;
+            uint8_t hlen;
+        };
+
+        struct Table  // stco or co64 entries
+        {
+            uint32_t offset;
+            uint32_t len;
+            uint8_t width;
+        };
+
+        static int header(File * fp, uint32_t offset, uint32_t end, Atom & atom, uint32_t & type);
+        static int tables(File * fp, Atom const & parent, Table * tables, uint8_t & num);
+        static bool read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len);
+        static uint32_t be32(uint8_t const * p)
+        { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+        static constexpr uint32_t fourcc(char const * s)
+        { return ((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8) | (uint32_t)s[3]; }
+
+        static constexpr uint8_t const _s_max_children = 8;
+        static constexpr uint8_t const _s_max_tables = 4;
+        static constexpr uint8_t const _s_max_depth = 5;  // moov/trak/mdia/minf/stbl
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3 Index ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// What the library scan keeps for each track, so playing one doesn't have to
+// work it all out again from the file's headers.  Written to the card by
+// TrackSniffer, so any change to the layout needs a new VERSION.
+struct TrackMeta
+{
+    static constexpr uint8_t const VERSION = 1;
+
+    enum codec_e : uint8_t { CODEC_NONE, CODEC_MP3, CODEC_AAC };
+
+    uint8_t version;
+    uint8_t codec;
+    uint8_t index;        // Mp3Index type
+    uint8_t reserved;
+    uint32_t start;       // Audio, past any ID3v2 tags
+    uint32_t first;       // First frame
+    uint32_t bytes;       // Audio from the first frame on
+    uint32_t duration;    // Seconds
+    uint32_t bitrate;     // bps, the average if VBR
+    uint32_t samplerate;
+    uint32_t ref;         // Header of the first frame
+    uint32_t toc;         // Where the Xing TOC is, 0 if it came from VBRI
+
+    bool valid(void) const { return (version == VERSION) && (codec != CODEC_NONE); }
+};
+
+static_assert(sizeof(TrackMeta) <= FileSniffer::META_SIZE, "TrackMeta too big for the sort's meta record");
+
+// Maps a time in an MP3 to where it is in the file, using the TOC from a Xing
+// or VBRI header in the first frame or the bitrate if it's CBR, and finds the
+// next frame header from there so the decoder is handed whole frames.
+class Mp3Index
+{
+    public:
+        Mp3Index(void) = default;
+
+        bool init(File * fp);
+        bool init(File * fp, TrackMeta const & meta);  // Parses only the TOC, if any
+        void save(TrackMeta & meta) const;
+        bool valid(void) const { return _type != NONE; }
+        uint32_t duration(void) const { return _secs; }
+        uint32_t offset(uint32_t secs) const;
+
+        // Seeks fp to the first frame at or after offset
+        bool sync(File * fp, uint32_t offset) const;
+
+    private:
+        struct Frame
+        {
+            uint32_t bitrate;     // bps
+            uint32_t samplerate;
+            uint16_t samples;     // Per frame
+            uint16_t len;         // Bytes including the header
+            uint8_t side;         // Layer III side info bytes
+        };
+
+        static bool frame(uint32_t hdr, Frame & f);
+        bool match(uint32_t hdr) const { return (hdr & _s_ref_mask) == (_ref & _s_ref_mask); }
+        int find(File * fp, uint32_t offset, uint32_t & hdr) const;
+        bool xing(File * fp, Frame const & f);
+        bool vbri(File * fp, Frame const & f);
+        static bool read(File * fp, uint32_t offset, uint8_t * buf, uint8_t len);
+        static uint32_t be32(uint8_t const * p)
+        { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+
+        // Sync, version, layer and sample rate all have to stay the same
+        static constexpr uint32_t const _s_ref_mask = 0xFFFE0C00;
+        static constexpr uint16_t const _s_sync_window = 4096;
+        static constexpr uint8_t const _s_toc_len = 100;
+
+        enum type_e : uint8_t { NONE, CBR, AVG, TOC };
+
+        type_e _type = NONE;
+        uint32_t _ref = 0;
+        uint32_t _first = 0;  // First frame
+        uint32_t _bytes = 0;  // Audio from there on
+        uint32_t _secs = 0;
+        uint32_t _bitrate = 0;
+        uint32_t _toc_at = 0;      // Where the Xing TOC was read from
+        uint8_t _toc[_s_toc_len];  // Xing style, 1/256ths of _bytes at each 1% of _secs
+};
+
+// Fills in a TrackMeta for each MP3 and M4A found by the library scan.  Only
+// the codec is known for an M4A - its layout is worked out when it's cued.
+class TrackSniffer : public FileSniffer
+{
+    public:
+        virtual int sniff(File * fp, uint8_t * meta, uint16_t len);
+
+    private:
+        static bool is(File const * fp, char const * ext);
+
+        Mp3Index _index;  // Too big for the stack
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // VS1053B /////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -114,11 +282,98 @@ enum vc_e : uint8_t
 #define VS1053_SM_CLK_RANGE       0x8000
 #define VS1053_SM_DEFAULT   (VS1053_SM_LINE1 | VS1053_SM_SDINEW)
 
+#define VS1053_BYTE_RATE_ADDR      0x1E05  // Average of the stream, bytes per second
 #define VS1053_END_FILL_BYTE_ADDR  0x1E06
 
+// Where the VS1053b ROM keeps the write and read pointers of its stream
+// buffer, in X memory.  They point into the buffer itself so how full it is
+// only needs their difference modulo its size.
+#define VS1053_STREAM_WR_PTR_ADDR  0x5A7D
+#define VS1053_STREAM_RD_PTR_ADDR  0x5A7E
+#define VS1053_STREAM_BUF_WORDS    1024
+
 #define VS1053_VOLUME_MAX   255
 #define VS1053_VOLUME_MIN   192
 
+// Last, least, most and average of a sampled value over the last one to two
+// windows of samples.  Two sets are kept and the older is dropped each time
+// the newer fills so a spike stays visible for at least a window.
+class Gauge
+{
+    public:
+        void add(uint32_t val)
+        {
+            if (_cur.count == _s_window)
+            {
+                _prev = _cur;
+                _cur = {};
+            }
+
+            _cur.add(val);
+            _last = val;
+        }
+
+        uint32_t last(void) const { return _last; }
+        uint32_t count(void) const { return _prev.count + _cur.count; }
+        uint32_t min(void) const
+        { return (_prev.count == 0) ? _cur.min : ((_cur.min < _prev.min) ? _cur.min : _prev.min); }
+        uint32_t max(void) const { return (_cur.max > _prev.max) ? _cur.max : _prev.max; }
+        uint32_t avg(void) const
+        { return (count() == 0) ? 0 : (uint32_t)((_prev.total + _cur.total) / count()); }
+
+    private:
+        static constexpr uint16_t const _s_window = 60;
+
+        struct Window
+        {
+            uint16_t count;
+            uint32_t min;
+            uint32_t max;
+            uint64_t total;
+
+            void add(uint32_t val)
+            {
+                if ((count == 0) || (val < min)) min = val;
+                if (val > max) max = val;
+                total += val;
+                count++;
+            }
+        };
+
+        Window _prev = {};
+        Window _cur = {};
+        uint32_t _last = 0;
+};
+
+// How much DevVS1053B::send() reads into a feed ring of SIZE bytes holding
+// level.  At or above HIGH nothing, below LOW or when the decoder is short
+// of headroom all the free space, otherwise the len asked for.  Kept apart
+// from the device so the host tests can run it against simulated SD spikes.
+template < uint16_t SIZE, uint16_t LOW, uint16_t HIGH >
+class FeedMarks
+{
+    static_assert((LOW <= HIGH) && (HIGH <= SIZE), "Feed watermarks out of order");
+
+    public:
+        static constexpr uint16_t const size = SIZE;
+        static constexpr uint16_t const low = LOW;
+        static constexpr uint16_t const high = HIGH;
+
+        static bool accepting(uint16_t level, bool short_of)
+        { return (level < HIGH) || ((level < SIZE) && short_of); }
+
+        static uint16_t want(uint16_t level, uint16_t len, bool short_of)
+        {
+            if ((level >= HIGH) && !short_of) return 0;
+            return ((level < LOW) || short_of) ? SIZE - level : len;
+        }
+};
+
+// Define to feed SDI from the main loop, spinning on DREQ before every 32
+// bytes, instead of by DMA from the DREQ interrupt.  Both count the cycles
+// spent feeding in feedStats() so the two can be compared.
+//#define VS_FEED_POLLED
+
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
          template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 class DevVS1053B :
@@ -135,7 +390,8 @@ class DevVS1053B :
         static DevVS1053B & acquire(void) { static DevVS1053B vs1053b; return vs1053b; }
 
         virtual bool busy(void) { return TCtrl::_spi.busy() || TData::_spi.busy(); }
-        virtual bool valid(void) { return TDreq::valid() && TReset::valid() && TCtrl::valid() && TData::valid(); }
+        virtual bool valid(void)
+        { return TDreq::valid() && TReset::valid() && TCtrl::valid() && TData::valid() && _feed.valid(); }
 
         void start(void);
         void stop(void);
@@ -149,6 +405,86 @@ class DevVS1053B :
         void send(uint8_t const * data, uint16_t len);
         void cancel(File * fp);
 
+        // The next file sent follows straight on in the same stream - no end
+        // fill, cancel or soft reset in between.  Only for formats whose
+        // streams can be concatenated.  Used up at the end of the current file.
+        void chain(bool enable) { _chain = enable; }
+        bool chained(void) const { return _chain; }
+
+        // True if send() can take more data, i.e. under the high watermark or
+        // short of headroom
+        bool accepting(void);
+        uint16_t buffered(void) const { return _feed.level(); }
+
+        // Milliseconds of audio queued in the feed and the decoder's stream
+        // buffer at the stream's byte rate.  Both of the decoder's figures are
+        // read at most every _s_fill_msecs and the last ones used in between.
+        uint32_t headroom(void);
+
+        // Whether something that keeps the main loop from feeding for about
+        // msecs can go ahead now without the decoder running dry
+        bool spare(uint32_t msecs) { return headroom() >= (msecs + _s_headroom_guard); }
+
+        struct FeedStats
+        {
+            uint32_t cycles;     // CPU cycles spent getting data onto SDI
+            uint32_t bytes;
+            uint32_t bursts;
+            uint32_t underruns;  // Times DREQ asked for data mid-stream and the ring was empty
+            uint16_t low_water;  // Least buffered after a burst mid-stream
+        };
+
+        // Divide cycles by decodeTime() for cycles per second of audio
+        FeedStats const & feedStats(void) const { return _feed.stats(); }
+        void resetFeedStats(void) { _feed.resetStats(); }
+
+        struct GapStats
+        {
+            uint32_t transitions;  // Tracks played to the end
+            uint32_t gapless;      // Of those, chained into the next
+            uint32_t resets;       // Soft resets, each of which reloads the patches
+            uint32_t reset_time;   // usecs the last one took, patch upload included
+            uint32_t last;         // usecs without track data across the last transition
+            uint32_t max;
+        };
+
+        GapStats const & gapStats(void) const { return _feed.gapStats(); }
+        void resetGapStats(void) { _feed.resetGapStats(); }
+
+        // What sample() has seen of the decoder and the feed.  Rates are per
+        // second of wall time between samples.
+        struct Telemetry
+        {
+            uint16_t hdat0;      // Last read
+            uint16_t hdat1;      // Last read - format
+            uint16_t decode_time;
+            uint32_t samples;
+            uint32_t underruns;  // DREQ high with nothing to send
+            Gauge kbps;          // From the decoder's byte rate
+            Gauge fill;          // Bytes in the decoder's stream buffer
+            Gauge ring;          // Bytes queued in the feed
+            Gauge rate;          // Bytes fed per second
+            Gauge blocked;       // usecs per second spent in send()
+        };
+
+        // Reads the header data, decode time and stream buffer pointers, each
+        // of which waits on DREQ, so about once a second is plenty.
+        void sample(void);
+        Telemetry const & telemetry(void) const { return _tele; }
+        void resetTelemetry(void) { _tele = {}; _tele_mark = 0; }
+        int streamFill(void);  // Bytes in the decoder's stream buffer
+        static char const * format(uint16_t hdat1);
+        // The decoder doesn't start it again for a chained track so until the
+        // next track's data goes out it's taken as 0 and send() sets it to 0
+        // once it has
+        uint16_t decodeTime(void) { return _feed.crossing() ? 0 : ctrlGet(VC_DECODE_TIME); }
+        // Has to be written twice to take
+        void setDecodeTime(uint16_t secs) { ctrlSet(VC_DECODE_TIME, secs); ctrlSet(VC_DECODE_TIME, secs); }
+
+        // Drops whatever is queued so the next send() can come from elsewhere
+        // in the same file.  MP3 only - the decoder picks up at the next frame.
+        void jump(void) { if (_efb_bytes == -1) _feed.reset(); }
+
         DevVS1053B(DevVS1053B const &) = delete;
         DevVS1053B & operator=(DevVS1053B const &) = delete;
 
@@ -161,6 +497,17 @@ class DevVS1053B :
         void ctrlSet(vc_e cmd, uint16_t val);
         uint16_t ctrlGet(vc_e cmd);
 
+        // Doesn't wait on DREQ, which while streaming is low for as long as
+        // the stream buffer is full.  Reads, and setting the WRAM address,
+        // are handled by the decoder within a few CLKI so don't need to.
+        uint16_t ctrlPeek(vc_e cmd);
+        uint16_t wramPeek(uint16_t addr);
+
+        // SCI multiple writes - n words to the one register with CS held, in
+        // chunks so the bus isn't kept from the SD card for long.
+        void ctrlSet(vc_e cmd, uint16_t const * vals, uint16_t n) { ctrlBurst(cmd, vals, 0, n); }
+        void ctrlSet(vc_e cmd, uint16_t val, uint16_t n) { ctrlBurst(cmd, nullptr, val, n); }
+
         void setClock(uint16_t val) { ctrlSet(VC_CLOCKF, val); }
         void setCancel(void) { ctrlSet(VC_MODE, ctrlGet(VC_MODE) | VS1053_SM_CANCEL); }
         void setVolume(uint8_t r, uint8_t l) { ctrlSet(VC_VOL, ((uint16_t)r << 8) | l); }
@@ -176,16 +523,147 @@ class DevVS1053B :
 
         uint8_t _volume = VS1053_VOLUME_MAX;
 
+        virtual void isrRising(void) { _feed.kick(); }  // DREQ
+
     private:
         void loadPlugin(uint16_t const * plugin, uint16_t plugin_size);
+        void ctrlBurst(vc_e cmd, uint16_t const * vals, uint16_t val, uint16_t n);
+
+        // WRAM writes take the decoder at most ~100 CLKI, about 2.3 usecs,
+        // which is less than a word takes to shift in so DREQ only needs
+        // checking before each chunk.  Other registers are written singly.
+        static bool burstable(vc_e cmd) { return cmd == VC_WRAM; }
+        static constexpr uint16_t const _s_sci_burst = 128;  // Words, ~350 usecs
+
+        // How long to wait for the bus, in usecs.  Long enough for the SD card
+        // to reach the next block boundary and yield.
+        static constexpr uint32_t const _s_sci_deadline = 2000;
+        static constexpr uint32_t const _s_sdi_deadline = 1000;
+
+        // Above the high watermark send() doesn't read.  Below the low one it
+        // fills all the free space with as few multi-block reads as it can,
+        // otherwise it reads what it's asked to.
+        typedef FeedMarks < 4096, 1024, 3072 > TFeedMarks;
+        static constexpr uint16_t const _s_feed_size = TFeedMarks::size;
+        static constexpr uint16_t const _s_sdi_burst = 32;  // Guaranteed room when DREQ is high
+
+        // Below _s_headroom_low milliseconds of audio the feed is topped right
+        // up whatever the watermarks say - at 320 kbps the low watermark is
+        // only 25 ms.  Until the decoder knows the byte rate the highest MP3
+        // one is assumed.
+        static constexpr uint32_t const _s_fill_msecs = 50;
+        static constexpr uint32_t const _s_headroom_low = 100;
+        static constexpr uint32_t const _s_headroom_guard = 50;
+        static constexpr uint32_t const _s_max_byte_rate = 320000 / 8;
+
+        // Streams a ring buffer to SDI.  Whenever DREQ goes high a 32 byte DMA
+        // transfer is started and it is chained from the DMA isr for as long as
+        // DREQ stays high and there is data, so the main loop only fills the ring.
+        // Falls back to sending from the isr if there are no DMA channels.
+        // The ring running dry while DREQ is up counts as an underrun unless
+        // ended() was called to say nothing more is coming.
+        class Feed : public DMA::Isr, public SPIArbiter < SPI, MOSI, MISO, SCK >::Waiter,
+            public ProducerConsumer < _s_feed_size >
+        {
+            public:
+                Feed(void);
+
+                bool valid(void) const { return _client != -1; }
+
+                void start(uint32_t cta);
+                void stop(void);
+                void reset(void);  // Drops whatever hasn't been sent
+                void kick(void);
+
+                int fill(File * fp, uint16_t len);
+                void ended(void) { _streaming = false; }
+                void mark(bool chained);  // Last byte of a track is in
+                bool crossing(void) const { return _marked && _chained; }  // Into a chained track
+                bool crossed(void) { bool c = _crossed; _crossed = false; return c; }
+                bool drained(void) const { return consumed() == produced(); }
+                uint16_t level(void) const { return produced() - consumed(); }
+
+                FeedStats const & stats(void) const { return _stats; }
+                void resetStats(void) { _stats = {}; _stats.low_water = _s_feed_size; }
+                void account(uint32_t cycles, uint16_t bytes);
+
+                GapStats const & gapStats(void) const { return _gaps; }
+                void resetGapStats(void) { _gaps = {}; }
+                void reloaded(uint32_t usecs) { _gaps.resets++; _gaps.reset_time = usecs; }
+
+            private:
+                virtual void isr(DMA::Channel & ch);
+                virtual void granted(void);
+
+                bool claim(void);
+                void burst(void);
+                void finish(void);
+                void dry(void);
+                void passed(void);
+
+                enum fs_e : uint8_t { IDLE, WAITING, RUNNING };
+
+                fs_e volatile _state = IDLE;
+                bool volatile _hold = false;
+                bool volatile _streaming = false;
+                bool volatile _dry = false;
+                bool _selected = false;
+
+                spi_client_t const _client;
+                uint32_t _cta = 0;
+                uint16_t _len = 0;
+                uint8_t volatile _popr;
+
+                TCD _tcd_tx;
+                TCD _tcd_rx;
+
+                DMA::Channel * _ch_rx = nullptr;
+                DMA::Channel * _ch_tx = nullptr;
+
+                FeedStats _stats = { 0, 0, 0, 0, _s_feed_size };
+
+                // Gap timing - from the burst carrying the last byte of a track
+                // to the one carrying the first byte of whatever follows it
+                GapStats _gaps = {};
+                uint32_t _mark = 0;
+                uint32_t _gap_start = 0;
+                bool volatile _marked = false;
+                bool _gap_open = false;
+
+                // Whether the track after the mark was chained and whether its
+                // data has started going out, until the main loop has seen it
+                bool volatile _chained = false;
+                bool volatile _crossed = false;
+
+                SPI < MOSI, MISO, SCK > & _spi = SPI < MOSI, MISO, SCK >::acquire();
+                SPIArbiter < SPI, MOSI, MISO, SCK > & _arb = SPIArbiter < SPI, MOSI, MISO, SCK >::acquire();
+                PinOut < DCS > & _dcs = PinOut < DCS >::acquire();
+                PinIn < DREQ > & _dreq = PinIn < DREQ >::acquire();
+        };
+
+        Feed _feed;
+
+        Telemetry _tele = {};
+        uint32_t _tele_mark = 0;  // msecs of the last sample, 0 before the first
+        uint32_t _tele_bytes = 0;
+        uint32_t _tele_underruns = 0;
+        uint32_t _tele_send = 0;
+        uint32_t _send_usecs = 0;  // Spent in send(), for Telemetry::blocked
+
+        // For headroom()
+        uint32_t _fill_mark = 0;
+        uint16_t _fill = 0;
+        uint16_t _byte_rate = 0;
 
         uint32_t _stop_time = 0;
         int16_t _efb_bytes = -1;
+        bool _chain = false;
 };
 
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
     template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::DevVS1053B(void)
+    : TCtrl(SPI_PRI_CTRL), TData(SPI_PRI_STREAM)
 {
     if (!valid())
         return;
@@ -196,6 +674,14 @@ DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::DevVS1053B(void)
 
     // CLKI / 4 = 43008000 / 4 = 10752000
     TData::_cta = spi_cta(10000000, 5, 24, 0); // Set this now since it doesn't change
+
+    // For feedStats()
+    Debug::enableDWT();
+    DWT::enableCycleCount();
+
+#ifndef VS_FEED_POLLED
+    (void)TDreq::attach(IRQC_INTR_RISING);
+#endif
 }
 
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
@@ -235,6 +721,8 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::start(void)
 
     loadPlugin(vs1053b_patches_plugin, VS1053B_PATCH_PLUGIN_SIZE);
 
+    _feed.start(TData::_cta);
+
     _efb_bytes = -1;
 }
 
@@ -245,6 +733,10 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::stop(void)
     if (!running())
         return;
 
+    _feed.stop();
+    _chain = false;
+    _fill_mark = 0;
+
     TReset::_pin.clear();
     _stop_time = msecs();
 }
@@ -262,6 +754,11 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::softReset(void)
     //  uint16_t mode = ctrlGet(VS1053_CMD_MODE);
     //  ctrlSet(VC_MODE, mode | VS1053_SM_RESET);
     // But do this:
+    uint32_t start = usecs();
+
+    _feed.reset();
+    _chain = false;
+    _fill_mark = 0;
     ctrlSet(VC_MODE, VS1053_SM_DEFAULT | VS1053_SM_RESET);
 
     // Delay only seems necessary when RESET pin is asserted.
@@ -270,6 +767,8 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::softReset(void)
 
     loadPlugin(vs1053b_patches_plugin, VS1053B_PATCH_PLUGIN_SIZE);
 
+    _feed.reloaded(usecs() - start);
+
     _efb_bytes = -1;
 }
 
@@ -283,10 +782,46 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::ctrlSet(vc_e cmd,
 
     while (!ready());
 
-    TCtrl::_spi.begin(TCtrl::_pin, TCtrl::_cta);
+    if (!TCtrl::begin(_s_sci_deadline))
+        return;
+
     TCtrl::_spi.tx16(VC_WRITE << 8 | cmd);
     TCtrl::_spi.tx16(val);
-    TCtrl::_spi.end(TCtrl::_pin);
+    TCtrl::end();
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::ctrlBurst(vc_e cmd, uint16_t const * vals, uint16_t val, uint16_t n)
+{
+    if ((cmd == VC_HDAT0) || (cmd == VC_HDAT1))
+        return;
+
+    while (n != 0)
+    {
+        uint16_t len = (n < _s_sci_burst) ? n : _s_sci_burst;
+
+        while (!ready());
+
+        if (!TCtrl::begin(_s_sci_deadline))
+            return;
+
+        TCtrl::_spi.tx16(VC_WRITE << 8 | cmd);
+
+        if (vals != nullptr)
+        {
+            TCtrl::_spi.tx16(vals, len);
+            vals += len;
+        }
+        else
+        {
+            TCtrl::_spi.tx16(val, len);
+        }
+
+        TCtrl::end();
+
+        n -= len;
+    }
 }
 
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
@@ -299,13 +834,45 @@ uint16_t DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::ctrlGet(vc_e c
 
     while (!ready());
 
-    TCtrl::_spi.begin(TCtrl::_pin, TCtrl::_cta);
+    if (!TCtrl::begin(_s_sci_deadline))
+        return 0;
+
+    uint16_t val = TCtrl::_spi.trans16(VC_READ << 8 | cmd);
+    TCtrl::end();
+
+    return val;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+uint16_t DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::ctrlPeek(vc_e cmd)
+{
+    if (cmd == VC_WRAMADDR)
+        return 0;
+
+    if (!TCtrl::begin(_s_sci_deadline))
+        return 0;
+
     uint16_t val = TCtrl::_spi.trans16(VC_READ << 8 | cmd);
-    TCtrl::_spi.end(TCtrl::_pin);
+    TCtrl::end();
 
     return val;
 }
 
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+uint16_t DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::wramPeek(uint16_t addr)
+{
+    if (!TCtrl::begin(_s_sci_deadline))
+        return 0;
+
+    TCtrl::_spi.tx16(VC_WRITE << 8 | VC_WRAMADDR);
+    TCtrl::_spi.tx16(addr);
+    TCtrl::end();
+
+    return ctrlPeek(VC_WRAM);
+}
+
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
     template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::setVolume(uint8_t mono)
@@ -327,28 +894,185 @@ bool DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(File * fp, ui
     if ((fp == nullptr) || !fp->valid() || fp->eof())
         return false;
 
+    uint32_t start = usecs();
+
+    if (_feed.crossed())
+        setDecodeTime(0);
+
     if (_efb_bytes != -1)
     {
         finish();
+        _send_usecs += usecs() - start;
         return true;
     }
 
-    static uint8_t buf[32];
+#ifdef VS_FEED_POLLED
+    static uint8_t buf[_s_sdi_burst];
+
+    if (len > sizeof(buf))
+        len = sizeof(buf);
 
     uint8_t const * p;
     int read = 0;
 
     if ((read = fp->read(&p, len)) > 0)
         send(p, read);
-    else if ((len <= sizeof(buf)) && ((read = fp->read(buf, len)) > 0))
+    else if ((read = fp->read(buf, len)) > 0)
         send(buf, read);
+#else
+    uint16_t level = _feed.level();
+    bool short_of = (headroom() < _s_headroom_low);
+
+    if ((len = TFeedMarks::want(level, len, short_of)) == 0)
+        return true;
+
+    // At most two goes since the free space may wrap
+    int read = 0, r = 0;
+    while ((len != 0) && !fp->eof() && ((r = _feed.fill(fp, len)) > 0))
+    {
+        read += r;
+        len -= r;
+    }
+
+    if ((r < 0) && (read == 0))
+        read = r;
+#endif
 
     if ((read > 0) && fp->eof())
-        _efb_bytes = 0;
+    {
+        _feed.mark(_chain);
+
+        if (_chain)
+        {
+            _chain = false;
+        }
+        else
+        {
+            _efb_bytes = 0;
+            _feed.ended();
+        }
+    }
+
+    _send_usecs += usecs() - start;
 
     return read > 0;
 }
 
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::sample(void)
+{
+    if (!running())
+        return;
+
+    FeedStats const & fs = _feed.stats();
+    uint32_t now = msecs();
+
+    _tele.hdat0 = ctrlPeek(VC_HDAT0);
+    _tele.hdat1 = ctrlPeek(VC_HDAT1);
+    _tele.decode_time = ctrlPeek(VC_DECODE_TIME);
+
+    uint16_t byte_rate = wramPeek(VS1053_BYTE_RATE_ADDR);
+    int fill = streamFill();
+
+    // The first sample only marks where the rates are taken from
+    if ((_tele_mark != 0) && (now != _tele_mark))
+    {
+        uint32_t elapsed = now - _tele_mark;
+
+        _tele.underruns += fs.underruns - _tele_underruns;
+        _tele.kbps.add(((uint32_t)byte_rate * 8) / 1000);
+        _tele.ring.add(_feed.level());
+        _tele.rate.add((uint32_t)(((uint64_t)(fs.bytes - _tele_bytes) * 1000) / elapsed));
+        _tele.blocked.add((uint32_t)(((uint64_t)(_send_usecs - _tele_send) * 1000) / elapsed));
+
+        if (fill >= 0)
+            _tele.fill.add(fill);
+
+        _tele.samples++;
+    }
+
+    _tele_mark = (now == 0) ? 1 : now;
+    _tele_bytes = fs.bytes;
+    _tele_underruns = fs.underruns;
+    _tele_send = _send_usecs;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::streamFill(void)
+{
+    if (!running())
+        return -1;
+
+    uint16_t wr = wramPeek(VS1053_STREAM_WR_PTR_ADDR);
+    uint16_t rd = wramPeek(VS1053_STREAM_RD_PTR_ADDR);
+
+    return ((wr - rd) & (VS1053_STREAM_BUF_WORDS - 1)) * 2;
+}
+
+// HDAT1 is the sync word for MP3 and two ASCII characters for everything else
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+char const * DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::format(uint16_t hdat1)
+{
+    if ((hdat1 & 0xFFE0) == 0xFFE0)
+        return "MP3";
+
+    switch (hdat1)
+    {
+        case 0x4154:  // "AT"
+        case 0x4144:  // "AD"
+        case 0x4D34:  // "M4"
+            return "AAC";
+        case 0x4F67: return "OGG";   // "Og"
+        case 0x664C: return "FLAC";  // "fL"
+        case 0x7665: return "WAV";   // "ve"
+        case 0x574D: return "WMA";   // "WM"
+        case 0x4D54: return "MIDI";  // "MT"
+        default: break;
+    }
+
+    return "----";
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::accepting(void)
+{
+#ifdef VS_FEED_POLLED
+    return ready();
+#else
+    uint16_t level = _feed.level();
+
+    // headroom() only if the level alone doesn't settle it
+    return (level < TFeedMarks::high) || TFeedMarks::accepting(level, headroom() < _s_headroom_low);
+#endif
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+uint32_t DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::headroom(void)
+{
+    if (!running())
+        return 0;
+
+    uint32_t now = msecs();
+
+    if ((_fill_mark == 0) || ((now - _fill_mark) >= _s_fill_msecs))
+    {
+        int fill = streamFill();
+
+        _fill = (fill < 0) ? 0 : fill;
+        _byte_rate = wramPeek(VS1053_BYTE_RATE_ADDR);
+        _fill_mark = (now == 0) ? 1 : now;
+    }
+
+    uint32_t rate = (_byte_rate == 0) ? _s_max_byte_rate : _byte_rate;
+
+    return (((uint32_t)_fill + _feed.level()) * 1000) / rate;
+}
+
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
     template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(uint8_t const * data, uint16_t len)
@@ -358,7 +1082,14 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(uint8_t const
     uint16_t send32s = len / 32;
     uint16_t sendleft = len % 32;
 
-    TData::_spi.begin(TData::_pin, TData::_cta);
+    // Anything already queued goes first
+    while (!_feed.drained())
+        _feed.kick();
+
+    uint32_t cycles = DWT::cycleCount();
+
+    if (!TData::begin(_s_sdi_deadline))
+        return;
 
     for (uint16_t i = 0; i < send32s; i++)
     {
@@ -373,7 +1104,9 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(uint8_t const
         TData::_spi.tx(data, sendleft);
     }
 
-    TData::_spi.end(TData::_pin);
+    TData::end();
+
+    _feed.account(DWT::cycleCount() - cycles, len);
 }
 
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
@@ -383,7 +1116,8 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(uint8_t byte,
     uint16_t send32s = num_times / 32;
     uint16_t sendleft = num_times % 32;
 
-    TData::_spi.begin(TData::_pin, TData::_cta);
+    if (!TData::begin(_s_sdi_deadline))
+        return;
 
     for (uint16_t i = 0; i < send32s; i++)
     {
@@ -397,7 +1131,7 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::send(uint8_t byte,
         TData::_spi.tx(byte, sendleft);
     }
 
-    TData::_spi.end(TData::_pin);
+    TData::end();
 }
 
 template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
@@ -416,6 +1150,13 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::finish(void)
 
     static uint8_t efb = 0;
 
+    // Rest of the file has to get to the decoder before the end fill bytes
+    if (!_feed.drained())
+    {
+        _feed.kick();
+        return;
+    }
+
     if (_efb_bytes == 0)
     {
         efb = getEFB();
@@ -519,13 +1260,25 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::loadPlugin(uint16_
     {
         n &= 0x7FFF;
         uint16_t val = *plugin++;
-        while (n--) ctrlSet(cmd, val);
+
+        if (burstable(cmd))
+            ctrlSet(cmd, val, n);
+        else
+            while (n--) ctrlSet(cmd, val);
     };
 
     // Copy run, copy n samples
     auto copy = [&](vc_e cmd, uint16_t n) -> void
     {
-        while (n--) ctrlSet(cmd, *plugin++);
+        if (burstable(cmd))
+        {
+            ctrlSet(cmd, plugin, n);
+            plugin += n;
+        }
+        else
+        {
+            while (n--) ctrlSet(cmd, *plugin++);
+        }
     };
 
     uint16_t const * plugin_end = plugin + plugin_size;
@@ -539,6 +1292,351 @@ void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::loadPlugin(uint16_
     }
 }
 
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::Feed(void)
+    : _client(SPIArbiter < SPI, MOSI, MISO, SCK >::acquire().attach(SPI_PRI_STREAM))
+{
+    _arb.waiter(_client, this);
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::start(uint32_t cta)
+{
+    _cta = cta;
+
+    if (_ch_rx == nullptr)
+        _ch_rx = DMA::acquire();
+
+    if (_ch_tx == nullptr)
+        _ch_tx = DMA::acquire();
+
+    if ((_ch_rx == nullptr) || (_ch_tx == nullptr))
+    {
+        DMA::release(_ch_rx);
+        DMA::release(_ch_tx);
+        _ch_rx = _ch_tx = nullptr;
+    }
+
+    reset();
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::stop(void)
+{
+    reset();
+    _marked = false;
+
+    DMA::release(_ch_rx);
+    DMA::release(_ch_tx);
+    _ch_rx = _ch_tx = nullptr;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::reset(void)
+{
+    // Keep a running transfer from chaining and wait for it to finish
+    _hold = true;
+
+    __disable_irq();
+    if (_state == WAITING)
+        _state = IDLE;
+    __enable_irq();
+
+    while (_state != IDLE);
+
+    _produced = _consumed = 0;
+    _total = (uint32_t)-1;  // Open ended
+    _streaming = _dry = false;
+    _chained = _crossed = false;
+
+    // A track that ended and was sent in full carries the gap timing over to
+    // whatever is sent after the reset.  One cut short doesn't count.
+    if (_marked && _gap_open)
+        _mark = 0;
+    else
+        _marked = false;
+
+    _hold = false;
+}
+
+// From the DREQ isr and after the ring has been filled
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::kick(void)
+{
+    uint32_t cycles = DWT::cycleCount();
+
+    __disable_irq();
+
+    if ((_state == IDLE) && !_hold && _dreq.isHigh())
+    {
+        if (consumeLen(1) != 0)
+            _state = WAITING;
+        else
+            dry();
+    }
+
+    bool waiting = (_state == WAITING);
+
+    __enable_irq();
+
+    if (!waiting)
+        return;
+
+    // If the bus isn't free the request stays posted, making the SD card
+    // yield at its next block boundary, and granted() is called then.
+    if (_arb.request(_client, _cta, _s_sdi_deadline) && claim())
+        burst();
+
+    account(DWT::cycleCount() - cycles, 0);
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::fill(File * fp, uint16_t len)
+{
+    uint8_t * p;
+    uint16_t n = reserveContiguous(&p, len);
+
+    if (n == 0)
+        return 0;
+
+    int read = fp->read(p, n);
+    if (read > 0)
+    {
+        publish(read);
+        _streaming = true;
+        _dry = false;
+    }
+
+    kick();
+
+    return read;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::account(uint32_t cycles, uint16_t bytes)
+{
+    _stats.cycles += cycles;
+    _stats.bytes += bytes;
+    _stats.bursts += (bytes + _s_sdi_burst - 1) / _s_sdi_burst;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::isr(DMA::Channel & ch)
+{
+    uint32_t cycles = DWT::cycleCount();
+
+    // RX count is done so everything has been shifted out
+    commit(_len);
+    account(0, _len);
+    passed();
+
+    if (_streaming && (level() < _stats.low_water))
+        _stats.low_water = level();
+
+    burst();
+
+    account(DWT::cycleCount() - cycles, 0);
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::granted(void)
+{
+    uint32_t cycles = DWT::cycleCount();
+
+    // Request was dropped by reset() in the meantime
+    if (!claim())
+    {
+        _arb.release(_client);
+        return;
+    }
+
+    burst();
+
+    account(DWT::cycleCount() - cycles, 0);
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::claim(void)
+{
+    __disable_irq();
+
+    bool claimed = (_state == WAITING);
+    if (claimed)
+        _state = RUNNING;
+
+    __enable_irq();
+
+    return claimed;
+}
+
+// Only called while owning the bus
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::burst(void)
+{
+    uint8_t const * p;
+    uint16_t n = (_hold || !_dreq.isHigh()) ? 0 : peekContiguous(&p, _s_sdi_burst);
+
+    if (n == 0)
+    {
+        if (!_hold && _dreq.isHigh())
+            dry();
+
+        finish();
+        return;
+    }
+
+    if (!_selected)
+    {
+        (void)_spi.begin(_dcs, _cta);
+        if (_ch_tx != nullptr)
+            _spi.dmaEnable();
+        _selected = true;
+    }
+
+    if (_ch_tx == nullptr)
+    {
+        do
+        {
+            _spi.tx(p, n);
+            commit(n);
+            account(0, n);
+            passed();
+
+            n = (_hold || !_dreq.isHigh()) ? 0 : peekContiguous(&p, _s_sdi_burst);
+
+        } while (n != 0);
+
+        finish();
+        return;
+    }
+
+    _len = n;
+
+    memset(&_tcd_tx, 0, sizeof(TCD));
+    memset(&_tcd_rx, 0, sizeof(TCD));
+
+    _tcd_tx.saddr = (void volatile *)p;
+    _tcd_tx.soff = 1;
+    _tcd_tx.daddr = (void volatile *)_spi.writeReg();
+    _tcd_tx.nbytes = 1;
+    _tcd_tx.biter = n;
+    _tcd_tx.citer = n;
+    _tcd_tx.dreq = 1;
+
+    _tcd_rx.saddr = (void volatile *)_spi.readReg();
+    _tcd_rx.daddr = (void volatile *)&_popr;
+    _tcd_rx.nbytes = 1;
+    _tcd_rx.biter = n;
+    _tcd_rx.citer = n;
+    _tcd_rx.intmajor = 1;
+    _tcd_rx.dreq = 1;
+
+    // Must start RX first or risk missing a signal if TX finishes before RX start
+    _ch_rx->start(_tcd_rx, DMA::Channel::SPI0_RX, this);
+    _ch_tx->start(_tcd_tx, DMA::Channel::SPI0_TX);
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::finish(void)
+{
+    if (_selected)
+    {
+        if (_ch_tx != nullptr)
+        {
+            _ch_rx->disconnect();
+            _ch_tx->disconnect();
+            _spi.dmaDisable();
+        }
+
+        _spi.end(_dcs);
+        _selected = false;
+    }
+
+    _state = IDLE;
+    _arb.release(_client);
+
+    // DREQ may have come back up after it was last looked at
+    if (!_hold)
+        kick();
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::dry(void)
+{
+    // Once per dry spell
+    if (!_streaming || _dry)
+        return;
+
+    _dry = true;
+    _stats.underruns++;
+}
+
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::mark(bool chained)
+{
+    _gaps.transitions++;
+    if (chained)
+        _gaps.gapless++;
+
+    __disable_irq();
+    _mark = produced();
+    _gap_open = false;
+    _marked = true;
+    _chained = chained;
+    _crossed = false;
+    __enable_irq();
+}
+
+// After each burst.  With a chained track the two ends are usually in the
+// ring together so the gap is 0 or a single DREQ wait.  Otherwise it takes in
+// the end fill, cancel and any soft reset.
+template < pin_t CS, pin_t DCS, pin_t DREQ, pin_t RST,
+    template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevVS1053B < CS, DCS, DREQ, RST, SPI, MOSI, MISO, SCK >::Feed::passed(void)
+{
+    if (!_marked)
+        return;
+
+    uint32_t c = consumed();
+    if (c < _mark)
+        return;
+
+    uint32_t now = usecs();
+
+    if (!_gap_open)
+    {
+        _gap_start = now;
+        _gap_open = true;
+    }
+
+    // Nothing of the next track yet
+    if (c == _mark)
+        return;
+
+    _gaps.last = now - _gap_start;
+    if (_gaps.last > _gaps.max)
+        _gaps.max = _gaps.last;
+
+    if (_chained)
+        _crossed = true;
+
+    _marked = _gap_open = _chained = false;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Audio - VS1053B & Amplifier /////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -550,7 +1648,7 @@ class DevAudio : public VS1053B, public AMP
 
         bool valid(void) { return VS1053B::valid() && AMP::valid(); }
         bool running(void) { return VS1053B::running() && AMP::running(); }
-        bool ready(void) { return valid() && running() && VS1053B::ready(); }
+        bool ready(void) { return valid() && running() && VS1053B::accepting(); }
 
         void start(void)
         {
@@ -2,6 +2,7 @@
 #define _DEV_H_
 
 #include "pin.h"
+#include "spi.h"
 #include "types.h"
 
 class Dev
@@ -40,15 +41,35 @@ class DevSPI : public DevPin < PinOut, CS >
 {
     using Tdp = DevPin < PinOut, CS >;
     using Tspi = SPI < MOSI, MISO, SCK >;
+    using Tarb = SPIArbiter < SPI, MOSI, MISO, SCK >;
 
     public:
         virtual bool busy(void) = 0;
-        virtual bool valid(void) const { return Tdp::valid() && _spi.valid(); }
+        virtual bool valid(void) const { return Tdp::valid() && _spi.valid() && (_client != -1); }
+
+        typename Tarb::Stats const & busStats(void) const { return _arb.stats(_client); }
+
+        // Shared bus off while nothing's on it, see SPIArbiter::park()
+        void park(void) { _arb.park(); }
 
     protected:
-        DevSPI(void) { if (!valid()) return; this->_pin.set(); }
+        DevSPI(spi_pri_e pri = SPI_PRI_BULK)
+            : _client(Tarb::acquire().attach(pri)) { if (!valid()) return; this->_pin.set(); }
+
+        // Waits up to deadline usecs for the bus then selects the device
+        bool begin(uint32_t deadline)
+        {
+            if (!_arb.grab(_client, _cta, deadline)) return false;
+            (void)_spi.begin(this->_pin, _cta);
+            return true;
+        }
+
+        void end(void) { _spi.end(this->_pin); release(); }
+        void release(void) { _arb.release(_client); }
 
         Tspi & _spi = Tspi::acquire();
+        Tarb & _arb = Tarb::acquire();
+        spi_client_t const _client;
         uint32_t _cta;
 };
 
@@ -79,6 +100,12 @@ class DevDisk : public DevSPI < CS, SPI, MOSI, MISO, SCK >
         virtual int write(dd_desc_t dd, uint8_t * data, uint16_t dlen) = 0;
         virtual int close(dd_desc_t dd) = 0;
 
+        // In place access to an open descriptor's buffer.  For reads p is set to data
+        // and for writes to free space, either of which is valid until commit().
+        // Reads can skip data already spanned but not yet committed.
+        virtual int span(dd_desc_t dd, uint8_t ** p, uint16_t len, uint16_t skip = 0) = 0;
+        virtual int commit(dd_desc_t dd, uint16_t len) = 0;
+
         virtual uint32_t reserve(uint32_t bytes) = 0;
 
         virtual uint32_t capacity(void) = 0;  // In kilobytes
@@ -6,10 +6,27 @@
 #include "spi_cta.h"
 #include "types.h"
 #include "dma.h"
+#include "eeprom.h"
 //#include <string.h>   // For manufacturer string
 
 #define SD_BLOCK_LEN  512
 
+// Block buffers shared by users that only need one for the duration of an operation.
+// Sorting the file list holds the most - read, write and meta plus one per merge list.
+// With USB the SCSI write-back cache takes what it can get of them, up to 8.
+#define SD_NUM_POOL_BLOCKS  8
+
+using TBlockPool = BufferPool < SD_BLOCK_LEN, SD_NUM_POOL_BLOCKS >;
+using TBlockLease = TBlockPool::Lease;
+
+// Blocks written by something other than the file system, i.e. the USB host,
+// as few enough ranges to map back to the file system's clusters
+#define SD_NUM_WRITTEN_EXTENTS  16
+
+using TExtents = Extents < SD_NUM_WRITTEN_EXTENTS >;
+
+using tSdProfile = eSdProfile;
+
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
 {
@@ -28,13 +45,66 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
         virtual int write(dd_desc_t dd, uint8_t * data, uint16_t dlen);
         virtual int close(dd_desc_t dd);
 
+        virtual int span(dd_desc_t dd, uint8_t ** p, uint16_t len, uint16_t skip = 0);
+        virtual int commit(dd_desc_t dd, uint16_t len);
+
         virtual uint32_t reserve(uint32_t bytes);
 
         virtual uint32_t capacity(void);  // In kilobytes
         virtual uint32_t blocks(void);
 
+        // Allocation unit from the SD Status, zero if the card didn't say
+        uint32_t auBlocks(void) const { return _au_blocks; }
+
         //virtual dd_err_e errno(void);
 
+        // Latency profiling
+        enum lat_e : uint8_t
+        {
+            LAT_READ_SETUP,         // READ_SINGLE_BLOCK to start block token
+            LAT_READ_MULTI_SETUP,   // READ_MULTIPLE_BLOCK to first start block token
+            LAT_WRITE_SETUP,        // WRITE_BLOCK to R1 response
+            LAT_WRITE_MULTI_SETUP,  // WRITE_MULTIPLE_BLOCK (and pre-erase) to R1 response
+            LAT_WRITE_BUSY,         // WRITE_BLOCK busy after data response
+            LAT_STOP_BUSY,          // STOP_TRANSMISSION or Stop Tran token busy
+            LAT_READ_BLOCK,         // Per block of a READ_MULTIPLE_BLOCK transfer
+            LAT_WRITE_BLOCK,        // Per block of a WRITE_MULTIPLE_BLOCK transfer
+            LAT_CNT
+        };
+
+        struct Latency
+        {
+            static constexpr uint8_t const buckets = 16;
+
+            uint32_t count;
+            uint32_t total;  // All times are in microseconds
+            uint32_t min;
+            uint32_t max;
+
+            // Power of 2 histogram - hist[0] is anything below 16us, hist[n]
+            // is [2^(n+3), 2^(n+4)) and the last bucket takes everything above.
+            uint32_t hist[buckets];
+
+            void add(uint32_t us);
+            uint32_t avg(void) const { return (count == 0) ? 0 : total / count; }
+        };
+
+        void profiling(bool enable) { _profiling = enable; }
+        bool profiling(void) const { return _profiling; }
+        void resetLatency(void) { memset(_latency, 0, sizeof(_latency)); }
+        Latency const & latency(lat_e lat) const { return _latency[lat]; }
+        static char const * latencyName(lat_e lat);
+
+        // True if the current profile was loaded from EEPROM for this card
+        bool tuned(void) const { return _tuned; }
+        tSdProfile const & profile(void) const { return _profile; }
+
+        // Runs a read benchmark over each DMA chunk size and a write benchmark with
+        // and without pre-erase, then derives the timeouts from the worst latencies
+        // seen and saves the resulting profile to EEPROM.  Blocks written are
+        // scratch and their contents are not preserved.
+        int tune(uint32_t scratch, uint16_t num_blocks);
+
         DevSD(DevSD const &) = delete;
         DevSD & operator=(DevSD const &) = delete;
 
@@ -133,6 +203,19 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
             // sent until the idle state bit is cleared in the response.
             // R1 response
             SD_SEND_OP_COND = 41,
+
+            // SET_WR_BLK_ERASE_COUNT
+            // Sets the number of write blocks to be pre-erased before writing for a
+            // subsequent WRITE_MULTIPLE_BLOCK.  May speed up the multiple block write
+            // depending on the card.  Reset to one after the write.
+            // R1 response
+            SET_WR_BLK_ERASE_COUNT = 23,
+
+            // SD_STATUS
+            // Asks the card to send its 512 bit SD Status, which among other
+            // things has the size of its allocation unit.
+            // R2 response followed by a data block
+            SD_STATUS = 13,
         };
 
         // Format R1 response
@@ -237,9 +320,26 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
             TOKEN_HIGH = 0xFF,
         };
 
-        static constexpr uint16_t const _s_bsize = 1024;
+        // Descriptor ring.  Four blocks so a READ stream has the next blocks on
+        // hand while the host turns the command around.
+        static constexpr uint16_t const _s_bsize = 2048;
+
+        static constexpr uint8_t const _s_min_chunk_shift = 4;  // 16 bytes
+        static constexpr uint8_t const _s_max_chunk_shift = 9;  // 512 bytes
 
-        class DiskDesc : public DMA::Isr, public ProducerConsumer < _s_bsize >
+        // Tuned timeouts are the worst latency seen multiplied by this
+        // but no less than the minimum.
+        static constexpr uint16_t const _s_timeout_factor = 4;
+        static constexpr uint16_t const _s_min_timeout = 50;
+
+        // How long to wait for the SPI bus, in usecs
+        static constexpr uint32_t const _s_bus_deadline = 10000;
+
+        // mid, oid, psn, chunk_shift (C64), pre_erase, read_timeout, write_timeout
+        static constexpr tSdProfile const _s_default_profile{ 0, 0, 0, 6, false, 100, 250 };
+
+        class DiskDesc : public DMA::Isr, public SPIArbiter < SPI, MOSI, MISO, SCK >::Waiter,
+            public ProducerConsumer < _s_bsize >
         {
             public:
                 enum chunk_e : uint16_t
@@ -265,10 +365,12 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
                 //virtual bool consumeDone(void) const final;
                 //virtual bool produceDone(void) const final;
 
-                bool stalled(void) const { return _stalled; }
+                bool stalled(void) const { return _stalled || _yielded; }
+                bool yielded(void) const { return _yielded; }
                 bool error(void) const { return _error; }
 
-                bool start(uint32_t total, dd_dir_e dir);
+                bool start(uint32_t total, dd_dir_e dir, chunk_e chunk,
+                        spi_client_t client, uint32_t cta, Latency * latency = nullptr);
                 void resume(void);
                 void stop(void);
 
@@ -277,12 +379,17 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
 
             private:
                 virtual void isr(DMA::Channel & ch) { (_dir == DD_READ) ? read() : write(); }
+                virtual void granted(void);
 
                 void init(void);
                 void read(void);
                 void write(void);
                 void abort(void);
                 void _resume(void);
+                void lap(lat_e lat);
+                bool boundary(void) const;
+                bool yield(void);
+                bool reclaim(void);
 
                 enum dds_e : uint8_t
                 {
@@ -296,15 +403,22 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
 
                 dds_e volatile _state;
 
-                chunk_e const _chunk = C64;
+                chunk_e _chunk = C64;
                 dd_dir_e volatile _dir = DD_READ;
 
+                Latency * _latency = nullptr;
+                uint32_t _lap = 0;
+
                 uint8_t volatile _pushr;
                 uint8_t volatile _popr;
 
                 bool volatile _stalled = false;
+                bool volatile _yielded = false;
                 bool volatile _error = false;
 
+                spi_client_t _client = -1;
+                uint32_t _cta = 0;
+
                 TCD _tcd_tx;
                 TCD _tcd_rx;
 
@@ -312,6 +426,8 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
                 DMA::Channel * _ch_tx = nullptr;
 
                 SPI < MOSI, MISO, SCK > & _spi = SPI < MOSI, MISO, SCK >::acquire();
+                SPIArbiter < SPI, MOSI, MISO, SCK > & _arb = SPIArbiter < SPI, MOSI, MISO, SCK >::acquire();
+                PinOut < CS > & _cs = PinOut < CS >::acquire();
         };
 
         DevSD(void);
@@ -331,10 +447,19 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
         bool checkCapacity(void);
         bool readCSD(void);
         bool readCID(void);
+        bool readSdStatus(void);
+        void loadProfile(void);
+        int bench(uint32_t addr, uint16_t num_blocks, dd_dir_e dir);
+        uint16_t tunedTimeout(uint32_t us) const;
+        void record(lat_e lat, uint32_t ts) { if (_profiling) _latency[lat].add(usecs() - ts); }
 
         uint32_t address(uint32_t addr) { return _hc ? addr : (addr << 9); }
         int error(dd_err_e errno, bool abort = false)
         {
+            // A command that never got the bus failed for want of it
+            if (abort && !this->_arb.owner(this->_client))
+                errno = DD_ERR_BUSY;
+
             this->_errno = errno;
             if (abort) endCmd();
             return -1;
@@ -352,6 +477,12 @@ class DevSD : public DevDisk < SD_BLOCK_LEN, CS, SPI, MOSI, MISO, SCK >
 
         uint32_t _blocks = 0;
         uint32_t _reserved = 0;
+        uint32_t _au_blocks = 0;
+
+        tSdProfile _profile{_s_default_profile};
+        bool _tuned = false;
+        bool _profiling = false;
+        Latency _latency[LAT_CNT] = {};
 
         bool _crc = true;
         uint8_t _crc7_table[256];
@@ -680,6 +811,9 @@ DevSD < CS, SPI, MOSI, MISO, SCK >::DevSD(void)
 {
     crc7Init();
 
+    // Multi-block transfers that yield the bus get it back from the arbiter
+    this->_arb.waiter(this->_client, &_disk_desc);
+
     if (!valid())
         return;
 
@@ -717,8 +851,11 @@ DevSD < CS, SPI, MOSI, MISO, SCK >::DevSD(void)
     }
 
     (void)readCID();
+    (void)readSdStatus();
 
     _blocks = _csd.numBlocks();
+
+    loadProfile();
 }
 
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
@@ -796,7 +933,12 @@ uint8_t DevSD < CS, SPI, MOSI, MISO, SCK >::sendCommand(uint8_t cmd_num, uint32_
     uint8_t start = _s_start_bit | _s_trans_bit | cmd_num;
     uint8_t end = _crc ? ((crc7(cmd_num, arg) << 1) | _s_end_bit) : (0xFE | _s_end_bit);
 
-    this->_spi.begin(this->_pin, this->_cta);
+    // Nothing was selected so there's nothing to end, see endCmd()
+    if (!this->begin(_s_bus_deadline))
+    {
+        _busy = false;
+        return TOKEN_HIGH;
+    }
 
     // Send command
     this->_spi.tx8(start);
@@ -836,7 +978,10 @@ uint16_t DevSD < CS, SPI, MOSI, MISO, SCK >::sendStatus(void)
     uint8_t r1 = sendCmd(SEND_STATUS);
 
     if (r1 == TOKEN_HIGH)
+    {
+        endCmd();
         return r1;
+    }
 
     uint16_t r2 = ((uint16_t)r1 << 8) | this->_spi.txrx8();
 
@@ -848,8 +993,15 @@ uint16_t DevSD < CS, SPI, MOSI, MISO, SCK >::sendStatus(void)
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 void DevSD < CS, SPI, MOSI, MISO, SCK >::endCmd(void)
 {
-    this->_spi.end(this->_pin);
-    (void)this->_spi.txrx8();  // I think spec says to do this or at least wait 8 clocks.
+    // sendCommand() couldn't get the bus in which case someone else may have
+    // it and it's theirs to end
+    if (this->_arb.owner(this->_client))
+    {
+        this->_spi.end(this->_pin);
+        (void)this->_spi.txrx8();  // I think spec says to do this or at least wait 8 clocks.
+        this->release();
+    }
+
     _busy = false;
 }
 
@@ -862,6 +1014,9 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::clock74(void)
     // * ... In case of SPI mode, CS shall be held to high during 74 clock cycles.
     static uint8_t const sd_init_clocks = 80;
 
+    if (!this->_arb.grab(this->_client, this->_cta, _s_bus_deadline))
+        return;
+
     _busy = true;
 
     this->_spi.begin(this->_cta);
@@ -870,6 +1025,7 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::clock74(void)
         this->_spi.tx16();
 
     this->_spi.end();
+    this->release();
 
     _busy = false;
 }
@@ -1076,12 +1232,259 @@ bool DevSD < CS, SPI, MOSI, MISO, SCK >::readCID(void)
     return true;
 }
 
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevSD < CS, SPI, MOSI, MISO, SCK >::readSdStatus(void)
+{
+    uint8_t resp = sendAcmd(SD_STATUS);
+
+    if (r1Error(resp))
+    {
+        endCmd();
+        return false;
+    }
+
+    // Second byte of the R2 response
+    (void)this->_spi.txrx8();
+
+    // In bytes, i.e number of 8-bit transfers
+    static uint8_t const resp_tries = 8;
+
+    // Wait for response
+    for (uint8_t i = 0; i < resp_tries; i++)
+    {
+        if ((resp = this->_spi.txrx8()) != TOKEN_HIGH)
+            break;
+    }
+
+    if (resp != TOKEN_START_BLOCK)
+    {
+        endCmd();
+        return false;
+    }
+
+    // 64 bytes + CRC16
+    uint8_t status[64];
+    this->_spi.trans(nullptr, 0, status, sizeof(status));
+    this->_spi.tx16(); // Ignore CRC16
+
+    endCmd();
+
+    // AU_SIZE is SD Status [431:428], in kilobytes
+    static uint32_t const au_sizes[16] =
+    {
+        0, 16, 32, 64, 128, 256, 512, 1024,
+        2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536
+    };
+
+    _au_blocks = au_sizes[status[10] >> 4] * (1024 / SD_BLOCK_LEN);
+
+    return true;
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+constexpr tSdProfile const DevSD < CS, SPI, MOSI, MISO, SCK >::_s_default_profile;
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevSD < CS, SPI, MOSI, MISO, SCK >::Latency::add(uint32_t us)
+{
+    if ((count == 0) || (us < min)) min = us;
+    if (us > max) max = us;
+
+    count++;
+    total += us;
+
+    uint8_t b = (us < 16) ? 0 : (28 - __builtin_clz(us));
+    hist[(b < buckets) ? b : (buckets - 1)]++;
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+char const * DevSD < CS, SPI, MOSI, MISO, SCK >::latencyName(lat_e lat)
+{
+    static char const * const names[LAT_CNT] =
+    {
+        "CMD17 setup",
+        "CMD18 setup",
+        "CMD24 setup",
+        "CMD25 setup",
+        "CMD24 busy",
+        "Stop busy",
+        "CMD18 block",
+        "CMD25 block",
+    };
+
+    return (lat < LAT_CNT) ? names[lat] : "";
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevSD < CS, SPI, MOSI, MISO, SCK >::loadProfile(void)
+{
+    tSdProfile profile;
+
+    _profile = _s_default_profile;
+    _profile.mid = _cid.mid();
+    _profile.oid = _cid.oid();
+    _profile.psn = _cid.psn();
+
+    // Only use a stored profile if it was generated for this card
+    if (!Eeprom::acquire().getSdProfile(profile)
+            || (profile.mid != _profile.mid)
+            || (profile.oid != _profile.oid)
+            || (profile.psn != _profile.psn)
+            || (profile.chunk_shift < _s_min_chunk_shift)
+            || (profile.chunk_shift > _s_max_chunk_shift)
+            || (profile.read_timeout < _s_min_timeout)
+            || (profile.write_timeout < _s_min_timeout))
+        return;
+
+    _profile = profile;
+    _tuned = true;
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+uint16_t DevSD < CS, SPI, MOSI, MISO, SCK >::tunedTimeout(uint32_t us) const
+{
+    uint32_t ms = ceiling(us, 1000) * _s_timeout_factor;
+
+    if (ms < _s_min_timeout)
+        return _s_min_timeout;
+    else if (ms > EE_SD_TIMEOUT_MAX)
+        return EE_SD_TIMEOUT_MAX;
+
+    return ms;
+}
+
+// Transfers num_blocks using a multiple block read or write.  Written data is garbage.
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevSD < CS, SPI, MOSI, MISO, SCK >::bench(uint32_t addr, uint16_t num_blocks, dd_dir_e dir)
+{
+    TBlockLease lease;
+    if (!lease.valid())
+        return error(DD_ERR_BUSY);
+
+    uint8_t * buf = lease.get();
+
+    dd_desc_t dd = open(addr, num_blocks, dir);
+    if (dd == nullptr)
+        return -1;
+
+    uint32_t const total = (uint32_t)num_blocks * SD_BLOCK_LEN;
+    uint32_t const timeout = (uint32_t)num_blocks * _profile.write_timeout;
+    uint32_t n = 0, ts = msecs();
+
+    while ((n < total) && ((msecs() - ts) < timeout))
+    {
+        int ret = (dir == DD_READ) ? read(dd, buf, SD_BLOCK_LEN) : write(dd, buf, SD_BLOCK_LEN);
+        if (ret < 0)
+        {
+            (void)close(dd);
+            return -1;
+        }
+
+        n += ret;
+    }
+
+    if (n != total)
+    {
+        (void)close(dd);
+        return error(DD_ERR_TIMED_OUT);
+    }
+
+    return close(dd);
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevSD < CS, SPI, MOSI, MISO, SCK >::tune(uint32_t scratch, uint16_t num_blocks)
+{
+    TBlockLease lease;
+
+    if (busy() || !lease.valid())
+        return error(DD_ERR_BUSY);
+
+    if ((num_blocks == 0) || ((scratch + num_blocks) > _blocks) || ((scratch + num_blocks) < scratch))
+        return error(DD_ERR_INVAL);
+
+    bool profiling = _profiling;
+    tSdProfile profile = _profile;
+
+    auto tune_error = [&](void) -> int
+    {
+        _profile = profile;
+        _profiling = profiling;
+        return -1;
+    };
+
+    resetLatency();
+    _profiling = true;
+
+    // Start from the defaults so timeouts from a bad profile don't skew anything
+    _profile.chunk_shift = _s_default_profile.chunk_shift;
+    _profile.pre_erase = false;
+    _profile.read_timeout = _s_default_profile.read_timeout;
+    _profile.write_timeout = _s_default_profile.write_timeout;
+
+    // Single block commands
+    for (uint16_t i = 0; i < num_blocks; i++)
+    {
+        if ((read(scratch + i, lease.block()) < 0) || (write(scratch + i, lease.block()) < 0))
+            return tune_error();
+    }
+
+    // Chunk size that gives the best multiple block read throughput.
+    // Larger chunks mean fewer DMA interrupts but longer stalls on the consumer side.
+    uint32_t best = UINT32_MAX;
+    uint8_t chunk_shift = _profile.chunk_shift;
+
+    for (uint8_t shift = _s_min_chunk_shift; shift <= _s_max_chunk_shift; shift++)
+    {
+        _profile.chunk_shift = shift;
+
+        uint32_t ts = usecs();
+        if (bench(scratch, num_blocks, DD_READ) < 0)
+            return tune_error();
+
+        uint32_t us = usecs() - ts;
+        if (us < best)
+        {
+            best = us;
+            chunk_shift = shift;
+        }
+    }
+
+    _profile.chunk_shift = chunk_shift;
+
+    // Whether pre-erasing helps multiple block writes
+    uint32_t us[2];
+    for (uint8_t pre_erase = 0; pre_erase < 2; pre_erase++)
+    {
+        _profile.pre_erase = pre_erase;
+
+        uint32_t ts = usecs();
+        if (bench(scratch, num_blocks, DD_WRITE) < 0)
+            return tune_error();
+
+        us[pre_erase] = usecs() - ts;
+    }
+
+    _profile.pre_erase = us[1] < us[0];
+
+    auto worst = [&](lat_e a, lat_e b) -> uint32_t
+    {
+        return (_latency[a].max > _latency[b].max) ? _latency[a].max : _latency[b].max;
+    };
+
+    _profile.read_timeout = tunedTimeout(worst(LAT_READ_SETUP, LAT_READ_MULTI_SETUP));
+    _profile.write_timeout = tunedTimeout(worst(LAT_WRITE_BUSY, LAT_STOP_BUSY));
+
+    _profiling = profiling;
+    _tuned = Eeprom::acquire().setSdProfile(_profile);
+
+    return 0;
+}
+
 // uint32_t addr - a sector on the disk
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 int DevSD < CS, SPI, MOSI, MISO, SCK >::read(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN])
 {
-    static uint32_t const read_timeout = 100;
-
     addr = address(addr);
 
     if (addr >= _blocks)
@@ -1089,17 +1492,20 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::read(uint32_t addr, uint8_t (&buf)[SD_BL
     else if (busy())
         return error(DD_ERR_BUSY);
 
+    uint32_t lts = usecs();
     uint8_t resp = sendCmd(READ_SINGLE_BLOCK, addr);
 
     if (r1Error(resp))
         return error(DD_ERR_IO, true);
 
     uint32_t ts = msecs();
-    while (((resp = this->_spi.txrx8()) == TOKEN_HIGH) && ((msecs() - ts) < read_timeout));
+    while (((resp = this->_spi.txrx8()) == TOKEN_HIGH) && ((msecs() - ts) < _profile.read_timeout));
 
     if (resp != TOKEN_START_BLOCK)
         return error(DD_ERR_TIMED_OUT, true);
 
+    record(LAT_READ_SETUP, lts);
+
     // Total of 514 bytes, 512 bytes data + CRC16
     this->_spi.trans(nullptr, 0, buf, SD_BLOCK_LEN);
     this->_spi.tx16(); // Ignore CRC16
@@ -1113,8 +1519,6 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::read(uint32_t addr, uint8_t (&buf)[SD_BL
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 int DevSD < CS, SPI, MOSI, MISO, SCK >::write(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN])
 {
-    static uint32_t const write_timeout = 250;
-
     addr = address(addr);
 
     if (addr >= _blocks)
@@ -1122,10 +1526,13 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::write(uint32_t addr, uint8_t (&buf)[SD_B
     else if (busy())
         return error(DD_ERR_BUSY);
 
+    uint32_t lts = usecs();
     uint8_t resp = sendCmd(WRITE_BLOCK, addr);
     if (r1Error(resp))
         return error(DD_ERR_IO, true);
 
+    record(LAT_WRITE_SETUP, lts);
+
     // Total of 515 bytes, Start Block Token + 512 bytes data + CRC16
     this->_spi.tx8(TOKEN_START_BLOCK);
     this->_spi.trans(buf, SD_BLOCK_LEN, nullptr, 0);
@@ -1144,12 +1551,15 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::write(uint32_t addr, uint8_t (&buf)[SD_B
         return -1;
     }
 
+    lts = usecs();
     uint32_t ts = msecs();
-    while (((resp = this->_spi.txrx8()) == TOKEN_BUSY) && ((msecs() - ts) < write_timeout));
+    while (((resp = this->_spi.txrx8()) == TOKEN_BUSY) && ((msecs() - ts) < _profile.write_timeout));
 
     if (resp == TOKEN_BUSY)
         return error(DD_ERR_TIMED_OUT, true);
 
+    record(LAT_WRITE_BUSY, lts);
+
     endCmd();
 
     return SD_BLOCK_LEN;
@@ -1173,6 +1583,16 @@ dd_desc_t DevSD < CS, SPI, MOSI, MISO, SCK >::open(uint32_t addr, uint16_t num_b
         return open_error(DD_ERR_INVAL);
 
     uint8_t r1;
+    uint32_t lts = usecs();
+
+    if ((dir == DD_WRITE) && _profile.pre_erase)
+    {
+        r1 = sendAcmd(SET_WR_BLK_ERASE_COUNT, num_blocks);
+        if (r1Error(r1))
+            return open_error(DD_ERR_IO, true);
+
+        endCmd();
+    }
 
     if (dir == DD_READ)
         r1 = sendCmd(READ_MULTIPLE_BLOCK, addr);
@@ -1182,7 +1602,13 @@ dd_desc_t DevSD < CS, SPI, MOSI, MISO, SCK >::open(uint32_t addr, uint16_t num_b
     if (r1Error(r1))
         return open_error(DD_ERR_IO, true);
 
-    if (!_disk_desc.start((uint32_t)num_blocks * SD_BLOCK_LEN, dir))
+    // Read setup time is taken when the first start block token is seen
+    if (dir == DD_WRITE)
+        record(LAT_WRITE_MULTI_SETUP, lts);
+
+    auto chunk = (typename DiskDesc::chunk_e)(1 << _profile.chunk_shift);
+    if (!_disk_desc.start((uint32_t)num_blocks * SD_BLOCK_LEN, dir, chunk,
+                this->_client, this->_cta, _profiling ? _latency : nullptr))
     {
         close(&_disk_desc);
         return open_error(DD_ERR_BUSY, true);
@@ -1200,10 +1626,10 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::read(dd_desc_t dd, uint8_t * buf, uint16
     if (_disk_desc.error())
         return error(DD_ERR_BADFD);
 
-    uint16_t n;
-    if (_disk_desc.consumeDone() || ((n = _disk_desc.consume(buf, blen)) == 0))
-        return 0;
+    uint16_t n = _disk_desc.consumeDone() ? 0 : _disk_desc.consume(buf, blen);
 
+    // Resume even if nothing was consumed since the transfer may have
+    // yielded the bus with the ring empty.
     if (_disk_desc.stalled())
         _disk_desc.resume();
 
@@ -1219,9 +1645,7 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::write(dd_desc_t dd, uint8_t * data, uint
     if (_disk_desc.error())
         return error(DD_ERR_BADFD);
 
-    uint16_t n;
-    if (_disk_desc.produceDone() || ((n = _disk_desc.produce(data, dlen)) == 0))
-        return 0;
+    uint16_t n = _disk_desc.produceDone() ? 0 : _disk_desc.produce(data, dlen);
 
     if (_disk_desc.stalled())
         _disk_desc.resume();
@@ -1229,6 +1653,60 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::write(dd_desc_t dd, uint8_t * data, uint
     return n;
 }
 
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevSD < CS, SPI, MOSI, MISO, SCK >::span(dd_desc_t dd, uint8_t ** p, uint16_t len, uint16_t skip)
+{
+    if (!busy() || (dd != &_disk_desc) || (p == nullptr))
+        return error(DD_ERR_BADF);
+
+    if (_disk_desc.error())
+        return error(DD_ERR_BADFD);
+
+    if (_disk_desc.yielded())
+        _disk_desc.resume();
+
+    if (_disk_desc.dir() == DD_READ)
+        return _disk_desc.peekContiguous((uint8_t const **)p, len, skip);
+
+    if (skip != 0)
+        return error(DD_ERR_INVAL);
+
+    return _disk_desc.reserveContiguous(p, len);
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+int DevSD < CS, SPI, MOSI, MISO, SCK >::commit(dd_desc_t dd, uint16_t len)
+{
+    if (!busy() || (dd != &_disk_desc))
+        return error(DD_ERR_BADF);
+
+    if (_disk_desc.error())
+        return error(DD_ERR_BADFD);
+
+    if (len == 0)
+        return 0;
+
+    if (_disk_desc.dir() == DD_READ)
+    {
+        if (_disk_desc.consumeLen(len) != len)
+            return error(DD_ERR_INVAL);
+
+        _disk_desc.commit(len);
+    }
+    else
+    {
+        if (_disk_desc.produceLen(len) != len)
+            return error(DD_ERR_INVAL);
+
+        _disk_desc.publish(len);
+    }
+
+    if (_disk_desc.stalled())
+        _disk_desc.resume();
+
+    return len;
+}
+
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 int DevSD < CS, SPI, MOSI, MISO, SCK >::close(dd_desc_t dd)
 {
@@ -1237,32 +1715,34 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::close(dd_desc_t dd)
 
     _disk_desc.stop();
 
+    uint32_t lts;
+
     if (_disk_desc.dir() == DD_READ)
     {
-        static constexpr uint32_t const read_timeout = 100;
-
         // Response is type R1b so a busy signal may follow.
         // Physical Layer Simplified Specification 4.10 - 4.3.3 Data Read, * Block Read
         //  The stop command has an execution delay due to the serial command transmission.
         //  The data transfer stops after the end bit of the stop command.
         // Response always seems to be 0x7F - tested SanDisk and Samsung
 
+        lts = usecs();
         uint8_t r1b = sendCmd(STOP_TRANSMISSION);
         if (r1b == TOKEN_HIGH) // Timeout
             return error(DD_ERR_TIMED_OUT, true);
 
         uint32_t ts = msecs();
-        while (((r1b = this->_spi.txrx8()) == TOKEN_BUSY) && ((msecs() - ts) < read_timeout));
+        while (((r1b = this->_spi.txrx8()) == TOKEN_BUSY) && ((msecs() - ts) < _profile.read_timeout));
 
         if (r1b == TOKEN_BUSY)
             return error(DD_ERR_TIMED_OUT, true);
 
+        record(LAT_STOP_BUSY, lts);
+
         endCmd();
     }
     else
     {
-        static constexpr uint32_t const write_timeout = 250;
-
+        lts = usecs();
         (void)this->_spi.txrx8(TOKEN_STOP_TRAN);
 
         // Some extra clocks are sometimes necessary before the busy signal test.
@@ -1272,11 +1752,13 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::close(dd_desc_t dd)
         uint16_t status;
         uint32_t ts = msecs();
 
-        while (((status = this->_spi.txrx8()) != TOKEN_HIGH) && ((msecs() - ts) < write_timeout));
+        while (((status = this->_spi.txrx8()) != TOKEN_HIGH) && ((msecs() - ts) < _profile.write_timeout));
 
         if (status != TOKEN_HIGH)
             return error(DD_ERR_TIMED_OUT, true);
 
+        record(LAT_STOP_BUSY, lts);
+
         endCmd();
 
         // XXX Actually check status
@@ -1287,7 +1769,8 @@ int DevSD < CS, SPI, MOSI, MISO, SCK >::close(dd_desc_t dd)
 }
 
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
-bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::start(uint32_t total, dd_dir_e dir)
+bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::start(uint32_t total, dd_dir_e dir, chunk_e chunk,
+        spi_client_t client, uint32_t cta, Latency * latency)
 {
     _ch_tx = DMA::acquire();
     _ch_rx = DMA::acquire();
@@ -1302,9 +1785,16 @@ bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::start(uint32_t total, dd_dir_
     }
 
     _dir = dir;
+    _chunk = chunk;
     _total = total;
     _produced = _consumed = 0;
-    _stalled = _error = false;
+    _stalled = _yielded = _error = false;
+
+    _client = client;
+    _cta = cta;
+
+    _latency = latency;
+    _lap = usecs();
 
     init();
 
@@ -1321,8 +1811,17 @@ bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::start(uint32_t total, dd_dir_
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::resume(void)
 {
-    if ((_ch_tx == nullptr) || (_ch_rx == nullptr)
-            || ((_dir == DD_READ) && !canProduce(_chunk))
+    if ((_ch_tx == nullptr) || (_ch_rx == nullptr))
+        return;
+
+    // Transfer was left at a block boundary so only needs the bus back
+    if (_yielded)
+    {
+        (void)reclaim();
+        return;
+    }
+
+    if (((_dir == DD_READ) && !canProduce(_chunk))
             || ((_dir == DD_WRITE) && !canConsume(_chunk)))
     {
         return;
@@ -1344,7 +1843,12 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::_resume(void)
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::stop(void)
 {
-    while (!done());
+    while (!done())
+    {
+        if (_yielded)
+            resume();
+    }
+
     abort();
 }
 
@@ -1357,6 +1861,87 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::abort(void)
     _ch_rx = _ch_tx = nullptr;
 }
 
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::lap(lat_e lat)
+{
+    if (_latency == nullptr)
+        return;
+
+    uint32_t ts = usecs();
+    _latency[lat].add(ts - _lap);
+    _lap = ts;
+}
+
+// Points between blocks where the card doesn't care if chip select is
+// deasserted - waiting for a start block token on a read, or busy/about
+// to send a start block token on a write.
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::boundary(void) const
+{
+    if (_dir == DD_READ)
+        return _state == WAIT_READY;
+    else
+        return (_state == WAIT_BUSY) || (_state == START_BLOCK);
+}
+
+// Called from the DMA isr with both channels idle.  Hands the bus to a
+// higher priority client, e.g. the VS1053 when DREQ asks for data.
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::yield(void)
+{
+    if (!boundary() || !_arb.contended(_client))
+        return false;
+
+    _yielded = true;
+
+    // Only one channel may be routed to the SPI0 request sources so get out
+    // of the way of whoever does DMA next.
+    _ch_rx->disconnect();
+    _ch_tx->disconnect();
+
+    _spi.dmaDisable();
+    _spi.end(_cs);
+    (void)_spi.txrx8();  // So the card lets go of DO before anyone else reads, as endCmd()
+    _arb.release(_client, true);
+
+    // Ask for the bus back.  granted() is called when it comes back.
+    if (_arb.request(_client, _cta, _s_bus_deadline))
+        granted();
+
+    return true;
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::reclaim(void)
+{
+    if (!_arb.request(_client, _cta, _s_bus_deadline))
+        return false;
+
+    granted();
+
+    return true;
+}
+
+template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::granted(void)
+{
+    __disable_irq();
+    bool yielded = _yielded;
+    _yielded = false;
+    __enable_irq();
+
+    if (!yielded)
+        return;
+
+    (void)_spi.begin(_cs, _cta);
+    _spi.dmaEnable();
+
+    _ch_rx->connect();
+    _ch_tx->connect();
+
+    _resume();
+}
+
 template < pin_t CS, template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
 bool DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::done(void) const
 {
@@ -1407,12 +1992,15 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::read(void)
         if (_popr != TOKEN_START_BLOCK)
             return;
 
+        if (_produced == 0)
+            lap(LAT_READ_MULTI_SETUP);
+
         _state = DATA;
 
         _tcd_tx.biter = _chunk;
         _tcd_tx.citer = _chunk;
 
-        _tcd_rx.daddr = (void volatile *)(_buffer + (_produced % _s_bsize));
+        _tcd_rx.daddr = (void volatile *)(_buffer + offset(_produced));
         _tcd_rx.doff = 1;
         _tcd_rx.biter = _chunk;
         _tcd_rx.citer = _chunk;
@@ -1426,7 +2014,7 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::read(void)
 
     auto data = [&](void) -> void
     {
-        _produced += _chunk;
+        publish(_chunk);
 
         if ((_produced % SD_BLOCK_LEN) == 0)
             _state = CHKSUM;
@@ -1450,6 +2038,8 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::read(void)
 
     auto chksum = [&](void) -> void
     {
+        lap(LAT_READ_BLOCK);
+
         _state = WAIT_READY;
 
         _tcd_tx.biter = 1;
@@ -1473,7 +2063,7 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::read(void)
     if (error())
         abort();
 
-    if (!error() && !done() && !stalled())
+    if (!error() && !done() && !stalled() && !yield())
         _resume();
 }
 
@@ -1484,7 +2074,7 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::write(void)
     {
         _state = DATA;
 
-        _tcd_tx.saddr = (void volatile *)(_buffer + (_consumed % _s_bsize));
+        _tcd_tx.saddr = (void volatile *)(_buffer + offset(_consumed));
         _tcd_tx.soff = 1;
         _tcd_tx.biter = _chunk;
         _tcd_tx.citer = _chunk;
@@ -1501,7 +2091,7 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::write(void)
 
     auto data = [&](void) -> void
     {
-        _consumed += _chunk;
+        commit(_chunk);
 
         if ((_consumed % SD_BLOCK_LEN) == 0)
             _state = CHKSUM;
@@ -1551,6 +2141,8 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::write(void)
         if (_popr == TOKEN_BUSY)
             return;
 
+        lap(LAT_WRITE_BLOCK);
+
         _state = START_BLOCK;
         _pushr = TOKEN_START_BLOCK_WMB;
     };
@@ -1568,13 +2160,18 @@ void DevSD < CS, SPI, MOSI, MISO, SCK >::DiskDesc::write(void)
     if (error())
         abort();
 
-    if (!error() && !done() && !stalled())
+    if (!error() && !done() && !stalled() && !yield())
         _resume();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Templates ///////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+#ifdef HOST_DISK
+// Host builds of the tests put an image file where the card would be
+#include HOST_DISK
+#else
 using TDisk = DevSD < PIN_SD_CS, SPI0, PIN_MOSI, PIN_MISO, PIN_SCK >;
+#endif
 
 #endif
@@ -31,6 +31,7 @@ void DMA::Channel::start(TCD const & tcd, src_e source, Isr * isr)
         NVIC::enable((irq_e)(IRQ_DMA_CH0 + _ch_num));
 
     _isr = isr;
+    _source = source;
 
     *_erq = 1;
     *_int = 1;
@@ -49,6 +50,7 @@ void DMA::Channel::stop(void)
 }
 
 uint32_t DMA::_s_available = _s_max_available;
+uint32_t volatile DMA::_s_errors = 0;
 
 reg8 DMA::_s_base_reg = (reg8)0x40008000;
 reg32 DMA::_s_cr = (reg32)_s_base_reg;
@@ -129,6 +131,7 @@ void DMA::errorIsr(void)
     *_s_cerr = DMA_ALL;
 
     _s_channels[(error & (0x0F << 8)) >> 8]._error = error & _s_error_mask;
+    _s_errors++;
 }
 
 void dma_ch0_isr(void) { DMA::chIsr < 0 > (); }
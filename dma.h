@@ -286,6 +286,11 @@ class DMA : public Module
                 void update(TCD const & tcd) { memcpy((void *)_tcd, &tcd, sizeof(TCD)); }
                 void resume(void) { *_erq = 1; }
                 void stop(void);
+
+                // Take the channel off its request source and put it back without
+                // touching the TCD.  Only one channel may be routed to a source.
+                void disconnect(void) { *_chcfg = 0; }
+                void connect(void) { *_chcfg = _source | DMAMUX_CHCFGn_ENBL; }
                 //bool running(void) { return *_hrs == 1; }
 
                 uint8_t channel(void) const { return _ch_num; }
@@ -297,6 +302,7 @@ class DMA : public Module
 
                 uint8_t const _ch_num;
                 Isr * _isr = nullptr;
+                src_e _source = ALWAYS_ENABLED_0;
 
                 reg8 _chcfg = (reg8)(0x40021000 + _ch_num);
 
@@ -323,6 +329,7 @@ class DMA : public Module
         static Channel * acquire(bool pit_channel = false);
         static void release(Channel * ch);
         static uint8_t available(bool pit_channels = false);
+        static uint32_t errors(void) { return _s_errors; }  // Channel errors since boot
 
         void cancel(bool clear_ecx = false) { clear_ecx ? *_s_cr |= DMA_CR_ECX : *_s_cr |= DMA_CR_CX; }
         void enableMinorLoopMapping(bool enable = true) { enable ? *_s_cr |= DMA_CR_EMLM : *_s_cr &= ~DMA_CR_EMLM; }
@@ -359,6 +366,7 @@ class DMA : public Module
         static constexpr uint32_t const _s_error_mask = 0x000140FF;  // Masks out VLD and ERRCHN
 
         static uint32_t _s_available;
+        static uint32_t volatile _s_errors;
         static Channel _s_channels[_s_num_channels];
 
         static reg8 _s_base_reg;
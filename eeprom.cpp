@@ -353,3 +353,45 @@ bool Eeprom::getPower(ePower & power) const
 
     return true;
 }
+
+bool Eeprom::setSdProfile(eSdProfile const & profile)
+{
+    if ((profile.read_timeout > EE_SD_TIMEOUT_MAX) || (profile.write_timeout > EE_SD_TIMEOUT_MAX))
+        return false;
+
+    uint16_t mf = ((uint16_t)profile.mid << 8)
+        | (profile.chunk_shift & EE_SD_FLAG_CHUNK_MASK)
+        | (profile.pre_erase ? EE_SD_FLAG_PRE_ERASE : 0);
+    uint16_t o = profile.oid;
+    uint16_t psh = (uint16_t)(profile.psn >> 16);
+    uint16_t psl = (uint16_t)(profile.psn & 0xFFFF);
+    uint16_t rw = ((uint16_t)ceiling(profile.read_timeout, EE_SD_TIMEOUT_UNIT) << 8)
+        | (uint16_t)ceiling(profile.write_timeout, EE_SD_TIMEOUT_UNIT);
+
+    return (write(EEI_SD_MID_FLAGS, mf)
+            && write(EEI_SD_OID, o)
+            && write(EEI_SD_PSN_HIGH, psh)
+            && write(EEI_SD_PSN_LOW, psl)
+            && write(EEI_SD_TIMEOUTS, rw));
+}
+
+bool Eeprom::getSdProfile(eSdProfile & profile) const
+{
+    uint16_t mf, o, psh, psl, rw;
+    if (!read(EEI_SD_MID_FLAGS, mf)
+            || !read(EEI_SD_OID, o)
+            || !read(EEI_SD_PSN_HIGH, psh)
+            || !read(EEI_SD_PSN_LOW, psl)
+            || !read(EEI_SD_TIMEOUTS, rw))
+        return false;
+
+    profile.mid = (uint8_t)(mf >> 8);
+    profile.chunk_shift = (uint8_t)(mf & EE_SD_FLAG_CHUNK_MASK);
+    profile.pre_erase = (mf & EE_SD_FLAG_PRE_ERASE) == EE_SD_FLAG_PRE_ERASE;
+    profile.oid = o;
+    profile.psn = ((uint32_t)psh << 16) | (uint32_t)psl;
+    profile.read_timeout = (rw >> 8) * EE_SD_TIMEOUT_UNIT;
+    profile.write_timeout = (rw & 0xFF) * EE_SD_TIMEOUT_UNIT;
+
+    return true;
+}
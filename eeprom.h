@@ -45,9 +45,16 @@ enum eei_e : uint8_t
     EEI_NLC_03_LOW,
     EEI_NLC_03_HIGH,
 
-    // Num entries : 27
+    // 28-32
+    EEI_SD_MID_FLAGS,   // SD card CID Manufacturer ID & Profile flags
+    EEI_SD_OID,         // SD card CID OEM/Application ID
+    EEI_SD_PSN_HIGH,    // SD card CID Product Serial Number high 16 bits
+    EEI_SD_PSN_LOW,     // SD card CID Product Serial Number low 16 bits
+    EEI_SD_TIMEOUTS,    // SD card Read & Write timeouts
+
+    // Num entries : 32
 // Used to determine the EEPROM size
-#define EEI_CNT  27
+#define EEI_CNT  32
 };
 
 #define EE_ALARM_TYPE_BEEP   0x00
@@ -69,6 +76,14 @@ enum eei_e : uint8_t
 // Night Light Colors Count
 #define EE_NLC_CNT  3
 
+// SD Profile flags - low nibble is the DMA chunk size as a power of 2
+#define EE_SD_FLAG_CHUNK_MASK  0x0F
+#define EE_SD_FLAG_PRE_ERASE   0x10
+
+// SD Profile timeouts are stored in a byte each in units of this many milliseconds
+#define EE_SD_TIMEOUT_UNIT  4
+#define EE_SD_TIMEOUT_MAX   (0xFF * EE_SD_TIMEOUT_UNIT)
+
 struct eAlarm
 {
     uint8_t hour;
@@ -109,6 +124,18 @@ struct ePower
     uint8_t touch_secs;
 };
 
+// Per card tuning keyed by the card's CID
+struct eSdProfile
+{
+    uint8_t mid;   // Manufacturer ID
+    uint16_t oid;  // OEM/Application ID
+    uint32_t psn;  // Product Serial Number
+    uint8_t chunk_shift;     // DMA chunk size as a power of 2
+    bool pre_erase;          // Send SET_WR_BLK_ERASE_COUNT before multiple block writes
+    uint16_t read_timeout;   // Milliseconds
+    uint16_t write_timeout;  // Milliseconds
+};
+
 class Eeprom : public Module
 {
     public:
@@ -137,6 +164,9 @@ class Eeprom : public Module
         bool setNLC(uint8_t index, uint32_t color_code);
         bool getNLC(uint8_t index, uint32_t & color_code) const;
 
+        bool setSdProfile(eSdProfile const & profile);
+        bool getSdProfile(eSdProfile & profile) const;
+
         Eeprom(Eeprom const &) = delete;
         Eeprom & operator=(Eeprom const &) = delete;
 
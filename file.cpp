@@ -170,3 +170,231 @@ int FileInfo::deserialize(uint8_t const * buf, uint16_t blen)
 
     return bytes;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// Span File ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+bool SpanFile::open(File * fp)
+{
+    if ((fp == nullptr) || !fp->valid() || !fp->canRead())
+        return false;
+
+    File::set(fp->info(), O_READ);
+    _info = 0;
+
+    _fst = fp->fs();
+    _fp = fp;
+    _offset = 0;
+    _num_spans = _num_patches = 0;
+    _taken = true;
+
+    return true;
+}
+
+bool SpanFile::add(uint32_t offset, uint32_t len, uint8_t const * head, uint8_t hlen)
+{
+    if (!valid() || (hlen > sizeof(_spans[0].head)) || ((head == nullptr) && (hlen != 0))
+            || (offset > _fp->size()) || (len > (_fp->size() - offset)))
+        return false;
+
+    uint32_t pos = size();
+
+    // Carry on the last span if this follows straight on from it in the file
+    if ((_num_spans != 0) && (hlen == 0))
+    {
+        Span & last = _spans[_num_spans - 1];
+
+        if ((last.offset + last.len) == offset)
+        {
+            last.len += len;
+            _info = pos + len;
+            return true;
+        }
+    }
+
+    if (_num_spans == _s_max_spans)
+        return false;
+
+    Span & s = _spans[_num_spans++];
+
+    s.pos = pos;
+    s.offset = offset;
+    s.len = len;
+    s.hlen = hlen;
+    if (hlen != 0)
+        memcpy(s.head, head, hlen);
+
+    _info = pos + hlen + len;
+
+    return true;
+}
+
+// Patches are expected in file order
+bool SpanFile::patch(uint32_t offset, uint32_t len, uint8_t width, int32_t delta)
+{
+    if (!valid() || (_num_patches == _s_max_patches)
+            || ((width != 4) && (width != 8)) || ((len % width) != 0))
+        return false;
+
+    if ((_num_patches != 0) && (_patches[_num_patches - 1].end > offset))
+        return false;
+
+    _patches[_num_patches++] = { offset, offset + len, width, delta };
+
+    return true;
+}
+
+bool SpanFile::seek(uint32_t offset)
+{
+    if (!valid() || (offset > size()))
+        return false;
+
+    // The file under it is only moved when read from
+    _offset = offset;
+
+    return true;
+}
+
+int SpanFile::read(uint8_t * buf, int amt)
+{
+    if (!valid() || (buf == nullptr) || (amt < 0))
+        return -1;
+
+    int n = 0;
+
+    while ((n != amt) && !eof())
+    {
+        Span const * s = span(_offset);
+        if (s == nullptr)
+            return -1;
+
+        uint32_t off = _offset - s->pos;
+        uint32_t want = amt - n;
+
+        if (off < s->hlen)
+        {
+            uint32_t cpy = s->hlen - off;
+            if (cpy > want)
+                cpy = want;
+
+            memcpy(buf + n, s->head + off, cpy);
+            n += cpy; _offset += cpy;
+
+            continue;
+        }
+
+        off -= s->hlen;
+
+        uint32_t fo = s->offset + off;
+        if (want > (s->len - off))
+            want = s->len - off;
+
+        int r;
+        Patch const * pt = patched(fo, want);
+
+        if (pt == nullptr)
+            r = fetch(fo, buf + n, want);
+        else if (fo < pt->start)
+            r = fetch(fo, buf + n, pt->start - fo);
+        else
+            r = fetch(*pt, fo, buf + n, want);
+
+        if (r <= 0)
+            return (n == 0) ? r : n;
+
+        n += r; _offset += r;
+    }
+
+    return n;
+}
+
+SpanFile::Span const * SpanFile::span(uint32_t pos) const
+{
+    for (uint8_t i = 0; i < _num_spans; i++)
+    {
+        Span const & s = _spans[i];
+
+        if ((pos >= s.pos) && ((pos - s.pos) < (s.hlen + s.len)))
+            return &s;
+    }
+
+    return nullptr;
+}
+
+SpanFile::Patch const * SpanFile::patched(uint32_t offset, uint32_t len) const
+{
+    for (uint8_t i = 0; i < _num_patches; i++)
+    {
+        Patch const & pt = _patches[i];
+
+        if ((pt.end > offset) && (pt.start < (offset + len)))
+            return &pt;
+    }
+
+    return nullptr;
+}
+
+int SpanFile::fetch(uint32_t offset, uint8_t * buf, uint32_t len)
+{
+    if ((_fp->offset() != offset) && !_fp->seek(offset))
+        return -1;
+
+    return _fp->read(buf, len);
+}
+
+// Whole values go straight into buf and are adjusted there.  Part of one, at
+// either end of a read, is read whole and the part wanted copied out.
+int SpanFile::fetch(Patch const & pt, uint32_t offset, uint8_t * buf, uint32_t len)
+{
+    uint32_t into = (offset - pt.start) % pt.width;
+
+    if (len > (pt.end - offset))
+        len = pt.end - offset;
+
+    if ((into == 0) && (len >= pt.width))
+    {
+        len -= len % pt.width;
+
+        int r = fetch(offset, buf, len);
+        if (r <= 0)
+            return r;
+
+        r -= r % pt.width;
+        for (int i = 0; i < r; i += pt.width)
+            adjust(buf + i, pt.width, pt.delta);
+
+        return r;
+    }
+
+    uint8_t val[8];
+
+    int r = fetch(offset - into, val, pt.width);
+    if (r != pt.width)
+        return (r < 0) ? -1 : 0;
+
+    adjust(val, pt.width, pt.delta);
+
+    uint32_t cpy = pt.width - into;
+    if (cpy > len)
+        cpy = len;
+
+    memcpy(buf, val + into, cpy);
+
+    return cpy;
+}
+
+void SpanFile::adjust(uint8_t * p, uint8_t width, int32_t delta)
+{
+    uint64_t val = 0;
+
+    for (uint8_t i = 0; i < width; i++)
+        val = (val << 8) | p[i];
+
+    val += (int64_t)delta;
+
+    for (uint8_t i = width; i != 0; i--)
+    {
+        p[i - 1] = (uint8_t)val;
+        val >>= 8;
+    }
+}
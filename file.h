@@ -101,6 +101,15 @@ class File
         virtual int write(FileInfo const & info) = 0;
         virtual bool flush(void) = 0;
         virtual bool rewind(void) = 0;
+        virtual bool seek(uint32_t offset) = 0;  // Read only
+
+        // Read only.  Makes the file look size long, e.g. to leave off a
+        // trailing tag.  Lasts until the file is closed.
+        virtual bool trim(uint32_t size)
+        {
+            if (canWrite() || (size > _info.size())) return false;
+            _info = size; return true;
+        }
 
         virtual bool eof(void) const { return _offset >= _info.size(); }
         virtual uint32_t offset(void) const { return _offset; }
@@ -108,6 +117,8 @@ class File
         virtual uint32_t size(void) const { return _info.size(); }
         virtual uint32_t address(void) const { return _info.address(); }
         virtual uint32_t parent(void) const { return _info.parent(); }
+        virtual String < NS > const & name(void) const { return _info.name(); }
+        virtual FileInfo const & info(void) const { return _info; }
         virtual void close(void) { _taken = false; }
 
         virtual bool canRead(void) const { return _oflags & O_READ; }
@@ -124,6 +135,26 @@ class File
             _oflags = oflags;
         }
 
+        // Writes lines of text a piece at a time without flushing each.  Once
+        // one piece fails the rest are dropped and ok() says so.
+        class Writer
+        {
+            public:
+                Writer(File * fp) : _fp(fp) {}
+
+                void put(char const * str) {
+                    if (_ok && (_fp->write((uint8_t const *)str, strlen(str), false) <= 0)) _ok = false;
+                }
+
+                void num(uint32_t n) { put(" "); put((char const *)itoa((int)n)); }
+                bool flush(void) { if (_ok && !_fp->flush()) _ok = false; return _ok; }
+                bool ok(void) const { return _ok; }
+
+            private:
+                File * _fp;
+                bool _ok = true;
+        };
+
     protected:
         File(fst_e fst) : _fst(fst) {}
         File(fst_e fst, FileInfo const & info, uint8_t oflags = O_READ)
@@ -152,6 +183,89 @@ class TFile : public File
         DD * _dd = nullptr;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Span File ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Read only view of another file made up of spans of it in any order.  A span
+// can start with a few literal bytes, e.g. a rewritten header, and regions of
+// big endian 32 or 64 bit values can have a delta added as they're read, e.g.
+// offsets that have moved.  Closing the view closes the file under it.
+class SpanFile : public File
+{
+    public:
+        SpanFile(void) : File(FST_FAT32) {}
+
+        bool open(File * fp);
+        void detach(void) { _fp = nullptr; File::close(); }  // Without closing the file
+        bool add(uint32_t offset, uint32_t len, uint8_t const * head = nullptr, uint8_t hlen = 0);
+        bool patch(uint32_t offset, uint32_t len, uint8_t width, int32_t delta);
+
+        virtual int read(uint8_t * buf, int amt);
+        virtual int read(uint8_t const **, uint8_t) { return 0; }  // Nothing in place
+        virtual int read(FileInfo &) { return -1; }
+        virtual int write(uint8_t const *, int, bool) { return -1; }
+        virtual int write(FileInfo const &) { return -1; }
+        virtual bool flush(void) { return false; }
+        virtual bool rewind(void) { _offset = 0; return valid(); }
+        virtual bool seek(uint32_t offset);
+
+        virtual void close(void) { if (_fp != nullptr) _fp->close(); detach(); }
+        virtual bool valid(void) { return File::valid() && (_fp != nullptr) && _fp->valid(); }
+
+        File * file(void) const { return _fp; }
+
+        SpanFile(SpanFile const &) = delete;
+        SpanFile & operator=(SpanFile const &) = delete;
+
+    private:
+        struct Span
+        {
+            uint32_t pos;     // Where it starts in the view
+            uint32_t offset;  // and in the file
+            uint32_t len;     // Not counting head
+            uint8_t hlen;
+            uint8_t head[8];
+        };
+
+        struct Patch
+        {
+            uint32_t start;
+            uint32_t end;
+            uint8_t width;
+            int32_t delta;
+        };
+
+        Span const * span(uint32_t pos) const;
+        Patch const * patched(uint32_t offset, uint32_t len) const;
+        int fetch(uint32_t offset, uint8_t * buf, uint32_t len);
+        int fetch(Patch const & pt, uint32_t offset, uint8_t * buf, uint32_t len);
+        static void adjust(uint8_t * p, uint8_t width, int32_t delta);
+
+        static constexpr uint8_t const _s_max_spans = 12;
+        static constexpr uint8_t const _s_max_patches = 4;
+
+        File * _fp = nullptr;
+        Span _spans[_s_max_spans];
+        Patch _patches[_s_max_patches];
+        uint8_t _num_spans = 0;
+        uint8_t _num_patches = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// File Sniffer ////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Works out whatever is worth knowing about a file ahead of it being opened,
+// from its first sector or two, while the sorted file list is built.  What it
+// puts in meta is kept alongside the file's entry and read back with meta().
+class FileSniffer
+{
+    public:
+        static constexpr uint16_t const META_SIZE = 64;
+
+        // Returns the number of bytes of meta used, 0 if nothing was found
+        virtual int sniff(File * fp, uint8_t * meta, uint16_t len) = 0;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // File System /////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -167,17 +281,40 @@ class FileSystem
 
         virtual bool valid(void) { return _dd.valid(); }
         virtual bool busy(void) { return _dd.busy(); }
-        virtual int sort(char const * const * exts = nullptr) = 0;
+        virtual int sort(char const * const * exts = nullptr, FileSniffer * sniffer = nullptr) = 0;
         virtual int list(void) = 0;
 
+        // As sort() but only directories with clusters in written, the blocks
+        // something other than the file system has written since, are read
+        // again.  Everything else and what was sniffed for it is carried over
+        // from the last sort.
+        virtual int resort(TExtents const & written, char const * const * exts = nullptr,
+                FileSniffer * sniffer = nullptr) = 0;
+
+        // What the sniffer passed to the last sort() found for the file
+        int meta(uint32_t file_index, uint8_t * buf, uint16_t len) { return _fs.meta(file_index, buf, len); }
+        uint32_t sniffTime(void) const { return _fs.sniffTime(); }  // usecs the last sort spent sniffing
+        uint32_t numFiles(void) const { return _fs.numFiles(); }    // Files the last sort() found
+
     protected:
+        // Whether any of the clusters of a file or directory are in written
+        virtual bool touched(FileInfo const & info, TExtents const & written) = 0;
+
         class FileSort
         {
             public:
                 FileSort(FileSystem & fs);
-                int sort(FileInfo const & dir, char const * const * exts);
+                bool expand(uint32_t volume_end);
+                int sort(FileInfo const & dir, char const * const * exts, FileSniffer * sniffer,
+                        TExtents const * written = nullptr);
                 int retrieve(uint32_t file_index, FileInfo & info);
+                int meta(uint32_t file_index, uint8_t * buf, uint16_t len);
                 uint32_t numFiles(void) const { return _files; }
+                uint32_t sniffTime(void) const { return _sniff_time; }
+
+                // The ping-pong space is only used while sorting so can be used as scratch
+                uint32_t scratch(void) const { return _pp_space[0]; }
+                uint32_t scratchBlocks(void) const { return _pp_space[1] - _pp_space[0]; }
 
             private:
                 static constexpr uint16_t const _s_block_size = SD_BLOCK_LEN;
@@ -219,6 +356,7 @@ class FileSystem
 
                         bool shift(WriteList & wlist);
                         bool fill(void);
+                        void release(void) { _lease.reset(); }
 
                         int count(void) const { return _count; }
                         int size(void) const { return _size; }
@@ -260,9 +398,11 @@ class FileSystem
 
                         FileInfo * _infos = nullptr;
                         uint32_t _block = 0;
-                        uint32_t _offset = 0;
                         uint16_t _boff = 0;
-                        uint8_t _buffer[_s_block_size];
+
+                        // Only held while a partially deserialized block is buffered
+                        bool lease(void) { if (!_lease.valid()) _lease = TBlockLease(); return _lease.valid(); }
+                        TBlockLease _lease{false};
 
                         DD & _dd = DD::acquire();
                 };
@@ -270,8 +410,30 @@ class FileSystem
                 bool read(uint32_t space, uint32_t offset, FileInfo & info);
                 bool write(uint32_t space, uint32_t offset, FileInfo const & info);
                 bool flush(void);
+                uint8_t * mrecord(uint32_t file_index);
+                bool sniff(uint32_t file_index, FileInfo const & info);
+                bool flushMeta(void);
 
                 bool sort(FileInfo const & dir, char const * const * exts, int sorted_items);
+                bool scan(FileInfo const & dir, char const * const * exts, int sorted_items);
+                int carry(FileInfo const & dir, char const * const * exts, int sorted_items);
+                bool carry(uint32_t from, uint32_t to);
+
+                // Where each directory's files are in the final list, in the
+                // order the directories were sorted so everything under one
+                // follows it
+                struct DirRecord
+                {
+                    uint32_t address;
+                    uint32_t first;  // Index of the first file under it
+                    uint32_t files;  // Files under it
+                    uint32_t dirs;   // Records for it and everything under it
+                };
+
+                bool read(uint32_t space, uint32_t index, DirRecord & rec);
+                bool write(uint32_t space, uint32_t index, DirRecord const & rec);
+                uint8_t * rblock(uint32_t block);
+                uint8_t * wblock(uint32_t block);
 
                 static uint32_t diskBlock(uint32_t space, uint32_t offset) {
                     return space + (offset / _s_infos_per_block);
@@ -283,23 +445,59 @@ class FileSystem
 
                 uint32_t _pp_space[2];
                 uint32_t _sorted_space;
-                uint32_t _final_space;
+                // Two of each so a resort can carry over from the last one if
+                // expand() found room, otherwise both the same.  _list is the
+                // one retrieve() and meta() use.
+                uint32_t _final_space[2];
+                uint32_t _meta_space[2];  // A record for each entry in the final space
+                uint32_t _dir_space[2] = {};  // A DirRecord for each directory
+                uint32_t _max_dirs;
+                uint8_t _list = 0;
+
+                // Whether the list has a record for every directory, otherwise
+                // there's nothing to carry over
+                bool _recorded = false;
+                bool _expanded = false;  // Whether there's a second list at all
+                uint32_t _dirs = 0;
+                uint32_t _last_dirs = 0;
+
+                // Only while a resort carries over from the last list, with a
+                // block leased for reading its meta alongside its files
+                TExtents const * _written = nullptr;
+                uint8_t (* _lbuffer)[_s_block_size] = nullptr;
+                uint32_t _lcached = 0;
 
                 //static constexpr uint16_t const _s_info_size = 64;
                 static constexpr uint16_t const _s_info_size = 128;
                 static constexpr uint16_t const _s_infos_per_block = _s_block_size / _s_info_size;
+                static constexpr uint16_t const _s_meta_size = FileSniffer::META_SIZE;
+                static constexpr uint16_t const _s_metas_per_block = _s_block_size / _s_meta_size;
+                static constexpr uint16_t const _s_records_per_block = _s_block_size / sizeof(DirRecord);
                 static constexpr uint16_t const _s_num_infos = 64;
                 static constexpr uint16_t const _s_write_list_size = _s_num_infos / 4;
                 static constexpr uint16_t const _s_num_read_lists = 4;
                 static constexpr uint16_t const _s_read_list_size =
                     (_s_num_infos - _s_write_list_size) / _s_num_read_lists;
 
-                static uint8_t _s_rbuffer[_s_block_size];
-                static uint8_t _s_wbuffer[_s_block_size];
+                // Leased for the duration of a sort
+                uint8_t (* _rbuffer)[_s_block_size] = nullptr;
+                uint8_t (* _wbuffer)[_s_block_size] = nullptr;
                 uint32_t _rcached = 0;
                 uint32_t _wcached = 0;
                 uint32_t _files = 0;
 
+                // Files are mostly retrieved in order so the last block read is
+                // kept between calls.  Given back when a sort needs the pool.
+                bool rlease(void) { if (!_rlease.valid()) _rlease = TBlockLease(); return _rlease.valid(); }
+                TBlockLease _rlease{false};
+                uint32_t _rblock = 0;
+
+                // Records are written in order so a block is only written, never read
+                FileSniffer * _sniffer = nullptr;
+                uint8_t (* _mbuffer)[_s_block_size] = nullptr;
+                uint32_t _mcached = 0;
+                uint32_t _sniff_time = 0;
+
                 FileSystem & _fs;
         };
 
@@ -310,12 +508,6 @@ class FileSystem
 ////////////////////////////////////////////////////////////////////////////////
 // FileSort ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-template < class DD, fst_e FST >
-uint8_t FileSystem < DD, FST >::FileSort::_s_wbuffer[_s_block_size];
-
-template < class DD, fst_e FST >
-uint8_t FileSystem < DD, FST >::FileSort::_s_rbuffer[_s_block_size];
-
 template < class DD, fst_e FST >
 FileSystem < DD, FST >::FileSort::FileSort(FileSystem < DD, FST > & fs)
     : _fs(fs)
@@ -345,20 +537,85 @@ FileSystem < DD, FST >::FileSort::FileSort(FileSystem < DD, FST > & fs)
     _pp_space[0] = space; next();
     _pp_space[1] = space; next();
     _sorted_space = space; next();
-    _final_space = space;
+    _final_space[0] = _final_space[1] = space;
+
+    uint32_t max_files = (blocks / 4) * _s_infos_per_block;
+    _max_dirs = max_files;
+
+    _meta_space[0] = _meta_space[1] = _fs._dd.reserve(max_files * _s_meta_size);
+}
+
+// The second list a resort carries over from goes below what's reserved
+// already, which a card formatted before it was would have its volume over.
+// Only taken if it's clear of the end of the volume, otherwise there's the one
+// list and every resort is a full sort.
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::expand(uint32_t volume_end)
+{
+    uint32_t final_bytes = (_max_dirs / _s_infos_per_block) * _s_block_size;
+    uint32_t meta_bytes = _max_dirs * _s_meta_size;
+    uint32_t dir_bytes = _max_dirs * sizeof(DirRecord);
+    uint32_t blocks = ceiling(final_bytes, _s_block_size) + ceiling(meta_bytes, _s_block_size)
+        + (2 * ceiling(dir_bytes, _s_block_size));
+
+    if (_expanded || (_fs._dd.blocks() < blocks) || ((_fs._dd.blocks() - blocks) < volume_end))
+        return _expanded;
+
+    _final_space[1] = _fs._dd.reserve(final_bytes);
+    _meta_space[1] = _fs._dd.reserve(meta_bytes);
+    _dir_space[0] = _fs._dd.reserve(dir_bytes);
+    _dir_space[1] = _fs._dd.reserve(dir_bytes);
+
+    _expanded = true;
+
+    return true;
 }
 
+// The list is built in the other of the two spaces from the last one so a
+// resort can carry over what wasn't written from it.  Only if every directory
+// in the last one has a record though, otherwise it's sorted from scratch.
 template < class DD, fst_e FST >
-int FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * const * exts)
+int FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * const * exts, FileSniffer * sniffer,
+        TExtents const * written)
 {
-    _files = _rcached = _wcached = 0;
+    _rlease.reset();
+    _rblock = 0;
+
+    if (!_recorded)
+        written = nullptr;
+
+    TBlockLease rlease, wlease, mlease, llease(written != nullptr);
 
-    if (!dir.isDir() || !sort(dir, exts, 0))
+    _last_dirs = _dirs;
+    _list ^= 1;
+    _recorded = true;
+
+    _files = _dirs = _rcached = _wcached = _mcached = _lcached = _sniff_time = 0;
+
+    if (!rlease.valid() || !wlease.valid() || !mlease.valid() || ((written != nullptr) && !llease.valid()))
+    {
+        _recorded = false;
         return -1;
+    }
+
+    _rbuffer = &rlease.block();
+    _wbuffer = &wlease.block();
+    _mbuffer = &mlease.block();
+    _lbuffer = (written != nullptr) ? &llease.block() : nullptr;
+    _sniffer = sniffer;
+    _written = written;
+
+    bool sorted = dir.isDir() && sort(dir, exts, 0) && flush() && flushMeta();
 
-    _rcached = _wcached = 0;
+    if (!sorted)
+        _recorded = false;
 
-    return _files;
+    _rbuffer = _wbuffer = _mbuffer = _lbuffer = nullptr;
+    _rcached = _wcached = _mcached = _lcached = 0;
+    _sniffer = nullptr;
+    _written = nullptr;
+
+    return sorted ? _files : -1;
 }
 
 template < class DD, fst_e FST >
@@ -367,32 +624,83 @@ int FileSystem < DD, FST >::FileSort::retrieve(uint32_t file_index, FileInfo & i
     if (file_index >= _files)
         return -1;
 
-    uint32_t block = diskBlock(_final_space, file_index);
-    if (block != _rcached)
+    uint32_t block = diskBlock(_final_space[_list], file_index);
+    if ((block != _rblock) || !_rlease.valid())
     {
+        if (!rlease())
+            return -1;
+
         int err;
-        if ((err = _fs._dd.read(block, _s_rbuffer)) <= 0)
+        if ((err = _fs._dd.read(block, _rlease.block())) <= 0)
+        {
+            _rblock = 0;
             return err;
+        }
 
-        _rcached = block;
+        _rblock = block;
     }
 
-    return info.deserialize(_s_rbuffer + blockOffset(file_index), _s_info_size);
+    return info.deserialize(_rlease.get() + blockOffset(file_index), _s_info_size);
 }
 
 template < class DD, fst_e FST >
-bool FileSystem < DD, FST >::FileSort::read(uint32_t space, uint32_t offset, FileInfo & info)
+int FileSystem < DD, FST >::FileSort::meta(uint32_t file_index, uint8_t * buf, uint16_t len)
+{
+    if ((file_index >= _files) || (buf == nullptr))
+        return -1;
+
+    TBlockLease lease;
+    if (!lease.valid())
+        return -1;
+
+    int err;
+    if ((err = _fs._dd.read(_meta_space[_list] + (file_index / _s_metas_per_block), lease.block())) <= 0)
+        return err;
+
+    if (len > _s_meta_size)
+        len = _s_meta_size;
+
+    memcpy(buf, lease.get() + ((file_index % _s_metas_per_block) * _s_meta_size), len);
+
+    return len;
+}
+
+template < class DD, fst_e FST >
+uint8_t * FileSystem < DD, FST >::FileSort::rblock(uint32_t block)
 {
-    uint32_t block = diskBlock(space, offset);
     if (block != _rcached)
     {
-        if (_fs._dd.read(block, _s_rbuffer) < 0)
-            return false;
+        if (_fs._dd.read(block, *_rbuffer) < 0)
+            return nullptr;
 
         _rcached = block;
     }
 
-    if (info.deserialize(_s_rbuffer + blockOffset(offset), _s_info_size) < 0)
+    return *_rbuffer;
+}
+
+// Whatever's already in the block is read in first since only part of it is
+// written at a time
+template < class DD, fst_e FST >
+uint8_t * FileSystem < DD, FST >::FileSort::wblock(uint32_t block)
+{
+    if (block != _wcached)
+    {
+        if (!flush() || (_fs._dd.read(block, *_wbuffer) < 0))
+            return nullptr;
+
+        _wcached = block;
+    }
+
+    return *_wbuffer;
+}
+
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::read(uint32_t space, uint32_t offset, FileInfo & info)
+{
+    uint8_t * p = rblock(diskBlock(space, offset));
+
+    if ((p == nullptr) || (info.deserialize(p + blockOffset(offset), _s_info_size) < 0))
         return false;
 
     return true;
@@ -401,18 +709,43 @@ bool FileSystem < DD, FST >::FileSort::read(uint32_t space, uint32_t offset, Fil
 template < class DD, fst_e FST >
 bool FileSystem < DD, FST >::FileSort::write(uint32_t space, uint32_t offset, FileInfo const & info)
 {
-    uint32_t block = diskBlock(space, offset);
-    if (block != _wcached)
-    {
-        if (!flush() || (_fs._dd.read(block, _s_wbuffer) < 0))
-            return false;
+    uint8_t * p = wblock(diskBlock(space, offset));
 
-        _wcached = block;
+    if ((p == nullptr) || (info.serialize(p + blockOffset(offset), _s_info_size) < 0))
+        return false;
+
+    return true;
+}
+
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::read(uint32_t space, uint32_t index, DirRecord & rec)
+{
+    uint8_t * p = (index < _max_dirs) ? rblock(space + (index / _s_records_per_block)) : nullptr;
+    if (p == nullptr)
+        return false;
+
+    memcpy(&rec, p + ((index % _s_records_per_block) * sizeof(DirRecord)), sizeof(DirRecord));
+
+    return true;
+}
+
+// Past the space for them, or without any, the list just doesn't get records,
+// which only matters to a resort after it
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::write(uint32_t space, uint32_t index, DirRecord const & rec)
+{
+    if (!_expanded || (index >= _max_dirs))
+    {
+        _recorded = false;
+        return true;
     }
 
-    if (info.serialize(_s_wbuffer + blockOffset(offset), _s_info_size) < 0)
+    uint8_t * p = wblock(space + (index / _s_records_per_block));
+    if (p == nullptr)
         return false;
 
+    memcpy(p + ((index % _s_records_per_block) * sizeof(DirRecord)), &rec, sizeof(DirRecord));
+
     return true;
 }
 
@@ -422,7 +755,7 @@ bool FileSystem < DD, FST >::FileSort::flush(void)
     if (_wcached == 0)
         return true;
 
-    if (_fs._dd.write(_wcached, _s_wbuffer) < 0)
+    if (_fs._dd.write(_wcached, *_wbuffer) < 0)
         return false;
 
     _wcached = 0;
@@ -430,8 +763,186 @@ bool FileSystem < DD, FST >::FileSort::flush(void)
     return true;
 }
 
+// A record is kept for every file, zeroed if there's no sniffer or it finds
+// nothing, so meta() can be indexed the same as retrieve().
+template < class DD, fst_e FST >
+uint8_t * FileSystem < DD, FST >::FileSort::mrecord(uint32_t file_index)
+{
+    uint32_t block = _meta_space[_list] + (file_index / _s_metas_per_block);
+
+    if (block != _mcached)
+    {
+        if (!flushMeta())
+            return nullptr;
+
+        memset(*_mbuffer, 0, _s_block_size);
+        _mcached = block;
+    }
+
+    return *_mbuffer + ((file_index % _s_metas_per_block) * _s_meta_size);
+}
+
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::sniff(uint32_t file_index, FileInfo const & info)
+{
+    uint8_t * meta = mrecord(file_index);
+
+    if (meta == nullptr)
+        return false;
+
+    if (_sniffer == nullptr)
+        return true;
+
+    uint32_t start = usecs();
+
+    File * fp = _fs.open(info);
+    if (fp != nullptr)
+    {
+        if (_sniffer->sniff(fp, meta, _s_meta_size) <= 0)
+            memset(meta, 0, _s_meta_size);
+
+        fp->close();
+    }
+
+    _sniff_time += usecs() - start;
+
+    return true;
+}
+
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::flushMeta(void)
+{
+    if (_mcached == 0)
+        return true;
+
+    if (_fs._dd.write(_mcached, *_mbuffer) < 0)
+        return false;
+
+    _mcached = 0;
+
+    return true;
+}
+
+// A directory's files go onto the end of the list, carried over from the last
+// one if it wasn't written to since, otherwise scanned.  Either way it gets a
+// record of where they went.
 template < class DD, fst_e FST >
 bool FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * const * exts, int sorted_items)
+{
+    if (_written != nullptr)
+    {
+        int carried = carry(dir, exts, sorted_items);
+        if (carried != 0)
+            return carried > 0;
+    }
+
+    // dir may be what's read into while scanning
+    DirRecord rec = { dir.address(), _files, 0, 0 };
+    uint32_t index = _dirs++;
+
+    if (!scan(dir, exts, sorted_items))
+        return false;
+
+    rec.files = _files - rec.first;
+    rec.dirs = _dirs - index;
+
+    return write(_dir_space[_list], index, rec);
+}
+
+// The directory's own files come from where its record in the last list says
+// they are and its subdirectories are sorted in turn, between them, so any of
+// those written to are scanned.  Returns 1 if carried over, 0 if it has to be
+// scanned since it was written to or isn't in the last list and -1 on error.
+template < class DD, fst_e FST >
+int FileSystem < DD, FST >::FileSort::carry(FileInfo const & dir, char const * const * exts, int sorted_items)
+{
+    static FileInfo sub;
+
+    uint8_t const last = _list ^ 1;
+    DirRecord rec, child;
+    uint32_t i = 0;
+
+    for (; i < _last_dirs; i++)
+    {
+        if (!read(_dir_space[last], i, rec))
+            return -1;
+
+        if (rec.address == dir.address())
+            break;
+    }
+
+    if ((i == _last_dirs) || _fs.touched(dir, *_written))
+        return 0;
+
+    uint32_t const index = _dirs++;
+    uint32_t const first = _files;
+    uint32_t from = rec.first;
+
+    for (uint32_t j = i + 1; j < (i + rec.dirs); j += child.dirs)
+    {
+        if (!read(_dir_space[last], j, child) || (child.dirs == 0) || !carry(from, child.first))
+            return -1;
+
+        sub.set(FileInfo::FT_DIR, child.address, 0, rec.address);
+
+        if (!sort(sub, exts, sorted_items))
+            return -1;
+
+        from = child.first + child.files;
+    }
+
+    if (!carry(from, rec.first + rec.files))
+        return -1;
+
+    DirRecord const now = { rec.address, first, _files - first, _dirs - index };
+
+    return write(_dir_space[_list], index, now) ? 1 : -1;
+}
+
+// Files from the last list with what was sniffed for them, unless they were
+// written to in which case they're sniffed again
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::carry(uint32_t from, uint32_t to)
+{
+    static FileInfo info;
+
+    uint8_t const last = _list ^ 1;
+
+    for (; from < to; from++, _files++)
+    {
+        if (!read(_final_space[last], from, info) || !write(_final_space[_list], _files, info))
+            return false;
+
+        if (_fs.touched(info, *_written))
+        {
+            if (!sniff(_files, info))
+                return false;
+
+            continue;
+        }
+
+        uint8_t * meta = mrecord(_files);
+        uint32_t block = _meta_space[last] + (from / _s_metas_per_block);
+
+        if (meta == nullptr)
+            return false;
+
+        if (block != _lcached)
+        {
+            if (_fs._dd.read(block, *_lbuffer) < 0)
+                return false;
+
+            _lcached = block;
+        }
+
+        memcpy(meta, *_lbuffer + ((from % _s_metas_per_block) * _s_meta_size), _s_meta_size);
+    }
+
+    return true;
+}
+
+template < class DD, fst_e FST >
+bool FileSystem < DD, FST >::FileSort::scan(FileInfo const & dir, char const * const * exts, int sorted_items)
 {
     static FileInfo infos[_s_num_infos];
     static FileInfo info;
@@ -452,8 +963,10 @@ bool FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * c
             }
             else
             {
-                if (!write(_final_space, _files++, info))
+                if (!write(_final_space[_list], _files, info) || !sniff(_files, info))
                     return false;
+
+                _files++;
             }
         }
 
@@ -560,7 +1073,7 @@ bool FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * c
 
     // Phase 2 /////////////////////////////////////////////////////////////////
 
-    static ReadList rlists[_s_num_read_lists];
+    ReadList rlists[_s_num_read_lists];
 
     uint32_t num_items = dir_items;
     uint32_t max_items = _s_num_infos;
@@ -669,6 +1182,10 @@ bool FileSystem < DD, FST >::FileSort::sort(FileInfo const & dir, char const * c
     if (!write_list())
         return false;
 
+    // Don't hold on to any buffers while recursing
+    for (auto & rlist : rlists)
+        rlist.release();
+
     return recurse(dir_items);
 }
 
@@ -711,11 +1228,15 @@ void FileSystem < DD, FST >::FileSort::WriteList::sort(void)
 template < class DD, fst_e FST >
 int FileSystem < DD, FST >::FileSort::WriteList::flush(uint32_t space, uint32_t offset)
 {
-    static uint8_t buffer[_s_block_size];
-
     if (isEmpty())
         return 0;
 
+    TBlockLease lease;
+    if (!lease.valid())
+        return -1;
+
+    auto & buffer = lease.block();
+
     int s = 0;
 
     auto serialize = [&](uint16_t boff) -> bool
@@ -758,7 +1279,7 @@ int FileSystem < DD, FST >::FileSort::WriteList::flush(uint32_t space, uint32_t
     if (!dd)
         return -1;
 
-    int err;
+    int err = 0;
 
     // Serialize and write to disk
     for (uint32_t i = 0; i < num_blocks; i++)
@@ -806,13 +1327,12 @@ bool FileSystem < DD, FST >::FileSort::ReadList::init(
     _infos = infos;
     _size = num_infos;
     _remaining = expected;
-    _offset = offset;
     _block = diskBlock(space, offset);
     _boff = blockOffset(offset);
 
     _count = _head = _tail = 0;
 
-    if ((_boff != 0) && (_dd.read(_block, _buffer) < 0))
+    if ((_boff != 0) && (!lease() || (_dd.read(_block, _lease.block()) < 0)))
         return false;
 
     return fill();
@@ -846,7 +1366,7 @@ bool FileSystem < DD, FST >::FileSort::ReadList::fill(void)
     {
         while ((_boff < _s_block_size) && !isFull())
         {
-            _infos[_tail].deserialize(_buffer + _boff, _s_info_size);
+            _infos[_tail].deserialize(_lease.get() + _boff, _s_info_size);
 
             if (++_tail == _size)
                 _tail = 0;
@@ -855,16 +1375,13 @@ bool FileSystem < DD, FST >::FileSort::ReadList::fill(void)
             _remaining--;
 
             _boff += _s_info_size;
-            _offset++;
         }
 
+        // On to the next block once this one's been used up
         if (_boff == _s_block_size)
-            _boff = 0;
-
-        if (_offset == _s_infos_per_block)
         {
+            _boff = 0;
             _block++;
-            _offset = 0;
         }
     };
 
@@ -872,10 +1389,16 @@ bool FileSystem < DD, FST >::FileSort::ReadList::fill(void)
     {
         deserialize();
 
+        if (_boff == 0)
+            _lease.reset();
+
         if (isFull())
             return true;
     }
 
+    if (!lease())
+        return false;
+
     uint32_t max_fill = ((uint16_t)(_size - _count) < _remaining) ? _size - _count : _remaining;
     uint32_t num_blocks = ceiling(max_fill, _s_infos_per_block);
     dd_desc_t dd = _dd.open(_block, num_blocks, DD_READ);
@@ -887,7 +1410,7 @@ bool FileSystem < DD, FST >::FileSort::ReadList::fill(void)
 
     do
     {
-        while ((err = _dd.read(dd, _buffer, _s_block_size)) == 0);
+        while ((err = _dd.read(dd, _lease.get(), _s_block_size)) == 0);
 
         if (err < 0)
             break;
@@ -898,6 +1421,9 @@ bool FileSystem < DD, FST >::FileSort::ReadList::fill(void)
 
     _dd.close(dd);
 
+    if ((_boff == 0) || (_remaining == 0))
+        _lease.reset();
+
     return err > 0;
 }
 
@@ -1202,6 +1728,7 @@ class Fat32File : public TFile < DD, FST_FAT32 >
         virtual int write(FileInfo const & info);
         virtual bool flush(void);
         virtual bool rewind(void);
+        virtual bool seek(uint32_t offset);
 
         Fat32File(Fat32File const &) = delete;
         Fat32File & operator=(Fat32File const &) = delete;
@@ -1219,6 +1746,8 @@ class Fat32File : public TFile < DD, FST_FAT32 >
         bool write(void) { _flush = false; return (_dsb_off == 0) ? true : this->_dd->write(_ds, _dsb.a8) > 0; }
         uint8_t checksum(chr_t const * name);
         bool readNext(void);
+        bool nextSector(void);
+        int readSectors(uint8_t * buf, uint32_t len);
         int readEntry(FatDirEntry const * & entry);
         int _read(uint8_t * buf, int amt);
         int _read(uint8_t const ** p, uint8_t n);
@@ -1285,6 +1814,61 @@ bool Fat32File < DD >::rewind(void)
     return this->valid();
 }
 
+// Walks the cluster chain, from where the file is if going forward otherwise
+// from the start, and loads the sector the offset falls in.  An offset on a
+// sector boundary is left at the end of the sector before it, same as after
+// reading up to it, so nothing past the end of the file is ever read.
+template < class DD >
+bool Fat32File < DD >::seek(uint32_t offset)
+{
+    static constexpr uint32_t const ss = sizeof(_dsb.a8);
+
+    if (!this->isReg() || !this->canRead() || this->canWrite() || (offset > this->size()))
+        return false;
+
+    if (offset == 0)
+        return rewind() && !_rewind;
+
+    if ((_rewind && !rewind()) || _rewind || this->_dd->busy())
+        return false;
+
+    uint32_t spc = Fat32 < DD >::_s_sectors_per_cluster;
+    uint32_t sector = (offset - 1) / ss;
+    uint32_t want = sector / spc;
+    uint32_t have = ((this->_offset - _dsb_off) / ss) / spc;
+
+    if (want < have)
+    {
+        have = 0;
+        _cluster = this->_info.address();
+    }
+
+    for (; have != want; have++)
+    {
+        if (!Fat32 < DD >::nextCluster(*this->_dd, _cluster))
+        {
+            this->close();
+            return false;
+        }
+    }
+
+    _sofc = sector % spc;
+
+    uint32_t ds = Fat32 < DD >::dataSector(_cluster) + _sofc;
+
+    if ((ds != _ds) && (this->_dd->read(ds, _dsb.a8) != sizeof(_dsb.a8)))
+    {
+        this->close();
+        return false;
+    }
+
+    _ds = ds;
+    _dsb_off = offset - (sector * ss);
+    this->_offset = offset;
+
+    return true;
+}
+
 template < class DD >
 uint8_t Fat32File < DD >::checksum(chr_t const * name)
 {
@@ -1299,28 +1883,106 @@ uint8_t Fat32File < DD >::checksum(chr_t const * name)
 template < class DD >
 bool Fat32File < DD >::readNext(void)
 {
-    auto next_sector = [&](uint32_t ds) -> bool
-    {
-        _ds = ds;
+    if (!nextSector())
+        return false;
 
-        if (!read())
-            this->close();
+    if (!read())
+        this->close();
 
-        return this->valid();
-    };
+    return this->valid();
+}
 
+// Moves on to the next data sector without reading it
+template < class DD >
+bool Fat32File < DD >::nextSector(void)
+{
     _dsb_off = 0;
 
     if (++_sofc != Fat32 < DD >::_s_sectors_per_cluster)
-        return next_sector(_ds + 1);
+    {
+        _ds++;
+        return true;
+    }
 
     _sofc = 0;
 
     if (Fat32 < DD >::nextCluster(*this->_dd, _cluster))
-        return next_sector(Fat32 < DD >::dataSector(_cluster));
+    {
+        _ds = Fat32 < DD >::dataSector(_cluster);
+        return true;
+    }
 
     this->close();
-    return this->valid();
+    return false;
+}
+
+// Reads whole sectors straight into buf with one multi-block read, as many
+// as fit in len, the file and what's left of the cluster.  Only called when
+// the sector buffer has been used up.  Returns 0 if it wasn't worth it, in
+// which case the next sector is in the sector buffer.
+template < class DD >
+int Fat32File < DD >::readSectors(uint8_t * buf, uint32_t len)
+{
+    static constexpr uint32_t const ss = sizeof(_dsb.a8);
+    static constexpr uint32_t const max_sectors = 32;
+
+    uint32_t num = len / ss;
+
+    if (num > (this->remaining() / ss))
+        num = this->remaining() / ss;
+
+    if (num > max_sectors)
+        num = max_sectors;
+
+    if (num < 2)
+        return 0;
+
+    if (!nextSector())
+        return -1;
+
+    uint32_t left = Fat32 < DD >::_s_sectors_per_cluster - _sofc;
+    if (num > left)
+        num = left;
+
+    if (num < 2)
+    {
+        if (!read())
+            this->close();
+
+        return this->valid() ? 0 : -1;
+    }
+
+    uint32_t total = num * ss;
+    uint32_t got = 0;
+
+    dd_desc_t dd = this->_dd->open(_ds, num, DD_READ);
+    if (!dd)
+    {
+        this->close();
+        return -1;
+    }
+
+    int err;
+    while ((got != total) && ((err = this->_dd->read(dd, buf + got, total - got)) >= 0))
+        got += err;
+
+    this->_dd->close(dd);
+
+    if (got != total)
+    {
+        this->close();
+        return -1;
+    }
+
+    // Keep the sector buffer in step with _ds
+    _ds += num - 1;
+    _sofc += num - 1;
+    memcpy(_dsb.a8, buf + total - ss, ss);
+    _dsb_off = ss;
+
+    this->_offset += total;
+
+    return total;
 }
 
 template < class DD >
@@ -1347,8 +2009,22 @@ int Fat32File < DD >::_read(uint8_t * buf, int amt)
         if (this->eof())
             return n;
 
-        if ((_dsb_off == sizeof(_dsb.a8)) && !readNext())
-            return -1;
+        if (_dsb_off == sizeof(_dsb.a8))
+        {
+            int r = readSectors(buf + n, amt - n);
+
+            if (r < 0)
+                return -1;
+
+            if (r > 0)
+            {
+                n += r;
+                continue;
+            }
+
+            if ((_dsb_off == sizeof(_dsb.a8)) && !readNext())
+                return -1;
+        }
 
         uint32_t cpy = sizeof(_dsb.a8) - _dsb_off;
 
@@ -1453,13 +2129,19 @@ int Fat32File < DD >::read(FileInfo & info)
                 continue;
             }
 
-            String < LNL > ln(entry->ln1, LNL1);
+            // The entry's packed so its pieces are copied out to where they're aligned
+            wchr_t lnc[LNL];
+            memcpy(lnc, entry->ln1, sizeof(entry->ln1));
+            memcpy(lnc + LNL1, entry->ln2, sizeof(entry->ln2));
+            memcpy(lnc + LNL1 + LNL2, entry->ln3, sizeof(entry->ln3));
+
+            String < LNL > ln(lnc, LNL1);
 
             if (ln.len() == LNL1)
-                ln.postpend(entry->ln2, LNL2);
+                ln.postpend(lnc + LNL1, LNL2);
 
             if (ln.len() == (LNL1 + LNL2))
-                ln.postpend(entry->ln3, LNL3);
+                ln.postpend(lnc + LNL1 + LNL2, LNL3);
 
             name.prepend(ln.str(), ln.len());
             ln_ord--;
@@ -1758,10 +2440,15 @@ int Fat32File < DD >::write(FileInfo const & info)
             };
 
             FatDirEntry entry = {};
+            wchr_t lnc[LNL];  // Aligned, the entry's packed
+
+            cpy_name(lnc + LNL1 + LNL2, LNL3);
+            cpy_name(lnc + LNL1, LNL2);
+            cpy_name(lnc, LNL1);
 
-            cpy_name(entry.ln3, LNL3);
-            cpy_name(entry.ln2, LNL2);
-            cpy_name(entry.ln1, LNL1);
+            memcpy(entry.ln1, lnc, sizeof(entry.ln1));
+            memcpy(entry.ln2, lnc + LNL1, sizeof(entry.ln2));
+            memcpy(entry.ln3, lnc + LNL1 + LNL2, sizeof(entry.ln3));
 
             entry.order_num = num_lns - i;
             if (i == 0)
@@ -1983,15 +2670,26 @@ class Fat32 : public FileSystem < DD, FST_FAT32 >
         virtual File * open(chr_t const * name, uint8_t oflags = O_READ);
         virtual File * open(String < NS > const & name, uint8_t oflags = O_READ);
 
-        virtual int sort(char const * const * exts = nullptr);
+        virtual int sort(char const * const * exts = nullptr, FileSniffer * sniffer = nullptr);
+        virtual int resort(TExtents const & written, char const * const * exts = nullptr,
+                FileSniffer * sniffer = nullptr);
         virtual int list(void);
 
+        // Tunes the disk using the sort scratch space and writes the disk's profile
+        // and latency histograms to a file
+        bool tuned(void) { return this->_dd.tuned(); }
+        int profile(void);
+
         Fat32(Fat32 const &) = delete;
         Fat32 & operator=(Fat32 const &) = delete;
 
+    protected:
+        virtual bool touched(FileInfo const & info, TExtents const & written);
+
     private:
         Fat32(void);
         File * open(Fat32File < DD > & dir, String < NS > const & name, uint8_t oflags);
+        void fsInfo(void);
 
         static bool read(DD & dd, uint32_t sector, uint8_t (&buf)[SD_BLOCK_LEN]) {
             return dd.read(sector, buf) == SD_BLOCK_LEN;
@@ -2002,6 +2700,7 @@ class Fat32 : public FileSystem < DD, FST_FAT32 >
         }
 
         uint32_t _volume_sector_start = 0;
+        uint32_t _fs_info_sector = 0;
         bool _valid = true;
 
         static constexpr uint32_t const _s_entries_per_sector = FAT32_SECTOR_SIZE / 4;
@@ -2044,7 +2743,9 @@ class Fat32 : public FileSystem < DD, FST_FAT32 >
 
         static FileInfo _s_root_dir;
         static String < NS > _s_name;
-        static constexpr chr_t const * _s_sort_name = (chr_t const *)"songlist.txt";
+        static constexpr char const * _s_sort_name = "songlist.txt";
+        static constexpr char const * _s_profile_name = "sdprof.txt";
+        static constexpr uint16_t const _s_profile_blocks = 32;
 
         static sector_u _s_tsb;
         static uint32_t _s_ts;
@@ -2161,7 +2862,15 @@ Fat32 < DD >::Fat32(void)
 
     _s_root_dir.set(FileInfo::FT_DIR, _s_root_cluster, 0, 0);
 
-    if (read(this->_dd, _volume_sector_start + f->fs_info_sector, _s_dsb.a8))
+    _fs_info_sector = _volume_sector_start + f->fs_info_sector;
+    this->_fs.expand(_volume_sector_start + f->num_sectors32);
+    fsInfo();
+}
+
+template < class DD >
+void Fat32 < DD >::fsInfo(void)
+{
+    if (read(this->_dd, _fs_info_sector, _s_dsb.a8))
     {
         FsInfo const * finfo = (FsInfo const *)_s_dsb.a8;
 
@@ -2573,9 +3282,53 @@ bool Fat32 < DD >::update(Fat32File < DD > & file)
 }
 
 template < class DD >
-int Fat32 < DD >::sort(char const * const * exts)
+int Fat32 < DD >::sort(char const * const * exts, FileSniffer * sniffer)
 {
-    return this->_fs.sort(_s_root_dir, exts);
+    return this->_fs.sort(_s_root_dir, exts, sniffer);
+}
+
+// The FAT sector held and the next free cluster are let go of since either
+// could have been written.  A new partition table or boot sector could have
+// moved everything, so then nothing is carried over.
+template < class DD >
+int Fat32 < DD >::resort(TExtents const & written, char const * const * exts, FileSniffer * sniffer)
+{
+    _s_ts = 0;
+
+    if (written.overlaps(_fs_info_sector, 1))
+        fsInfo();
+
+    if (written.overlaps(0, 1) || written.overlaps(_volume_sector_start, 1))
+        return sort(exts, sniffer);
+
+    return this->_fs.sort(_s_root_dir, exts, sniffer, &written);
+}
+
+// Only as many clusters as a file's size needs are walked, all of a
+// directory's.  A chain that can't be followed counts as touched.
+template < class DD >
+bool Fat32 < DD >::touched(FileInfo const & info, TExtents const & written)
+{
+    if (!written.overlaps(_s_data_sector_start, UINT32_MAX - _s_data_sector_start))
+        return false;
+
+    uint32_t const cbytes = _s_sectors_per_cluster * FAT32_SECTOR_SIZE;
+    uint32_t cluster = info.address();
+    uint32_t clusters = info.isDir() ? _s_num_clusters
+        : ((info.size() / cbytes) + (((info.size() % cbytes) != 0) ? 1 : 0));
+
+    for (uint32_t i = 0; i < clusters; i++)
+    {
+        uint32_t ds = dataSector(cluster);
+
+        if ((ds == UINT32_MAX) || written.overlaps(ds, _s_sectors_per_cluster))
+            return true;
+
+        if (((i + 1) != clusters) && !nextCluster(this->_dd, cluster))
+            return !isEOC(cluster);
+    }
+
+    return false;
 }
 
 template < class DD >
@@ -2586,7 +3339,7 @@ int Fat32 < DD >::list(void)
     if (num_files == 0)
         return num_files;
 
-    File * file = open(_s_sort_name, O_WRITE | O_CREATE | O_TRUNC);
+    File * file = open((chr_t const *)_s_sort_name, O_WRITE | O_CREATE | O_TRUNC);
     if (file == nullptr)
         return -1;
 
@@ -2628,6 +3381,62 @@ int Fat32 < DD >::list(void)
     return num_files;
 }
 
+template < class DD >
+int Fat32 < DD >::profile(void)
+{
+    uint16_t num_blocks = _s_profile_blocks;
+
+    if (this->_fs.scratchBlocks() < num_blocks)
+        num_blocks = this->_fs.scratchBlocks();
+
+    if (this->_dd.tune(this->_fs.scratch(), num_blocks) < 0)
+        return -1;
+
+    File * file = open((chr_t const *)_s_profile_name, O_WRITE | O_CREATE | O_TRUNC);
+    if (file == nullptr)
+        return -1;
+
+    File::Writer w(file);
+
+    auto hex = [&](uint32_t n, uint8_t digits) -> void
+    {
+        char str[10] = { ' ' };
+        for (uint8_t i = 0; i < digits; i++)
+            str[digits - i] = "0123456789ABCDEF"[(n >> (i * 4)) & 0x0F];
+        str[digits + 1] = '\0';
+        w.put(str);
+    };
+
+    auto const & p = this->_dd.profile();
+
+    w.put("cid"); hex(p.mid, 2); hex(p.oid, 4); hex(p.psn, 8); w.put("\n");
+    w.put("chunk"); w.num(1 << p.chunk_shift);
+    w.put("\npre_erase"); w.num(p.pre_erase);
+    w.put("\nread_timeout"); w.num(p.read_timeout);
+    w.put("\nwrite_timeout"); w.num(p.write_timeout);
+    w.put("\n\n# name : count min max avg (usecs) : histogram <16, <32, ... <256K, >=256K\n");
+
+    for (uint8_t i = 0; i < DD::LAT_CNT; i++)
+    {
+        auto const & lat = this->_dd.latency((typename DD::lat_e)i);
+
+        w.put(DD::latencyName((typename DD::lat_e)i));
+        w.put(" :"); w.num(lat.count); w.num(lat.min); w.num(lat.max); w.num(lat.avg());
+        w.put(" :");
+
+        for (uint8_t j = 0; j < DD::Latency::buckets; j++)
+            w.num(lat.hist[j]);
+
+        w.put("\n");
+    }
+
+    bool ok = w.flush();
+
+    file->close();
+
+    return ok ? 0 : -1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Templates ///////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -7,6 +7,15 @@ Scsi::Scsi(void)
     memcpy(_si.vendor_id, _s_vendor_id, sizeof(_si.vendor_id));
     memcpy(_si.prod_id, _s_prod_id, sizeof(_si.prod_id));
     memcpy(_si.prod_rev, _s_prod_rev, sizeof(_si.prod_rev));
+
+    // Whole allocation units at a time are what the card writes best
+    uint32_t au_blocks = _dd.auBlocks();
+    if (au_blocks == 0)
+        au_blocks = _s_au_blocks;
+
+    _vpd_bl.optimal_transfer_length_granularity = htons(_s_ru_blocks);
+    _vpd_bl.maximum_transfer_length = htonl(au_blocks);
+    _vpd_bl.optimal_transfer_length = htonl(au_blocks);
 }
 
 void Scsi::reset(void)
@@ -14,13 +23,13 @@ void Scsi::reset(void)
     _active = true;
     _ejected = false;
 
-    if (_disk_desc)
-    {
-        _dd.close(_disk_desc);
-        _disk_desc = 0;
-    }
+    abandon();
+
+    // The host was told these made it so they still have to
+    (void)flush();
 
-    _lba = _transfer_length = _transferred = _doff = 0;
+    _lba = _transfer_length = _transferred = _doff = _spanned = 0;
+    _caching = false;
     _have_sense = false;
 }
 
@@ -56,6 +65,7 @@ int Scsi::request(uint8_t * req, uint8_t rlen)
     if ((req == nullptr) || (rlen == 0))
         return SCSI_ERROR;
 
+    _cmd_time = msecs();
     _op_code = (op_code_e)req[0];
     uint8_t clen = cdb_length(cdb_type(_op_code));
 
@@ -80,7 +90,12 @@ int Scsi::request(uint8_t * req, uint8_t rlen)
         return SCSI_FAILED;
     }
 
-    _doff = _transferred = 0;
+    // A transfer the host gave up on can't be picked up again
+    if ((_disk_desc != 0) && !done())
+        abandon();
+
+    _doff = _transferred = _spanned = 0;
+    _caching = false;
 
     int status;
 
@@ -119,16 +134,34 @@ int Scsi::request(uint8_t * req, uint8_t rlen)
                 return SCSI_FAILED;
             status = readCapacity10(req);
             break;
+        case SERVICE_ACTION_IN_16:
+            if (!_active || _ejected)
+                return SCSI_FAILED;
+            status = serviceActionIn16(req);
+            break;
         case READ_10:
             if (!_active || _ejected)
                 return SCSI_FAILED;
             status = read10(req);
             break;
+        case READ_16:
+            if (!_active || _ejected)
+                return SCSI_FAILED;
+            status = read16(req);
+            break;
         case WRITE_10:
             if (!_active || _ejected)
                 return SCSI_FAILED;
             status = write10(req);
             break;
+        case WRITE_16:
+            if (!_active || _ejected)
+                return SCSI_FAILED;
+            status = write16(req);
+            break;
+        case SYNCHRONIZE_CACHE_10:
+            status = synchronizeCache10(req);
+            break;
         case REPORT_LUNS:
             status = reportLuns(req);
             break;
@@ -206,6 +239,9 @@ int Scsi::inquiry(uint8_t * req)
             case UNIT_SERIAL_NUMBER:
                 vpd = &_vpd_us;
                 break;
+            case BLOCK_LIMITS:
+                vpd = &_vpd_bl;
+                break;
             case BLOCK_DEVICE_CHARACTERISTICS:
                 vpd = &_vpd_bdc;
                 break;
@@ -369,6 +405,7 @@ int Scsi::modeSense(uint8_t * req)
         ModePage6 mp6;
 
         mp6.mode_data_length = _transfer_length - 1;
+        mp6.wp = _shared;
         mp6.block_descriptor_length = dbd ? 0 : sizeof(ModePageShortBD);
 
         memcpy(_dbuf, &mp6, sizeof(mp6));
@@ -380,6 +417,7 @@ int Scsi::modeSense(uint8_t * req)
         ModePage10 mp10;
 
         mp10.mode_data_length = htons(_transfer_length - 2);
+        mp10.wp = _shared;
         mp10.block_descriptor_length = dbd ? 0 : htons(sizeof(ModePageShortBD));
 
         memcpy(_dbuf, &mp10, sizeof(mp10));
@@ -470,6 +508,15 @@ int Scsi::startStopUnit(uint8_t * req)
         return SCSI_FAILED;
     }
 
+    // Cached writes go out before the unit stops or the medium is ejected
+    if ((ssu->pc == START_VALID) && (ssu->start == 0))
+    {
+        abandon();
+
+        if (!ssu->no_flush && !flush())
+            return SCSI_FAILED;
+    }
+
     if (ssu->pc == START_VALID)
     {
         // Process START bit and LOEJ bit
@@ -563,7 +610,56 @@ int Scsi::readCapacity10(uint8_t * req)
     return 0;
 }
 
+int Scsi::serviceActionIn16(uint8_t * req)
+{
+    // SERVICE ACTION field
+    switch (req[1] & 0x1F)
+    {
+        case 0x10: return readCapacity16(req);
+        default: invalidField(1); return SCSI_FAILED;
+    }
+}
+
+int Scsi::readCapacity16(uint8_t * req)
+{
+    uint32_t last_lba = htonl(_num_blocks - 1);
+    uint32_t block_size = htonl(_s_block_size);
+
+    // Upper half of the LBA, then the PROT_EN, LOGICAL BLOCKS PER PHYSICAL
+    // BLOCK EXPONENT, LBPME and LOWEST ALIGNED LOGICAL BLOCK ADDRESS fields
+    // and the rest reserved are all zero
+    memset(_dbuf, 0, 32);
+    memcpy(_dbuf + 4, &last_lba, 4);
+    memcpy(_dbuf + 8, &block_size, 4);
+
+    _transfer_length = 32;
+
+    uint32_t alloc_len = ntohl(*(uint32_t *)&req[10]);
+
+    if (alloc_len < _transfer_length)
+        _transfer_length = alloc_len;
+
+    return 0;
+}
+
 int Scsi::read10(uint8_t * req)
+{
+    return readBlocks(req, ntohl(*(uint32_t *)&req[2]), ntohs(*(uint16_t *)&req[7]), 7);
+}
+
+int Scsi::read16(uint8_t * req)
+{
+    // The card's nowhere near needing more than 32 bits of LBA
+    if (*(uint32_t *)&req[2] != 0)
+    {
+        invalidLBA(2, _num_blocks - 1);
+        return SCSI_FAILED;
+    }
+
+    return readBlocks(req, ntohl(*(uint32_t *)&req[6]), ntohl(*(uint32_t *)&req[10]), 10);
+}
+
+int Scsi::readBlocks(uint8_t * req, uint32_t lba, uint32_t num_blocks, uint8_t field)
 {
     // Don't care about DPO and FUA bits or GROUP NUMBER field
 
@@ -581,27 +677,72 @@ int Scsi::read10(uint8_t * req)
         return SCSI_FAILED;
     }
 
-    uint32_t lba = ntohl(*(uint32_t *)&req[2]);
-    uint16_t num_blocks = ntohs(*(uint16_t *)&req[7]);
     uint32_t lba_end = lba + num_blocks;
 
     if ((lba_end > _num_blocks) || (lba_end <= lba))  // Overflow
     {
-        invalidLBA((lba > _num_blocks) ? 2 : 7, _num_blocks - 1);
+        invalidLBA((lba > _num_blocks) ? 2 : field, _num_blocks - 1);
         return SCSI_FAILED;
     }
 
     _lba = lba;
     _transfer_length = num_blocks;
 
-    _disk_desc = _dd.open(lba, num_blocks, DD_READ);
+    // Read a block at a time by dataRead() so the disk isn't held between them
+    if (_shared)
+        return 0;
+
+    // Picks up where the last one left off on the descriptor still open
+    if ((_desc_left != 0) && (lba == _ra_next))
+        return 0;
+
+    abandon();
+
+    // Following on from the last one so read ahead as far as the window goes
+    uint32_t ahead = 0;
+    if ((lba == _ra_next) && ((_num_blocks - lba) > num_blocks))
+    {
+        ahead = ((_num_blocks - lba) < _s_read_ahead_blocks)
+            ? (_num_blocks - lba) : _s_read_ahead_blocks;
+    }
+
+    uint32_t read_end = lba + ((ahead > num_blocks) ? ahead : num_blocks);
+
+    // Anything cached that'll be read has to be on the disk first
+    if ((_cache_len != 0) && (lba < (_cache_lba + _cache_len))
+            && (read_end > _cache_lba) && !flush())
+        return SCSI_FAILED;
+
+    (void)open(lba, num_blocks, DD_READ, ahead);
 
     return 0;
 }
 
 int Scsi::write10(uint8_t * req)
 {
-    // Don't care about DPO and FUA bits or GROUP NUMBER field
+    return writeBlocks(req, ntohl(*(uint32_t *)&req[2]), ntohs(*(uint16_t *)&req[7]), 7);
+}
+
+int Scsi::write16(uint8_t * req)
+{
+    if (*(uint32_t *)&req[2] != 0)
+    {
+        invalidLBA(2, _num_blocks - 1);
+        return SCSI_FAILED;
+    }
+
+    return writeBlocks(req, ntohl(*(uint32_t *)&req[6]), ntohl(*(uint32_t *)&req[10]), 10);
+}
+
+int Scsi::writeBlocks(uint8_t * req, uint32_t lba, uint32_t num_blocks, uint8_t field)
+{
+    if (_shared)
+    {
+        writeProtected();
+        return SCSI_FAILED;
+    }
+
+    // Don't care about DPO bit or GROUP NUMBER field
 
     // No write protection so WRPROTECT field must be zero
     if ((req[1] & (7 << 5)) != 0)
@@ -610,24 +751,63 @@ int Scsi::write10(uint8_t * req)
         return SCSI_FAILED;
     }
 
-    uint32_t lba = ntohl(*(uint32_t *)&req[2]);
-    uint16_t num_blocks = ntohs(*(uint16_t *)&req[7]);
     uint32_t lba_end = lba + num_blocks;
 
     if ((lba_end > _num_blocks) || (lba_end <= lba))  // Overflow
     {
-        invalidLBA((lba > _num_blocks) ? 2 : 7, _num_blocks - 1);
+        invalidLBA((lba > _num_blocks) ? 2 : field, _num_blocks - 1);
         return SCSI_FAILED;
     }
 
+    // FUA bit - Force Unit Access
+    bool fua = req[1] & (1 << 3);
+
+    _written.add(lba, num_blocks);
+
+    // Whatever was read ahead may be about to change
+    abandon();
+
     _lba = lba;
     _transfer_length = num_blocks;
 
-    _disk_desc = _dd.open(lba, num_blocks, DD_WRITE);
+    if (_mp_caching.wce && !fua && (num_blocks <= _s_cache_blocks))
+    {
+        // Joins the cached run if it starts inside it or right after it and
+        // the whole thing still fits, otherwise the run is flushed to make room.
+        bool joins = (_cache_len == 0) || ((lba >= _cache_lba)
+                && (lba <= (_cache_lba + _cache_len)) && ((lba_end - _cache_lba) <= _s_cache_blocks));
+
+        if (!joins && !flush())
+            return SCSI_FAILED;
+
+        if (_cache_len == 0)
+            _cache_lba = lba;
+
+        if (lease(lba_end - _cache_lba))
+        {
+            _caching = true;
+            return 0;
+        }
+    }
+
+    // Written through so anything cached has to go first to keep the order
+    if (!flush())
+        return SCSI_FAILED;
+
+    (void)open(lba, num_blocks, DD_WRITE);
 
     return 0;
 }
 
+int Scsi::synchronizeCache10(uint8_t * req)
+{
+    // Don't care about IMMED bit, LOGICAL BLOCK ADDRESS or NUMBER OF BLOCKS
+    // fields.  There's only ever one run cached so all of it is flushed.
+    _transfer_length = 0;
+
+    return flush() ? 0 : SCSI_FAILED;
+}
+
 int Scsi::reportLuns(uint8_t * req)
 {
     uint8_t report = req[2];  // SELECT REPORT
@@ -670,14 +850,18 @@ int Scsi::read(uint8_t * buf, uint16_t blen)
         case MODE_SENSE_10:
         case READ_FORMAT_CAPACITIES:
         case READ_CAPACITY_10:
+        case SERVICE_ACTION_IN_16:
         case REPORT_LUNS:
             return paramRead(buf, blen);
 
         case READ_10:
+        case READ_16:
             return dataRead(buf, blen);
 
         case TEST_UNIT_READY:
         case WRITE_10:
+        case WRITE_16:
+        case SYNCHRONIZE_CACHE_10:
         default:
             break;
     }
@@ -694,14 +878,18 @@ int Scsi::write(uint8_t * data, uint16_t dlen)
             return paramWrite(data, dlen);
 
         case WRITE_10:
-            return dataWrite(data, dlen);
+        case WRITE_16:
+            return _caching ? cacheWrite(data, dlen) : dataWrite(data, dlen);
 
         case TEST_UNIT_READY:
         case REQUEST_SENSE:
         case INQUIRY:
         case READ_FORMAT_CAPACITIES:
         case READ_CAPACITY_10:
+        case SERVICE_ACTION_IN_16:
         case READ_10:
+        case READ_16:
+        case SYNCHRONIZE_CACHE_10:
         case REPORT_LUNS:
         default:
             break;
@@ -757,21 +945,51 @@ int Scsi::paramWrite(uint8_t * data, uint16_t dlen)
     return cpy;
 }
 
-void Scsi::dataUpdate(uint16_t n)
+bool Scsi::dataUpdate(uint16_t n)
 {
     _doff += n;
 
-    if (_doff == _s_block_size)
-    {
-        _doff = 0;
-        _transferred++;
+    if (_doff != _s_block_size)
+        return true;
 
-        if (done())
-        {
-            _dd.close(_disk_desc);
-            _disk_desc = 0;
-        }
-    }
+    _doff = 0;
+    _transferred++;
+    _desc_left--;
+
+    if (done() && reading())
+        _ra_next = _lba + _transfer_length;
+
+    // Left open if there's more read ahead
+    if (_desc_left != 0)
+        return true;
+
+    // A write isn't done until the blocks still in the descriptor's buffer
+    // have made it to the disk
+    bool closed = (_dd.close(_disk_desc) == 0);
+    _disk_desc = 0;
+
+    if (!closed && !reading())
+        return false;
+
+    // Carries on with another for what's left of a command too long for one
+    if (done())
+        return true;
+
+    return open(_lba + _transferred, _transfer_length - _transferred, reading() ? DD_READ : DD_WRITE);
+}
+
+// Opens for as much of num_blocks as a descriptor takes, or through ahead
+// blocks if that's further.
+bool Scsi::open(uint32_t lba, uint32_t num_blocks, dd_dir_e dir, uint32_t ahead)
+{
+    uint32_t blocks = (ahead > num_blocks) ? ahead : num_blocks;
+    if (blocks > _s_desc_blocks)
+        blocks = _s_desc_blocks;
+
+    _disk_desc = _dd.open(lba, (uint16_t)blocks, dir);
+    _desc_left = (_disk_desc != 0) ? (uint16_t)blocks : 0;
+
+    return _disk_desc != 0;
 }
 
 int Scsi::dataRead(uint8_t * buf, uint16_t blen)
@@ -782,7 +1000,7 @@ int Scsi::dataRead(uint8_t * buf, uint16_t blen)
         uint32_t tstart = msecs();
         uint8_t retries = 0;
 
-        while (!(ret = _dd.read(_lba + _transferred, _dbuf)))
+        while (!(ret = (_dd.read(_lba + _transferred, _dbuf) == _s_block_size)))
         {
             if (++retries == _s_read_retry_count)
                 break;
@@ -817,21 +1035,45 @@ int Scsi::dataRead(uint8_t * buf, uint16_t blen)
     if (_disk_desc != 0)
     {
         int n = _dd.read(_disk_desc, buf, blen);
+        if ((n >= 0) && dataUpdate(n))
+            return n;
+
+        abandon();
+
+        // Couldn't get the next descriptor after a whole block went out
         if (n >= 0)
         {
-            dataUpdate(n);
-            return n;
+            readError(_lba + _transferred);
+            return SCSI_FAILED;
         }
 
-        _dd.close(_disk_desc);
-        _disk_desc = 0;
-
         if (!read())
             return SCSI_FAILED;
     }
 
-    if ((_transferred == 0) && (_doff == 0) && !read())
-        return SCSI_FAILED;
+    // Shared, a block is only read when the disk can be spared and only one
+    // each time it's lent, so the player has it back before the next.
+    // Whatever's been read so far goes out and the rest waits.
+    auto lent = [&](void) -> bool
+    {
+        if (!_shared)
+            return true;
+
+        if (!_lent || _dd.busy())
+            return false;
+
+        _lent = false;
+        return true;
+    };
+
+    if ((_transferred == 0) && (_doff == 0))
+    {
+        if (!lent())
+            return 0;
+
+        if (!read())
+            return SCSI_FAILED;
+    }
 
     bool success = true;
     uint16_t n = 0;
@@ -844,13 +1086,77 @@ int Scsi::dataRead(uint8_t * buf, uint16_t blen)
         memcpy(buf + n, _dbuf + _doff, cpy);
         n += cpy; _doff += cpy;
 
-        if ((_doff == sizeof(_dbuf)) && !(success = readLBA()))
+        if (_doff != sizeof(_dbuf))
+            continue;
+
+        if (((_transferred + 1) != _transfer_length) && !lent())
+            break;
+
+        if (!(success = readLBA()))
             break;
     }
 
     return success ? n : SCSI_FAILED;
 }
 
+// Only whole spans of len are handed out since anything shorter would end the
+// host's transfer early.  The descriptor's buffer is a multiple of the packet
+// size so a span never has to be cut short where it wraps.
+int Scsi::span(uint8_t const ** p, uint16_t len)
+{
+    if (!spanning() || (p == nullptr))
+        return SCSI_ERROR;
+
+    if (done() || (len == 0))
+        return 0;
+
+    int n = _dd.span(_disk_desc, (uint8_t **)p, len, _spanned);
+    if (n < 0)
+    {
+        readError(_lba + _transferred);
+        return SCSI_FAILED;
+    }
+
+    if (n != len)
+        return 0;
+
+    _spanned += n;
+
+    return n;
+}
+
+int Scsi::commit(uint16_t len)
+{
+    if (!spanning() || (len > _spanned))
+        return SCSI_ERROR;
+
+    if (_dd.commit(_disk_desc, len) != len)
+    {
+        readError(_lba + _transferred);
+        return SCSI_FAILED;
+    }
+
+    _spanned -= len;
+
+    // Blocks are counted as they're committed so the descriptor isn't closed
+    // with any of it still out
+    for (uint16_t n = len; n != 0; )
+    {
+        uint16_t cnt = _s_block_size - _doff;
+        if (cnt > n) cnt = n;
+
+        if (!dataUpdate(cnt))
+        {
+            readError(_lba + _transferred);
+            return SCSI_FAILED;
+        }
+
+        n -= cnt;
+    }
+
+    return len;
+}
+
 int Scsi::dataWrite(uint8_t * data, uint16_t dlen)
 {
     auto write = [&](void) -> bool
@@ -859,7 +1165,7 @@ int Scsi::dataWrite(uint8_t * data, uint16_t dlen)
         uint32_t tstart = msecs();
         uint8_t retries = 0;
 
-        while (!(success = _dd.write(_lba + _transferred, _dbuf)))
+        while (!(success = (_dd.write(_lba + _transferred, _dbuf) == _s_block_size)))
         {
             if (_s_write_retry_count == retries++)
                 break;
@@ -895,14 +1201,13 @@ int Scsi::dataWrite(uint8_t * data, uint16_t dlen)
     if (_disk_desc != 0)
     {
         int n = _dd.write(_disk_desc, data, dlen);
-        if (n >= 0)
-        {
-            dataUpdate(n);
+        if ((n >= 0) && dataUpdate(n))
             return n;
-        }
 
-        _dd.close(_disk_desc);
-        _disk_desc = 0;
+        abandon();
+
+        if (n >= 0)
+            writeError(_lba + _transferred);
 
         return SCSI_FAILED;
     }
@@ -924,3 +1229,167 @@ int Scsi::dataWrite(uint8_t * data, uint16_t dlen)
 
     return success ? n : SCSI_FAILED;
 }
+
+int Scsi::cacheWrite(uint8_t * data, uint16_t dlen)
+{
+    if (done()) return 0;
+
+    uint16_t n = 0;
+
+    while ((n != dlen) && !done())
+    {
+        uint8_t block = (uint8_t)(_lba + _transferred - _cache_lba);
+
+        uint16_t cpy = _s_block_size - _doff;
+        if (cpy > (dlen - n)) cpy = dlen - n;
+
+        memcpy(_cache[block] + _doff, data + n, cpy);
+        n += cpy; _doff += cpy;
+
+        if (_doff == _s_block_size)
+        {
+            // Only whole blocks extend the run
+            if (block == _cache_len)
+                _cache_len++;
+
+            _doff = 0;
+            _transferred++;
+        }
+    }
+
+    _cache_time = msecs();
+
+    return n;
+}
+
+// The run goes out as one multi-block write.  If that fails it falls back to
+// writing a block at a time with retries like dataWrite().
+bool Scsi::flush(void)
+{
+    auto write = [&](uint8_t block) -> bool
+    {
+        bool success;
+        uint32_t tstart = msecs();
+        uint8_t retries = 0;
+
+        uint8_t (& buf)[_s_block_size] = *(uint8_t (*)[_s_block_size])_cache[block];
+
+        while (!(success = (_dd.write(_cache_lba + block, buf) == _s_block_size)))
+        {
+            if (_s_write_retry_count == retries++)
+                break;
+
+            if ((_s_recovery_time_limit != 0) && ((msecs() - tstart) > _s_recovery_time_limit))
+                break;
+        }
+
+        return success;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    // Needs the disk, and so does whoever's asking with the host gone
+    abandon();
+
+    // Could have leased for a command that never finished a block
+    if (_cache_len == 0)
+    {
+        release();
+        return true;
+    }
+
+    bool success = false;
+    dd_desc_t desc = _dd.open(_cache_lba, _cache_len, DD_WRITE);
+
+    if (desc != 0)
+    {
+        uint8_t block = 0;
+        uint16_t off = 0;
+        uint32_t ts = msecs();
+
+        // The descriptor's buffer only takes so much at a time
+        while (block != _cache_len)
+        {
+            int n = _dd.write(desc, _cache[block] + off, _s_block_size - off);
+            if (n < 0)
+                break;
+
+            if (n != 0)
+                ts = msecs();
+            else if ((msecs() - ts) > _s_flush_timeout)
+                break;
+
+            if ((off += n) == _s_block_size)
+            {
+                off = 0;
+                block++;
+            }
+        }
+
+        success = (_dd.close(desc) == 0) && (block == _cache_len);
+    }
+
+    for (uint8_t block = 0; !success && (block < _cache_len); block++)
+    {
+        if (!write(block))
+        {
+            writeError(_cache_lba + block);
+            _cache_time = msecs();  // Try again after another idle period
+            return false;
+        }
+    }
+
+    _cache_len = 0;
+    release();
+
+    return true;
+}
+
+// Leases whatever the run doesn't already have up to blocks.  If the pool
+// runs dry the blocks past the run are given back and the caller writes
+// through.
+bool Scsi::lease(uint32_t blocks)
+{
+    for (uint8_t block = 0; block < blocks; block++)
+    {
+        if ((_cache[block] == nullptr) && ((_cache[block] = TBlockPool::acquire().lease()) == nullptr))
+        {
+            release(_cache_len);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Scsi::release(uint8_t from)
+{
+    for (uint8_t block = from; block < _s_cache_blocks; block++)
+    {
+        TBlockPool::acquire().giveBack(_cache[block]);
+        _cache[block] = nullptr;
+    }
+}
+
+void Scsi::abandon(void)
+{
+    if (_disk_desc != 0)
+    {
+        _dd.close(_disk_desc);
+        _disk_desc = 0;
+    }
+
+    _desc_left = 0;
+}
+
+void Scsi::idle(void)
+{
+    uint32_t now = msecs();
+
+    if ((_cache_len != 0) && ((now - _cache_time) >= _s_cache_flush_msecs))
+        (void)flush();
+
+    // Host has stopped reading so the card needn't be kept at it
+    if ((_disk_desc != 0) && (_cache_len == 0) && ((now - _cmd_time) >= _s_park_msecs))
+        park();
+}
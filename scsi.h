@@ -111,7 +111,7 @@ enum op_code_e : uint8_t
 // 34  O    O    O      PRE-FETCH(10)
 // 34    M              READ POSITION
 // 34                   GET DATA BUFFER STATUS
-// 35  O   OO   MO      SYNCHRONIZE CACHE(10)
+/* 35  O   OO   MO   */ SYNCHRONIZE_CACHE_10 = 0x35,
 // 36  Z    O    O      LOCK UNLOCK CACHE(10)
 // 37  O    O           READ DEFECT DATA(10)
 // 37        O          INITIALIZE ELEMENT STATUS WITH RANGE
@@ -175,9 +175,9 @@ enum op_code_e : uint8_t
 // 85  OO       O       ATA PASS-THROUGH(16)
 // 86  Z ZZ ZZZZZZZ     ACCESS CONTROL IN
 // 87  Z ZZ ZZZZZZZ     ACCESS CONTROL OUT
-// 88  MMO  O   O       READ(16)
+/* 88  MMO  O   O    */ READ_16 = 0x88,
 // 89  O                COMPARE AND WRITE
-// 8A  OMO  O   O       WRITE(16)
+/* 8A  OMO  O   O    */ WRITE_16 = 0x8A,
 // 8B  O                ORWRITE
 // 8C  O O  OO  O M     READ ATTRIBUTE
 // 8D  O O  OO  O O     WRITE ATTRIBUTE
@@ -200,7 +200,7 @@ enum op_code_e : uint8_t
 // 9B  OOO   OOO  O     READ BUFFER(16)
 // 9C  O                WRITE ATOMIC(16)
 // 9D                   SERVICE ACTION BIDIRECTIONAL
-// 9E  OM               SERVICE ACTION IN(16)
+/* 9E  OM            */ SERVICE_ACTION_IN_16 = 0x9E,  // READ CAPACITY(16)
 // 9F             M     SERVICE ACTION OUT(16)
 /* A0  MMMO OMMM OMO */ REPORT_LUNS = 0xA0,
 // A1      O            BLANK
@@ -296,6 +296,10 @@ enum pdt_e : uint8_t                  // Doc.  Description
     UNKNOWN_OR_NO_DEVICE_TYPE = 0x1F  // ----  Unknown or no device type
 };
 
+// Define to open READs for exactly their length and close them when they're
+// done, as before read-ahead.  The host tests build it both ways to compare.
+//#define SCSI_NO_READ_AHEAD
+
 class Scsi
 {
     public:
@@ -305,10 +309,42 @@ class Scsi
         int read(uint8_t * buf, uint16_t blen);
         int write(uint8_t * data, uint16_t dlen);
         bool done(void) { return _transferred == _transfer_length; }
+
+        // READ data in place in the disk's DMA buffer instead of copied by
+        // read().  Each span stays valid until it's committed, in order, once
+        // the caller is done with it.  Only while spanning().
+        bool spanning(void) const { return reading() && (_disk_desc != 0); }
+        int span(uint8_t const ** p, uint16_t len);
+        int commit(uint16_t len);
         void reset(void);
+
+        // Writes are held in the write-back cache until a command needs them
+        // on the disk, they've sat for a while or the host goes away.
+        bool flush(void);
+        void idle(void);
+
+        // Nothing open on the card, so nothing lost if its bus is switched off.
+        // A read-ahead is let go after _s_park_msecs without a command or when
+        // the host goes away, only ever between commands.
+        bool parked(void) const { return (_disk_desc == 0) && (_cache_len == 0); }
+        void park(void) { abandon(); }
+        uint32_t lastCommand(void) const { return _cmd_time; }
+
         bool active(void) const { return _active; }
         bool ejected(void) const { return _ejected; }
 
+        // Sharing the card with something else using it, i.e. the player.  The
+        // host only gets to read and only a block each time the disk is lent
+        // to it so it's never held for long.
+        void share(bool on) { _shared = on; }
+        bool shared(void) const { return _shared; }
+        void lend(bool on) { _lent = on; }
+
+        // Blocks the host has asked to write since last cleaned, added as the
+        // command's accepted so it errs on the side of dirty
+        TExtents const & written(void) const { return _written; }
+        void clean(void) { _written.clear(); }
+
     private:
         // Client Requests
         int testUnitReady(uint8_t * req);
@@ -320,8 +356,13 @@ class Scsi
         int startStopUnit(uint8_t * req);
         int readFormatCapacities(uint8_t * req);
         int readCapacity10(uint8_t * req);
+        int serviceActionIn16(uint8_t * req);
+        int readCapacity16(uint8_t * req);
         int read10(uint8_t * req);
+        int read16(uint8_t * req);
         int write10(uint8_t * req);
+        int write16(uint8_t * req);
+        int synchronizeCache10(uint8_t * req);
         int reportLuns(uint8_t * req);
 
         // Client Data-In Buffer
@@ -331,8 +372,19 @@ class Scsi
         // Client Data-Out Buffer
         int paramWrite(uint8_t * data, uint16_t dlen);
         int dataWrite(uint8_t * data, uint16_t dlen);
+        int cacheWrite(uint8_t * data, uint16_t dlen);
+        bool lease(uint32_t blocks);
+        void release(uint8_t from = 0);
+
+        // READ and WRITE once the CDB's been picked apart.  field is where the
+        // TRANSFER LENGTH is for sense data.
+        int readBlocks(uint8_t * req, uint32_t lba, uint32_t num_blocks, uint8_t field);
+        int writeBlocks(uint8_t * req, uint32_t lba, uint32_t num_blocks, uint8_t field);
+        bool reading(void) const { return (_op_code == READ_10) || (_op_code == READ_16); }
 
-        void dataUpdate(uint16_t n);
+        bool open(uint32_t lba, uint32_t num_blocks, dd_dir_e dir, uint32_t ahead = 0);
+        bool dataUpdate(uint16_t n);
+        void abandon(void);
 
         TDisk & _dd = TDisk::acquire();
         uint32_t const _num_blocks = _dd.blocks();
@@ -342,14 +394,50 @@ class Scsi
         bool _active = false;
         bool _ejected = false;
 
+        bool _shared = false;
+        bool _lent = true;
+        TExtents _written;
+
         dd_desc_t _disk_desc = 0;
         op_code_e _op_code;
 
         uint32_t _lba = 0;
-        uint16_t _transfer_length = 0;
-        uint16_t _transferred = 0;
+        uint32_t _transfer_length = 0;  // Blocks for READ and WRITE, otherwise bytes
+        uint32_t _transferred = 0;
         uint8_t _dbuf[_s_block_size];
         uint16_t _doff = 0;
+        uint16_t _spanned = 0;  // Handed out by span() but not yet committed
+
+        // A descriptor only goes so far so a longer command opens another one
+        // where it runs out
+        static constexpr uint16_t const _s_desc_blocks = 0xFFFF;
+        uint16_t _desc_left = 0;  // Blocks left on the descriptor
+
+        // Read-ahead.  Once READs are seen to be sequential the descriptor is
+        // opened past the end of the command and left open when it's done so the
+        // next one's data is already coming.
+#ifndef SCSI_NO_READ_AHEAD
+        static constexpr uint16_t const _s_read_ahead_blocks = 2048;
+#else
+        static constexpr uint16_t const _s_read_ahead_blocks = 0;
+#endif
+        uint32_t _ra_next = 0;  // LBA following the last completed READ
+        static constexpr uint32_t const _s_park_msecs = 500;
+        uint32_t _cmd_time = 0;  // When the last command came in
+
+        // Write-back cache.  Holds a single run of contiguous blocks so a flush
+        // is always one multi-block write.  Blocks are leased from the block
+        // pool as the run grows and given back once it's flushed, so they're
+        // only held while there's something cached.  If the pool can't cover a
+        // command it's written through instead.
+        static constexpr uint8_t const _s_cache_blocks = 8;
+        static constexpr uint32_t const _s_cache_flush_msecs = 100;  // Idle time before flushing
+        static constexpr uint32_t const _s_flush_timeout = 250;  // Without progress
+        uint8_t * _cache[_s_cache_blocks] = {};
+        uint32_t _cache_lba = 0;
+        uint8_t _cache_len = 0;  // In blocks
+        uint32_t _cache_time = 0;
+        bool _caching = false;  // Current WRITE(10) is going to the cache
 
         // Sense Key Specific Data
         uint8_t _sks[3];
@@ -445,6 +533,7 @@ class Scsi
         {
             SUPPORTED_PAGES,
             UNIT_SERIAL_NUMBER = 0x80,
+            BLOCK_LIMITS = 0xB0,
             BLOCK_DEVICE_CHARACTERISTICS = 0xB1,
         };
 
@@ -466,19 +555,20 @@ class Scsi
             uint16_t const page_length;
 
             VPD(uint8_t pc, uint16_t pl) : page_code(pc), page_length(htons(pl)) {}
-            virtual uint8_t size(void) const { return ntohs(page_length) + sizeof(VPD); }
+            uint8_t size(void) const { return ntohs(page_length) + sizeof(VPD); }
 
         } __attribute__ ((packed));
 
         // Supported VPD Pages
         struct SupportedVPDPages : public VPD
         {
-            static constexpr uint8_t const num_vpd_pages = 3;
+            static constexpr uint8_t const num_vpd_pages = 4;
 
             uint8_t const pages[num_vpd_pages] =
             {
                 SUPPORTED_PAGES,
                 UNIT_SERIAL_NUMBER,
+                BLOCK_LIMITS,
                 BLOCK_DEVICE_CHARACTERISTICS,
             };
 
@@ -504,6 +594,27 @@ class Scsi
 
         } __attribute__ ((packed));
 
+        // Block Limits - SBC-3 6.5.3.  Transfer lengths are in blocks and set
+        // from the card's allocation unit once it's known, see Scsi().
+        struct BlockLimits : public VPD
+        {
+            uint8_t const wsnz = 0;  // WRITE SAME not supported
+            uint8_t const maximum_compare_and_write_length = 0;
+            uint16_t optimal_transfer_length_granularity = 0;
+            uint32_t maximum_transfer_length = 0;
+            uint32_t optimal_transfer_length = 0;
+            uint32_t const maximum_prefetch_length = 0;
+            uint32_t const maximum_unmap_lba_count = 0;
+            uint32_t const maximum_unmap_block_descriptor_count = 0;
+            uint32_t const optimal_unmap_granularity = 0;
+            uint32_t const unmap_granularity_alignment = 0;
+            uint64_t const maximum_write_same_length = 0;
+            uint8_t const r0[20] = {};
+
+            BlockLimits(void) : VPD(BLOCK_LIMITS, 0x003C) {}
+
+        } __attribute__ ((packed));
+
         // Block Device Characteristics
         struct BlockDeviceCharacteristics : public VPD
         {
@@ -566,8 +677,14 @@ class Scsi
         StandardInquiry _si;
         SupportedVPDPages _vpd_sp;
         UnitSerialNumber _vpd_us;
+        BlockLimits _vpd_bl;
         BlockDeviceCharacteristics _vpd_bdc;
 
+        // Card's allocation unit if it didn't say, typical of SDHC
+        static constexpr uint32_t const _s_au_blocks = 8192;
+        // Speed class Recording Unit, 16 KB
+        static constexpr uint16_t const _s_ru_blocks = 32;
+
 
         ////////////////////////////////////////////////////////////////////////
         // Sense Data //////////////////////////////////////////////////////////
@@ -647,6 +764,9 @@ class Scsi
         void readError(uint32_t lba) { diskError(_s_read_retry_count, lba); }
         void writeError(uint32_t lba) { diskError(_s_write_retry_count, lba); }
 
+        // DATA PROTECT - WRITE PROTECTED
+        void writeProtected(void) { addSense < DATA_PROTECT, 0x27, 0x00 > (); }
+
         // RECOVERED ERROR
         template < uint8_t ASC, uint8_t ASCQ >
         void recoveredError(uint16_t retry_count, uint32_t info) {
@@ -1048,7 +1168,7 @@ class Scsi
 
             ////////////////////////////////////////////////////////////////////
 
-            Caching(void) : ModePage(CACHING, 0x12) {}
+            Caching(void) : ModePage(CACHING, 0x12) { wce = 1; }
 
         } __attribute__ ((packed));
 
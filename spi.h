@@ -52,6 +52,7 @@
 #define SPI_PUSHR_EOQ        (1 << 27)
 #define SPI_PUSHR_CTAS0      (0) 
 #define SPI_PUSHR_CTAS1      (1 << 28) 
+#define SPI_PUSHR_CONT       (1 << 31)
 
 template < pin_t MOSI, pin_t MISO, pin_t SCK >
 class SPI0 : public Module
@@ -91,12 +92,18 @@ class SPI0 : public Module
 
         bool busy(void) { return _busy || dmaEnabled(); }
 
+        // Stops the module's clock between transactions, begin() starts it again
+        void park(void);
+        bool parked(void) { return *_mcr & SPI_MCR_MDIS; }
+
         // Use for just sending data with no expectation of receiving anything back
         void tx8(uint8_t tx = 0xFF) { txWait(3); push8(tx); }
         void tx16(uint16_t tx = 0xFFFF) { txWait(3); push16(tx); }
         void tx32(uint32_t tx = 0xFFFFFFFF) { txWait(2); push16(tx >> 16); push16(tx & 0xFFFF); }
         void tx(uint8_t const * tx, uint16_t tx_len);
         void tx(uint8_t tx, uint16_t num_times);
+        void tx16(uint16_t const * tx, uint16_t num);  // Host order words
+        void tx16(uint16_t tx, uint16_t num_times);
 
         // Use for full duplex send and receive
         uint8_t txrx8(uint8_t tx = 0xFF) { tx8(tx); rxWait(1); return (uint8_t)*_popr; }
@@ -138,6 +145,12 @@ class SPI0 : public Module
     private:
         SPI0(void);
 
+        // Pipelined 16-bit frames from words, tx, or of fill if both are null, optionally into rx
+        void burst(uint8_t const * tx, uint16_t fill, uint8_t * rx, uint16_t frames,
+                uint16_t const * words = nullptr);
+
+        static constexpr uint8_t const _s_fifo_depth = 4;
+
         PinMOSI < MOSI > & _mosi = PinMOSI < MOSI >::acquire();
         PinMISO < MISO > & _miso = PinMISO < MISO >::acquire();
         PinSCK < SCK > & _sck = PinSCK < SCK >::acquire();
@@ -206,6 +219,17 @@ void SPI0 < MOSI, MISO, SCK >::stop(void)
     while (running());
 }
 
+template < pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPI0 < MOSI, MISO, SCK >::park(void)
+{
+    if (busy() || parked())
+        return;
+
+    stop();
+
+    *_mcr |= SPI_MCR_MDIS;
+}
+
 template < pin_t MOSI, pin_t MISO, pin_t SCK >
 void SPI0 < MOSI, MISO, SCK >::dmaEnable(void)
 {
@@ -234,7 +258,11 @@ bool SPI0 < MOSI, MISO, SCK >::begin(uint32_t cta)
     if (_busy) return false;
     _busy = true;
 
-    if (restart(cta))
+    // Clock has to be running to set up the CTARs
+    if (parked())
+        *_mcr &= ~SPI_MCR_MDIS;
+
+    if (restart(cta) || !running())
     {
         stop();
 
@@ -297,45 +325,105 @@ void SPI0 < MOSI, MISO, SCK >::clearStatusFlags(void)
         0;
 }
 
+// Keeps up to a FIFO's depth of frames in flight rather than waiting for each
+// frame to complete, draining RX as frames finish.  Limiting frames in flight
+// to the FIFO depth means neither FIFO can overflow and nothing is left in RX
+// after.  CONT is set on all but the last frame and CTCNT on the first so
+// transfers() counts the frames of this burst.  TCF is left clear after, the
+// same as complete() leaves it, otherwise the next push8() / push16() would
+// see the last frame's TCF and return before its own frame has gone out.
 template < pin_t MOSI, pin_t MISO, pin_t SCK >
-void SPI0 < MOSI, MISO, SCK >::tx(uint8_t const * tx, uint16_t tx_len)
+void SPI0 < MOSI, MISO, SCK >::burst(uint8_t const * tx, uint16_t fill, uint8_t * rx, uint16_t frames,
+        uint16_t const * words)
 {
-    if ((tx == nullptr) || (tx_len == 0))
+    if (frames == 0)
         return;
 
-    uint16_t i = 0;
+    // Frames from single frame pushes are already complete so their RX entries can go
+    flush();
 
-    txWait(0);
+    uint16_t pushed = 0, popped = 0;
 
-    if (tx_len & 1)
+    while (popped != frames)
     {
-        push8(tx[i]);
-        i += 1;
-    }
+        if ((pushed != frames) && ((uint16_t)(pushed - popped) < _s_fifo_depth))
+        {
+            uint32_t pushr = SPI_PUSHR_CTAS1;
+
+            if (pushed == 0)
+                pushr |= SPI_PUSHR_CTCNT;
+
+            if (++pushed != frames)
+                pushr |= SPI_PUSHR_CONT;
+
+            if (words != nullptr)
+            {
+                pushr |= *words++;
+            }
+            else if (tx != nullptr)
+            {
+                pushr |= ((uint16_t)tx[0] << 8) | tx[1];
+                tx += 2;
+            }
+            else
+            {
+                pushr |= fill;
+            }
+
+            *_pushr = pushr;
+        }
 
-    while (i < tx_len)
-    {
-        push16(((uint16_t)tx[i] << 8) | tx[i+1]);
-        i += 2;
+        if (rxFifoCount() != 0)
+        {
+            uint16_t rx16 = (uint16_t)*_popr;
+
+            if (rx != nullptr)
+            {
+                *rx++ = (uint8_t)(rx16 >> 8);
+                *rx++ = (uint8_t)(rx16 >> 0);
+            }
+
+            popped++;
+        }
     }
+
+    *_sr = SPI_SR_TCF;
 }
 
 template < pin_t MOSI, pin_t MISO, pin_t SCK >
-void SPI0 < MOSI, MISO, SCK >::tx(uint8_t tx, uint16_t num_times)
+void SPI0 < MOSI, MISO, SCK >::tx(uint8_t const * tx, uint16_t tx_len)
 {
-    txWait(0);
+    if ((tx == nullptr) || (tx_len == 0))
+        return;
 
+    if (tx_len & 1)
+        (void)txrx8(*tx++);
+
+    burst(tx, 0, nullptr, tx_len >> 1);
+}
+
+template < pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPI0 < MOSI, MISO, SCK >::tx(uint8_t tx, uint16_t num_times)
+{
     if (num_times & 1)
-    {
-        push8(tx);
-        num_times -= 1;
-    }
+        (void)txrx8(tx);
 
-    while (num_times != 0)
-    {
-        push16(((uint16_t)tx << 8) | tx);
-        num_times -= 2;
-    }
+    burst(nullptr, ((uint16_t)tx << 8) | tx, nullptr, num_times >> 1);
+}
+
+template < pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPI0 < MOSI, MISO, SCK >::tx16(uint16_t const * tx, uint16_t num)
+{
+    if ((tx == nullptr) || (num == 0))
+        return;
+
+    burst(nullptr, 0, nullptr, num, tx);
+}
+
+template < pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPI0 < MOSI, MISO, SCK >::tx16(uint16_t tx, uint16_t num_times)
+{
+    burst(nullptr, tx, nullptr, num_times);
 }
 
 template < pin_t MOSI, pin_t MISO, pin_t SCK >
@@ -351,117 +439,335 @@ void SPI0 < MOSI, MISO, SCK >::txrx(uint8_t const * tx, uint8_t * rx, uint16_t l
     if ((tx == nullptr) || (rx == nullptr))
         return;
 
-    uint16_t i = 0;
-
     if (len & 1)
-    {
-        *rx++ = txrx8(tx[i]);
-        i += 1;
-    }
+        *rx++ = txrx8(*tx++);
+
+    burst(tx, 0, rx, len >> 1);
+}
+
+template < pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPI0 < MOSI, MISO, SCK >::trans(uint8_t const * tx, uint16_t tx_len, uint8_t * rx, uint16_t rx_len)
+{
+    // Just send off the request if there is one.  Data shifted in is chucked.
+    if ((tx != nullptr) && (tx_len != 0))
+        this->tx(tx, tx_len);
+
+    if ((rx == nullptr) || (rx_len == 0))
+        return;
+
+    // Now get the response by pushing all 1 bits
+    if (rx_len & 1)
+        *rx++ = txrx8(0xFF);
+
+    burst(nullptr, 0xFFFF, rx, rx_len >> 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Arbiter /////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Bus priorities, lowest first.  Within a priority the earliest deadline wins.
+enum spi_pri_e : uint8_t
+{
+    SPI_PRI_BULK,    // Block transfers that can be deferred, e.g. SD card
+    SPI_PRI_CTRL,    // Short register accesses
+    SPI_PRI_STREAM,  // Real time data, e.g. audio decoder feed
+};
+
+using spi_client_t = int8_t;
+
+// Grants ownership of a shared SPI bus to the devices on it.  Every device
+// attaches once and gets a client slot.  A request posts the client as pending
+// with a deadline in usecs - while it is live, owners that can give the bus up
+// mid-transaction (SD multi-block transfers at block boundaries) check
+// contended() and release early.  When the bus is free the highest priority
+// live request gets it.  Clients that can't spin for the bus, e.g. ones
+// driven from isrs, register a Waiter and are handed the bus on release.
+// Waits, deadline misses and yields are kept per client.
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+class SPIArbiter
+{
+    public:
+        static SPIArbiter & acquire(void) { static SPIArbiter arb; return arb; }
+
+        struct Stats
+        {
+            uint32_t grants;      // Number of times the bus was granted
+            uint32_t waits;       // Grants that weren't immediate
+            uint32_t wait_total;  // usecs
+            uint32_t wait_max;    // usecs
+            uint32_t misses;      // Blocking requests that passed their deadline
+            uint32_t yields;      // Times the client gave the bus up early
+
+            uint32_t avg(void) const { return (waits == 0) ? 0 : (wait_total / waits); }
+        };
+
+        class Waiter
+        {
+            friend class SPIArbiter;
+
+            protected:
+                Waiter(void) = default;
+
+                // Called with the bus already owned, possibly from an isr
+                virtual void granted(void) = 0;
+        };
+
+        // Returns -1 if there are no client slots left
+        spi_client_t attach(spi_pri_e pri);
+        void waiter(spi_client_t c, Waiter * w) { if (valid(c)) _clients[c].waiter = w; }
+
+        // Non-blocking.  Returns true if the client now owns the bus, otherwise
+        // leaves the request posted until it is granted or deadline passes.
+        // An expired request is posted anew.
+        bool request(spi_client_t c, uint32_t cta, uint32_t deadline);
+
+        // Blocks until the bus is granted or the deadline passes
+        bool grab(spi_client_t c, uint32_t cta, uint32_t deadline);
+
+        void release(spi_client_t c, bool yield = false);
 
-    if (len & 2)
+        // Parks the bus if no one has it or is waiting for it
+        void park(void);
+
+        bool owner(spi_client_t c) const { return (c != -1) && (_owner == c); }
+        bool contended(spi_client_t c) const;
+
+        Stats const & stats(spi_client_t c) const { return _clients[valid(c) ? c : 0].stats; }
+        uint32_t ctaSwitches(void) const { return _cta_switches; }
+        void resetStats(void);
+
+        SPIArbiter(SPIArbiter const &) = delete;
+        SPIArbiter & operator=(SPIArbiter const &) = delete;
+
+    private:
+        SPIArbiter(void) = default;
+
+        bool valid(spi_client_t c) const { return (c >= 0) && (c < _num_clients); }
+        bool live(spi_client_t c, uint32_t now) const
+        { return _clients[c].pending && ((now - _clients[c].posted) < _clients[c].deadline); }
+        spi_client_t next(uint32_t now) const;
+        void grant(spi_client_t c, uint32_t now);
+        void withdraw(spi_client_t c);
+
+        static constexpr uint8_t const _s_max_clients = 4;
+
+        struct Client
+        {
+            spi_pri_e pri;
+            bool pending;
+            uint32_t posted;
+            uint32_t deadline;
+            uint32_t cta;
+            Waiter * waiter;
+            Stats stats;
+        };
+
+        Client _clients[_s_max_clients] = {};
+        uint8_t _num_clients = 0;
+        spi_client_t volatile _owner = -1;
+
+        uint32_t _cta = 0;  // CTA of the last client granted the bus
+        uint32_t _cta_switches = 0;
+};
+
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+spi_client_t SPIArbiter < SPI, MOSI, MISO, SCK >::attach(spi_pri_e pri)
+{
+    if (_num_clients == _s_max_clients)
+        return -1;
+
+    _clients[_num_clients].pri = pri;
+
+    return _num_clients++;
+}
+
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool SPIArbiter < SPI, MOSI, MISO, SCK >::request(spi_client_t c, uint32_t cta, uint32_t deadline)
+{
+    if (!valid(c))
+        return false;
+
+    bool granted = true;
+    uint32_t now = usecs();
+
+    __disable_irq();
+
+    if (_owner != c)
     {
-        *rx++ = txrx8(tx[i]);
-        *rx++ = txrx8(tx[i+1]);
-        i += 2;
+        Client & client = _clients[c];
+
+        if (!live(c, now))
+        {
+            client.pending = true;
+            client.posted = now;
+        }
+
+        client.deadline = deadline;
+        client.cta = cta;
+
+        if ((_owner == -1) && (next(now) == c))
+            grant(c, now);
+        else
+            granted = false;
     }
 
-    if (len & 4)
+    __enable_irq();
+
+    return granted;
+}
+
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool SPIArbiter < SPI, MOSI, MISO, SCK >::grab(spi_client_t c, uint32_t cta, uint32_t deadline)
+{
+    uint32_t start = usecs();
+
+    while (!request(c, cta, deadline))
     {
-        *rx++ = txrx8(tx[i]);
-        *rx++ = txrx8(tx[i+1]);
-        *rx++ = txrx8(tx[i+2]);
-        *rx++ = txrx8(tx[i+3]);
-        i += 4;
+        if ((usecs() - start) >= deadline)
+        {
+            withdraw(c);
+            return false;
+        }
     }
 
-    while (i < len)
+    return true;
+}
+
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPIArbiter < SPI, MOSI, MISO, SCK >::release(spi_client_t c, bool yield)
+{
+    Waiter * w = nullptr;
+
+    __disable_irq();
+
+    if (owner(c))
     {
-        txWait(0);
+        if (yield)
+            _clients[c].stats.yields++;
 
-        *_pushr = ((uint16_t)tx[i]   << 8) | tx[i+1] | SPI_PUSHR_CTAS1;
-        *_pushr = ((uint16_t)tx[i+2] << 8) | tx[i+3] | SPI_PUSHR_CTAS1;
-        *_pushr = ((uint16_t)tx[i+4] << 8) | tx[i+5] | SPI_PUSHR_CTAS1;
-        *_pushr = ((uint16_t)tx[i+6] << 8) | tx[i+7] | SPI_PUSHR_CTAS1;
+        _owner = -1;
 
-        i += 8;
+        uint32_t now = usecs();
+        spi_client_t n = next(now);
 
-        rxWait(4);
+        if ((n != -1) && (_clients[n].waiter != nullptr))
+        {
+            grant(n, now);
+            w = _clients[n].waiter;
+        }
+    }
 
-        uint32_t rx32 = (*_popr << 16) | *_popr;
+    __enable_irq();
 
-        *rx++ = (uint8_t)(rx32 >> 24);
-        *rx++ = (uint8_t)(rx32 >> 16);
-        *rx++ = (uint8_t)(rx32 >>  8);
-        *rx++ = (uint8_t)(rx32 >>  0);
+    if (w != nullptr)
+        w->granted();
+}
 
-        rx32 = (*_popr << 16) | *_popr;
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPIArbiter < SPI, MOSI, MISO, SCK >::park(void)
+{
+    __disable_irq();
 
-        *rx++ = (uint8_t)(rx32 >> 24);
-        *rx++ = (uint8_t)(rx32 >> 16);
-        *rx++ = (uint8_t)(rx32 >>  8);
-        *rx++ = (uint8_t)(rx32 >>  0);
-    }
+    if ((_owner == -1) && (next(usecs()) == -1))
+        SPI < MOSI, MISO, SCK >::acquire().park();
+
+    __enable_irq();
 }
 
-template < pin_t MOSI, pin_t MISO, pin_t SCK >
-void SPI0 < MOSI, MISO, SCK >::trans(uint8_t const * tx, uint16_t tx_len, uint8_t * rx, uint16_t rx_len)
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+bool SPIArbiter < SPI, MOSI, MISO, SCK >::contended(spi_client_t c) const
 {
-    // Just send off the request if there is one
-    if ((tx != nullptr) && (tx_len != 0))
+    if (!valid(c))
+        return false;
+
+    uint32_t now = usecs();
+
+    for (spi_client_t i = 0; i < _num_clients; i++)
     {
-        this->tx(tx, tx_len);
-        flush(); // Chuck the data that was shifted in
+        if ((_clients[i].pri > _clients[c].pri) && live(i, now))
+            return true;
     }
 
-    if ((rx == nullptr) || (rx_len == 0))
-        return;
+    return false;
+}
 
-    // Now get the response by pushing all 1 bits
-    uint8_t * rx_end = rx + rx_len;
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPIArbiter < SPI, MOSI, MISO, SCK >::resetStats(void)
+{
+    __disable_irq();
 
-    if (rx_len & 1)
-        *rx++ = txrx8(0xFF);
+    for (uint8_t i = 0; i < _num_clients; i++)
+        _clients[i].stats = {};
 
-    if (rx_len & 2)
-    {
-        *rx++ = txrx8(0xFF);
-        *rx++ = txrx8(0xFF);
-    }
+    _cta_switches = 0;
 
-    if (rx_len & 4)
+    __enable_irq();
+}
+
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+spi_client_t SPIArbiter < SPI, MOSI, MISO, SCK >::next(uint32_t now) const
+{
+    spi_client_t n = -1;
+    uint32_t left = 0;
+
+    for (spi_client_t i = 0; i < _num_clients; i++)
     {
-        *rx++ = txrx8(0xFF);
-        *rx++ = txrx8(0xFF);
-        *rx++ = txrx8(0xFF);
-        *rx++ = txrx8(0xFF);
+        if (!live(i, now))
+            continue;
+
+        uint32_t l = _clients[i].deadline - (now - _clients[i].posted);
+
+        if ((n == -1) || (_clients[i].pri > _clients[n].pri)
+                || ((_clients[i].pri == _clients[n].pri) && (l < left)))
+        {
+            n = i;
+            left = l;
+        }
     }
 
-    while (rx < rx_end)
-    {
-        *_pushr = 0xFFFF | SPI_PUSHR_CTAS1;
-        *_pushr = 0xFFFF | SPI_PUSHR_CTAS1;
-        *_pushr = 0xFFFF | SPI_PUSHR_CTAS1;
-        *_pushr = 0xFFFF | SPI_PUSHR_CTAS1;
+    return n;
+}
 
-        rxWait(2);
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPIArbiter < SPI, MOSI, MISO, SCK >::grant(spi_client_t c, uint32_t now)
+{
+    Client & client = _clients[c];
+    uint32_t wait = now - client.posted;
 
-        uint32_t rx32 = (*_popr << 16) | *_popr;
+    client.pending = false;
+    client.stats.grants++;
 
-        *rx++ = (uint8_t)(rx32 >> 24);
-        *rx++ = (uint8_t)(rx32 >> 16);
-        *rx++ = (uint8_t)(rx32 >>  8);
-        *rx++ = (uint8_t)(rx32 >>  0);
+    if (wait != 0)
+    {
+        client.stats.waits++;
+        client.stats.wait_total += wait;
+        if (wait > client.stats.wait_max)
+            client.stats.wait_max = wait;
+    }
+
+    if (client.cta != _cta)
+    {
+        _cta = client.cta;
+        _cta_switches++;
+    }
 
-        rxWait(2);
+    _owner = c;
+}
 
-        rx32 = (*_popr << 16) | *_popr;
+template < template < pin_t, pin_t, pin_t > class SPI, pin_t MOSI, pin_t MISO, pin_t SCK >
+void SPIArbiter < SPI, MOSI, MISO, SCK >::withdraw(spi_client_t c)
+{
+    __disable_irq();
 
-        *rx++ = (uint8_t)(rx32 >> 24);
-        *rx++ = (uint8_t)(rx32 >> 16);
-        *rx++ = (uint8_t)(rx32 >>  8);
-        *rx++ = (uint8_t)(rx32 >>  0);
+    if (_clients[c].pending)
+    {
+        _clients[c].stats.misses++;
+        _clients[c].pending = false;
     }
+
+    __enable_irq();
 }
 
 #endif
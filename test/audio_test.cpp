@@ -0,0 +1,483 @@
+#include "audio.h"
+#include "test.h"
+
+#include <cstring>
+#include <vector>
+
+// A read only file over bytes in memory
+class MemFile : public File
+{
+    public:
+        MemFile(std::vector < uint8_t > const & data)
+            : File(FST_FAT32, FileInfo(FileInfo::FT_REG, 0, data.size(), 0)), _data(data)
+        { _taken = true; }
+
+        virtual int read(uint8_t * buf, int amt)
+        {
+            if ((uint32_t)amt > remaining()) amt = remaining();
+            memcpy(buf, &_data[_offset], amt); _offset += amt; return amt;
+        }
+
+        virtual int read(uint8_t const ** p, uint8_t n) { return -1; }
+        virtual int read(FileInfo & info) { return -1; }
+        virtual int write(uint8_t const * buf, int amt, bool flush = true) { return -1; }
+        virtual int write(FileInfo const & info) { return -1; }
+        virtual bool flush(void) { return false; }
+        virtual bool rewind(void) { _offset = 0; return true; }
+        virtual bool seek(uint32_t offset) { if (offset > size()) return false; _offset = offset; return true; }
+
+    private:
+        std::vector < uint8_t > _data;
+};
+
+typedef std::vector < uint8_t > Bytes;
+
+// MPEG1 Layer III, 128 kbps, 44.1 kHz, stereo, so 417 byte frames of 1152
+// samples with 32 bytes of side info
+static constexpr uint32_t const _s_hdr = 0xFFFB9000;
+static constexpr uint32_t const _s_frame_len = 417;
+static constexpr uint32_t const _s_side = 32;
+
+static void be32(Bytes & b, uint32_t at, uint32_t v)
+{
+    b[at] = v >> 24; b[at + 1] = v >> 16; b[at + 2] = v >> 8; b[at + 3] = v;
+}
+
+static void le32(Bytes & b, uint32_t at, uint32_t v)
+{
+    b[at] = v; b[at + 1] = v >> 8; b[at + 2] = v >> 16; b[at + 3] = v >> 24;
+}
+
+static void frames(Bytes & b, uint32_t num)
+{
+    for (uint32_t i = 0; i < num; i++)
+    {
+        uint32_t at = b.size();
+        b.resize(at + _s_frame_len, 0);
+        be32(b, at, _s_hdr);
+    }
+}
+
+// len is what the header says, which doesn't count the header or footer
+static void id3v2(Bytes & b, uint32_t len, bool footer = false, uint8_t ver = 4)
+{
+    uint32_t at = b.size();
+    uint8_t hdr[10] = { 'I', 'D', '3', ver, 0, (uint8_t)(footer ? 0x10 : 0),
+        (uint8_t)((len >> 21) & 0x7F), (uint8_t)((len >> 14) & 0x7F),
+        (uint8_t)((len >> 7) & 0x7F), (uint8_t)(len & 0x7F) };
+
+    b.insert(b.end(), hdr, hdr + sizeof(hdr));
+    b.resize(at + 10 + len, 0);
+
+    if (footer)
+    {
+        hdr[0] = '3'; hdr[1] = 'D'; hdr[2] = 'I';
+        b.insert(b.end(), hdr, hdr + sizeof(hdr));
+    }
+}
+
+static void id3v1(Bytes & b)
+{
+    uint32_t at = b.size();
+    b.resize(at + 128, ' ');
+    memcpy(&b[at], "TAG", 3);
+}
+
+// items is the bytes of items, the size in the footer also counts the footer
+static void ape(Bytes & b, uint32_t items, bool header)
+{
+    uint32_t at = b.size();
+    b.resize(at + (header ? 32 : 0) + items + 32, 0);
+
+    if (header)
+    {
+        memcpy(&b[at], "APETAGEX", 8);
+        at += 32;
+    }
+
+    at += items;
+    memcpy(&b[at], "APETAGEX", 8);
+    le32(b, at + 8, 2000);
+    le32(b, at + 12, items + 32);
+    le32(b, at + 20, header ? 0x80000000 : 0);
+}
+
+// Xing or Info in the first frame, with frames and bytes and optionally a TOC
+// of toc[i] = i * 256 / 100
+static void xing(Bytes & b, uint32_t first, char const * id, uint32_t num, uint32_t bytes, bool toc)
+{
+    uint32_t at = first + 4 + _s_side;
+
+    memcpy(&b[at], id, 4);
+    be32(b, at + 4, 0x03 | (toc ? 0x04 : 0));
+    be32(b, at + 8, num);
+    be32(b, at + 12, bytes);
+
+    if (toc)
+    {
+        for (uint32_t i = 0; i < 100; i++)
+            b[at + 16 + i] = (uint8_t)((i * 256) / 100);
+    }
+}
+
+// VBRI with entries 2 byte entries each of an equal share of the bytes
+static void vbri(Bytes & b, uint32_t first, uint32_t num, uint32_t bytes, uint16_t entries)
+{
+    uint32_t at = first + 4 + 32;
+
+    memcpy(&b[at], "VBRI", 4);
+    be32(b, at + 10, bytes);
+    be32(b, at + 14, num);
+    b[at + 18] = entries >> 8; b[at + 19] = entries;
+    b[at + 20] = 0; b[at + 21] = 1;   // Scale
+    b[at + 22] = 0; b[at + 23] = 2;   // Entry width
+    b[at + 24] = 0; b[at + 25] = 1;   // Frames per entry
+
+    for (uint16_t i = 0; i < entries; i++)
+    {
+        uint16_t val = bytes / entries;
+        b[at + 26 + (i * 2)] = val >> 8;
+        b[at + 27 + (i * 2)] = val;
+    }
+}
+
+static TrackMeta index(File * fp, Mp3Index & idx)
+{
+    TrackMeta meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.version = TrackMeta::VERSION;
+    meta.codec = TrackMeta::CODEC_MP3;
+
+    CHECK(idx.init(fp));
+    idx.save(meta);
+
+    return meta;
+}
+
+enum { NONE, CBR, AVG, TOC };  // Mp3Index's types as saved to TrackMeta
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void tags_none(void)
+{
+    Bytes b;
+    frames(b, 10);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::front(&f), 0);
+    CHECK_EQ(AudioTags::skip(&f), 0);
+    CHECK_EQ(f.size(), b.size());
+    CHECK_EQ(f.offset(), 0);
+}
+
+static void tags_id3v2(void)
+{
+    Bytes b;
+    id3v2(b, 1000);
+    frames(b, 10);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::front(&f), 1010);
+    CHECK_EQ(AudioTags::skip(&f), 1010);
+    CHECK_EQ(f.offset(), 1010);
+    CHECK_EQ(f.size(), b.size());
+}
+
+static void tags_id3v2_footer(void)
+{
+    Bytes b;
+    id3v2(b, 300, true);
+    frames(b, 2);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::front(&f), 320);
+}
+
+// Some taggers leave a second tag in front of the first, or an old one behind
+static void tags_id3v2_stacked(void)
+{
+    Bytes b;
+    id3v2(b, 200, false, 3);
+    id3v2(b, 5000, true);
+    id3v2(b, 0);
+    frames(b, 2);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::front(&f), 210 + 5020 + 10);
+}
+
+// Sizes that run off the end of the file or aren't syncsafe, and a version of
+// 0xFF, aren't tags and audio is taken to start where they are
+static void tags_id3v2_bad(void)
+{
+    Bytes b;
+    id3v2(b, 100);
+    frames(b, 2);
+
+    Bytes big(b);
+    big[9] = 0x7F; big[8] = 0x7F;
+    MemFile f1(big);
+    CHECK_EQ(AudioTags::front(&f1), 0);
+
+    Bytes unsafe(b);
+    unsafe[8] |= 0x80;
+    MemFile f2(unsafe);
+    CHECK_EQ(AudioTags::front(&f2), 0);
+
+    Bytes ver(b);
+    ver[3] = 0xFF;
+    MemFile f3(ver);
+    CHECK_EQ(AudioTags::front(&f3), 0);
+
+    // Too short to hold a header
+    Bytes tiny = { 'I', 'D', '3', 4, 0 };
+    MemFile f4(tiny);
+    CHECK_EQ(AudioTags::front(&f4), 0);
+    CHECK_EQ(AudioTags::skip(&f4), 0);
+}
+
+static void tags_id3v1(void)
+{
+    Bytes b;
+    id3v2(b, 100);
+    frames(b, 10);
+    id3v1(b);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::skip(&f), 110 + 128);
+    CHECK_EQ(f.size(), b.size() - 128);
+    CHECK_EQ(f.offset(), 110);
+}
+
+static void tags_ape(void)
+{
+    Bytes b;
+    frames(b, 10);
+    uint32_t audio = b.size();
+    ape(b, 500, true);
+    MemFile f1(b);
+
+    CHECK_EQ(AudioTags::skip(&f1), 32 + 500 + 32);
+    CHECK_EQ(f1.size(), audio);
+
+    b.resize(audio);
+    ape(b, 500, false);
+    MemFile f2(b);
+
+    CHECK_EQ(AudioTags::skip(&f2), 500 + 32);
+    CHECK_EQ(f2.size(), audio);
+}
+
+// APE is in front of ID3v1 when there are both
+static void tags_ape_id3v1(void)
+{
+    Bytes b;
+    id3v2(b, 50, true);
+    frames(b, 10);
+    uint32_t audio = b.size();
+    ape(b, 64, true);
+    id3v1(b);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::skip(&f), 70 + 32 + 64 + 32 + 128);
+    CHECK_EQ(f.size(), audio);
+    CHECK_EQ(f.offset(), 70);
+}
+
+// A footer claiming more than there is is left alone
+static void tags_ape_bad(void)
+{
+    Bytes b;
+    frames(b, 1);
+    ape(b, 16, false);
+    le32(b, b.size() - 32 + 12, 100000);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::skip(&f), 0);
+    CHECK_EQ(f.size(), b.size());
+}
+
+// The audio start that's passed in is used as it is
+static void tags_skip_known_front(void)
+{
+    Bytes b;
+    id3v2(b, 100);
+    frames(b, 4);
+    id3v1(b);
+    MemFile f(b);
+
+    CHECK_EQ(AudioTags::skip(&f, 110), 110 + 128);
+    CHECK_EQ(f.offset(), 110);
+
+    MemFile g(b);
+    CHECK_EQ(AudioTags::skip(&g, b.size() + 1), -1);
+}
+
+static void mp3_cbr(void)
+{
+    Bytes b;
+    id3v2(b, 90);
+    frames(b, 100);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+    uint32_t bytes = 100 * _s_frame_len;
+
+    CHECK_EQ(meta.index, CBR);
+    CHECK_EQ(meta.first, 100);
+    CHECK_EQ(meta.bytes, bytes);
+    CHECK_EQ(meta.bitrate, 128000);
+    CHECK_EQ(meta.samplerate, 44100);
+    CHECK_EQ(meta.ref, _s_hdr);
+    CHECK_EQ(idx.duration(), (bytes * 8) / 128000);
+    CHECK_EQ(idx.offset(1), 100 + 16000);
+    CHECK_EQ(idx.offset(idx.duration()), 100 + bytes);
+}
+
+// A header looking pattern ahead of the first frame without another header
+// where its frame would end isn't taken for the first frame
+static void mp3_stray_sync(void)
+{
+    Bytes b;
+    id3v2(b, 0);
+    b.resize(60, 0);
+    be32(b, 20, _s_hdr);
+    frames(b, 4);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+    CHECK_EQ(meta.first, 60);
+
+    // Back to the frame at or after an offset
+    CHECK(idx.sync(&f, 61));
+    CHECK_EQ(f.offset(), 60 + _s_frame_len);
+}
+
+static void mp3_xing_toc(void)
+{
+    Bytes b;
+    id3v2(b, 0);
+    frames(b, 50);
+    uint32_t bytes = 50 * _s_frame_len;
+    xing(b, 10, "Xing", 1000, bytes, true);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+
+    CHECK_EQ(meta.index, TOC);
+    CHECK_EQ(meta.toc, 10 + 4 + _s_side + 16);
+    CHECK_EQ(idx.duration(), (1000 * 1152) / 44100);
+    CHECK_EQ(idx.offset(idx.duration() / 2), 10 + (bytes * ((50 * 256) / 100)) / 256);
+
+    // Back from what was saved, TOC read from where it was found
+    Mp3Index again;
+    CHECK(again.init(&f, meta));
+    CHECK_EQ(again.duration(), idx.duration());
+    CHECK_EQ(again.offset(7), idx.offset(7));
+}
+
+static void mp3_xing_no_toc(void)
+{
+    Bytes b;
+    frames(b, 50);
+    xing(b, 0, "Xing", 500, 0, false);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+
+    CHECK_EQ(meta.index, AVG);
+    CHECK_EQ(meta.bytes, 50 * _s_frame_len);  // Zero in the header isn't used
+    CHECK_EQ(idx.duration(), (500 * 1152) / 44100);
+}
+
+static void mp3_info(void)
+{
+    Bytes b;
+    frames(b, 50);
+    xing(b, 0, "Info", 2000, 50 * _s_frame_len, true);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+
+    CHECK_EQ(meta.index, CBR);
+    CHECK_EQ(meta.toc, 0);
+    CHECK_EQ(idx.duration(), (2000 * 1152) / 44100);
+}
+
+static void mp3_vbri(void)
+{
+    Bytes b;
+    frames(b, 50);
+    uint32_t bytes = 50 * _s_frame_len;
+    vbri(b, 0, 1225, bytes, 10);  // 32 seconds so half way is an entry
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+
+    CHECK_EQ(meta.index, TOC);
+    CHECK_EQ(meta.toc, 0);
+    CHECK_EQ(idx.duration(), 32);
+    CHECK_EQ(idx.offset(0), 0);
+    CHECK_EQ(idx.offset(idx.duration() / 2), (bytes * 128) / 256);
+
+    // No TOC offset saved so it's built again from VBRI
+    Mp3Index again;
+    CHECK(again.init(&f, meta));
+    CHECK_EQ(again.offset(idx.duration() / 2), idx.offset(idx.duration() / 2));
+}
+
+// Saved values that don't fit the file send it back to a full parse
+static void mp3_stale_meta(void)
+{
+    Bytes b;
+    frames(b, 20);
+    MemFile f(b);
+    Mp3Index idx;
+
+    TrackMeta meta = index(&f, idx);
+    meta.bytes = b.size() * 2;
+    meta.duration = 9999;
+
+    Mp3Index again;
+    CHECK(again.init(&f, meta));
+    CHECK_EQ(again.duration(), idx.duration());
+}
+
+static void mp3_no_frames(void)
+{
+    Bytes b;
+    id3v2(b, 100);
+    b.resize(5000, 0x55);
+    MemFile f(b);
+    Mp3Index idx;
+
+    CHECK(!idx.init(&f));
+    CHECK(!idx.valid());
+}
+
+TEST_MAIN(
+    RUN(tags_none);
+    RUN(tags_id3v2);
+    RUN(tags_id3v2_footer);
+    RUN(tags_id3v2_stacked);
+    RUN(tags_id3v2_bad);
+    RUN(tags_id3v1);
+    RUN(tags_ape);
+    RUN(tags_ape_id3v1);
+    RUN(tags_ape_bad);
+    RUN(tags_skip_known_front);
+    RUN(mp3_cbr);
+    RUN(mp3_stray_sync);
+    RUN(mp3_xing_toc);
+    RUN(mp3_xing_no_toc);
+    RUN(mp3_info);
+    RUN(mp3_vbri);
+    RUN(mp3_stale_meta);
+    RUN(mp3_no_frames);
+)
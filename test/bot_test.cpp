@@ -0,0 +1,701 @@
+#include "usb_host.h"
+#include "test.h"
+
+#include <chrono>
+#include <cstring>
+
+// Bulk-Only Transport and the SCSI commands behind it, against UsbHost as the
+// PC's mass storage driver and an image file as the card.  CBWs are replayed
+// as a host sends them: the CBW, the Data stage in or out, then the CSW, with
+// any STALL cleared as BOT 6.7 says and a bad CBW followed by Reset Recovery.
+//
+// bot_throughput is the gate for changes to the data path.  Along with
+// commands and bytes per second it counts every byte the firmware memcpy()s
+// against the bytes the host moved, the sim's own copies being memmove()s.
+
+using Ep0 = ControlPipe < EndPoint::N0 >;
+
+static constexpr uint32_t const _s_disk_blocks = 8192;
+static constexpr uint16_t const _s_iface = UsbDesc::Interface::iface_number;
+static constexpr uint8_t const _s_ep_in = 0x80 | BULK_IN_EP_NUM;
+static constexpr uint8_t const _s_ep_out = BULK_OUT_EP_NUM;
+
+static bool _s_counting = false;
+static uint64_t _s_copied = 0;
+
+// The firmware's copies.  Through a pointer so the compiler can't turn it back
+// into a call to memcpy().
+static void * (* volatile _s_memmove)(void *, void const *, size_t) = memmove;
+
+extern "C" void * memcpy(void * dst, void const * src, size_t n) noexcept
+{
+    if (_s_counting)
+        _s_copied += n;
+
+    return _s_memmove(dst, src, n);
+}
+
+struct CSW
+{
+    uint32_t dCSWSignature;
+    uint32_t dCSWTag;
+    uint32_t dCSWDataResidue;
+    uint8_t bCSWStatus;
+
+} __attribute__ ((packed));
+
+static void put32(uint8_t * p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint32_t be32(uint8_t const * p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint16_t be16(uint8_t const * p) { return (p[0] << 8) | p[1]; }
+
+static UsbHost & host(void)
+{
+    static bool attached = HostDisk::acquire().attach(TEST_IMG("bot_test.img"), _s_disk_blocks);
+    static UsbHost h;
+
+    (void)attached;
+    CHECK(h.enumerate());
+
+    return h;
+}
+
+static int clearHalt(UsbHost & h, uint8_t ep)
+{
+    return h.control(0x02, Ep0::CLEAR_FEATURE, Ep0::ENDPOINT_HALT, ep, 0);
+}
+
+// BOT 5.3.4 - Bulk-Only Mass Storage Reset then both halts cleared
+static void resetRecovery(UsbHost & h)
+{
+    CHECK_EQ(h.control(0x21, Ep0::BOMSR, 0, _s_iface, 0), 0);
+    CHECK_EQ(clearHalt(h, _s_ep_in), 0);
+    CHECK_EQ(clearHalt(h, _s_ep_out), 0);
+}
+
+static uint32_t _s_tag = 0;
+
+// A command through all three stages.  Returns the bytes moved in the Data
+// stage or UsbHost's reason if a stage fell over.
+static int command(UsbHost & h, uint8_t const * cdb, uint8_t clen, bool in,
+        uint8_t * data, uint32_t len, CSW & csw)
+{
+    uint8_t cbw[31] = {};
+
+    put32(cbw, 0x43425355);
+    put32(cbw + 4, ++_s_tag);
+    put32(cbw + 8, len);
+    cbw[12] = in ? 0x80 : 0x00;
+    cbw[14] = clen;
+    memmove(cbw + 15, cdb, clen);
+
+    int ret = h.bulkOut(BULK_OUT_EP_NUM, cbw, sizeof(cbw));
+    if (ret < 0)
+        return ret;
+
+    int n = 0;
+
+    if (len != 0)
+    {
+        n = in ? h.bulkIn(BULK_IN_EP_NUM, data, len) : h.bulkOut(BULK_OUT_EP_NUM, data, len);
+
+        if (n == UsbHost::STALL)
+        {
+            if ((ret = clearHalt(h, in ? _s_ep_in : _s_ep_out)) < 0)
+                return ret;
+
+            n = 0;
+        }
+        else if (n < 0)
+        {
+            return n;
+        }
+    }
+
+    // The CSW may be behind a STALL too, BOT 6.7.2
+    memset(&csw, 0, sizeof(csw));
+    ret = h.bulkIn(BULK_IN_EP_NUM, (uint8_t *)&csw, sizeof(csw));
+
+    if (ret == UsbHost::STALL)
+    {
+        if ((ret = clearHalt(h, _s_ep_in)) < 0)
+            return ret;
+
+        ret = h.bulkIn(BULK_IN_EP_NUM, (uint8_t *)&csw, sizeof(csw));
+    }
+
+    if (ret < 0)
+        return ret;
+
+    CHECK_EQ(ret, sizeof(csw));
+    CHECK_EQ(csw.dCSWSignature, 0x53425355);
+    CHECK_EQ(csw.dCSWTag, _s_tag);
+
+    return n;
+}
+
+static int readBlocks(UsbHost & h, uint32_t lba, uint16_t num_blocks, uint8_t * buf, CSW & csw)
+{
+    uint8_t const cdb[10] = { 0x28, 0, (uint8_t)(lba >> 24), (uint8_t)(lba >> 16),
+        (uint8_t)(lba >> 8), (uint8_t)lba, 0, (uint8_t)(num_blocks >> 8), (uint8_t)num_blocks, 0 };
+
+    return command(h, cdb, sizeof(cdb), true, buf, (uint32_t)num_blocks * 512, csw);
+}
+
+static int writeBlocks(UsbHost & h, uint32_t lba, uint16_t num_blocks, uint8_t * data, CSW & csw)
+{
+    uint8_t const cdb[10] = { 0x2A, 0, (uint8_t)(lba >> 24), (uint8_t)(lba >> 16),
+        (uint8_t)(lba >> 8), (uint8_t)lba, 0, (uint8_t)(num_blocks >> 8), (uint8_t)num_blocks, 0 };
+
+    return command(h, cdb, sizeof(cdb), false, data, (uint32_t)num_blocks * 512, csw);
+}
+
+static uint8_t status(UsbHost & h, uint8_t const * cdb, uint8_t clen)
+{
+    CSW csw;
+
+    CHECK_EQ(command(h, cdb, clen, false, nullptr, 0, csw), 0);
+
+    return csw.bCSWStatus;
+}
+
+static bool synchronize(UsbHost & h)
+{
+    static uint8_t const cdb[10] = { 0x35 };
+    return status(h, cdb, sizeof(cdb)) == 0;
+}
+
+// Fixed format sense data, key in byte 2 and ASC in byte 12
+static void sense(UsbHost & h, uint8_t & key, uint8_t & asc)
+{
+    static uint8_t const cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+    uint8_t buf[18] = {};
+    CSW csw;
+
+    CHECK_EQ(command(h, cdb, sizeof(cdb), true, buf, sizeof(buf), csw), 18);
+    CHECK_EQ(csw.bCSWStatus, 0);
+
+    key = buf[2] & 0x0F;
+    asc = buf[12];
+}
+
+static void checkSense(UsbHost & h, uint8_t key, uint8_t asc, int line)
+{
+    uint8_t k, a;
+
+    sense(h, k, a);
+
+    if ((k != key) || (a != asc))
+    {
+        test_failures++;
+        fprintf(stderr, "bot_test.cpp:%d: sense %02x/%02x, expected %02x/%02x\n", line, k, a, key, asc);
+    }
+}
+
+#define CHECK_SENSE(h, key, asc) checkSense(h, key, asc, __LINE__)
+
+// What a block holds is its LBA and a seed so nothing reads back right by chance
+static void pattern(uint8_t * p, uint32_t lba, uint32_t num_blocks, uint8_t seed)
+{
+    for (uint32_t b = 0; b < num_blocks; b++)
+        for (uint32_t i = 0; i < 512; i++)
+            p[(b * 512) + i] = (uint8_t)((lba + b) * 7 + i + seed);
+}
+
+static uint8_t _s_buf[256 * 512];
+static uint8_t _s_check[256 * 512];
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void bot_inquiry(void)
+{
+    UsbHost & h = host();
+    uint8_t buf[96];
+    CSW csw;
+
+    static uint8_t const std36[6] = { 0x12, 0, 0, 0, 36, 0 };
+    CHECK_EQ(command(h, std36, sizeof(std36), true, buf, 36, csw), 36);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(csw.dCSWDataResidue, 0);
+    CHECK_EQ(buf[0] & 0x1F, 0);  // Direct access block device
+    CHECK_EQ(buf[3] & 0x0F, 2);  // Response data format
+    CHECK_EQ(buf[4], 31);        // Additional length
+
+    // The host asking for more than there is gets it short with the rest as
+    // the residue
+    static uint8_t const std96[6] = { 0x12, 0, 0, 0, 96, 0 };
+    CHECK_EQ(command(h, std96, sizeof(std96), true, buf, 96, csw), 36);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(csw.dCSWDataResidue, 60);
+
+    // Supported VPD pages
+    static uint8_t const vpd[6] = { 0x12, 1, 0x00, 0, 64, 0 };
+    int n = command(h, vpd, sizeof(vpd), true, buf, 64, csw);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK(n > 4);
+    CHECK_EQ(buf[1], 0x00);
+    CHECK_EQ(n, buf[3] + 4);
+
+    // Block limits
+    static uint8_t const bl[6] = { 0x12, 1, 0xB0, 0, 64, 0 };
+    n = command(h, bl, sizeof(bl), true, buf, 64, csw);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(buf[1], 0xB0);
+    CHECK(be32(buf + 8) != 0);  // MAXIMUM TRANSFER LENGTH
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+static void bot_capacity(void)
+{
+    UsbHost & h = host();
+    uint8_t buf[8];
+    CSW csw;
+
+    static uint8_t const tur[6] = { 0x00 };
+    CHECK_EQ(status(h, tur, sizeof(tur)), 0);
+
+    static uint8_t const rc10[10] = { 0x25 };
+    CHECK_EQ(command(h, rc10, sizeof(rc10), true, buf, sizeof(buf), csw), 8);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(be32(buf), _s_disk_blocks - 1);
+    CHECK_EQ(be32(buf + 4), 512);
+
+    CHECK_SENSE(h, 0x00, 0x00);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+static void bot_mode_sense(void)
+{
+    UsbHost & h = host();
+    uint8_t buf[192];
+    CSW csw;
+
+    // All pages with the block descriptor
+    static uint8_t const ms6[6] = { 0x1A, 0, 0x3F, 0, 192, 0 };
+    int n = command(h, ms6, sizeof(ms6), true, buf, 192, csw);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(n, buf[0] + 1);
+    CHECK_EQ(buf[2] & 0x80, 0);  // Not write protected
+    CHECK_EQ(buf[3], 8);
+    CHECK_EQ(be32(buf + 4), _s_disk_blocks);
+    CHECK_EQ(be32(buf + 8) & 0x00FFFFFF, 512);
+
+    // Caching page alone without, write cache enabled
+    static uint8_t const ms10[10] = { 0x5A, 0x08, 0x08, 0, 0, 0, 0, 0, 64, 0 };
+    n = command(h, ms10, sizeof(ms10), true, buf, 64, csw);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK_EQ(n, be16(buf) + 2);
+    CHECK_EQ(be16(buf + 6), 0);
+    CHECK_EQ(buf[8] & 0x3F, 0x08);
+    CHECK_EQ(buf[9], 0x12);
+    CHECK(buf[10] & 0x04);
+
+    // Allocation length cuts it short
+    static uint8_t const ms6_4[6] = { 0x1A, 0, 0x3F, 0, 4, 0 };
+    CHECK_EQ(command(h, ms6_4, sizeof(ms6_4), true, buf, 4, csw), 4);
+    CHECK_EQ(csw.bCSWStatus, 0);
+
+    // Saved values aren't supported, the Data-In the host wanted is stalled
+    static uint8_t const saved[6] = { 0x1A, 0, 0xFF, 0, 192, 0 };
+    CHECK_EQ(command(h, saved, sizeof(saved), true, buf, 192, csw), 0);
+    CHECK_EQ(csw.bCSWStatus, 1);
+    CHECK_EQ(csw.dCSWDataResidue, 192);
+    CHECK_SENSE(h, 0x05, 0x39);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+// Sizes either side of the write-back cache's 8 blocks and up to a whole
+// READ(10)'s worth of the buffer, at LBAs that don't line up with anything
+static void bot_read_write(void)
+{
+    UsbHost & h = host();
+    HostDisk & hd = HostDisk::acquire();
+    CSW csw;
+
+    static uint16_t const sizes[] = { 1, 2, 3, 7, 8, 9, 16, 63, 64, 65, 128, 255, 256 };
+    uint32_t lba = 5;
+
+    for (uint16_t blocks : sizes)
+    {
+        uint32_t len = blocks * 512;
+
+        // What's on the card comes back
+        pattern(_s_check, lba, blocks, 0x11);
+        CHECK(hd.store(lba, _s_check, blocks));
+
+        memset(_s_buf, 0, len);
+        CHECK_EQ(readBlocks(h, lba, blocks, _s_buf, csw), len);
+        CHECK_EQ(csw.bCSWStatus, 0);
+        CHECK_EQ(csw.dCSWDataResidue, 0);
+        CHECK(memcmp(_s_buf, _s_check, len) == 0);
+
+        // What's written gets to the card once synchronized and reads back
+        pattern(_s_check, lba, blocks, 0x5A);
+        memmove(_s_buf, _s_check, len);
+        CHECK_EQ(writeBlocks(h, lba, blocks, _s_buf, csw), len);
+        CHECK_EQ(csw.bCSWStatus, 0);
+        CHECK_EQ(csw.dCSWDataResidue, 0);
+
+        CHECK(synchronize(h));
+        memset(_s_buf, 0, len);
+        CHECK(hd.load(lba, _s_buf, blocks));
+        CHECK(memcmp(_s_buf, _s_check, len) == 0);
+
+        memset(_s_buf, 0, len);
+        CHECK_EQ(readBlocks(h, lba, blocks, _s_buf, csw), len);
+        CHECK_EQ(csw.bCSWStatus, 0);
+        CHECK(memcmp(_s_buf, _s_check, len) == 0);
+
+        lba += blocks + 3;
+    }
+
+    // Sequential READs, which run on read-ahead
+    lba = 1000;
+    pattern(_s_check, lba, 256, 0x33);
+    CHECK(hd.store(lba, _s_check, 256));
+
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        CHECK_EQ(readBlocks(h, lba + (i * 32), 32, _s_buf, csw), 32 * 512);
+        CHECK_EQ(csw.bCSWStatus, 0);
+        CHECK(memcmp(_s_buf, _s_check + (i * 32 * 512), 32 * 512) == 0);
+    }
+
+    // The last block, and cached writes read back before they're on the card
+    lba = _s_disk_blocks - 4;
+    pattern(_s_check, lba, 4, 0x77);
+    memmove(_s_buf, _s_check, 4 * 512);
+    CHECK_EQ(writeBlocks(h, lba, 4, _s_buf, csw), 4 * 512);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    memset(_s_buf, 0, 4 * 512);
+    CHECK_EQ(readBlocks(h, lba, 4, _s_buf, csw), 4 * 512);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK(memcmp(_s_buf, _s_check, 4 * 512) == 0);
+    CHECK(synchronize(h));
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+static void bot_errors(void)
+{
+    UsbHost & h = host();
+    HostDisk & hd = HostDisk::acquire();
+    uint8_t buf[1024];
+    CSW csw;
+
+    // Past the end.  The Data-In is stalled and the Data-Out taken and
+    // dropped, the whole transfer the residue either way.
+    CHECK_EQ(readBlocks(h, _s_disk_blocks, 1, buf, csw), 0);
+    CHECK_EQ(csw.bCSWStatus, 1);
+    CHECK_EQ(csw.dCSWDataResidue, 512);
+    CHECK_SENSE(h, 0x05, 0x21);
+
+    uint8_t last[512];
+    CHECK(hd.load(_s_disk_blocks - 1, last));
+
+    memset(buf, 0xEE, sizeof(buf));
+    CHECK_EQ(writeBlocks(h, _s_disk_blocks - 1, 2, buf, csw), 1024);
+    CHECK_EQ(csw.bCSWStatus, 1);
+    CHECK_EQ(csw.dCSWDataResidue, 1024);
+    CHECK_SENSE(h, 0x05, 0x21);
+
+    CHECK(synchronize(h));
+    CHECK(hd.load(_s_disk_blocks - 1, buf));
+    CHECK(memcmp(buf, last, sizeof(last)) == 0);
+
+    // Not a command there is, with and without a Data stage
+    static uint8_t const vendor[6] = { 0xC0 };
+    CHECK_EQ(status(h, vendor, sizeof(vendor)), 1);
+    CHECK_SENSE(h, 0x05, 0x20);
+
+    CHECK_EQ(command(h, vendor, sizeof(vendor), true, buf, 64, csw), 0);
+    CHECK_EQ(csw.bCSWStatus, 1);
+    CHECK_EQ(csw.dCSWDataResidue, 64);
+
+    // Bad field in the CDB
+    static uint8_t const evpd[6] = { 0x12, 0, 0x80, 0, 64, 0 };
+    CHECK_EQ(command(h, evpd, sizeof(evpd), true, buf, 64, csw), 0);
+    CHECK_EQ(csw.bCSWStatus, 1);
+    CHECK_SENSE(h, 0x05, 0x24);
+
+    // A CBW that isn't valid gets a STALL on Bulk-In until Reset Recovery,
+    // BOT 6.6.1, after which commands go through as normal
+    static uint8_t const tur[6] = { 0x00 };
+    uint8_t cbw[31] = {};
+
+    put32(cbw, 0x43425356);
+    cbw[14] = 6;
+    CHECK_EQ(h.bulkOut(BULK_OUT_EP_NUM, cbw, sizeof(cbw)), sizeof(cbw));
+    CHECK_EQ(h.bulkIn(BULK_IN_EP_NUM, buf, 13), UsbHost::STALL);
+    resetRecovery(h);
+    CHECK_EQ(status(h, tur, sizeof(tur)), 0);
+
+    put32(cbw, 0x43425355);
+    CHECK_EQ(h.bulkOut(BULK_OUT_EP_NUM, cbw, 30), 30);
+    CHECK_EQ(h.bulkIn(BULK_IN_EP_NUM, buf, 13), UsbHost::STALL);
+    resetRecovery(h);
+    CHECK_EQ(status(h, tur, sizeof(tur)), 0);
+
+    // Reset Recovery in the middle of a READ, the host having given up on it
+    pattern(_s_check, 300, 64, 0x42);
+    CHECK(hd.store(300, _s_check, 64));
+
+    uint8_t const read64[10] = { 0x28, 0, 0, 0, 300 >> 8, 300 & 0xFF, 0, 0, 64, 0 };
+    put32(cbw, 0x43425355);
+    put32(cbw + 4, ++_s_tag);
+    put32(cbw + 8, 64 * 512);
+    cbw[12] = 0x80;
+    cbw[14] = sizeof(read64);
+    memmove(cbw + 15, read64, sizeof(read64));
+
+    CHECK_EQ(h.bulkOut(BULK_OUT_EP_NUM, cbw, sizeof(cbw)), sizeof(cbw));
+    CHECK_EQ(h.bulkIn(BULK_IN_EP_NUM, buf, 512), 512);
+    resetRecovery(h);
+    CHECK_EQ(status(h, tur, sizeof(tur)), 0);
+
+    CHECK_EQ(readBlocks(h, 300, 8, _s_buf, csw), 8 * 512);
+    CHECK_EQ(csw.bCSWStatus, 0);
+    CHECK(memcmp(_s_buf, _s_check, 8 * 512) == 0);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct Load
+{
+    char const * name;
+    bool write;
+    uint16_t blocks;     // Per command
+    uint32_t commands;
+    double max_copies;   // Per byte, what the gate allows
+    bool single;         // READs fail to open a descriptor and go a block at a time
+};
+
+static void replay(UsbHost & h, Load const & l)
+{
+    Usb & usb = Usb::acquire();
+    HostDisk & hd = HostDisk::acquire();
+    CSW csw;
+
+    uint32_t cmds = usb.commands();
+    uint32_t bytes = usb.bytes();
+    uint32_t fw_copied = usb.copied();
+    uint64_t moved = 0;
+
+    pattern(_s_buf, 0, l.blocks, 0x99);
+    hd.resetStats();
+
+    _s_copied = 0;
+    _s_counting = true;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0, lba = 64; i < l.commands; i++, lba += l.blocks)
+    {
+        if ((lba + l.blocks) > _s_disk_blocks)
+            lba = 64;
+
+        if (l.single)
+            hd.failOpens(1);
+
+        int n = l.write ? writeBlocks(h, lba, l.blocks, _s_buf, csw) : readBlocks(h, lba, l.blocks, _s_buf, csw);
+        if ((n != (l.blocks * 512)) || (csw.bCSWStatus != 0))
+        {
+            CHECK(false);
+            break;
+        }
+
+        moved += n;
+    }
+
+    if (l.write)
+        CHECK(synchronize(h));
+
+    double secs = std::chrono::duration < double > (std::chrono::steady_clock::now() - start).count();
+
+    _s_counting = false;
+
+    cmds = usb.commands() - cmds;
+    bytes = usb.bytes() - bytes;
+    fw_copied = usb.copied() - fw_copied;
+
+    double copies = (double)_s_copied / (double)moved;
+
+    printf("  %-18s  cmds/s %7.0f  MB/s %6.1f  copies/byte %5.2f  fw %5.2f\n", l.name,
+            cmds / secs, (bytes / secs) / (1024 * 1024), copies, (double)fw_copied / bytes);
+
+    CHECK(copies <= l.max_copies);
+
+    if (l.single)
+        CHECK_EQ(hd.stats().block_reads, l.blocks * l.commands);
+}
+
+// Only relative figures mean anything, the host's doing the SIE's work too.
+// The copies are what's gated: READ(10) goes straight out of the card's
+// buffer, WRITE(10) is copied from the packets into the card's ring and a
+// cached one into the cache first.  "fw" is the firmware's own count.  A READ
+// that can't open a descriptor falls back to reading a block at a time into
+// the data buffer and copying it to the packets, "single".
+static void bot_throughput(void)
+{
+    UsbHost & h = host();
+
+    static Load const loads[] =
+    {
+        { "read 4 KB",            false,   8, 512, 0.05, false },
+        { "read 64 KB",           false, 128,  64, 0.05, false },
+        { "read 128 KB",          false, 256,  32, 0.05, false },
+        { "read 4 KB single",     false,   8, 512, 1.05, true },
+        { "read 64 KB single",    false, 128,  64, 1.05, true },
+        { "read 128 KB single",   false, 256,  32, 1.05, true },
+        { "write 4 KB",           true,    8, 512, 2.05, false },
+        { "write 64 KB",          true,  128,  64, 1.05, false },
+    };
+
+    for (Load const & l : loads)
+        replay(h, l);
+
+    // Commands with little or no data, so mostly the BOT overhead
+    Usb & usb = Usb::acquire();
+    static uint8_t const tur[6] = { 0x00 };
+    uint32_t cmds = usb.commands();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < 2000; i++)
+        (void)status(h, tur, sizeof(tur));
+
+    double secs = std::chrono::duration < double > (std::chrono::steady_clock::now() - start).count();
+
+    printf("  %-18s  cmds/s %7.0f\n", "test unit ready", (usb.commands() - cmds) / secs);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+// Sequential READs as dd and a file copy make them, against a card taking
+// half a millisecond to its first block.  The same loads run in the build
+// with SCSI_NO_READ_AHEAD, nora/bot_test, to compare against.  opens/read is
+// descriptors opened per READ and card/host the blocks read off the card per
+// block the host asked for, what read-ahead throws away when the host stops
+// following on.  The files are fragmented into 512 KB extents 128 KB apart,
+// a copy on the card writes each 64 KB it reads somewhere else.
+struct Stream
+{
+    char const * name;
+    uint16_t blocks;    // Per READ
+    uint16_t extent;    // READs before skipping, 0 for none
+    bool copy;
+    uint32_t commands;
+};
+
+static void stream(UsbHost & h, Stream const & s, uint8_t const * disk)
+{
+    HostDisk & hd = HostDisk::acquire();
+    CSW csw;
+
+    uint32_t lba = 64, to = _s_disk_blocks / 2;
+    uint32_t reads = 0;
+    uint64_t moved = 0;
+
+    // Something else first so the first READ doesn't follow on from the last
+    (void)readBlocks(h, _s_disk_blocks - 1, 1, _s_buf, csw);
+
+    hd.resetStats();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < s.commands; i++)
+    {
+        if ((s.extent != 0) && (i != 0) && ((i % s.extent) == 0))
+            lba += 256;
+
+        uint32_t opens = hd.stats().opens;
+
+        int n = readBlocks(h, lba, s.blocks, _s_buf, csw);
+        if ((n != (s.blocks * 512)) || (csw.bCSWStatus != 0)
+                || (memcmp(_s_buf, disk + (lba * 512), n) != 0))
+        {
+            CHECK(false);
+            break;
+        }
+
+        reads += hd.stats().opens - opens;
+        moved += n;
+
+        if (s.copy)
+        {
+            CHECK_EQ(writeBlocks(h, to, s.blocks, _s_buf, csw), n);
+            to += s.blocks;
+        }
+
+        lba += s.blocks;
+    }
+
+    if (s.copy)
+        CHECK(synchronize(h));
+
+    double secs = std::chrono::duration < double > (std::chrono::steady_clock::now() - start).count();
+    HostDisk::Stats const & st = hd.stats();
+
+    printf("  %-18s  MB/s %6.1f  opens/read %4.2f  card/host %4.2f\n", s.name,
+            (moved / secs) / (1024 * 1024), (double)reads / s.commands,
+            (double)(st.blocks_read - st.block_reads) / (moved / 512));
+
+#ifndef SCSI_NO_READ_AHEAD
+    // Once going, a READ only opens where it can't follow on: the first of an
+    // extent, the one after that opening the window, and where a window ends
+    uint32_t extents = 1 + ((s.extent == 0) ? 0 : ((s.commands - 1) / s.extent));
+
+    if (!s.copy)
+        CHECK(reads <= ((extents * 2) + ((moved / 512) / 2048)));
+#else
+    CHECK_EQ(reads, s.commands);
+#endif
+}
+
+static void bot_read_ahead(void)
+{
+    UsbHost & h = host();
+    HostDisk & hd = HostDisk::acquire();
+
+    static Stream const streams[] =
+    {
+        { "dd 64 KB",      128, 0, false, 48 },
+        { "dd 128 KB",     256, 0, false, 24 },
+        { "copy off",      128, 8, false, 32 },
+        { "copy on",       128, 0, true,  24 },
+    };
+
+#ifndef SCSI_NO_READ_AHEAD
+    printf("  read-ahead on\n");
+#else
+    printf("  read-ahead off\n");
+#endif
+
+    static uint8_t disk[_s_disk_blocks * 512];
+    pattern(disk, 0, _s_disk_blocks, 0x24);
+    CHECK(hd.store(0, disk, _s_disk_blocks));
+
+    hd.latency(500);
+
+    // The copy on the card writes to the second half, which is why it's last
+    for (Stream const & s : streams)
+        stream(h, s, disk);
+
+    hd.latency(0);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+TEST_MAIN(
+    RUN(bot_inquiry);
+    RUN(bot_capacity);
+    RUN(bot_mode_sense);
+    RUN(bot_read_write);
+    RUN(bot_errors);
+    RUN(bot_throughput);
+    RUN(bot_read_ahead);
+)
@@ -0,0 +1,395 @@
+#include "audio.h"
+#include "test.h"
+
+// Simulation of the VS1053B feed against an SD card whose reads now and then
+// stall, e.g. while the card does its own housekeeping.  The ring and the
+// refill policy are the firmware's, the rest is modelled:
+//
+// - The decoder drains its 2 KB stream buffer at the stream's byte rate and
+//   raises DREQ whenever there's room for a 32 byte burst, which the DMA isr
+//   moves from the ring straight away, including while a read is under way.
+// - The main loop comes round every millisecond and, if the feed is
+//   accepting, asks for 512 bytes as the player does and reads what the
+//   policy says in at most two contiguous pieces.
+// - A read costs a fixed overhead plus the bytes at the bus rate, and the
+//   first read after every spike period takes spike msecs more.
+// - A host reading the card while it's shared is lent it at the top of a
+//   pass if the player can spare it, as UI::process does, and reads a block
+//   if the bulk-in queue has room for it.  The queue drains at what full
+//   speed bulk can move.
+//
+// The old feed was a 1 KB ring that read what it was asked whenever it had
+// room, which is FeedMarks < 1024, 0, 1024 > with no headroom check.  The
+// host was once lent the card for a whole pass, reading as many blocks as
+// the queue took in that time, HOST_PASS.
+
+// Exposes the total so the ring is open ended as the feed's is
+template < uint16_t BSIZE >
+class Ring : public ProducerConsumer < BSIZE >
+{
+    public:
+        Ring(void) { this->_total = (uint32_t)-1; }
+        uint16_t level(void) const { return this->produced() - this->consumed(); }
+};
+
+struct Card
+{
+    uint32_t spike_ms;
+    uint32_t period_ms;
+};
+
+// Whether and how a host reads the shared card
+enum host_e
+{
+    HOST_NONE,
+    HOST_BLOCK,  // A block each time it's lent
+    HOST_PASS,   // For as long as the pass it's lent in lasts
+};
+
+struct Result
+{
+    uint32_t underruns;   // Decoder ran out mid-stream
+    uint32_t dry;         // DREQ up and the ring empty, FeedStats::underruns
+    uint16_t low_water;   // Least in the ring
+    uint32_t reads;
+    uint32_t bytes;
+    uint32_t host_bytes;  // Read for the host
+};
+
+static constexpr uint32_t const _s_stream_buf = VS1053_STREAM_BUF_WORDS * 2;
+static constexpr uint32_t const _s_tick_us = 100;
+static constexpr uint32_t const _s_loop_us = 1000;
+static constexpr uint32_t const _s_read_us = 300;        // Command and access
+static constexpr uint32_t const _s_byte_ns = 400;        // ~20 Mbit/s
+static constexpr uint32_t const _s_fill_msecs = 50;      // As DevVS1053B
+static constexpr uint16_t const _s_send_len = 512;       // As the player
+static constexpr uint32_t const _s_spare_msecs = 5 + 50;  // Player::_s_usb_msecs and the guard
+static constexpr uint32_t const _s_usb_queue = (32 + 2) * 64;  // As usb.h, packets and BDs
+static constexpr uint32_t const _s_usb_rate = 19 * 64 * 1000;  // Bytes a second
+static constexpr uint16_t const _s_host_blocks = 128;  // Per READ
+
+template < class MARKS >
+class Sim
+{
+    public:
+        Sim(uint32_t byte_rate, uint32_t headroom_low, Card const & card, host_e host = HOST_NONE)
+            : _rate(byte_rate), _headroom_low(headroom_low), _card(card), _host(host)
+        {
+            _next_spike = _card.period_ms * 1000;
+            _res.low_water = MARKS::size;
+
+            // Start as if it's been playing a while
+            _fill = _s_stream_buf;
+            while (_ring.level() < MARKS::high) { uint8_t * p; _ring.publish(_ring.reserveContiguous(&p)); }
+        }
+
+        Result const & run(uint32_t secs)
+        {
+            while (_now < (secs * 1000000))
+            {
+                if (_host != HOST_NONE)
+                    lend();
+
+                uint16_t level = _ring.level();
+                bool short_of = headroom() < _headroom_low;
+
+                if (MARKS::accepting(level, short_of))
+                {
+                    uint16_t len = MARKS::want(level, _s_send_len, short_of);
+
+                    for (uint8_t i = 0; (i < 2) && (len != 0); i++)
+                    {
+                        uint8_t * p;
+                        uint16_t n = _ring.reserveContiguous(&p, len);
+                        if (n == 0)
+                            break;
+
+                        advance(read(n));
+                        _res.reads++;
+                        _res.bytes += n;
+                        _ring.publish(n);
+                        _dry = false;
+                        len -= n;
+                    }
+                }
+
+                advance(_s_loop_us);
+            }
+
+            return _res;
+        }
+
+    private:
+        uint32_t read(uint16_t n)
+        {
+            uint32_t us = _s_read_us + ((n * _s_byte_ns) / 1000);
+
+            if ((_card.period_ms != 0) && (_now >= _next_spike))
+            {
+                us += _card.spike_ms * 1000;
+                _next_spike += _card.period_ms * 1000;
+            }
+
+            return us;
+        }
+
+        // Decided once a pass as Scsi::lend() is.  A READ's next command
+        // only comes in the pass after the last one's done.
+        void lend(void)
+        {
+            if (_cmd_left == 0)
+            {
+                _cmd_left = _s_host_blocks;
+                return;
+            }
+
+            if (headroom() < _s_spare_msecs)
+                return;
+
+            while ((_cmd_left != 0) && ((_s_usb_queue - _usb_level) >= SD_BLOCK_LEN))
+            {
+                advance(read(SD_BLOCK_LEN));
+                _usb_level += SD_BLOCK_LEN;
+                _res.host_bytes += SD_BLOCK_LEN;
+                _cmd_left--;
+
+                if (_host == HOST_BLOCK)
+                    break;
+            }
+        }
+
+        // As DevVS1053B::headroom(), the decoder's fill sampled at most every
+        // _s_fill_msecs
+        uint32_t headroom(void)
+        {
+            if ((_now - _fill_mark) >= (_s_fill_msecs * 1000))
+            {
+                _fill_seen = _fill;
+                _fill_mark = _now;
+            }
+
+            return ((_fill_seen + _ring.level()) * 1000) / _rate;
+        }
+
+        void advance(uint32_t us)
+        {
+            for (uint32_t end = _now + us; _now < end; _now += _s_tick_us)
+            {
+                _owed += (uint64_t)_rate * _s_tick_us;
+                uint32_t want = _owed / 1000000;
+                _owed -= (uint64_t)want * 1000000;
+
+                if (want > _fill)
+                {
+                    if (!_starved) _res.underruns++;
+                    _starved = true;
+                    want = _fill;
+                }
+                else
+                {
+                    _starved = false;
+                }
+
+                _fill -= want;
+
+                // DREQ and the DMA chain
+                while ((_s_stream_buf - _fill) >= 32)
+                {
+                    uint8_t buf[32];
+                    uint16_t n = _ring.consume(buf, sizeof(buf), true);
+
+                    if (n == 0)
+                    {
+                        if (!_dry) _res.dry++;
+                        _dry = true;
+                        break;
+                    }
+
+                    _fill += n;
+                }
+
+                if (_ring.level() < _res.low_water)
+                    _res.low_water = _ring.level();
+
+                _usb_owed += (uint64_t)_s_usb_rate * _s_tick_us;
+                uint32_t sent = _usb_owed / 1000000;
+                _usb_owed -= (uint64_t)sent * 1000000;
+                _usb_level = (sent > _usb_level) ? 0 : (_usb_level - sent);
+            }
+        }
+
+        Ring < MARKS::size > _ring;
+        uint32_t const _rate;
+        uint32_t const _headroom_low;
+        Card const _card;
+        host_e const _host;
+
+        uint32_t _now = 0;
+        uint32_t _next_spike = 0;
+        uint32_t _fill = 0;
+        uint32_t _fill_seen = 0;
+        uint32_t _fill_mark = 0;
+        uint64_t _owed = 0;
+        bool _starved = false;
+        bool _dry = false;
+
+        uint32_t _usb_level = 0;
+        uint64_t _usb_owed = 0;
+        uint16_t _cmd_left = 0;
+
+        Result _res = {};
+};
+
+typedef FeedMarks < 4096, 1024, 3072 > NewMarks;  // As DevVS1053B
+typedef FeedMarks < 1024, 0, 1024 > OldMarks;
+static constexpr uint32_t const _s_headroom_low = 100;  // As DevVS1053B
+
+static constexpr uint32_t const _s_320k = 320000 / 8;
+static constexpr uint32_t const _s_128k = 128000 / 8;
+
+static void report(char const * what, Result const & r)
+{
+    printf("  %-28s underruns %4u  dry %4u  low water %4u  reads %6u  avg %4u\n",
+            what, r.underruns, r.dry, r.low_water, r.reads, (r.reads == 0) ? 0 : r.bytes / r.reads);
+}
+
+// Largest spike, to the nearest 10 ms, a feed rides out at a byte rate
+template < class MARKS >
+static uint32_t survives(uint32_t rate, uint32_t headroom_low)
+{
+    uint32_t ms = 0;
+
+    for (uint32_t spike = 10; spike <= 1000; spike += 10)
+    {
+        Sim < MARKS > sim(rate, headroom_low, Card{ spike, 2000 });
+        if (sim.run(10).underruns != 0)
+            break;
+
+        ms = spike;
+    }
+
+    return ms;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void feed_marks(void)
+{
+    // Full or over the high mark and fine for headroom, nothing
+    CHECK(!NewMarks::accepting(3072, false));
+    CHECK_EQ(NewMarks::want(3072, 512, false), 0);
+
+    // Short of headroom it takes the rest
+    CHECK(NewMarks::accepting(3072, true));
+    CHECK_EQ(NewMarks::want(3072, 512, true), 1024);
+    CHECK(!NewMarks::accepting(4096, true));
+
+    // Between the marks what's asked, under the low one all the free space
+    CHECK_EQ(NewMarks::want(2000, 512, false), 512);
+    CHECK_EQ(NewMarks::want(1023, 512, false), 4096 - 1023);
+
+    // The old policy never fills up and never holds off while there's room
+    CHECK_EQ(OldMarks::want(0, 512, false), 512);
+    CHECK(OldMarks::accepting(1023, false));
+}
+
+static void feed_steady(void)
+{
+    Card card = { 0, 0 };
+
+    Sim < NewMarks > sim(_s_320k, _s_headroom_low, card);
+    Result const & r = sim.run(30);
+    report("320 kbps, no spikes", r);
+
+    CHECK_EQ(r.underruns, 0);
+    CHECK_EQ(r.dry, 0);
+    CHECK(r.low_water >= NewMarks::low);
+}
+
+// 100 ms stalls once a second at 320 kbps are more than the old ring and
+// the decoder's buffer together hold, about 77 ms
+static void feed_spikes(void)
+{
+    Card card = { 100, 1000 };
+
+    Sim < OldMarks > old_sim(_s_320k, 0, card);
+    Result const & o = old_sim.run(30);
+    report("old, 320 kbps, 100 ms / 1 s", o);
+
+    Sim < NewMarks > new_sim(_s_320k, _s_headroom_low, card);
+    Result const & n = new_sim.run(30);
+    report("new, 320 kbps, 100 ms / 1 s", n);
+
+    CHECK(o.underruns != 0);
+    CHECK_EQ(n.underruns, 0);
+}
+
+// Back to back spikes, a stall on every read, are the worst case the
+// watermarks have to recover from
+static void feed_spike_storm(void)
+{
+    Card card = { 20, 1 };
+
+    Sim < NewMarks > sim(_s_128k, _s_headroom_low, card);
+    Result const & r = sim.run(30);
+    report("new, 128 kbps, 20 ms / read", r);
+
+    CHECK_EQ(r.underruns, 0);
+}
+
+static void feed_sweep(void)
+{
+    uint32_t old_320 = survives < OldMarks >(_s_320k, 0);
+    uint32_t new_320 = survives < NewMarks >(_s_320k, _s_headroom_low);
+    uint32_t old_128 = survives < OldMarks >(_s_128k, 0);
+    uint32_t new_128 = survives < NewMarks >(_s_128k, _s_headroom_low);
+
+    printf("  longest spike ridden out    320 kbps  old %3u ms  new %3u ms\n", old_320, new_320);
+    printf("                              128 kbps  old %3u ms  new %3u ms\n", old_128, new_128);
+
+    CHECK(new_320 > old_320);
+    CHECK(new_128 > old_128);
+    CHECK(new_320 >= 100);
+}
+
+// A host copying off the card while it plays.  Lent a pass at a time the
+// host can keep the card for a whole READ whenever the queue drains faster
+// than the card reads, which holds the feed off for tens of milliseconds.
+static void feed_shared(void)
+{
+    struct { char const * name; uint32_t rate; Card card; } const runs[] =
+    {
+        { "320 kbps",                _s_320k, { 0, 0 } },
+        { "320 kbps, 100 ms / 1 s",  _s_320k, { 100, 1000 } },
+        { "128 kbps, 100 ms / 1 s",  _s_128k, { 100, 1000 } },
+        { "128 kbps, 20 ms / 100 ms", _s_128k, { 20, 100 } },
+    };
+
+    static constexpr uint32_t const secs = 30;
+
+    printf("  %-26s %-6s  underruns  host KB/s\n", "shared", "lent");
+
+    for (auto const & r : runs)
+    {
+        Sim < NewMarks > block(r.rate, _s_headroom_low, r.card, HOST_BLOCK);
+        Result const & b = block.run(secs);
+
+        Sim < NewMarks > pass(r.rate, _s_headroom_low, r.card, HOST_PASS);
+        Result const & p = pass.run(secs);
+
+        printf("  %-26s block   %9u  %9u\n", r.name, b.underruns, b.host_bytes / 1024 / secs);
+        printf("  %-26s pass    %9u  %9u\n", "", p.underruns, p.host_bytes / 1024 / secs);
+
+        CHECK_EQ(b.underruns, 0);
+        CHECK(b.host_bytes != 0);
+    }
+}
+
+TEST_MAIN(
+    RUN(feed_marks);
+    RUN(feed_steady);
+    RUN(feed_spikes);
+    RUN(feed_spike_storm);
+    RUN(feed_sweep);
+    RUN(feed_shared);
+)
@@ -0,0 +1,537 @@
+#include "file.h"
+#include "test.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// The file list against a FAT32 volume laid out here on an image file, with a
+// host writing to it between sorts as it would over USB.  What the host writes
+// goes through put(), which keeps the extents Scsi would have, so a resort can
+// be checked against a sort from scratch of the same volume and against how
+// many files it had to sniff.
+
+// Writing a file stamps it with the RTC's time, which keeps its settings in
+// the flash the host hasn't got.  Nothing here writes files through Fat32.
+Eeprom::Eeprom(void) {}
+bool Eeprom::setAlarm(eAlarm const &) { return false; }
+bool Eeprom::getAlarm(eAlarm &) const { return false; }
+bool Eeprom::setClock(eClock const &) { return false; }
+bool Eeprom::getClock(eClock &) const { return false; }
+
+static constexpr uint32_t const _s_disk_blocks = 1 << 21;  // 1 GB, only what's written takes space
+static constexpr uint32_t const _s_volume = 2048;
+static constexpr uint32_t const _s_volume_sectors = 67584;
+static constexpr uint32_t const _s_reserved = 32;
+static constexpr uint32_t const _s_fat_sectors = 520;
+static constexpr uint32_t const _s_fat1 = _s_volume + _s_reserved;
+static constexpr uint32_t const _s_fat2 = _s_fat1 + _s_fat_sectors;
+static constexpr uint32_t const _s_data = _s_fat2 + _s_fat_sectors;
+static constexpr uint32_t const _s_root = 2;
+static constexpr uint16_t const _s_entries = SD_BLOCK_LEN / sizeof(FatDirEntry);
+
+static char const * const _s_exts[] = { "MP3", nullptr };
+
+static TExtents _s_written;
+static bool _s_hosting = false;
+
+static HostDisk & disk(void)
+{
+    static bool attached = HostDisk::acquire().attach(TEST_IMG("file_test.img"), _s_disk_blocks);
+
+    CHECK(attached);
+
+    return HostDisk::acquire();
+}
+
+static void put(uint32_t lba, uint8_t const * data)
+{
+    CHECK(disk().store(lba, data));
+
+    if (_s_hosting)
+        _s_written.add(lba, 1);
+}
+
+static uint32_t sector(uint32_t cluster) { return _s_data + (cluster - 2); }
+
+// <string> would drag in the C library's toupper() and tolower(), which
+// utility.h has its own of
+struct Name
+{
+    char s[16] = {};
+
+    Name(void) = default;
+    Name(char const * str) { snprintf(s, sizeof(s), "%s", str); }
+
+    bool operator ==(Name const & n) const { return strcmp(s, n.s) == 0; }
+    bool operator <(Name const & n) const { return strcmp(s, n.s) < 0; }
+    bool endsWith(char const * ext) const {
+        size_t l = strlen(s), e = strlen(ext); return (l >= e) && (strcmp(s + l - e, ext) == 0);
+    }
+};
+
+// The volume as the host sees it, one sector clusters so small files still
+// have chains to follow
+struct Entry
+{
+    Name name;  // 8.3, e.g. "SONG.MP3"
+    bool dir;
+    uint32_t cluster;
+    uint32_t size;
+    Name tag;   // What a file starts with, what the sniffer keeps
+};
+
+struct Dir
+{
+    uint32_t cluster;
+    std::vector < Entry > entries;
+};
+
+static std::vector < uint32_t > _s_fat;
+// A deque so what find() hands out stays put as directories are added
+static std::deque < Dir > _s_dirs;
+static uint32_t _s_next = _s_root + 1;
+
+static Dir * find(uint32_t cluster)
+{
+    for (auto & d : _s_dirs)
+    {
+        if (d.cluster == cluster)
+            return &d;
+    }
+
+    return nullptr;
+}
+
+static Dir & sub(Dir & parent, Name const & name)
+{
+    for (auto const & e : parent.entries)
+    {
+        if (e.dir && (e.name == name))
+            return *find(e.cluster);
+    }
+
+    CHECK(false);
+    return parent;
+}
+
+static Dir & root(void) { return *find(_s_root); }
+
+static void putFat(uint32_t cluster)
+{
+    uint32_t s = cluster / 128;
+    put(_s_fat1 + s, (uint8_t const *)&_s_fat[s * 128]);
+    put(_s_fat2 + s, (uint8_t const *)&_s_fat[s * 128]);
+}
+
+static uint32_t chain(uint32_t clusters)
+{
+    uint32_t first = _s_next;
+
+    for (uint32_t i = 0; i < clusters; i++, _s_next++)
+    {
+        _s_fat[_s_next] = ((i + 1) == clusters) ? 0x0FFFFFFF : (_s_next + 1);
+        putFat(_s_next);
+    }
+
+    return first;
+}
+
+static std::vector < uint32_t > clusters(uint32_t first)
+{
+    std::vector < uint32_t > c;
+
+    for (uint32_t cl = first; (cl >= 2) && (cl < 0x0FFFFFF7); cl = _s_fat[cl])
+        c.push_back(cl);
+
+    return c;
+}
+
+static void shortName(chr_t (&sn)[FatDirEntry::SHORT_NAME_LEN], char const * name)
+{
+    memset(sn, ' ', sizeof(sn));
+
+    char const * dot = (name[0] == '.') ? nullptr : strchr(name, '.');
+    size_t pre = (dot == nullptr) ? strlen(name) : (dot - name);
+
+    memcpy(sn, name, std::min < size_t > (pre, FatDirEntry::SN_PRE_LEN));
+    if (dot != nullptr)
+        memcpy(sn + FatDirEntry::SN_PRE_LEN, dot + 1, std::min < size_t > (strlen(dot + 1), FatDirEntry::SN_EXT_LEN));
+}
+
+// The whole directory, growing its chain if it has to
+static void putDir(Dir & d)
+{
+    uint32_t const needed = ((d.entries.size() + 2) / _s_entries) + 1;
+    std::vector < uint32_t > c = clusters(d.cluster);
+
+    while (c.size() < needed)
+    {
+        uint32_t more = chain(1);
+        _s_fat[c.back()] = more;
+        putFat(c.back());
+        c.push_back(more);
+    }
+
+    std::vector < FatDirEntry > entries(c.size() * _s_entries);
+    memset(entries.data(), 0, entries.size() * sizeof(FatDirEntry));
+
+    size_t i = 0;
+
+    if (d.cluster != _s_root)
+    {
+        for (char const * dots : { ".", ".." })
+        {
+            shortName(entries[i].name, dots);
+            entries[i].short_attrs = FatDirEntry::ATTR_DIRECTORY;
+            i++;
+        }
+    }
+
+    for (auto const & e : d.entries)
+    {
+        FatDirEntry & fe = entries[i++];
+
+        shortName(fe.name, e.name.s);
+        fe.short_attrs = e.dir ? FatDirEntry::ATTR_DIRECTORY : FatDirEntry::ATTR_ARCHIVE;
+        fe.cluster(e.cluster);
+        fe.file_size = e.dir ? 0 : e.size;
+    }
+
+    for (size_t j = 0; j < c.size(); j++)
+        put(sector(c[j]), (uint8_t const *)&entries[j * _s_entries]);
+}
+
+static void putData(Entry const & e)
+{
+    uint8_t block[SD_BLOCK_LEN];
+    std::vector < uint32_t > c = clusters(e.cluster);
+
+    for (size_t j = 0; j < c.size(); j++)
+    {
+        memset(block, (int)j, sizeof(block));
+        if (j == 0)
+            memcpy(block, e.tag.s, strlen(e.tag.s) + 1);
+
+        put(sector(c[j]), block);
+    }
+}
+
+static Entry & addFile(Dir & d, Name const & name, Name const & tag, uint32_t size = 700)
+{
+    d.entries.push_back({ name, false, chain((size + SD_BLOCK_LEN - 1) / SD_BLOCK_LEN), size, tag });
+    putData(d.entries.back());
+    putDir(d);
+
+    return d.entries.back();
+}
+
+static Dir & addDir(Dir & parent, Name const & name)
+{
+    uint32_t cluster = chain(1);
+
+    _s_dirs.push_back({ cluster, {} });
+    parent.entries.push_back({ name, true, cluster, 0, "" });
+
+    putDir(_s_dirs.back());
+    putDir(parent);
+
+    return _s_dirs.back();
+}
+
+// MBR, boot sector, FSInfo and an empty root
+static void format(void)
+{
+    uint8_t block[SD_BLOCK_LEN] = {};
+    sector_u & s = *(sector_u *)block;
+
+    PartInfo * p = (PartInfo *)&block[MBR_EXE_CODE_LEN];
+    p->partition_type = PT_FAT32_LBA13h;
+    p->sector_offset = _s_volume;
+    p->num_sectors = _s_volume_sectors;
+    s.a16[255] = BOOT_RECORD_SIGNATURE;
+    put(0, block);
+
+    memset(block, 0, sizeof(block));
+    FatInfo * f = (FatInfo *)block;
+    f->jump_code[0] = 0xEB; f->jump_code[1] = 0x58; f->jump_code[2] = 0x90;
+    f->bytes_per_sector = SD_BLOCK_LEN;
+    f->sectors_per_cluster = 1;
+    f->reserved_sectors = _s_reserved;
+    f->num_FATs = 2;
+    f->media = 0xF8;
+    f->num_sectors32 = _s_volume_sectors;
+    f->num_FAT_sectors32 = _s_fat_sectors;
+    f->root_cluster = _s_root;
+    f->fs_info_sector = 1;
+    f->backup_boot_sector = 6;
+    s.a16[255] = BOOT_RECORD_SIGNATURE;
+    put(_s_volume, block);
+
+    memset(block, 0, sizeof(block));
+    FsInfo * fi = (FsInfo *)block;
+    fi->lead_sig = FsInfo::LSIG;
+    fi->struct_sig = FsInfo::SSIG;
+    fi->trail_sig = FsInfo::TSIG;
+    fi->next_free = 3;
+    put(_s_volume + 1, block);
+
+    _s_fat.assign(_s_fat_sectors * 128, 0);
+    _s_fat[0] = 0x0FFFFFF8;
+    _s_fat[1] = 0x0FFFFFFF;
+    _s_fat[_s_root] = 0x0FFFFFFF;
+    putFat(0);
+
+    _s_dirs.push_back({ _s_root, {} });
+    putDir(_s_dirs.back());
+}
+
+// A few directories deep with one big enough to need merging
+static void populate(void)
+{
+    format();
+
+    addFile(root(), "ROOT1.MP3", "root1");
+    addFile(root(), "NOTES.TXT", "notes");
+
+    Dir & a = addDir(root(), "ALPHA");
+    for (int i = 0; i < 100; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "A%03d.MP3", (i * 37) % 100);
+        addFile(a, name, name);
+    }
+
+    Dir & b = addDir(root(), "BETA");
+    addFile(b, "B2.MP3", "b2");
+    addFile(b, "B1.MP3", "b1");
+
+    Dir & c = addDir(b, "GAMMA");
+    addFile(c, "C1.MP3", "c1", 3000);
+    addDir(c, "EMPTY");
+
+    addDir(root(), "DELTA");
+    addFile(root(), "ROOT0.MP3", "root0");
+}
+
+// Keeps the start of each file and counts how many it was asked for
+class Sniffer : public FileSniffer
+{
+    public:
+        virtual int sniff(File * fp, uint8_t * meta, uint16_t len)
+        {
+            count++;
+            return fp->read(meta, 16);
+        }
+
+        uint32_t count = 0;
+};
+
+static Sniffer _s_sniffer;
+
+struct Track
+{
+    Name name;
+    uint32_t address;
+    Name tag;
+
+    bool operator ==(Track const & t) const { return (name == t.name) && (address == t.address) && (tag == t.tag); }
+};
+
+static TFs & fs(void)
+{
+    (void)disk();
+    return TFs::acquire();
+}
+
+static std::vector < Track > tracks(int num)
+{
+    std::vector < Track > list;
+
+    for (int i = 0; i < num; i++)
+    {
+        uint8_t meta[FileSniffer::META_SIZE] = {};
+        File * fp = fs().open(i);
+
+        CHECK(fp != nullptr);
+        if (fp == nullptr)
+            break;
+
+        Track t;
+        snprintf(t.name.s, sizeof(t.name.s), "%.*s", (int)fp->name().len(), (char const *)fp->name().str());
+        t.address = fp->address();
+        fp->close();
+
+        CHECK_EQ(fs().meta(i, meta, sizeof(meta)), sizeof(meta));
+        t.tag = Name((char const *)meta);
+
+        list.push_back(t);
+    }
+
+    return list;
+}
+
+// What a sort from scratch would give, depth first with each directory's
+// entries in name order
+static void expected(uint32_t cluster, std::vector < Track > & list)
+{
+    std::vector < Entry > entries = find(cluster)->entries;
+
+    std::sort(entries.begin(), entries.end(),
+            [](Entry const & l, Entry const & r) { return l.name < r.name; });
+
+    for (auto const & e : entries)
+    {
+        if (e.dir)
+            expected(e.cluster, list);
+        else if (e.name.endsWith(".MP3"))
+            list.push_back({ e.name, e.cluster, e.tag });
+    }
+}
+
+static std::vector < Track > expected(void)
+{
+    std::vector < Track > list;
+    expected(_s_root, list);
+    return list;
+}
+
+// The host has a go and the list is resorted from what it wrote, which has to
+// come out the same as sorting from scratch
+template < class F >
+static uint32_t session(F host)
+{
+    _s_written.clear();
+    _s_hosting = true;
+    host();
+    _s_hosting = false;
+
+    _s_sniffer.count = 0;
+
+    int num = fs().resort(_s_written, _s_exts, &_s_sniffer);
+    std::vector < Track > want = expected();
+
+    CHECK_EQ(num, want.size());
+    CHECK(tracks(num) == want);
+
+    return _s_sniffer.count;
+}
+
+static void file_sort(void)
+{
+    populate();
+
+    CHECK(fs().valid());
+
+    // A 1 GB card has 512 blocks for the sort spaces and 64 for meta, what a
+    // card formatted before resort came along has its volume up to.  The
+    // volume here is well short of that so the second list, final, meta and
+    // two record spaces, 224 blocks, goes below them.
+    CHECK_EQ(disk().blocks(), _s_disk_blocks - 576 - 224);
+
+    int num = fs().sort(_s_exts, &_s_sniffer);
+    std::vector < Track > want = expected();
+
+    CHECK_EQ(num, 105);
+    CHECK_EQ(num, want.size());
+    CHECK_EQ(_s_sniffer.count, num);
+    CHECK(tracks(num) == want);
+}
+
+// Reading isn't writing, nothing's sniffed again
+static void file_resort_nothing(void)
+{
+    CHECK_EQ(session([](void) {}), 0);
+}
+
+// A tag rewritten in place, the directory left alone, gets just that file
+// sniffed again
+static void file_resort_data(void)
+{
+    uint32_t n = session([](void)
+    {
+        Entry & e = sub(root(), "ALPHA").entries[5];
+        e.tag = "retagged";
+        putData(e);
+    });
+
+    CHECK_EQ(n, 1);
+}
+
+// A file added to a directory two down has only that directory scanned, the
+// one above it and everything else carried over
+static void file_resort_add(void)
+{
+    uint32_t n = session([](void)
+    {
+        addFile(sub(root(), "BETA"), "B0.MP3", "b0");
+    });
+
+    CHECK_EQ(n, 3);
+
+    n = session([](void)
+    {
+        addFile(sub(sub(root(), "BETA"), "GAMMA"), "C0.MP3", "c0", 5000);
+        addFile(sub(root(), "DELTA"), "D1.MP3", "d1");
+    });
+
+    CHECK_EQ(n, 3);
+}
+
+// Renamed and deleted in the root, so the root's own files are sniffed again
+// but not the directories under it
+static void file_resort_root(void)
+{
+    uint32_t n = session([](void)
+    {
+        root().entries[0].name = "ZZZ.MP3";
+        root().entries.erase(root().entries.begin() + 1);
+        putDir(root());
+    });
+
+    CHECK_EQ(n, 2);
+}
+
+// More writes than extents kept, joined into ones covering more than was
+// written, still come out right
+static void file_resort_scattered(void)
+{
+    session([](void)
+    {
+        Dir & a = sub(root(), "ALPHA");
+
+        for (size_t i = 0; i < a.entries.size(); i += 5)
+        {
+            snprintf(a.entries[i].tag.s, sizeof(a.entries[i].tag.s), "again%u", (unsigned)(i % 100));
+            putData(a.entries[i]);
+        }
+
+        addFile(sub(root(), "DELTA"), "D2.MP3", "d2");
+    });
+
+    CHECK(_s_written.count() == SD_NUM_WRITTEN_EXTENTS);
+}
+
+// A rewritten boot sector could mean anything so everything's sniffed again
+static void file_resort_boot(void)
+{
+    uint32_t n = session([](void)
+    {
+        uint8_t block[SD_BLOCK_LEN];
+        CHECK(disk().load(_s_volume, block));
+        put(_s_volume, block);
+    });
+
+    CHECK_EQ(n, expected().size());
+}
+
+TEST_MAIN(
+    RUN(file_sort);
+    RUN(file_resort_nothing);
+    RUN(file_resort_data);
+    RUN(file_resort_add);
+    RUN(file_resort_root);
+    RUN(file_resort_scattered);
+    RUN(file_resort_boot);
+)
@@ -0,0 +1,79 @@
+#include "armv7m.h"
+#include "test.h"
+
+#include <cstdlib>
+#include <sys/mman.h>
+
+// The firmware's clock is SysTick's interval count, bumped by its isr.  Here
+// it only moves when a test moves it.
+v32 SysTick::_s_intervals = 0;
+
+void systick_isr(void)
+{
+    SysTick::_s_intervals++;
+}
+
+void host_msecs(uint32_t ms)
+{
+    while (ms-- != 0)
+        systick_isr();
+}
+
+// Peripheral registers are plain memory.  The firmware has their addresses
+// built in so the peripheral bridge's range is mapped where it would be before
+// anything gets constructed, and the NVIC's, inside the core's space, is an
+// array instead.
+static void __attribute__ ((constructor(101))) host_peripherals(void)
+{
+    void * const base = (void *)0x40000000;
+
+    if (mmap(base, 0x100000, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != base)
+    {
+        perror("mapping peripherals");
+        abort();
+    }
+}
+
+static uint32_t _s_nvic[256];
+
+reg32 NVIC::_s_base = _s_nvic;
+reg32 NVIC::_s_iser = _s_base;
+reg32 NVIC::_s_icer = _s_base +  32;
+reg32 NVIC::_s_ispr = _s_base +  64;
+reg32 NVIC::_s_icpr = _s_base +  96;
+reg32 NVIC::_s_iabr = _s_base + 128;
+reg8  NVIC::_s_ipr = (reg8)(_s_base + 192);
+
+// The same for the SCB and SysTick, which the firmware's clock reads
+static uint32_t _s_scb[16];
+
+reg32 SCB::_s_base = _s_scb;
+const reg32 SCB::_s_cpuid = (const reg32)_s_base;
+reg32 SCB::_s_icsr  = _s_base +  1;
+reg32 SCB::_s_vtor  = _s_base +  2;
+reg32 SCB::_s_aircr = _s_base +  3;
+reg32 SCB::_s_scr   = _s_base +  4;
+reg32 SCB::_s_ccr   = _s_base +  5;
+reg32 SCB::_s_shpr1 = _s_base +  6;
+reg32 SCB::_s_shpr2 = _s_base +  7;
+reg32 SCB::_s_shpr3 = _s_base +  8;
+reg8 SCB::_s_shpr_base = (reg8)_s_shpr1;
+reg32 SCB::_s_shcsr = _s_base +  9;
+reg32 SCB::_s_cfsr  = _s_base + 10;
+reg32 SCB::_s_hfsr  = _s_base + 11;
+reg32 SCB::_s_dfsr  = _s_base + 12;
+reg32 SCB::_s_mmfar = _s_base + 13;
+reg32 SCB::_s_bfar  = _s_base + 14;
+reg32 SCB::_s_afsr  = _s_base + 15;
+
+static uint32_t _s_systick[4];
+
+reg32 SysTick::_s_base = _s_systick;
+reg32 SysTick::_s_csr   = _s_base;
+reg32 SysTick::_s_rvr   = _s_base + 1;
+reg32 SysTick::_s_cvr   = _s_base + 2;
+reg32 SysTick::_s_calib = _s_base + 3;
+
+uint8_t SysTick::_s_pri = _s_def_pri;
+uint32_t SysTick::_s_rv = _s_def_rv;
@@ -0,0 +1,394 @@
+#ifndef _HOST_DISK_H_
+#define _HOST_DISK_H_
+
+// TDisk for host builds, included by disk.h when HOST_DISK names it.  An image
+// file stands in for the card behind DevSD's interface and semantics.  What
+// the card's DMA would move between a descriptor's ring and the card is moved
+// with pread() and pwrite() whenever the descriptor is used, at most pace()
+// bytes at a time so callers see the ring come up short as they would on the
+// device.  Writes reach the image a whole block at a time.
+//
+// Tests can also make opens slow or fail and cut the power after some number
+// of blocks, after which nothing more gets to the image.
+
+// Not fcntl.h, whose O_ flags are file.h's enumerators
+#include <cstdio>
+#include <unistd.h>
+
+class HostDisk
+{
+    public:
+        static HostDisk & acquire(void) { static HostDisk hd; return hd; }
+
+        // A zeroed image of num_blocks, replacing whatever's at path
+        bool attach(char const * path, uint32_t num_blocks, uint32_t au_blocks = 0);
+        void detach(void);
+
+        bool valid(void) const { return _fd != -1; }
+        bool busy(void) { return _desc.open; }
+
+        int read(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN]);
+        int write(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN]);
+
+        dd_desc_t open(uint32_t addr, uint16_t num_blocks, dd_dir_e dir);
+        int read(dd_desc_t dd, uint8_t * buf, uint16_t blen);
+        int write(dd_desc_t dd, uint8_t * data, uint16_t dlen);
+        int close(dd_desc_t dd);
+
+        int span(dd_desc_t dd, uint8_t ** p, uint16_t len, uint16_t skip = 0);
+        int commit(dd_desc_t dd, uint16_t len);
+
+        // Blocks at the end kept from the host for the file list, as DevSD
+        uint32_t reserve(uint32_t bytes) {
+            _reserved += (bytes + SD_BLOCK_LEN - 1) / SD_BLOCK_LEN; return _blocks - _reserved;
+        }
+
+        uint32_t capacity(void) { return (_blocks - _reserved) / 2; }  // In kilobytes
+        uint32_t blocks(void) { return _blocks - _reserved; }
+        uint32_t auBlocks(void) const { return _au_blocks; }
+        dd_err_e error(void) const { return _errno; }
+
+        // Most bytes the "DMA" moves each time a descriptor is used, 0 for as
+        // much as there's room for
+        void pace(uint16_t bytes) { _pace = bytes; }
+
+        // The next n opens fail as if the card wouldn't take the command
+        void failOpens(uint32_t n) { _fail_opens = n; }
+
+        // How long each open takes, as the card's access time to its first
+        // block after the command
+        void latency(uint32_t usecs) { _latency = usecs; }
+
+        // Power goes after num_blocks more blocks reach the image, every
+        // write after that fails and is lost.  restore() puts it back.
+        void cut(uint32_t num_blocks) { _cut = num_blocks; }
+        void restore(void) { _cut = (uint32_t)-1; }
+        bool powered(void) const { return _cut != 0; }
+
+        // Straight to and from the image, for setting up and checking
+        bool load(uint32_t addr, uint8_t * buf, uint32_t num_blocks = 1);
+        bool store(uint32_t addr, uint8_t const * data, uint32_t num_blocks = 1);
+
+        struct Stats
+        {
+            uint32_t opens;
+            uint32_t block_reads;     // Single block reads and writes
+            uint32_t block_writes;
+            uint32_t blocks_read;     // Every block that left or reached the image
+            uint32_t blocks_written;
+        };
+
+        Stats const & stats(void) const { return _stats; }
+        void resetStats(void) { _stats = Stats(); }
+
+        HostDisk(HostDisk const &) = delete;
+        HostDisk & operator=(HostDisk const &) = delete;
+
+    private:
+        HostDisk(void) = default;
+
+        static constexpr uint16_t const _s_bsize = 2048;  // As DevSD
+
+        class Desc : public ProducerConsumer < _s_bsize >
+        {
+            public:
+                void start(uint32_t addr, uint16_t num_blocks, dd_dir_e dir)
+                {
+                    _addr = addr; _dir = dir; open = true;
+                    _produced = _consumed = 0;
+                    _total = (uint32_t)num_blocks * SD_BLOCK_LEN;
+                }
+
+                uint32_t _addr;
+                dd_dir_e _dir;
+                bool open = false;
+        };
+
+        int error(dd_err_e err) { _errno = err; return -1; }
+        bool owns(dd_desc_t dd) const { return _desc.open && (dd == &_desc); }
+        bool put(uint32_t addr, uint8_t const * data);
+        void fill(void);
+        bool drain(bool all = false);
+
+        int _fd = -1;
+        uint32_t _blocks = 0;
+        uint32_t _reserved = 0;
+        uint32_t _au_blocks = 0;
+        dd_err_e _errno = DD_ERR_BUSY;
+
+        uint16_t _pace = 0;
+        uint32_t _fail_opens = 0;
+        uint32_t _latency = 0;
+        uint32_t _cut = (uint32_t)-1;
+
+        Desc _desc;
+        Stats _stats = Stats();
+};
+
+inline bool HostDisk::attach(char const * path, uint32_t num_blocks, uint32_t au_blocks)
+{
+    detach();
+
+    FILE * f = fopen(path, "w+b");
+    if (f == nullptr)
+        return false;
+
+    _fd = dup(fileno(f));
+    fclose(f);
+
+    if (_fd == -1)
+        return false;
+
+    if (ftruncate(_fd, (off_t)num_blocks * SD_BLOCK_LEN) != 0)
+    {
+        detach();
+        return false;
+    }
+
+    _blocks = num_blocks;
+    _reserved = 0;
+    _au_blocks = au_blocks;
+    _pace = 0;
+    _fail_opens = 0;
+    _latency = 0;
+    _cut = (uint32_t)-1;
+    _desc.open = false;
+    resetStats();
+
+    return true;
+}
+
+inline void HostDisk::detach(void)
+{
+    if (_fd != -1)
+        ::close(_fd);
+
+    _fd = -1;
+    _blocks = 0;
+}
+
+inline bool HostDisk::load(uint32_t addr, uint8_t * buf, uint32_t num_blocks)
+{
+    ssize_t len = (ssize_t)num_blocks * SD_BLOCK_LEN;
+    return pread(_fd, buf, len, (off_t)addr * SD_BLOCK_LEN) == len;
+}
+
+inline bool HostDisk::store(uint32_t addr, uint8_t const * data, uint32_t num_blocks)
+{
+    ssize_t len = (ssize_t)num_blocks * SD_BLOCK_LEN;
+    return pwrite(_fd, data, len, (off_t)addr * SD_BLOCK_LEN) == len;
+}
+
+// A block to the image unless the power's gone
+inline bool HostDisk::put(uint32_t addr, uint8_t const * data)
+{
+    if (_cut == 0)
+        return false;
+
+    if (!store(addr, data))
+        return false;
+
+    if (_cut != (uint32_t)-1)
+        _cut--;
+
+    _stats.blocks_written++;
+
+    return true;
+}
+
+inline int HostDisk::read(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN])
+{
+    if (addr >= _blocks)
+        return error(DD_ERR_INVAL);
+    else if (busy())
+        return error(DD_ERR_BUSY);
+
+    if (!load(addr, buf))
+        return error(DD_ERR_IO);
+
+    _stats.block_reads++;
+    _stats.blocks_read++;
+
+    return SD_BLOCK_LEN;
+}
+
+inline int HostDisk::write(uint32_t addr, uint8_t (&buf)[SD_BLOCK_LEN])
+{
+    if (addr >= _blocks)
+        return error(DD_ERR_INVAL);
+    else if (busy())
+        return error(DD_ERR_BUSY);
+
+    if (!put(addr, buf))
+        return error(DD_ERR_IO);
+
+    _stats.block_writes++;
+
+    return SD_BLOCK_LEN;
+}
+
+inline dd_desc_t HostDisk::open(uint32_t addr, uint16_t num_blocks, dd_dir_e dir)
+{
+    if (busy())
+        return (error(DD_ERR_BUSY), nullptr);
+
+    if ((num_blocks == 0) || ((addr + num_blocks) > _blocks) || ((addr + num_blocks) < addr))
+        return (error(DD_ERR_INVAL), nullptr);
+
+    if ((_fail_opens != 0) || ((dir == DD_WRITE) && !powered()))
+    {
+        if (_fail_opens != 0)
+            _fail_opens--;
+
+        return (error(DD_ERR_IO), nullptr);
+    }
+
+    if (_latency != 0)
+        usleep(_latency);
+
+    _desc.start(addr, num_blocks, dir);
+    _stats.opens++;
+
+    if (dir == DD_READ)
+        fill();
+
+    return &_desc;
+}
+
+// The card to the ring, as much as pace() lets through
+inline void HostDisk::fill(void)
+{
+    uint16_t left = (_pace == 0) ? _s_bsize : _pace;
+
+    while (left != 0)
+    {
+        uint8_t * p;
+        uint32_t at = _desc.produced();
+        uint16_t n = _desc.reserveContiguous(&p, left);
+
+        if (n == 0)
+            break;
+
+        if (pread(_fd, p, n, ((off_t)_desc._addr * SD_BLOCK_LEN) + at) != n)
+            break;
+
+        _desc.publish(n);
+        left -= n;
+
+        if ((at / SD_BLOCK_LEN) != ((at + n) / SD_BLOCK_LEN))
+            _stats.blocks_read += ((at + n) / SD_BLOCK_LEN) - (at / SD_BLOCK_LEN);
+    }
+}
+
+// The ring to the card a whole block at a time.  Blocks are contiguous in the
+// ring since it's a multiple of the block size.
+inline bool HostDisk::drain(bool all)
+{
+    uint16_t blocks = ((_pace == 0) || all) ? (_s_bsize / SD_BLOCK_LEN) : ((_pace + SD_BLOCK_LEN - 1) / SD_BLOCK_LEN);
+
+    while ((blocks != 0) && _desc.canConsume(SD_BLOCK_LEN))
+    {
+        uint8_t const * p;
+        uint32_t addr = _desc._addr + (_desc.consumed() / SD_BLOCK_LEN);
+
+        (void)_desc.peekContiguous(&p, SD_BLOCK_LEN);
+
+        if (!put(addr, p))
+            return false;
+
+        _desc.commit(SD_BLOCK_LEN);
+
+        if (!all)
+            blocks--;
+    }
+
+    return true;
+}
+
+inline int HostDisk::read(dd_desc_t dd, uint8_t * buf, uint16_t blen)
+{
+    if (!owns(dd) || (_desc._dir != DD_READ))
+        return error(DD_ERR_BADF);
+
+    uint16_t n = _desc.consumeDone() ? 0 : _desc.consume(buf, blen, true);
+
+    fill();
+
+    return n;
+}
+
+inline int HostDisk::write(dd_desc_t dd, uint8_t * data, uint16_t dlen)
+{
+    if (!owns(dd) || (_desc._dir != DD_WRITE))
+        return error(DD_ERR_BADF);
+
+    if (!drain())
+        return error(DD_ERR_BADFD);
+
+    return _desc.produceDone() ? 0 : _desc.produce(data, dlen, true);
+}
+
+inline int HostDisk::span(dd_desc_t dd, uint8_t ** p, uint16_t len, uint16_t skip)
+{
+    if (!owns(dd) || (p == nullptr))
+        return error(DD_ERR_BADF);
+
+    if (_desc._dir == DD_READ)
+    {
+        fill();
+        return _desc.peekContiguous((uint8_t const **)p, len, skip);
+    }
+
+    if (skip != 0)
+        return error(DD_ERR_INVAL);
+
+    if (!drain())
+        return error(DD_ERR_BADFD);
+
+    return _desc.reserveContiguous(p, len);
+}
+
+inline int HostDisk::commit(dd_desc_t dd, uint16_t len)
+{
+    if (!owns(dd))
+        return error(DD_ERR_BADF);
+
+    if (len == 0)
+        return 0;
+
+    if (_desc._dir == DD_READ)
+    {
+        if (_desc.consumeLen(len) != len)
+            return error(DD_ERR_INVAL);
+
+        _desc.commit(len);
+        fill();
+    }
+    else
+    {
+        if (_desc.produceLen(len) != len)
+            return error(DD_ERR_INVAL);
+
+        _desc.publish(len);
+    }
+
+    return len;
+}
+
+// Whatever whole blocks a write has in its ring go out before it's stopped
+inline int HostDisk::close(dd_desc_t dd)
+{
+    if (!owns(dd))
+        return error(DD_ERR_BADF);
+
+    _desc.open = false;
+
+    if ((_desc._dir == DD_WRITE) && !drain(true))
+        return error(DD_ERR_IO);
+
+    return 0;
+}
+
+using TDisk = HostDisk;
+
+#endif
@@ -0,0 +1,504 @@
+#include "scsi.h"
+#include "test.h"
+
+#include <cstring>
+
+// The write-back cache against the write patterns of the hosts it'll see, with
+// the power cut after every number of blocks a full run gets onto the card.
+//
+// Traces are a few files copied onto a FAT32 volume, one as Windows does it
+// and one as Linux does it.  Every block written holds its LBA and the version
+// that wrote it, the index of the command in the trace, so what's on the image
+// after a cut can be checked against what the host was told:
+//
+//   - every block holds the initial version or one a WRITE to it carried
+//   - nothing's older than the last FUA WRITE to it that completed, or than
+//     the last WRITE completed before a SYNCHRONIZE CACHE or STOP that did
+//
+// The same runs are repeated with every open failing so the cache's fallback
+// to single block writes gets the same treatment.
+
+static constexpr uint32_t const _s_disk_blocks = 16384;
+static constexpr uint16_t const _s_block_size = 512;
+static constexpr uint16_t const _s_max_blocks = 240;
+
+// Packets as the Bulk-Only pipes move them
+static constexpr uint16_t const _s_packet = 64;
+
+enum op_e : uint8_t { WRITE, WRITE_FUA, READ, SYNC, IDLE, STOP };
+
+struct Op
+{
+    op_e op;
+    uint32_t lba;
+    uint16_t blocks;
+};
+
+struct Trace
+{
+    Op ops[256];
+    uint16_t len = 0;
+
+    void add(op_e op, uint32_t lba = 0, uint16_t blocks = 0)
+    {
+        CHECK(len < (sizeof(ops) / sizeof(ops[0])));
+        if (len < (sizeof(ops) / sizeof(ops[0])))
+            ops[len++] = { op, lba, blocks };
+    }
+
+    uint32_t end(void) const
+    {
+        uint32_t e = 0;
+        for (uint16_t i = 0; i < len; i++)
+        {
+            if ((ops[i].blocks != 0) && ((ops[i].lba + ops[i].blocks) > e))
+                e = ops[i].lba + ops[i].blocks;
+        }
+
+        return e;
+    }
+};
+
+// A small FAT32 volume: FSINFO in block 1, two FATs and 8 block clusters from
+// the root directory on
+static constexpr uint32_t const _s_fsinfo = 1;
+static constexpr uint32_t const _s_fat1 = 32;
+static constexpr uint32_t const _s_fat_blocks = 64;
+static constexpr uint32_t const _s_fat2 = _s_fat1 + _s_fat_blocks;
+static constexpr uint32_t const _s_root = _s_fat2 + _s_fat_blocks;
+static constexpr uint16_t const _s_cluster = 8;
+
+// File sizes in clusters
+static constexpr uint16_t const _s_files[] = { 3, 20, 1, 6, 2 };
+
+// Data written 64 KiB at a time, FAT, directory and FSINFO updates a block at
+// a time after reading them in, write-through while the drive's set for quick
+// removal, then buffered with the lazy writer's gaps between them.
+static Trace const & windowsTrace(void)
+{
+    static Trace t;
+    if (t.len != 0)
+        return t;
+
+    uint32_t cluster = 1;  // Root directory's
+
+    for (uint16_t f = 0; f < (sizeof(_s_files) / sizeof(_s_files[0])); f++)
+    {
+        op_e const meta = (f < 2) ? WRITE_FUA : WRITE;
+        uint32_t const fat = cluster / 128;
+        uint32_t const dir = _s_root + (f / 16);
+
+        t.add(READ, _s_fat1 + fat, 1);
+        t.add(READ, dir, 1);
+        t.add(meta, dir, 1);
+
+        uint32_t lba = _s_root + (cluster * _s_cluster);
+        uint32_t left = _s_files[f] * _s_cluster;
+
+        while (left != 0)
+        {
+            uint16_t n = (left > 128) ? 128 : left;
+            t.add(WRITE, lba, n);
+            lba += n; left -= n;
+        }
+
+        cluster += _s_files[f];
+
+        t.add(meta, _s_fat1 + fat, 1);
+        t.add(meta, _s_fat2 + fat, 1);
+        t.add(meta, dir, 1);
+        t.add(meta, _s_fsinfo, 1);
+
+        if (f >= 2)
+            t.add(IDLE);
+    }
+
+    t.add(SYNC);
+
+    return t;
+}
+
+// Page cache writeback: 4 KiB pages, contiguous dirty pages merged up to the
+// request size and each pass in LBA order, metadata pages included.  An
+// fsync() half way and a SYNCHRONIZE CACHE and STOP at unmount.
+static Trace const & linuxTrace(void)
+{
+    static Trace t;
+    if (t.len != 0)
+        return t;
+
+    uint32_t cluster = 1;
+
+    for (uint16_t f = 0; f < (sizeof(_s_files) / sizeof(_s_files[0])); f++)
+    {
+        uint32_t const page = 8;
+        uint32_t const fat = (cluster / 128) & ~(page - 1);
+
+        t.add(WRITE, 0, page);  // FSINFO's page
+        t.add(WRITE, _s_fat1 + fat, page);
+        t.add(WRITE, _s_fat2 + fat, page);
+        t.add(WRITE, _s_root, page);
+
+        uint32_t lba = _s_root + (cluster * _s_cluster);
+        uint32_t left = _s_files[f] * _s_cluster;
+
+        while (left != 0)
+        {
+            uint16_t n = (left > _s_max_blocks) ? _s_max_blocks : left;
+            t.add(WRITE, lba, n);
+            lba += n; left -= n;
+        }
+
+        cluster += _s_files[f];
+
+        // Directory entry's size written back with the next pass
+        t.add(READ, _s_root, page);
+        t.add(WRITE, _s_root, page);
+
+        if (f == 2)
+            t.add(SYNC);
+    }
+
+    t.add(SYNC);
+    t.add(STOP);
+
+    return t;
+}
+
+static void put32(uint8_t * p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint32_t get32(uint8_t const * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+static uint32_t be32(uint8_t const * p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static void stamp(uint8_t * block, uint32_t lba, uint32_t version)
+{
+    for (uint16_t i = 0; i < _s_block_size; i += 8)
+    {
+        put32(block + i, lba);
+        put32(block + i + 4, version);
+    }
+}
+
+// The version in a block or -1 if it isn't one stamped for lba
+static int64_t version(uint8_t const * block, uint32_t lba)
+{
+    uint32_t v = get32(block + 4);
+
+    for (uint16_t i = 0; i < _s_block_size; i += 8)
+    {
+        if ((get32(block + i) != lba) || (get32(block + i + 4) != v))
+            return -1;
+    }
+
+    return v;
+}
+
+static HostDisk & disk(void)
+{
+    static bool attached = HostDisk::acquire().attach(TEST_IMG("scsi_test.img"), _s_disk_blocks);
+
+    CHECK(attached);
+
+    return HostDisk::acquire();
+}
+
+static Scsi & scsi(void)
+{
+    (void)disk();
+
+    static Scsi s;
+
+    return s;
+}
+
+static uint8_t _s_data[_s_max_blocks * _s_block_size];
+
+// A command and its Data stage a packet at a time as BulkOnlyIface runs them.
+// True if it would have ended with a GOOD status.
+static bool command(uint8_t * cdb, uint8_t clen, uint8_t * data, uint32_t len, bool in)
+{
+    Scsi & s = scsi();
+
+    if (s.request(cdb, clen) < 0)
+        return false;
+
+    uint32_t done = 0;
+    uint32_t stuck = 0;
+
+    while (!s.done())
+    {
+        uint16_t n = ((len - done) > _s_packet) ? _s_packet : (uint16_t)(len - done);
+
+        int ret = in ? s.read(data + done, n) : s.write(data + done, n);
+        if (ret < 0)
+            return false;
+
+        if ((ret == 0) && (++stuck == 1000))
+            return false;
+
+        done += ret;
+    }
+
+    return true;
+}
+
+static bool rw(op_e op, uint32_t lba, uint16_t blocks)
+{
+    uint8_t cdb[10] = { (op == READ) ? (uint8_t)0x28 : (uint8_t)0x2A };
+
+    if (op == WRITE_FUA)
+        cdb[1] = 1 << 3;
+
+    cdb[2] = lba >> 24; cdb[3] = lba >> 16; cdb[4] = lba >> 8; cdb[5] = lba;
+    cdb[7] = blocks >> 8; cdb[8] = blocks;
+
+    return command(cdb, sizeof(cdb), _s_data, (uint32_t)blocks * _s_block_size, op == READ);
+}
+
+static bool synchronize(void)
+{
+    uint8_t cdb[10] = { 0x35 };
+    return command(cdb, sizeof(cdb), nullptr, 0, false);
+}
+
+static bool stop(void)
+{
+    uint8_t cdb[6] = { 0x1B };
+    return command(cdb, sizeof(cdb), nullptr, 0, false);
+}
+
+static uint32_t _s_acked[_s_disk_blocks];     // Last WRITE completed
+static uint32_t _s_promised[_s_disk_blocks];  // Last one made durable
+
+// Image stamped with version 0 and whatever the last run left behind in the
+// cache got rid of first
+static void prepare(uint32_t end, uint32_t fail_opens)
+{
+    HostDisk & hd = disk();
+    Scsi & s = scsi();
+
+    hd.restore();
+    hd.failOpens(0);
+    s.reset();
+
+    for (uint32_t lba = 0; lba < end; lba++)
+    {
+        stamp(_s_data, lba, 0);
+        CHECK(hd.store(lba, _s_data));
+    }
+
+    memset(_s_acked, 0, sizeof(_s_acked));
+    memset(_s_promised, 0, sizeof(_s_promised));
+
+    hd.failOpens(fail_opens);
+    hd.resetStats();
+}
+
+// Runs the trace keeping track of what the host was promised.  READs are
+// checked for the last version written only while nothing's failed.
+static void replay(Trace const & t)
+{
+    bool failed = false;
+
+    for (uint16_t i = 0; i < t.len; i++)
+    {
+        Op const & op = t.ops[i];
+        uint32_t const v = i + 1;
+        bool ok = false;
+
+        switch (op.op)
+        {
+            case WRITE:
+            case WRITE_FUA:
+                for (uint16_t b = 0; b < op.blocks; b++)
+                    stamp(_s_data + (b * _s_block_size), op.lba + b, v);
+
+                if ((ok = rw(op.op, op.lba, op.blocks)))
+                {
+                    for (uint16_t b = 0; b < op.blocks; b++)
+                    {
+                        _s_acked[op.lba + b] = v;
+                        if (op.op == WRITE_FUA)
+                            _s_promised[op.lba + b] = v;
+                    }
+                }
+                break;
+
+            case READ:
+                if ((ok = rw(READ, op.lba, op.blocks)) && !failed)
+                {
+                    for (uint16_t b = 0; b < op.blocks; b++)
+                        CHECK_EQ(version(_s_data + (b * _s_block_size), op.lba + b), _s_acked[op.lba + b]);
+                }
+                break;
+
+            case SYNC:
+            case STOP:
+                if ((ok = ((op.op == SYNC) ? synchronize() : stop())))
+                    memcpy(_s_promised, _s_acked, sizeof(_s_promised));
+                break;
+
+            case IDLE:
+                host_msecs(200);
+                scsi().idle();
+                ok = true;
+                break;
+        }
+
+        failed |= !ok;
+    }
+}
+
+// What's on the image against what was written and promised.  False if not
+// everything was as it should be.
+static bool verify(Trace const & t, uint32_t end)
+{
+    uint8_t block[_s_block_size];
+    bool good = true;
+
+    for (uint32_t lba = 0; lba < end; lba++)
+    {
+        CHECK(disk().load(lba, block));
+
+        int64_t v = version(block, lba);
+
+        bool written = (v == 0) || ((v > 0) && (v <= t.len)
+                && ((t.ops[v - 1].op == WRITE) || (t.ops[v - 1].op == WRITE_FUA))
+                && (lba >= t.ops[v - 1].lba) && (lba < (t.ops[v - 1].lba + t.ops[v - 1].blocks)));
+
+        if (!written || (v < _s_promised[lba]))
+        {
+            fprintf(stderr, "  block %u: version %lld, promised %u\n", lba, (long long)v, _s_promised[lba]);
+            good = false;
+        }
+    }
+
+    return good;
+}
+
+// Nothing cut, so everything has to be there once it's all flushed
+static void full(Trace const & t, uint32_t fail_opens)
+{
+    uint32_t const end = t.end();
+
+    prepare(end, fail_opens);
+    replay(t);
+
+    CHECK(scsi().flush());
+    memcpy(_s_promised, _s_acked, sizeof(_s_promised));
+    CHECK(verify(t, end));
+
+    for (uint32_t lba = 0; lba < end; lba++)
+    {
+        uint8_t block[_s_block_size];
+        CHECK(disk().load(lba, block));
+        CHECK_EQ(version(block, lba), _s_acked[lba]);
+    }
+}
+
+// Power cut after every number of blocks a full run writes
+static void cuts(Trace const & t, uint32_t fail_opens)
+{
+    uint32_t const end = t.end();
+
+    prepare(end, fail_opens);
+    replay(t);
+
+    uint32_t const written = disk().stats().blocks_written;
+    uint32_t bad = 0;
+
+    CHECK(written != 0);
+
+    for (uint32_t k = 0; k <= written; k++)
+    {
+        prepare(end, fail_opens);
+        disk().cut(k);
+
+        replay(t);
+
+        if (!verify(t, end))
+        {
+            fprintf(stderr, "  ...with the power cut after %u blocks\n", k);
+            if (++bad == 5)
+                break;
+        }
+    }
+
+    CHECK_EQ(bad, 0);
+
+    disk().restore();
+}
+
+static void scsi_windows(void) { full(windowsTrace(), 0); }
+static void scsi_linux(void) { full(linuxTrace(), 0); }
+static void scsi_windows_cuts(void) { cuts(windowsTrace(), 0); }
+static void scsi_linux_cuts(void) { cuts(linuxTrace(), 0); }
+
+// No multi-block opens, so every flush is a block at a time
+static void scsi_windows_fallback(void) { full(windowsTrace(), (uint32_t)-1); cuts(windowsTrace(), (uint32_t)-1); }
+static void scsi_linux_fallback(void) { full(linuxTrace(), (uint32_t)-1); cuts(linuxTrace(), (uint32_t)-1); }
+
+// A flush whose one open fails still gets there a block at a time, and one
+// that can't get there at all fails the SYNCHRONIZE CACHE and keeps the run
+static void scsi_flush_fallback(void)
+{
+    HostDisk & hd = disk();
+    uint32_t const lba = 1000;
+    uint8_t block[_s_block_size];
+
+    prepare(lba + 8, 0);
+
+    for (uint16_t b = 0; b < 8; b++)
+        stamp(_s_data + (b * _s_block_size), lba + b, 1);
+
+    CHECK(rw(WRITE, lba, 8));
+    CHECK_EQ(hd.stats().blocks_written, 0);
+
+    hd.failOpens(1);
+    CHECK(synchronize());
+    CHECK_EQ(hd.stats().block_writes, 8);
+
+    for (uint16_t b = 0; b < 8; b++)
+    {
+        CHECK(hd.load(lba + b, block));
+        CHECK_EQ(version(block, lba + b), 1);
+    }
+
+    for (uint16_t b = 0; b < 8; b++)
+        stamp(_s_data + (b * _s_block_size), lba + b, 2);
+
+    CHECK(rw(WRITE, lba, 8));
+
+    hd.resetStats();
+    hd.failOpens(1);
+    hd.cut(3);
+    CHECK(!synchronize());
+    CHECK_EQ(hd.stats().blocks_written, 3);
+
+    // The sense says which block didn't make it
+    uint8_t cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+    uint8_t sense[18] = {};
+    CHECK(command(cdb, sizeof(cdb), sense, sizeof(sense), true));
+    CHECK_EQ(sense[2] & 0x0F, 0x03);  // MEDIUM ERROR
+    CHECK_EQ(sense[12], 0x11);
+    CHECK(sense[0] & 0x80);
+    CHECK_EQ(be32(sense + 3), lba + 3);
+
+    hd.restore();
+    CHECK(synchronize());
+
+    for (uint16_t b = 0; b < 8; b++)
+    {
+        CHECK(hd.load(lba + b, block));
+        CHECK_EQ(version(block, lba + b), 2);
+    }
+}
+
+TEST_MAIN(
+    RUN(scsi_windows);
+    RUN(scsi_linux);
+    RUN(scsi_windows_cuts);
+    RUN(scsi_linux_cuts);
+    RUN(scsi_windows_fallback);
+    RUN(scsi_linux_fallback);
+    RUN(scsi_flush_fallback);
+)
@@ -0,0 +1,455 @@
+#include "spi.h"
+#include "test.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+// SPI0's registers have side effects - a write to PUSHR queues a frame, a read
+// of POPR takes one off the RX FIFO, SR's flags are write 1 to clear - so plain
+// memory won't do.  The register page is kept inaccessible and each access
+// faults.  The fault lets the model below get the register ready for a read,
+// the access is single stepped with the page open and the trap after it hands
+// the model whatever was written.  One frame shifts out for each read of SR,
+// the only register the driver polls, or one every few reads to let the TX
+// FIFO back up.
+
+using TSpi = SPI0 < PIN_MOSI, PIN_MISO, PIN_SCK >;
+
+static uintptr_t const _s_page = 0x4002C000;
+
+enum : uint32_t
+{
+    MCR = 0x00, TCR = 0x08, SR = 0x2C, PUSHR = 0x34, POPR = 0x38,
+};
+
+static constexpr uint8_t const _s_fifo_depth = 4;
+static constexpr uint16_t const _s_max_frames = 512;
+
+struct Dspi
+{
+    // Hardware
+    uint32_t tx[_s_fifo_depth];
+    uint8_t tx_head, tx_count;
+    uint16_t rx[_s_fifo_depth];
+    uint8_t rx_head, rx_count;
+    bool halted, tcf, eoqf, rfof, tfuf;
+    uint16_t tcnt;
+
+    uint8_t shift_every;  // SR reads per frame shifted
+    uint8_t reads;
+    uint32_t idle;        // SR reads in a row with nothing to shift
+
+    // What went on
+    uint32_t frames[_s_max_frames];  // PUSHR as it was shifted out
+    uint16_t shifted;
+    uint16_t pops;
+    uint16_t pop_empty;   // POPR read with nothing in RX
+    uint16_t tx_overrun;  // PUSHR written with TX full
+    uint8_t max_queued;   // Most in TX and RX together
+};
+
+static Dspi _s_dspi;
+
+static volatile uint32_t * reg(uint32_t off) { return (volatile uint32_t *)(_s_page + off); }
+
+static void shift(void)
+{
+    Dspi & d = _s_dspi;
+
+    // The driver is waiting on something that will never come, e.g. RX that
+    // was dropped on an overflow
+    if (d.halted || (d.tx_count == 0))
+    {
+        if (++d.idle == 1000000)
+        {
+            static char const msg[] = "spi_test: stuck polling SR\n";
+            (void)!write(2, msg, sizeof(msg) - 1);
+            _exit(1);
+        }
+
+        return;
+    }
+
+    d.idle = 0;
+
+    if (++d.reads < d.shift_every)
+        return;
+
+    d.reads = 0;
+
+    uint32_t frame = d.tx[d.tx_head];
+    d.tx_head = (d.tx_head + 1) % _s_fifo_depth;
+    d.tx_count--;
+
+    if (frame & SPI_PUSHR_CTCNT)
+        d.tcnt = 0;
+
+    d.tcnt++;
+    d.tcf = true;
+
+    if (frame & SPI_PUSHR_EOQ)
+        d.eoqf = true;
+
+    if (d.shifted < _s_max_frames)
+        d.frames[d.shifted++] = frame;
+
+    // What comes back on MISO is the complement of what went out on MOSI
+    uint16_t mask = (frame & SPI_PUSHR_CTAS1) ? 0xFFFF : 0x00FF;
+    uint16_t in = ~(uint16_t)frame & mask;
+
+    if (d.rx_count == _s_fifo_depth)
+    {
+        d.rfof = true;
+        return;
+    }
+
+    d.rx[(d.rx_head + d.rx_count) % _s_fifo_depth] = in;
+    d.rx_count++;
+}
+
+static uint32_t status(void)
+{
+    Dspi & d = _s_dspi;
+
+    return (d.tcf ? SPI_SR_TCF : 0) | (!d.halted ? SPI_SR_TXRXS : 0) | (d.eoqf ? SPI_SR_EOQF : 0)
+        | (d.tfuf ? SPI_SR_TFUF : 0) | ((d.tx_count < _s_fifo_depth) ? SPI_SR_TFFF : 0)
+        | (d.rfof ? SPI_SR_RFOF : 0) | ((d.rx_count != 0) ? SPI_SR_RFDF : 0)
+        | ((uint32_t)d.tx_count << 12) | ((uint32_t)d.rx_count << 4);
+}
+
+static uint32_t _s_pending = 0;
+static uint32_t _s_before = 0;
+
+// Before the access, with the page open
+static void before(uint32_t off)
+{
+    Dspi & d = _s_dspi;
+
+    switch (off)
+    {
+        case SR:
+            shift();
+            *reg(SR) = status();
+            break;
+
+        case TCR:
+            *reg(TCR) = (uint32_t)d.tcnt << 16;
+            break;
+
+        case POPR:
+            if (d.rx_count == 0)
+                d.pop_empty++;
+            *reg(POPR) = (d.rx_count != 0) ? d.rx[d.rx_head] : 0;
+            break;
+    }
+
+    _s_before = *reg(off);
+}
+
+// After it, write or not
+static void after(uint32_t off, bool write)
+{
+    Dspi & d = _s_dspi;
+    uint32_t v = *reg(off);
+
+    switch (off)
+    {
+        case MCR:
+            if (!write)
+                break;
+
+            d.halted = v & SPI_MCR_HALT;
+            if (v & SPI_MCR_CLR_TXF)
+                d.tx_count = 0;
+            if (v & SPI_MCR_CLR_RXF)
+                d.rx_count = 0;
+            *reg(MCR) = v & ~(SPI_MCR_CLR_TXF | SPI_MCR_CLR_RXF);
+            break;
+
+        case SR:
+            if (!write)
+                break;
+
+            if (v & SPI_SR_TCF) d.tcf = false;
+            if (v & SPI_SR_EOQF) d.eoqf = false;
+            if (v & SPI_SR_TFUF) d.tfuf = false;
+            if (v & SPI_SR_RFOF) d.rfof = false;
+            break;
+
+        case PUSHR:
+            if (!write)
+                break;
+
+            if (d.tx_count == _s_fifo_depth)
+            {
+                d.tx_overrun++;
+                break;
+            }
+
+            d.tx[(d.tx_head + d.tx_count) % _s_fifo_depth] = v;
+            d.tx_count++;
+            break;
+
+        case POPR:
+            if (d.rx_count == 0)
+                break;
+
+            d.rx_head = (d.rx_head + 1) % _s_fifo_depth;
+            d.rx_count--;
+            d.pops++;
+            break;
+    }
+
+    if ((uint8_t)(d.tx_count + d.rx_count) > d.max_queued)
+        d.max_queued = d.tx_count + d.rx_count;
+}
+
+static void protect(bool on)
+{
+    if (mprotect((void *)_s_page, 0x1000, on ? PROT_NONE : (PROT_READ | PROT_WRITE)) != 0)
+        abort();
+}
+
+static void fault(int sig, siginfo_t * si, void * ctx)
+{
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    ucontext_t * uc = (ucontext_t *)ctx;
+
+    if ((addr < _s_page) || (addr >= (_s_page + 0x1000)))
+    {
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    // Bit 1 of the page fault error code is set for a write.  An instruction
+    // that reads and writes, e.g. *_sr |= x, faults as a write but reads too.
+    bool write = uc->uc_mcontext.gregs[REG_ERR] & 2;
+
+    _s_pending = ((addr - _s_page) & ~3) | (write ? 1 : 0);
+
+    protect(false);
+    before(_s_pending & ~1);
+
+    uc->uc_mcontext.gregs[REG_EFL] |= 0x100;  // Trap after the one instruction
+}
+
+static void trap(int sig, siginfo_t * si, void * ctx)
+{
+    ucontext_t * uc = (ucontext_t *)ctx;
+
+    uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+
+    uint32_t off = _s_pending & ~1;
+    bool write = (_s_pending & 1) || (*reg(off) != _s_before);
+
+    after(off, write);
+    protect(true);
+}
+
+static TSpi & spi(void)
+{
+    static bool hooked = false;
+
+    if (!hooked)
+    {
+        struct sigaction sa = {};
+        sa.sa_flags = SA_SIGINFO;
+
+        sa.sa_sigaction = fault;
+        sigaction(SIGSEGV, &sa, nullptr);
+        sa.sa_sigaction = trap;
+        sigaction(SIGTRAP, &sa, nullptr);
+
+        memset((void *)_s_page, 0, 0x1000);
+        _s_dspi = {};
+        _s_dspi.halted = true;
+        _s_dspi.shift_every = 1;
+
+        protect(true);
+        hooked = true;
+    }
+
+    return TSpi::acquire();
+}
+
+// Clean slate for the counters, the FIFOs as the last transfer left them
+static void reset(uint8_t shift_every)
+{
+    Dspi & d = _s_dspi;
+
+    d.shift_every = shift_every;
+    d.reads = 0;
+    d.shifted = d.pops = d.pop_empty = d.tx_overrun = 0;
+    d.max_queued = 0;
+}
+
+// Everything that has to hold after any transfer
+static void settled(uint16_t frames)
+{
+    Dspi & d = _s_dspi;
+
+    CHECK_EQ(d.shifted, frames);
+    CHECK_EQ(d.pops, frames);
+    CHECK_EQ(d.tx_count, 0);
+    CHECK_EQ(d.rx_count, 0);
+    CHECK_EQ(d.pop_empty, 0);
+    CHECK_EQ(d.tx_overrun, 0);
+    CHECK(!d.rfof);
+    CHECK(d.max_queued <= _s_fifo_depth);
+    CHECK(!d.tcf);  // Or the next single push wouldn't wait for its frame
+}
+
+// A burst of n 16 bit frames starting at frames[first]
+static void burstFrames(uint16_t first, uint16_t n, uint16_t const * words)
+{
+    Dspi & d = _s_dspi;
+
+    for (uint16_t i = 0; i < n; i++)
+    {
+        uint32_t f = d.frames[first + i];
+        bool last = (i + 1) == n;
+
+        CHECK(f & SPI_PUSHR_CTAS1);
+        CHECK_EQ(!!(f & SPI_PUSHR_CONT), !last);
+        CHECK_EQ(!!(f & SPI_PUSHR_CTCNT), i == 0);
+        CHECK(!(f & SPI_PUSHR_EOQ));
+
+        if (words != nullptr)
+            CHECK_EQ(f & 0xFFFF, words[i]);
+    }
+}
+
+static void spi_start(void)
+{
+    TSpi & s = spi();
+
+    CHECK(s.running());
+    CHECK(s.begin(0));
+    s.end();
+}
+
+// A single frame is complete when push16() returns
+static void spi_single(void)
+{
+    TSpi & s = spi();
+
+    for (uint8_t every = 1; every <= 3; every++)
+    {
+        reset(every);
+        CHECK(s.begin(0));
+        s.tx16(0x1234);
+        s.flush();
+        s.end();
+
+        CHECK_EQ(_s_dspi.shifted, 1);
+        CHECK_EQ(_s_dspi.tx_count, 0);
+        CHECK_EQ(_s_dspi.frames[0] & 0xFFFF, 0x1234);
+        CHECK(!(_s_dspi.frames[0] & SPI_PUSHR_CONT));
+    }
+}
+
+// Every length up to a good few times the FIFO depth, with the frames going
+// out as fast as SR is read and slower
+static void spi_burst_lengths(void)
+{
+    TSpi & s = spi();
+    uint16_t words[64];
+
+    for (uint16_t i = 0; i < 64; i++)
+        words[i] = 0x0100 * i + (0xFF - i);
+
+    for (uint8_t every = 1; every <= 3; every++)
+    {
+        for (uint16_t n = 1; n <= 64; n++)
+        {
+            reset(every);
+            CHECK(s.begin(0));
+            s.tx16(words, n);
+
+            CHECK_EQ(s.transfers(), n);
+            settled(n);
+            burstFrames(0, n, words);
+
+            // A single push straight after has to wait for its own frame
+            s.tx16(0xBEEF);
+            CHECK_EQ(_s_dspi.shifted, n + 1);
+            CHECK_EQ(_s_dspi.frames[n] & 0xFFFF, 0xBEEF);
+
+            s.flush();
+            s.end();
+        }
+    }
+}
+
+// Full duplex, odd lengths have a single 8 bit frame first
+static void spi_txrx(void)
+{
+    TSpi & s = spi();
+    uint8_t tx[81], rx[81];
+
+    for (uint16_t i = 0; i < sizeof(tx); i++)
+        tx[i] = (uint8_t)(i * 7 + 3);
+
+    for (uint8_t every = 1; every <= 2; every++)
+    {
+        for (uint16_t len = 1; len <= sizeof(tx); len++)
+        {
+            memset(rx, 0, sizeof(rx));
+
+            reset(every);
+            CHECK(s.begin(0));
+            s.txrx(tx, rx, len);
+            s.end();
+
+            uint16_t single = len & 1;
+
+            settled(single + (len >> 1));
+            burstFrames(single, len >> 1, nullptr);
+
+            if (single)
+                CHECK(!(_s_dspi.frames[0] & SPI_PUSHR_CTAS1));
+
+            int wrong = 0;
+            for (uint16_t i = 0; i < len; i++)
+                wrong += (rx[i] != (uint8_t)~tx[i]);
+
+            CHECK_EQ(wrong, 0);
+        }
+    }
+}
+
+// Request then response, as the SD card's commands go
+static void spi_trans(void)
+{
+    TSpi & s = spi();
+    uint8_t cmd[6] = { 0x51, 0, 0, 0, 8, 0xFF };
+    uint8_t rx[19];
+
+    reset(1);
+    CHECK(s.begin(0));
+    s.trans(cmd, sizeof(cmd), rx, sizeof(rx));
+    s.end();
+
+    // 3 frames of command, then 1 single and 9 of response
+    settled(3 + 1 + 9);
+    burstFrames(0, 3, nullptr);
+    burstFrames(4, 9, nullptr);
+
+    int wrong = 0;
+    for (uint16_t i = 0; i < sizeof(rx); i++)
+        wrong += (rx[i] != 0x00);
+
+    CHECK_EQ(wrong, 0);
+}
+
+TEST_MAIN(
+    RUN(spi_start);
+    RUN(spi_single);
+    RUN(spi_burst_lengths);
+    RUN(spi_txrx);
+    RUN(spi_trans);
+)
@@ -0,0 +1,39 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+// Host tests.  Each test is a plain function run from main(), failures are
+// counted and reported with where they happened and main() returns non-zero
+// if there were any.
+
+#include <cstdio>
+#include <cstdint>
+
+extern int test_failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { test_failures++; \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { long long _a = (long long)(a), _b = (long long)(b); if (_a != _b) { test_failures++; \
+        fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+                __FILE__, __LINE__, #a, #b, _a, _b); } } while (0)
+
+#define RUN(test) \
+    do { int _f = test_failures; test(); \
+        printf("%-40s %s\n", #test, (_f == test_failures) ? "ok" : "FAILED"); } while (0)
+
+#define TEST_MAIN(body) \
+    int test_failures = 0; \
+    int main(void) { body; return (test_failures == 0) ? 0 : 1; }
+
+// Path of a test's card image, in the build directory
+#ifndef TEST_IMG_DIR
+#define TEST_IMG_DIR "build"
+#endif
+#define TEST_IMG(name) TEST_IMG_DIR "/" name
+
+// Moves msecs() on, see host.cpp
+void host_msecs(uint32_t ms);
+
+#endif
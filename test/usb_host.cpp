@@ -0,0 +1,246 @@
+#include "usb_host.h"
+
+using Ep0 = ControlPipe < EndPoint::N0 >;
+
+static reg8 _s_istat = (reg8)0x40072080;
+static reg8 _s_stat = (reg8)0x40072090;
+static reg8 _s_addr = (reg8)0x40072098;
+static reg8 _s_endpt0 = (reg8)0x400720C0;
+
+void UsbHost::raise(uint8_t istat)
+{
+    *_s_istat = istat;
+    usb_isr();
+}
+
+void UsbHost::reset(void)
+{
+    _addr = 0;
+    memset(_odd, 0, sizeof(_odd));
+    memset(_toggle, 0, sizeof(_toggle));
+
+    raise(USB_ISTAT_USBRST);
+}
+
+void UsbHost::run(uint32_t loops)
+{
+    while (loops-- != 0)
+        _usb.process();
+}
+
+int UsbHost::transact(uint8_t ep, EndPoint::dir_e dir, PID::pid_e token, uint8_t * data, uint16_t len)
+{
+    _transactions++;
+
+    if ((ep >= EP_NUM_CNT) || (USB_ADDR_ADDR(*_s_addr) != _addr))
+        return TIMEOUT;
+
+    uint8_t endpt = _s_endpt0[ep * 4];
+    if (!(endpt & ((dir == EndPoint::IN) ? USB_ENDPTn_EPTXEN : USB_ENDPTn_EPRXEN)))
+        return TIMEOUT;
+
+    uint8_t odd = _odd[ep][dir];
+    BD & bd = bdt[(ep << 2) | (dir << 1) | odd];
+
+    // A stalled BD stays owned and untouched
+    if ((endpt & USB_ENDPTn_EPSTALL) || ((bd.desc & (BD_OWN | BD_BDT_STALL)) == (BD_OWN | BD_BDT_STALL)))
+    {
+        raise(USB_ISTAT_STALL);
+        return STALL;
+    }
+
+    if (!(bd.desc & BD_OWN))
+    {
+        _naks++;
+        return NAK;
+    }
+
+    uint8_t data1 = (bd.desc & BD_DATA1) ? 1 : 0;
+    uint16_t count = bd.count();
+
+    // Setups are always DATA0 and taken whatever the BD expected.  Otherwise
+    // an OUT the BD synchronizes against and doesn't expect is ACKed and
+    // dropped, as for a retry whose ACK was lost.
+    if ((token != PID::SETUP) && (data1 != _toggle[ep][dir]))
+    {
+        if ((dir == EndPoint::OUT) && (bd.desc & BD_DTS))
+        {
+            _toggle[ep][dir] ^= 1;
+            _dropped++;
+            return len;
+        }
+
+        _toggle_errors++;
+    }
+
+    if (dir == EndPoint::OUT)
+    {
+        if (len > count)
+            return BABBLE;
+
+        memmove((void *)bd.addr, data, len);
+        count = len;
+    }
+    else
+    {
+        if (count > len)
+            return BABBLE;
+
+        memmove(data, (void const *)bd.addr, count);
+    }
+
+    // Handed back with the PID where the control bits were
+    bd.desc = BD_BC(count) | BD_DATAX(data1) | ((uint32_t)token << 2);
+
+    _odd[ep][dir] ^= 1;
+    _toggle[ep][dir] = data1 ^ 1;
+
+    if (token == PID::SETUP)
+        _toggle[ep][EndPoint::OUT] = _toggle[ep][EndPoint::IN] = 1;
+
+    *_s_stat = (ep << 4) | ((dir == EndPoint::IN) ? USB_STAT_TX : 0) | (odd ? USB_STAT_ODD : 0);
+    raise(USB_ISTAT_TOKDNE);
+
+    return count;
+}
+
+int UsbHost::setup(uint8_t const (&req)[8])
+{
+    return transact(0, EndPoint::OUT, PID::SETUP, (uint8_t *)req, sizeof(req));
+}
+
+int UsbHost::out(uint8_t ep, uint8_t const * data, uint16_t len)
+{
+    return transact(ep, EndPoint::OUT, PID::OUT, (uint8_t *)data, len);
+}
+
+int UsbHost::in(uint8_t ep, uint8_t * buf, uint16_t max)
+{
+    return transact(ep, EndPoint::IN, PID::IN, buf, max);
+}
+
+int UsbHost::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+        uint16_t length, uint8_t * data)
+{
+    uint8_t const req[8] =
+    {
+        type, request,
+        (uint8_t)value, (uint8_t)(value >> 8),
+        (uint8_t)index, (uint8_t)(index >> 8),
+        (uint8_t)length, (uint8_t)(length >> 8)
+    };
+
+    bool const to_host = (type & 0x80) != 0;
+    uint8_t status[_s_mps];
+    uint16_t done = 0;
+    int ret;
+
+    // The device runs its main loop before anything else comes along
+    if ((ret = setup(req)) < 0)
+        return ret;
+
+    run();
+
+    while (done < length)
+    {
+        uint16_t n = length - done;
+        if (n > _s_mps) n = _s_mps;
+
+        ret = retry([&](void) { return to_host ? in(0, data + done, n) : out(0, data + done, n); });
+        if (ret < 0)
+            return ret;
+
+        done += ret;
+
+        if (to_host && (ret < _s_mps))
+            break;
+    }
+
+    // Status stage, zero length DATA1 the other way or IN if there was no
+    // Data stage
+    bool const status_in = !to_host || (length == 0);
+    _toggle[0][status_in ? EndPoint::IN : EndPoint::OUT] = 1;
+
+    ret = retry([&](void) { return status_in ? in(0, status, sizeof(status)) : out(0, nullptr, 0); });
+    if (ret < 0)
+        return ret;
+    else if (ret != 0)
+        return BABBLE;
+
+    if ((type == 0x00) && (request == Ep0::SET_ADDRESS))
+        _addr = (uint8_t)value;
+    else if ((type == 0x02) && (request == Ep0::CLEAR_FEATURE) && (value == Ep0::ENDPOINT_HALT))
+        _toggle[index & 0x0F][(index & 0x80) ? EndPoint::IN : EndPoint::OUT] = 0;
+
+    run();
+
+    return done;
+}
+
+bool UsbHost::enumerate(void)
+{
+    uint8_t buf[256];
+
+    reset();
+    run();
+
+    // Only the first packet's worth at address 0
+    if (control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::DEVICE << 8, 0, 64, buf) != sizeof(UsbDesc::Device))
+        return false;
+
+    if (control(0x00, Ep0::SET_ADDRESS, 1, 0, 0) != 0)
+        return false;
+
+    if (control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::CONFIGURATION << 8, 0, 9, buf) != 9)
+        return false;
+
+    uint16_t total = buf[2] | (buf[3] << 8);
+    if (control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::CONFIGURATION << 8, 0, total, buf) != total)
+        return false;
+
+    return control(0x00, Ep0::SET_CONFIGURATION, 1, 0, 0) == 0;
+}
+
+int UsbHost::bulkOut(uint8_t ep, uint8_t const * data, uint32_t len)
+{
+    uint32_t done = 0;
+
+    do
+    {
+        uint16_t n = ((len - done) > _s_mps) ? _s_mps : (uint16_t)(len - done);
+
+        int ret = retry([&](void) { return out(ep, data + done, n); });
+        if (ret < 0)
+            return ret;
+
+        done += n;
+
+    } while (done < len);
+
+    run();
+
+    return (int)done;
+}
+
+int UsbHost::bulkIn(uint8_t ep, uint8_t * buf, uint32_t len)
+{
+    uint32_t done = 0;
+
+    while (done < len)
+    {
+        uint16_t n = ((len - done) > _s_mps) ? _s_mps : (uint16_t)(len - done);
+
+        int ret = retry([&](void) { return in(ep, buf + done, n); });
+        if (ret < 0)
+            return ret;
+
+        done += ret;
+
+        if (ret < _s_mps)
+            break;
+    }
+
+    run();
+
+    return (int)done;
+}
@@ -0,0 +1,93 @@
+#ifndef _USB_HOST_H_
+#define _USB_HOST_H_
+
+// A full speed host on the far end of the USB module, for tests of the device
+// side.  Each transaction goes through the BDT as the module's SIE would take
+// it: the BD at the SIE's even/odd position for the endpoint has to be owned or
+// the host gets a NAK, a BD or ENDPTn stall gets a STALL and otherwise the data
+// is moved, the BD handed back with the count and PID, STAT set and usb_isr()
+// run for TOKDNE.  The main loop, Usb::process(), runs between transactions
+// when the device NAKs and after each transfer.
+//
+// Copies of the data to and from the BDs are memmove()s so a test counting the
+// firmware's memcpy()s doesn't count the bus.
+
+#include "usb.h"
+
+class UsbHost
+{
+    public:
+        // Short of an ACK
+        enum hs_e : int
+        {
+            NAK = -1,
+            STALL = -2,
+            TIMEOUT = -3,  // Nothing answered, e.g. wrong address or endpoint off
+            BABBLE = -4,   // Device sent more than asked for
+        };
+
+        UsbHost(void) : _usb(Usb::acquire()) {}
+
+        // Bus reset, address back to 0
+        void reset(void);
+
+        // Reset, address 1 and configuration 1 as a host enumerating would
+        bool enumerate(void);
+
+        // The device's main loop
+        void run(uint32_t loops = 1);
+
+        // Single transactions, data toggles as the host keeps them
+        int setup(uint8_t const (&req)[8]);
+        int out(uint8_t ep, uint8_t const * data, uint16_t len);
+        int in(uint8_t ep, uint8_t * buf, uint16_t max);
+
+        // Control transfer on endpoint 0.  Returns the length of the Data stage
+        // or why it failed.  A ClearFeature(ENDPOINT_HALT) that goes through
+        // starts the endpoint's toggle over at DATA0.
+        int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                uint16_t length, uint8_t * data = nullptr);
+
+        // Bulk or interrupt transfers in max packet size pieces.  OUT sends len
+        // and IN takes until len or a short packet.
+        int bulkOut(uint8_t ep, uint8_t const * data, uint32_t len);
+        int bulkIn(uint8_t ep, uint8_t * buf, uint32_t len);
+
+        uint8_t address(void) const { return _addr; }
+        uint32_t naks(void) const { return _naks; }
+        uint32_t toggleErrors(void) const { return _toggle_errors; }
+        uint32_t dropped(void) const { return _dropped; }
+        uint32_t transactions(void) const { return _transactions; }
+
+        // NAKs retried before a transfer gives up
+        static constexpr uint32_t const retries = 10000;
+
+    private:
+        static constexpr uint16_t const _s_mps = MAX_PKT_SIZE;
+
+        int transact(uint8_t ep, EndPoint::dir_e dir, PID::pid_e token, uint8_t * data, uint16_t len);
+        void raise(uint8_t istat);
+
+        template < class T >
+        int retry(T transaction)
+        {
+            int ret = NAK;
+
+            for (uint32_t i = 0; (i < retries) && ((ret = transaction()) == NAK); i++)
+                run();
+
+            return ret;
+        }
+
+        Usb & _usb;
+        uint8_t _addr = 0;
+        uint8_t _odd[16][2] = {};     // Which BD the SIE uses next
+        uint8_t _toggle[16][2] = {};  // DATA0 or DATA1 next
+
+        uint32_t _naks = 0;
+        uint32_t _toggle_errors = 0;
+        uint32_t _dropped = 0;
+        uint32_t _transactions = 0;
+};
+
+#endif
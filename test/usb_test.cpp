@@ -0,0 +1,308 @@
+#include "usb_host.h"
+#include "test.h"
+
+#include <cstring>
+
+// The composite device's descriptors and the CDC-ACM port's class requests,
+// against UsbHost standing in for the PC.  Each test starts from a freshly
+// enumerated device.
+
+using Ep0 = ControlPipe < EndPoint::N0 >;
+
+static constexpr uint8_t const _s_class_iface_out = 0x21;  // Class, interface, host to device
+static constexpr uint8_t const _s_class_iface_in = 0xA1;
+static constexpr uint16_t const _s_comm_iface = UsbDesc::Interface::cdc_comm_iface_number;
+
+static UsbHost & host(void)
+{
+    static bool attached = HostDisk::acquire().attach(TEST_IMG("usb_test.img"), 64);
+    static UsbHost h;
+
+    (void)attached;
+    CHECK(h.enumerate());
+
+    return h;
+}
+
+static uint32_t le32(uint8_t const * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+static uint16_t le16(uint8_t const * p) { return p[0] | (p[1] << 8); }
+
+static int getLineCoding(UsbHost & h, uint8_t (&lc)[7])
+{
+    return h.control(_s_class_iface_in, Ep0::GET_LINE_CODING, 0, _s_comm_iface, sizeof(lc), lc);
+}
+
+static int setLineState(UsbHost & h, uint16_t state)
+{
+    return h.control(_s_class_iface_out, Ep0::SET_CONTROL_LINE_STATE, state, _s_comm_iface, 0);
+}
+
+// Drains the port's data endpoint until it NAKs
+static uint32_t readPort(UsbHost & h, uint8_t * buf, uint32_t len)
+{
+    uint32_t n = 0;
+
+    for (uint8_t idle = 0; (idle < 4) && (n < len); )
+    {
+        int ret = h.in(CDC_DATA_EP_NUM, buf + n, 64);
+        if (ret == UsbHost::NAK)
+        {
+            h.run();
+            idle++;
+            continue;
+        }
+
+        CHECK(ret >= 0);
+        if (ret < 0)
+            break;
+
+        n += ret;
+        idle = 0;
+    }
+
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The bLength chain of the configuration as it's declared
+static void usb_config_layout(void)
+{
+    static UsbDesc::CompositeConfiguration cc;
+    uint8_t const * d = (uint8_t const *)&cc;
+
+    static uint8_t const types[] =
+    {
+        UsbDesc::CONFIGURATION,
+        UsbDesc::INTERFACE, UsbDesc::ENDPOINT, UsbDesc::ENDPOINT,
+        UsbDesc::INTERFACE_ASSOCIATION,
+        UsbDesc::INTERFACE, UsbDesc::CS_INTERFACE, UsbDesc::CS_INTERFACE,
+        UsbDesc::CS_INTERFACE, UsbDesc::CS_INTERFACE, UsbDesc::ENDPOINT,
+        UsbDesc::INTERFACE, UsbDesc::ENDPOINT, UsbDesc::ENDPOINT,
+    };
+
+    uint16_t off = 0;
+    uint8_t n = 0;
+
+    while ((off < sizeof(cc)) && (n < sizeof(types)))
+    {
+        CHECK(d[off] != 0);
+        CHECK_EQ(d[off + 1], types[n]);
+
+        if (d[off] == 0)
+            return;
+
+        off += d[off];
+        n++;
+    }
+
+    CHECK_EQ(off, sizeof(cc));
+    CHECK_EQ(n, sizeof(types));
+    CHECK_EQ(cc.conf.wTotalLength, sizeof(cc));
+    CHECK_EQ(cc.conf.bNumInterfaces, 3);
+
+    // Mass storage stays interface 0 on endpoint 1
+    CHECK_EQ(cc.iface.bInterfaceNumber, 0);
+    CHECK_EQ(cc.iface.bInterfaceClass, UsbDesc::MASS_STORAGE);
+    CHECK_EQ(cc.bulk_in.bEndpointAddress, 0x81);
+    CHECK_EQ(cc.bulk_out.bEndpointAddress, 0x01);
+
+    // The IAD groups the two CDC interfaces that follow it
+    CHECK_EQ(cc.cdc_iad.bFirstInterface, cc.cdc_comm.bInterfaceNumber);
+    CHECK_EQ(cc.cdc_iad.bInterfaceCount, 2);
+    CHECK_EQ(cc.cdc_iad.bFunctionClass, cc.cdc_comm.bInterfaceClass);
+    CHECK_EQ(cc.cdc_iad.bFunctionSubClass, cc.cdc_comm.bInterfaceSubClass);
+    CHECK_EQ(cc.cdc_iad.bFunctionProtocol, cc.cdc_comm.bInterfaceProtocol);
+
+    CHECK_EQ(cc.cdc_comm.bInterfaceNumber, 1);
+    CHECK_EQ(cc.cdc_comm.bInterfaceClass, UsbDesc::CDC_CONTROL);
+    CHECK_EQ(cc.cdc_comm.bInterfaceSubClass, UsbDesc::Interface::ACM);
+    CHECK_EQ(cc.cdc_comm.bNumEndpoints, 1);
+    CHECK_EQ(cc.cdc_data.bInterfaceNumber, 2);
+    CHECK_EQ(cc.cdc_data.bInterfaceClass, UsbDesc::CDC_DATA);
+    CHECK_EQ(cc.cdc_data.bNumEndpoints, 2);
+
+    // Functional descriptors point at the right interfaces
+    CHECK_EQ(cc.cdc_header.bDescriptorSubtype, UsbDesc::CDC_HEADER);
+    CHECK_EQ(cc.cdc_call_management.bDataInterface, cc.cdc_data.bInterfaceNumber);
+    CHECK_EQ(cc.cdc_acm.bmCapabilities, 0x02);
+    CHECK_EQ(cc.cdc_union.bControlInterface, cc.cdc_comm.bInterfaceNumber);
+    CHECK_EQ(cc.cdc_union.bSubordinateInterface0, cc.cdc_data.bInterfaceNumber);
+
+    CHECK_EQ(cc.cdc_notify.bEndpointAddress, 0x82);
+    CHECK_EQ(cc.cdc_notify.bmAttributes, EndPoint::INTERRUPT);
+    CHECK(cc.cdc_notify.bInterval != 0);
+    CHECK_EQ(cc.cdc_out.bEndpointAddress, 0x03);
+    CHECK_EQ(cc.cdc_in.bEndpointAddress, 0x83);
+    CHECK_EQ(cc.cdc_in.bmAttributes, EndPoint::BULK);
+    CHECK_EQ(cc.cdc_in.wMaxPacketSize, 64);
+}
+
+// What the host gets is what's declared, over more than one packet
+static void usb_descriptors(void)
+{
+    UsbHost & h = host();
+    uint8_t buf[256];
+
+    CHECK_EQ(h.address(), 1);
+
+    CHECK_EQ(h.control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::DEVICE << 8, 0, sizeof(buf), buf), 18);
+    CHECK_EQ(buf[4], UsbDesc::MISC);  // IAD class triple
+    CHECK_EQ(buf[5], 0x02);
+    CHECK_EQ(buf[6], 0x01);
+    CHECK_EQ(buf[7], 64);
+    CHECK_EQ(le16(buf + 10), 0x0002);
+    CHECK_EQ(buf[17], 1);
+
+    UsbDesc::CompositeConfiguration cc;
+    CHECK_EQ(h.control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::CONFIGURATION << 8, 0, sizeof(buf), buf), sizeof(cc));
+    CHECK(memcmp(buf, &cc, sizeof(cc)) == 0);
+
+    // Only what's asked for
+    CHECK_EQ(h.control(0x80, Ep0::GET_DESCRIPTOR, UsbDesc::CONFIGURATION << 8, 0, 9, buf), 9);
+    CHECK_EQ(le16(buf + 2), sizeof(cc));
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+static void cdc_line_coding(void)
+{
+    UsbHost & h = host();
+    uint8_t lc[7];
+
+    // 115200 8N1 until told otherwise
+    CHECK_EQ(getLineCoding(h, lc), 7);
+    CHECK_EQ(le32(lc), 115200);
+    CHECK_EQ(lc[4], 0);
+    CHECK_EQ(lc[5], 0);
+    CHECK_EQ(lc[6], 8);
+
+    uint8_t set[7] = { 0x80, 0x25, 0x00, 0x00, 2, 1, 7 };  // 9600 7O2
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_LINE_CODING, 0, _s_comm_iface, sizeof(set), set), 7);
+
+    CHECK_EQ(getLineCoding(h, lc), 7);
+    CHECK(memcmp(lc, set, sizeof(lc)) == 0);
+
+    // Shorter than the structure the host only gets what it asked for
+    uint8_t part[4] = {};
+    CHECK_EQ(h.control(_s_class_iface_in, Ep0::GET_LINE_CODING, 0, _s_comm_iface, sizeof(part), part), 4);
+    CHECK_EQ(le32(part), 9600);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+// Malformed requests get a STALL and the next request goes through as normal
+static void cdc_bad_requests_stall(void)
+{
+    UsbHost & h = host();
+    uint8_t lc[7], set[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };  // 115200 8N1
+
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_LINE_CODING, 0, _s_comm_iface, sizeof(set), set), 7);
+
+    // Wrong length, whether the data stage is taken or not
+    uint8_t bad[8] = { 0x80, 0x25, 0x00, 0x00, 0, 0, 8, 0 };
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_LINE_CODING, 0, _s_comm_iface, 6, bad), UsbHost::STALL);
+    CHECK_EQ(getLineCoding(h, lc), 7);
+    CHECK(memcmp(lc, set, sizeof(lc)) == 0);
+
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_LINE_CODING, 0, _s_comm_iface, sizeof(bad), bad), UsbHost::STALL);
+    CHECK_EQ(getLineCoding(h, lc), 7);
+    CHECK(memcmp(lc, set, sizeof(lc)) == 0);
+
+    // More than a packet's worth of Data stage isn't taken at all
+    uint8_t big[80] = {};
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_LINE_CODING, 0, _s_comm_iface, sizeof(big), big), UsbHost::STALL);
+
+    // No data stage allowed
+    CHECK_EQ(h.control(_s_class_iface_out, Ep0::SET_CONTROL_LINE_STATE, 1, _s_comm_iface, 2, bad), UsbHost::STALL);
+    CHECK_EQ(h.control(_s_class_iface_in, Ep0::GET_LINE_CODING, 0, _s_comm_iface, 0, lc), UsbHost::STALL);
+
+    // Not a recipient it knows
+    CHECK_EQ(h.control(0xA0, Ep0::GET_LINE_CODING, 0, _s_comm_iface, sizeof(lc), lc), UsbHost::STALL);
+
+    // Standard requests are unaffected
+    uint8_t conf = 0;
+    CHECK_EQ(h.control(0x80, Ep0::GET_CONFIGURATION, 0, 0, 1, &conf), 1);
+    CHECK_EQ(conf, 1);
+    CHECK_EQ(getLineCoding(h, lc), 7);
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+// Text only goes out while DTR's up, a packet at a time, and a line that
+// doesn't fit is dropped whole
+static void cdc_port(void)
+{
+    UsbHost & h = host();
+    Usb & usb = Usb::acquire();
+    static uint8_t buf[2048];
+
+    CHECK(!usb.logging());
+    CHECK_EQ(usb.log("before\n"), 0);
+
+    CHECK_EQ(setLineState(h, 0x0001), 0);
+    CHECK(usb.logging());
+
+    CHECK_EQ(usb.log("hello\n"), 6);
+    CHECK_EQ(readPort(h, buf, sizeof(buf)), 6);
+    CHECK(memcmp(buf, "hello\n", 6) == 0);
+
+    // A full packet with nothing after it goes short so the host isn't left
+    // waiting on the rest of a transfer
+    char line[65];
+    memset(line, 'x', 64);
+    line[64] = '\0';
+
+    CHECK_EQ(usb.log(line), 64);
+    CHECK_EQ(h.in(CDC_DATA_EP_NUM, buf, 64), UsbHost::NAK);
+    h.run();
+    CHECK_EQ(h.in(CDC_DATA_EP_NUM, buf, 64), 63);
+    h.run();
+    CHECK_EQ(h.in(CDC_DATA_EP_NUM, buf, 64), 1);
+
+    // With the host not reading the ring fills and whole lines are dropped
+    char text[101];
+    memset(text, 'a', 100);
+    text[99] = '\n';
+    text[100] = '\0';
+
+    uint32_t taken = 0, tries = 0;
+    uint32_t dropped = usb.dropped();
+
+    for (; tries < 20; tries++)
+        taken += usb.log(text);
+
+    CHECK(taken < (tries * 100));
+    CHECK_EQ(taken % 100, 0);
+    CHECK_EQ(usb.dropped() - dropped, (tries * 100) - taken);
+
+    // Nothing went out in the meantime so it's all still there
+    uint32_t n = readPort(h, buf, sizeof(buf));
+    CHECK_EQ(n, taken);
+    for (uint32_t i = 0; i < n; i++)
+        if (buf[i] != (((i % 100) == 99) ? '\n' : 'a')) { CHECK(false); break; }
+
+    // Closed, nothing is taken.  Opened again, nothing stale comes out.
+    CHECK_EQ(setLineState(h, 0), 0);
+    CHECK(!usb.logging());
+    CHECK_EQ(usb.log("closed\n"), 0);
+
+    CHECK_EQ(setLineState(h, 0x0003), 0);
+    CHECK_EQ(usb.log("again\n"), 6);
+    CHECK_EQ(readPort(h, buf, sizeof(buf)), 6);
+    CHECK(memcmp(buf, "again\n", 6) == 0);
+
+    // A bus reset closes the port
+    h.reset();
+    CHECK(!usb.logging());
+
+    CHECK_EQ(h.toggleErrors(), 0);
+}
+
+TEST_MAIN(
+    RUN(usb_config_layout);
+    RUN(usb_descriptors);
+    RUN(cdc_line_coding);
+    RUN(cdc_bad_requests_stall);
+    RUN(cdc_port);
+)
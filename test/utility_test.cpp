@@ -0,0 +1,259 @@
+#include "utility.h"
+#include "test.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Exposes the total so a test can bound a run
+template < uint16_t BSIZE >
+class Ring : public ProducerConsumer < BSIZE >
+{
+    public:
+        Ring(uint32_t total) { this->_total = total; }
+};
+
+// Byte n of the stream, a period that doesn't divide the ring size so a
+// misplaced span shows up
+static uint8_t pattern(uint32_t n) { return (uint8_t)(n % 251); }
+
+// Chunk lengths from a cheap LCG so both sides hit every offset and wrap
+static uint16_t chunk(uint32_t & seed, uint16_t max)
+{
+    seed = (seed * 1103515245) + 12345;
+    return (uint16_t)(((seed >> 16) % max) + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void ring_copy_wraps(void)
+{
+    Ring < 16 > ring(64);
+    uint8_t in[12], out[12];
+
+    for (uint8_t i = 0; i < sizeof(in); i++)
+        in[i] = i + 1;
+
+    // Twelve in, twelve out, then twelve that straddle the end of the buffer
+    CHECK_EQ(ring.produce(in, 12), 12);
+    CHECK_EQ(ring.produce(in, 12), 0);  // Doesn't fit and no truncation
+    CHECK_EQ(ring.consume(out, 12), 12);
+    CHECK_EQ(ring.produce(in, 12), 12);
+    CHECK_EQ(ring.consume(out, 12), 12);
+
+    for (uint8_t i = 0; i < sizeof(out); i++)
+        CHECK_EQ(out[i], in[i]);
+
+    CHECK_EQ(ring.consumeLen(), 0);
+    CHECK_EQ(ring.produceLen(), 16);
+}
+
+static void ring_truncates_to_total(void)
+{
+    Ring < 16 > ring(10);
+    uint8_t buf[16] = {};
+
+    CHECK_EQ(ring.produce(buf, 16), 0);
+    CHECK_EQ(ring.produce(buf, 16, true), 10);
+    CHECK(ring.produceDone());
+    CHECK_EQ(ring.produceLen(), 0);
+
+    CHECK_EQ(ring.consume(buf, 16, true), 10);
+    CHECK(ring.consumeDone());
+}
+
+static void ring_spans_stop_at_the_end(void)
+{
+    Ring < 16 > ring(64);
+    uint8_t buf[16] = {};
+    uint8_t * p;
+    uint8_t const * q;
+
+    CHECK_EQ(ring.produce(buf, 10), 10);
+    CHECK_EQ(ring.consume(buf, 10), 10);
+
+    // Offset 10, so only 6 contiguous either side
+    CHECK_EQ(ring.reserveContiguous(&p, 16), 6);
+    ring.publish(6);
+    CHECK_EQ(ring.reserveContiguous(&p, 16), 10);
+    ring.publish(4);
+
+    CHECK_EQ(ring.peekContiguous(&q, 16), 6);
+    CHECK_EQ(ring.peekContiguous(&q, 16, 6), 4);  // Past what's in hand
+    CHECK_EQ(ring.peekContiguous(&q, 16, 10), 0);
+    ring.commit(10);
+    CHECK_EQ(ring.consumeLen(), 0);
+}
+
+// One thread producing, one consuming, both in random sized pieces and each
+// side alternating between copying and in place access, for a couple of
+// seconds.  Every byte has to come out in order.  Sides yield when there's
+// nothing for them so it also gets somewhere on one core.
+static void ring_spsc_stress(void)
+{
+    Ring < 256 > ring(0xFFFFFFFF);
+    std::atomic < bool > stop(false);
+    std::atomic < uint32_t > produced(0);
+    uint32_t consumed = 0, errors = 0;
+
+    std::thread producer([&](void)
+    {
+        uint32_t seed = 1, n = 0;
+        uint8_t buf[256];
+
+        while (!stop)
+        {
+            uint16_t len = chunk(seed, sizeof(buf));
+            uint16_t got;
+
+            if (seed & 0x100)
+            {
+                for (uint16_t i = 0; i < len; i++)
+                    buf[i] = pattern(n + i);
+
+                got = ring.produce(buf, len, true);
+            }
+            else
+            {
+                uint8_t * p;
+                got = ring.reserveContiguous(&p, len);
+
+                for (uint16_t i = 0; i < got; i++)
+                    p[i] = pattern(n + i);
+
+                ring.publish(got);
+            }
+
+            if (got == 0)
+                std::this_thread::yield();
+
+            n += got;
+        }
+
+        produced = n;
+    });
+
+    std::thread consumer([&](void)
+    {
+        uint32_t seed = 2, n = 0;
+        uint8_t buf[256];
+
+        while (!stop || (n != produced))
+        {
+            uint16_t len = chunk(seed, sizeof(buf));
+            uint16_t got;
+
+            if (seed & 0x100)
+            {
+                got = ring.consume(buf, len, true);
+
+                for (uint16_t i = 0; i < got; i++)
+                    errors += (buf[i] != pattern(n + i));
+            }
+            else
+            {
+                uint8_t const * p;
+                got = ring.peekContiguous(&p, len);
+
+                for (uint16_t i = 0; i < got; i++)
+                    errors += (p[i] != pattern(n + i));
+
+                ring.commit(got);
+            }
+
+            if (got == 0)
+                std::this_thread::yield();
+
+            n += got;
+        }
+
+        consumed = n;
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop = true;
+
+    producer.join();
+    consumer.join();
+
+    printf("  %u bytes through\n", consumed);
+
+    CHECK_EQ(errors, 0);
+    CHECK(consumed != 0);
+    CHECK_EQ(consumed, produced.load());
+    CHECK_EQ(ring.consumeLen(), 0);
+}
+
+// Written blocks as Scsi keeps them, merged where they touch
+static void extents_merge(void)
+{
+    Extents < 4 > exts;
+
+    CHECK(exts.empty());
+
+    exts.add(10, 5);
+    exts.add(20, 5);
+    exts.add(15, 0);
+    CHECK_EQ(exts.count(), 2);
+
+    exts.add(15, 5);  // Touches both
+    CHECK_EQ(exts.count(), 1);
+    CHECK_EQ(exts[0].start, 10);
+    CHECK_EQ(exts[0].end, 25);
+
+    exts.add(0, 2);
+    exts.add(5, 10);  // Overlaps the start of [10, 25)
+    CHECK_EQ(exts.count(), 2);
+    CHECK_EQ(exts[0].start, 0);
+    CHECK_EQ(exts[1].start, 5);
+    CHECK_EQ(exts[1].end, 25);
+
+    CHECK(exts.overlaps(1, 1));
+    CHECK(!exts.overlaps(2, 3));
+    CHECK(exts.overlaps(2, 4));
+    CHECK(exts.overlaps(24, 100));
+    CHECK(!exts.overlaps(25, 100));
+
+    exts.add(UINT32_MAX - 1, 10);
+    CHECK_EQ(exts[exts.count() - 1].end, UINT32_MAX);
+
+    exts.clear();
+    CHECK(exts.empty());
+    CHECK(!exts.overlaps(0, UINT32_MAX));
+}
+
+// Past as many as are kept the two closest together are joined, so what's
+// kept always covers what was added
+static void extents_overflow(void)
+{
+    Extents < 4 > exts;
+
+    exts.add(0, 1);
+    exts.add(100, 1);
+    exts.add(200, 1);
+    exts.add(300, 1);
+    exts.add(150, 1);  // Closest to 100 and 200, joined with 100
+    CHECK_EQ(exts.count(), 4);
+    CHECK_EQ(exts[1].start, 100);
+    CHECK_EQ(exts[1].end, 151);
+
+    for (uint32_t i = 0; i < 1000; i += 7)
+        exts.add(i * 13, 2);
+
+    CHECK_EQ(exts.count(), 4);
+
+    for (uint32_t i = 0; i < 1000; i += 7)
+        CHECK(exts.overlaps(i * 13, 2));
+
+    for (uint8_t i = 1; i < exts.count(); i++)
+        CHECK(exts[i - 1].end < exts[i].start);
+}
+
+TEST_MAIN(
+    RUN(ring_copy_wraps);
+    RUN(ring_truncates_to_total);
+    RUN(ring_spans_stop_at_the_end);
+    RUN(ring_spsc_stress);
+    RUN(extents_merge);
+    RUN(extents_overflow);
+)
@@ -379,11 +379,19 @@ void UI::process(void)
     // Player second since both Alarm and Power rely on Player state.
     // Alarm third since Power relies on Alarm state.
 #ifdef USB_ENABLED
+    // Music that's playing when plugged in keeps playing, the host gets the
+    // card read-only and only when the player can spare it
+    _usb.share(_player.running());
+    _usb.lend(_player.spare(Player::_s_usb_msecs));
     _usb.process();
 #endif
     _player.process();
     _alarm.process(_controls.turn(ENC_SWI) != EV_ZERO, _controls.closed(SWI_ENC));
     _power.process(*_states[_state]);
+#ifdef USB_ENABLED
+    report();
+    rest();
+#endif
 
     ev_e bev = EV_ZERO;
 
@@ -546,6 +554,133 @@ UI::ps_e UI::pressState(uint32_t msecs)
         return PS_ALT_STATE;
 }
 
+#ifdef USB_ENABLED
+void UI::report(void)
+{
+    TDisk & dd = TDisk::acquire();
+
+    _report_loops++;
+
+    // Latencies are only recorded while someone's looking
+    if (!_usb.logging())
+    {
+        if (dd.profiling())
+            dd.profiling(false);
+
+        _report_mark = 0;
+        return;
+    }
+
+    uint32_t now = msecs();
+
+    if (_report_mark == 0)
+    {
+        dd.resetLatency();
+        dd.profiling(true);
+
+        _report_mark = now;
+        _report_loops = 0;
+        _report_commands = _usb.commands();
+        _report_bytes = _usb.bytes();
+        _report_copied = _usb.copied();
+        _report_rested = _rested;
+
+        return;
+    }
+
+    uint32_t elapsed = now - _report_mark;
+    if (elapsed < _s_report_msecs)
+        return;
+
+    // A line goes in the ring whole or not at all so it's put together first
+    char line[256];
+    uint16_t len = 0;
+
+    auto put = [&](char const * str) -> void
+    {
+        while ((*str != '\0') && (len < (sizeof(line) - 1)))
+            line[len++] = *str++;
+    };
+
+    auto num = [&](char const * name, uint32_t n) -> void
+    {
+        put(name);
+        put((char const *)itoa((int)n));
+    };
+
+    auto flush = [&](void) -> void
+    {
+        line[len] = '\0';
+        (void)_usb.log(line);
+        len = 0;
+    };
+
+    auto per_sec = [&](uint32_t n) -> uint32_t
+    {
+        return (uint32_t)(((uint64_t)n * 1000) / elapsed);
+    };
+
+    auto const & t = _player.telemetry();
+    uint32_t commands = _usb.commands();
+    uint32_t bytes = _usb.bytes();
+    uint32_t copied = _usb.copied();
+
+    num("t=", now);
+    num(" loops=", (_report_loops * 1000) / elapsed);
+    num(" underruns=", t.underruns);
+    num(" kbps=", t.kbps.last());
+    num(" fill=", t.fill.last());
+    num(" usb_cps=", per_sec(commands - _report_commands));
+    num(" usb_bps=", per_sec(bytes - _report_bytes));
+    // Copies per byte as a percentage, zero when everything went out of spans
+    num(" usb_copy_pct=", (bytes == _report_bytes) ? 0
+            : (uint32_t)(((uint64_t)(copied - _report_copied) * 100) / (bytes - _report_bytes)));
+    // Time spent waiting on interrupts, as good a proxy for current draw as
+    // there is without a meter on it
+    num(" rest_pct=", (uint32_t)(((uint64_t)(_rested - _report_rested) * 100) / ((uint64_t)elapsed * 1000)));
+    num(" dma_errors=", DMA::errors());
+    num(" files=", TFs::acquire().numFiles());
+    num(" dropped=", _usb.dropped());
+    put("\n");
+    flush();
+
+    auto lat = (TDisk::lat_e)_report_lat;
+    auto const & l = dd.latency(lat);
+
+    put("lat "); put(TDisk::latencyName(lat));
+    num(" n=", l.count);
+    num(" avg=", l.avg());
+    num(" max=", l.max);
+    put(" h=");
+    for (uint8_t i = 0; i < TDisk::Latency::buckets; i++)
+        num((i == 0) ? "" : ",", l.hist[i]);
+    put("\n");
+    flush();
+
+    if (++_report_lat == TDisk::LAT_CNT)
+        _report_lat = 0;
+
+    _report_mark = now;
+    _report_loops = 0;
+    _report_commands = commands;
+    _report_bytes = bytes;
+    _report_copied = copied;
+    _report_rested = _rested;
+}
+
+void UI::rest(void)
+{
+    if (!_usb.quiet() || _player.running() || _player.reloading() || _alarm.inProgress())
+        return;
+
+    TDisk::acquire().park();
+
+    uint32_t us = usecs();
+    SCB::waitForInterrupt();
+    _rested += usecs() - us;
+}
+#endif
+
 bool UI::pressing(void)
 {
     // Depressed states
@@ -1522,6 +1657,23 @@ void UI::Clock::uisWait(void)
         force = true;
     }
 
+    if (_state == CS_AUDIO)
+    {
+        if (!_ui._player.running())
+        {
+            _alt_display.disable();
+            _state = CS_TIME;
+            clockUpdate(true);
+            display();
+        }
+        else if (_ui._player.telemetry().samples != _audio_samples)
+        {
+            display();
+        }
+
+        return;
+    }
+
     if (_state >= CS_SHOW_TRACK)
     {
         if (_ui._controls.touching())
@@ -1549,6 +1701,13 @@ void UI::Clock::uisUpdate(ev_e ev)
         _ui._lighting.cycleNL(ev);
         uisWait();
     }
+    else if (_state == CS_AUDIO)
+    {
+        evUpdate < ap_e > (_audio_page, ev, AP_KBPS, (ap_e)(AP_CNT - 1));
+
+        _alt_display.reset(_s_audio_idle_time);
+        display();
+    }
     else
     {
         if (_state == CS_SHOW_TRACK)
@@ -1584,10 +1743,18 @@ void UI::Clock::uisChange(void)
 
     _state = _next_states[_state];
 
+    if ((_state == CS_AUDIO) && !_ui._player.running())
+        _state = _next_states[_state];
+
     if (_state == CS_SHOW_TRACK)
     {
         changeTrack();
     }
+    else if (_state == CS_AUDIO)
+    {
+        _audio_page = AP_KBPS;
+        _alt_display.reset(_s_audio_idle_time);
+    }
     else if (_state != CS_TIME)
     {
         _alt_display.reset(_s_flash_time);
@@ -1624,7 +1791,7 @@ void UI::Clock::uisRefresh(void)
 
 bool UI::Clock::uisPower(pwr_e pwr)
 {
-    if (_state == CS_SET_TRACK)
+    if ((_state == CS_SET_TRACK) || (_state == CS_AUDIO))
         return false;
     else if (pwr == PWR_NAP)
         _ui.dimScreens();
@@ -1712,6 +1879,47 @@ void UI::Clock::displayTrack(void)
         _ui._display.showInteger((_track + 1) % 10000, DF_LZ);
 }
 
+void UI::Clock::displayAudio(void)
+{
+    auto const & t = _ui._player.telemetry();
+
+    _audio_samples = t.samples;
+
+    if (t.samples == 0)
+    {
+        _ui._display.showDashes();
+        return;
+    }
+
+    auto pct = [](uint32_t n, uint32_t d) -> uint8_t
+    { uint32_t p = (n * 100) / d; return (p > 99) ? 99 : p; };
+
+    switch (_audio_page)
+    {
+        case AP_KBPS:
+            _ui._display.showInteger(t.kbps.last());
+            break;
+
+        case AP_FILL:
+            if (t.fill.count() == 0)
+                _ui._display.showOption("bF", "--");
+            else
+                _ui._display.showOption("bF", pct(t.fill.min(), VS1053_STREAM_BUF_WORDS * 2));
+            break;
+
+        case AP_UNDER:
+            _ui._display.showOption("Ur", (uint8_t)((t.underruns > 99) ? 99 : t.underruns));
+            break;
+
+        case AP_BLOCKED:
+            _ui._display.showOption("bL", pct(t.blocked.max(), 1000000));
+            break;
+
+        default:
+            break;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Clock END ///////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -2960,7 +3168,21 @@ bool UI::Player::init(void)
     if (_fs.busy())
         return false;
 
-    _num_tracks = _fs.sort(_track_exts);
+    drop();
+
+#ifdef USB_ENABLED
+    // After the host's had the card only the directories it wrote to are read
+    // again, the rest of the list carried over
+    if (_initialized && !_ui._usb.written().empty())
+    {
+        _num_tracks = _fs.resort(_ui._usb.written(), _track_exts, &_sniffer);
+
+        if (_num_tracks >= 0)
+            _ui._usb.clean();
+    }
+    else
+#endif
+        _num_tracks = _fs.sort(_track_exts, &_sniffer);
 
     if (_num_tracks > 0)
     {
@@ -2983,7 +3205,7 @@ bool UI::Player::init(void)
 
         _next_track = _current_track;
 
-        if ((_track == nullptr) && ((_track = _fs.open(_current_track)) == nullptr))
+        if ((_track == nullptr) && (((_track = _fs.open(_current_track)) == nullptr) || !cue(_track, _current_track)))
             error(ERR_PLAYER_OPEN_FILE);
     }
     else if (_num_tracks == 0)
@@ -3003,6 +3225,11 @@ bool UI::Player::init(void)
         if (_fs.list() < 0)
             error(ERR_PLAYER_LIST_FILES);
 
+        // First time seeing this card so profile it.  Not fatal if it fails
+        // since the defaults will be used.
+        if (!_fs.tuned())
+            (void)_fs.profile();
+
         _initialized = true;
     }
 
@@ -3011,6 +3238,8 @@ bool UI::Player::init(void)
 
 void UI::Player::cancel(bool close)
 {
+    drop();
+
     if (_track == nullptr)
         return;
 
@@ -3065,12 +3294,15 @@ void UI::Player::play(void)
         return;
     }
 
-    if (!running() && !_track->rewind())
+    if (!running() && !cue(_track, _current_track))
     {
         error(ERR_PLAYER_OPEN_FILE);
         return;
     }
 
+    if (!running())
+        _audio.resetTelemetry();
+
     start();
 }
 
@@ -3118,6 +3350,13 @@ bool UI::Player::pressing(void)
     if ((next_ptime < _s_skip_msecs) && (prev_ptime < _s_skip_msecs))
         return true;
 
+    // Held while playing scrubs through the track instead of skipping tracks
+    if (playing() && (_scrubbing || (format(_track) == FMT_MP3)))
+    {
+        scrub(next_ptime, prev_ptime);
+        return true;
+    }
+
     if (next_ptime >= _s_skip_msecs)
         next_ptime -= _s_skip_msecs;
 
@@ -3141,17 +3380,35 @@ void UI::Player::process(void)
     bool next_pressed = _ui._controls.pressed(SWI_NEXT);
     bool prev_pressed = _ui._controls.pressed(SWI_PREV);
 
+    // Letting go after scrubbing isn't a skip
+    if (_scrubbing && (next_pressed || prev_pressed))
+    {
+        _scrubbing = false;
+        next_pressed = prev_pressed = false;
+    }
+
 #ifdef USB_ENABLED
-    if (_ui._usb.active() && _playable)
+    if (_ui._usb.active() && !_ui._usb.shared() && _playable)
     {
         cancel(); stop();
         _playable = false;
+        _ui._usb.clean();
     }
     else if (reloading() && !_playable)
     {
         // Will fall into this after below.
         _playable = true;
     }
+    else if (!_ui._usb.active() && !_playable && _ui._usb.written().empty())
+    {
+        // Nothing was written so the tracks and their order are as they were
+        // and only the current one has to be opened again
+        if ((_num_tracks > 0) && (_track == nullptr)
+                && (((_track = _fs.open(_current_track)) == nullptr) || !cue(_track, _current_track)))
+            error(ERR_PLAYER_OPEN_FILE);
+
+        _playable = true;
+    }
     else if (!_ui._usb.active() && !_playable)
     {
         // Return here so "reloading" message is displayed
@@ -3182,7 +3439,15 @@ void UI::Player::process(void)
     else if (play_pressed)
     {
         if (_ui._controls.pressTime(SWI_PLAY) >= _s_stop_time)
+        {
             stop();
+
+            // Not under a host that's looking at the card
+#ifdef USB_ENABLED
+            if (!_ui._usb.active())
+#endif
+                (void)dump();
+        }
         else
             _paused = !_paused;
     }
@@ -3222,8 +3487,226 @@ void UI::Player::process(void)
             return;
     }
 
-    if (_audio.ready() && !_audio.send(_track, 32) && !_track->valid())
+    if (_audio.ready() && !_audio.send(_track, _s_send_len) && !_track->valid())
+    {
         error(ERR_PLAYER_AUDIO);
+        return;
+    }
+
+    prepare();
+    sample();
+}
+
+void UI::Player::sample(void)
+{
+    uint32_t now = msecs();
+
+    if ((now - _sample_mark) < _s_sample_msecs)
+        return;
+
+    _sample_mark = now;
+    _audio.sample();
+}
+
+// Telemetry for the session just stopped, along with the feed and gap stats.
+// The rolling figures cover the last minute or two of playing.
+int UI::Player::dump(void)
+{
+    File * file = _fs.open(_s_stats_name, O_WRITE | O_CREATE | O_TRUNC);
+    if (file == nullptr)
+        return -1;
+
+    File::Writer w(file);
+
+    auto gauge = [&](char const * name, Gauge const & g) -> void
+    {
+        w.put(name); w.put(" :"); w.num(g.last()); w.num(g.min()); w.num(g.max()); w.num(g.avg()); w.put("\n");
+    };
+
+    auto const & t = _audio.telemetry();
+    auto const & f = _audio.feedStats();
+    auto const & g = _audio.gapStats();
+
+    w.put("format "); w.put(_audio.format(t.hdat1));
+    w.put("\ndecode_time"); w.num(t.decode_time);
+    w.put("\nsamples"); w.num(t.samples);
+    w.put("\nunderruns"); w.num(t.underruns);
+    w.put("\n\n# name : last min max avg\n");
+    gauge("kbps", t.kbps);
+    gauge("stream_fill", t.fill);
+    gauge("feed_level", t.ring);
+    gauge("feed_bytes_per_sec", t.rate);
+    gauge("send_usecs_per_sec", t.blocked);
+    w.put("\nfeed :"); w.num(f.cycles); w.num(f.bytes); w.num(f.bursts); w.num(f.underruns); w.num(f.low_water);
+    w.put("\ngaps :"); w.num(g.transitions); w.num(g.gapless); w.num(g.resets); w.num(g.reset_time); w.num(g.last); w.num(g.max);
+    w.put("\n");
+
+    bool ok = w.flush();
+
+    file->close();
+
+    return ok ? 0 : -1;
+}
+
+// Opens the track that follows once the current one is nearly done so the
+// lookups and first sector read are out of the way at the change over.  If
+// both are MP3 the decoder is chained straight into the next one.  M4A can't
+// be since each file has its own header and index.  Put off while there's
+// too little queued for the decoder to cover it.
+void UI::Player::prepare(void)
+{
+    if ((_next != nullptr) || (_track == nullptr) || (_num_tracks < 2)
+            || skipping() || _track->eof() || (_track->remaining() > _s_next_lead)
+            || !spare(_s_next_msecs))
+        return;
+
+    _next_index = skipTracks(1);
+    _next = _fs.open(_next_index);
+    if ((_next != nullptr) && !cue(_next, _next_index))
+    {
+        _next->close();
+        _next = nullptr;
+    }
+
+    if (_next == nullptr)
+        return;
+
+    int f = format(_track);
+    if ((f == FMT_MP3) && (f == format(_next)))
+        _audio.chain(true);
+}
+
+void UI::Player::drop(void)
+{
+    _audio.chain(false);
+
+    if (_next == nullptr)
+        return;
+
+    _next->close();
+    _next = nullptr;
+}
+
+// The position is kept in the decoder's decode time, which is set to where
+// each jump lands so it carries on from there.
+void UI::Player::scrub(uint32_t next_ptime, uint32_t prev_ptime)
+{
+    bool forward = next_ptime >= prev_ptime;
+    uint32_t tick = ((forward ? next_ptime : prev_ptime) - _s_skip_msecs) / _s_scrub_msecs;
+    uint32_t pos = _track->offset();
+
+    if (!_scrubbing)
+    {
+        _scrubbing = true;
+        _scrub_tick = tick - 1;
+        _scrub_secs = _audio.decodeTime();
+
+        // No index, no scrubbing, until let go
+        TrackMeta meta;
+        bool indexed = trackMeta(_current_track, meta) ? _index.init(_track, meta) : _index.init(_track);
+        (void)_track->seek(pos);
+
+        if (!indexed)
+            return;
+    }
+
+    if (!_index.valid() || (tick == _scrub_tick) || (_index.duration() == 0))
+        return;
+
+    _scrub_tick = tick;
+
+    uint32_t doublings = tick / 8;
+    uint32_t step = _s_scrub_secs << ((doublings < 3) ? doublings : 3);
+    uint32_t secs;
+
+    if (forward)
+        secs = ((_scrub_secs + step) < _index.duration()) ? _scrub_secs + step : _index.duration() - 1;
+    else
+        secs = (_scrub_secs > step) ? _scrub_secs - step : 0;
+
+    if (secs == _scrub_secs)
+        return;
+
+    if (!_index.sync(_track, _index.offset(secs)))
+    {
+        (void)_track->seek(pos);
+        return;
+    }
+
+    _audio.jump();
+    _audio.setDecodeTime(secs);
+    _scrub_secs = secs;
+}
+
+// Rewinds and, for MP3, moves past any leading tags and trims off trailing
+// ones.  Where the leading ones end is taken from the scan if it got that far.
+// An M4A is swapped for a view of it without the artwork and with moov first.
+// If either can't be worked out it's played from the start as is.
+bool UI::Player::cue(File * & fp, int track)
+{
+    TrackMeta meta;
+
+    if (!fp->rewind())
+        return false;
+
+    switch (format(fp))
+    {
+        case FMT_MP3:
+            if (AudioTags::skip(fp, (trackMeta(track, meta) && (meta.codec == TrackMeta::CODEC_MP3)) ? (int)meta.start : -1) >= 0)
+                return true;
+            break;
+
+        case FMT_M4A:
+            if ((fp == &_views[0]) || (fp == &_views[1]))
+                return true;
+
+            for (auto & v : _views)
+            {
+                if (v.valid())
+                    continue;
+
+                if (AudioAtoms::plan(fp, v) > 0)
+                {
+                    fp = &v;
+                    return true;
+                }
+
+                break;
+            }
+            break;
+
+        default:
+            return true;
+    }
+
+    return fp->rewind();
+}
+
+int UI::Player::format(File const * fp) const
+{
+    String < NS > const & name = fp->name();
+
+    for (int i = 0; _track_exts[i] != nullptr; i++)
+    {
+        int index = name.rfind((chr_t *)_track_exts[i]);
+
+        if ((index > 0) && (name[index-1] == '.') && ((name.len() - (uint16_t)strlen(_track_exts[i])) == index))
+            return i;
+    }
+
+    return -1;
+}
+
+// The scan's record of the track, if there is one and it's this version's
+bool UI::Player::trackMeta(int track, TrackMeta & meta)
+{
+    if ((track < 0) || (track >= _num_tracks))
+        return false;
+
+    if (_fs.meta(track, (uint8_t *)&meta, sizeof(meta)) != (int)sizeof(meta))
+        return false;
+
+    return meta.valid();
 }
 
 bool UI::Player::rewind(void)
@@ -3268,7 +3751,7 @@ bool UI::Player::newTrack(void)
 
     if (_next_track == _current_track)
     {
-        if ((_track != nullptr) && _track->rewind())
+        if ((_track != nullptr) && cue(_track, _current_track))
             return true;
     }
 
@@ -3277,7 +3760,22 @@ bool UI::Player::newTrack(void)
     if (_track != nullptr)
         _track->close();
 
+    if ((_next != nullptr) && (_next_index == _current_track))
+    {
+        _track = _next;
+        _next = nullptr;
+        return true;
+    }
+
+    drop();
+
     _track = _fs.open(_current_track);
+    if ((_track != nullptr) && !cue(_track, _current_track))
+    {
+        _track->close();
+        _track = nullptr;
+    }
+
     if (_track == nullptr)
         error(ERR_PLAYER_OPEN_FILE);
 
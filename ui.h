@@ -360,6 +360,29 @@ class UI
         void updateBrightness(ev_e ev);
         void error(void);
 
+#ifdef USB_ENABLED
+        // Counters out the USB serial port while the host has it open, a line
+        // every _s_report_msecs along with one SD latency histogram, taking
+        // turns.  Only ever queued, see CdcIface.
+        void report(void);
+
+        // Plugged in with the host leaving the card alone and nothing else
+        // going on, so the SD bus is parked and the core sleeps until the next
+        // interrupt - SysTick's every millisecond so nothing polled goes amiss.
+        // Not a deep sleep since the USB module needs its clocks.
+        void rest(void);
+        uint32_t _rested = 0;  // usecs
+
+        static constexpr uint32_t const _s_report_msecs = 1000;
+        uint32_t _report_mark = 0;
+        uint32_t _report_loops = 0;
+        uint32_t _report_commands = 0;
+        uint32_t _report_bytes = 0;
+        uint32_t _report_copied = 0;
+        uint32_t _report_rested = 0;
+        uint8_t _report_lat = 0;
+#endif
+
         static constexpr uint32_t const _s_reset_blink_time = 300;
 
         static constexpr uint32_t const _s_press_change = 1500;
@@ -866,7 +889,9 @@ class UI
                 void displayDate(void);
                 void displayYear(void);
                 void displayTrack(void);
+                void displayAudio(void);
 
+                // CS_AUDIO only comes up while the player is running
                 enum cs_e : uint8_t
                 {
                     CS_TIME,
@@ -874,6 +899,7 @@ class UI
                     CS_YEAR,
                     CS_SHOW_TRACK,
                     CS_SET_TRACK,
+                    CS_AUDIO,
                     CS_CNT
                 };
 
@@ -881,9 +907,10 @@ class UI
                 {
                     CS_DATE,
                     CS_YEAR,
-                    CS_SHOW_TRACK,
+                    CS_AUDIO,
                     CS_TIME,
                     CS_SHOW_TRACK,
+                    CS_SHOW_TRACK,
                 };
 
                 using cs_display_action_t = void (Clock::*)(void);
@@ -894,8 +921,24 @@ class UI
                     &Clock::displayYear,
                     &Clock::displayTrack,
                     &Clock::displayTrack,
+                    &Clock::displayAudio,
                 };
 
+                // Audio telemetry, a page at a time - turning the encoder
+                // moves between them
+                enum ap_e : uint8_t
+                {
+                    AP_KBPS,     // Bitrate of the stream
+                    AP_FILL,     // "bF" - least the decoder's buffer has been, percent
+                    AP_UNDER,    // "Ur" - underruns
+                    AP_BLOCKED,  // "bL" - most of a second spent in send(), percent
+                    AP_CNT
+                };
+
+                ap_e _audio_page = AP_KBPS;
+                uint32_t _audio_samples = 0;
+                static constexpr uint32_t const _s_audio_idle_time = 30000;
+
                 cs_e _state = CS_TIME;
                 tClock _clock = {};
                 df_t _dflag = DF_12H;
@@ -1468,12 +1511,13 @@ class UI
                 bool paused(void) const { return _paused; }
                 bool running(void) const { return _audio.running(); }
                 bool stopped(void) const { return !running(); }
-                void stop(void) { if (running()) _audio.stop(); _paused = true; _stopping = false; }
+                void stop(void) { if (running()) _audio.stop(); drop(); _paused = true; _stopping = false; }
                 bool playing(void) const { return running() && !paused(); }
                 bool stopping(void) const { return _stopping; }
                 bool reloading(void) const { return _reloading; }
                 bool listing(void) const { return _listing; }
                 bool skipping(void) const { return _next_track != _current_track; }
+                bool scrubbing(void) const { return _scrubbing; }
                 bool occupied(void) const;
                 bool disabled(void) const { return _disabled; }
                 bool initialized(void) const { return _initialized; }
@@ -1482,6 +1526,12 @@ class UI
                 int currentTrack(void) const { return _current_track; }
                 int nextTrack(void) const { return _next_track; }
                 bool setTrack(int track);
+                bool trackMeta(int track, TrackMeta & meta);
+                TAudio::Telemetry const & telemetry(void) const { return _audio.telemetry(); }
+
+                // Disk work that would keep the main loop away for about msecs
+                // asks first.  Always true unless playing.
+                bool spare(uint32_t msecs) { return !playing() || _audio.spare(msecs); }
 
             private:
                 bool init(void);
@@ -1496,6 +1546,13 @@ class UI
                 int skip(uint32_t t);
                 int skipTracks(int skip);
                 void cancel(bool close = true);
+                void prepare(void);
+                void drop(void);
+                int format(File const * fp) const;
+                bool cue(File * & fp, int track);
+                void scrub(uint32_t next_ptime, uint32_t prev_ptime);
+                void sample(void);
+                int dump(void);
 
                 TAudio & _audio = TAudio::acquire();
                 TFs & _fs = TFs::acquire();
@@ -1503,6 +1560,15 @@ class UI
                 UI & _ui;
 
                 File * _track = nullptr;
+                File * _next = nullptr;  // Track after _track, opened before it ends
+                SpanFile _views[2];      // M4A laid out for the decoder, one each for the above
+                int _next_index = 0;
+                Mp3Index _index;         // For scrubbing through _track
+                TrackSniffer _sniffer;   // Fills in a TrackMeta for each track as they're sorted
+                uint32_t _scrub_secs = 0;
+                uint32_t _scrub_tick = 0;
+                uint32_t _sample_mark = 0;
+                bool _scrubbing = false;
                 bool _playable = true;
                 bool _paused = false;
                 bool _stopping = false;
@@ -1518,6 +1584,23 @@ class UI
                 static constexpr uint32_t const _s_stop_time = 2000;
                 static constexpr uint32_t const _s_list_time = 2000;
                 static constexpr uint32_t const _s_skip_msecs = 1024;
+                // Held past _s_skip_msecs while playing an MP3, next and prev jump
+                // this many seconds every _s_scrub_msecs, doubling every 8 jumps
+                static constexpr uint32_t const _s_scrub_msecs = 250;
+                static constexpr uint32_t const _s_scrub_secs = 5;
+                // Most to hand the audio device per pass - it only spins on DREQ with VS_FEED_POLLED
+                static constexpr uint16_t const _s_send_len = 512;
+                // Open the next track when the current one gets this close to the end
+                static constexpr uint32_t const _s_next_lead = 16384;
+                // Opening it walks the FAT and reads the tags at both ends
+                static constexpr uint32_t const _s_next_msecs = 40;
+                // Reading a block for the host while it shares the card
+                static constexpr uint32_t const _s_usb_msecs = 5;
+                // Audio telemetry is sampled this often while playing and written
+                // out when the player is stopped
+                static constexpr uint32_t const _s_sample_msecs = 1000;
+                static constexpr chr_t const * _s_stats_name = (chr_t const *)"audstats.txt";
+                enum fmt_e { FMT_MP3, FMT_M4A };  // Index into _track_exts
                 char const * const _track_exts[3] = { "MP3", "M4A", nullptr };
                 int _num_tracks = 0;
                 int _current_track = 0;
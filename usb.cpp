@@ -6,7 +6,7 @@
 // Buffer Descriptor Table (BDT) ///////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 __attribute__ ((section(".usbdescriptortable"), used))
-static BD bdt[EP_NUM_CNT * 4] = {};
+BD bdt[EP_NUM_CNT * 4] = {};
 
 ////////////////////////////////////////////////////////////////////////////////
 // EndPoint ////////////////////////////////////////////////////////////////////
@@ -130,6 +130,30 @@ void StreamPipeOut::enable(void)
     *_endptN |= USB_ENDPTn_EPHSHK | USB_ENDPTn_EPRXEN;
 }
 
+// ClearFeature(ENDPOINT_HALT).  The host starts over at DATA0 (USB 2.0 - 9.4.5)
+// so the BDs already armed for it have to as well, beginning with the one the
+// SIE takes next.  That's _bank unless it's waiting on a packet.
+void StreamPipeOut::unstall(void)
+{
+    StreamPipe::unstall();
+
+    uint8_t next = _bank;
+    if ((_bd[next]->addr == nullptr) && (_bd[next ^ 1]->addr != nullptr))
+        next ^= 1;
+
+    _dataX = DATA0;
+
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        BD * bd = _bd[next ^ i];
+        if (bd->addr == nullptr)
+            break;
+
+        bd->desc = (bd->desc & ~BD_DATA1) | BD_DATAX(_dataX);
+        _dataX ^= 1;
+    }
+}
+
 bool StreamPipeOut::give(UsbPkt * p)
 {
     if (_bd[_bank]->addr != nullptr)
@@ -153,9 +177,100 @@ void StreamPipeIn::enable(void)
     _dataX = DATA0;
     _bank = EVEN;
 
+    _span[EVEN] = _span[ODD] = false;
+    _span_taken = _span_sent;
+
     *_endptN |= USB_ENDPTn_EPHSHK | USB_ENDPTn_EPTXEN;
 }
 
+// Spans aren't packets so mustn't be released as one
+void StreamPipeIn::disable(void)
+{
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        if (_span[i])
+            _bd[i]->clear();
+
+        _span[i] = false;
+    }
+
+    StreamPipe::disable();
+}
+
+// ClearFeature(ENDPOINT_HALT).  A stall() is only ever put on a free BD which
+// mustn't be left owned with nothing to send, and the toggle starts over at
+// DATA0 (USB 2.0 - 9.4.5) unless something's already on its way.
+void StreamPipeIn::unstall(void)
+{
+    StreamPipe::unstall();
+
+    if (_bd[_bank]->addr == nullptr)
+        _bd[_bank]->clear();
+
+    if ((_bd[EVEN]->addr == nullptr) && (_bd[ODD]->addr == nullptr))
+        _dataX = DATA0;
+}
+
+uint16_t StreamPipeIn::spanSent(void)
+{
+    uint32_t sent = _span_sent;
+    uint16_t n = sent - _span_taken;
+
+    _span_taken = sent;
+
+    return n;
+}
+
+void StreamPipeIn::refill(void)
+{
+    if (_feed == nullptr)
+        return;
+
+    uint8_t const * p;
+
+    while (canSendSpan())
+    {
+        uint16_t n = _feed->feed(&p);
+        if ((n == 0) || !send(p, n))
+            break;
+    }
+}
+
+// The toggle and even/odd carry on from the first BD that didn't go, which
+// is the older of the two if both are waiting.  A stalled BD is left alone.
+void StreamPipeIn::flush(void)
+{
+    __disable_irq();
+
+    uint8_t next = (_bd[_bank]->addr != nullptr) ? _bank : (_bank ^ 1);
+
+    if (_bd[next]->addr != nullptr)
+    {
+        _dataX = (_bd[next]->desc & BD_DATA1) ? DATA1 : DATA0;
+        _bank = next;
+    }
+
+    UsbPkt * p;
+    while (_pkt_queue.dequeue(p))
+        UsbPkt::release(p);
+
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        if (_bd[i]->addr == nullptr)
+            continue;
+
+        if (!_span[i])
+            UsbPkt::release((UsbPkt *)_bd[i]->addr);
+
+        _span[i] = false;
+        _bd[i]->clear();
+    }
+
+    _span_taken = _span_sent;
+
+    __enable_irq();
+}
+
 bool StreamPipeIn::canSend(void)
 {
     return (_bd[0]->addr == nullptr)
@@ -232,17 +347,40 @@ void ControlPipe < EndPoint::N0 >::isr(dir_e dir, bank_e bank)
         case PID::SETUP:
             if (count != sizeof(req_t))
             {
-                stall();
+                halt();
                 return;
             }
 
+            // A Setup ends the STALL of a Request Error before it, USB 2.0 - 8.5.3.4
+            if (_bd[(IN << 1) | _tx_bank]->stalled())
+                _bd[(IN << 1) | _tx_bank]->clear();
+
             memcpy(&_req, p->buffer, sizeof(req_t));
+            _rx_wait = _rx_done = false;
             _state = SETUP;
             *_usb._ctl &= ~USB_CTL_TXSUSPENDTOKENBUSY;
             break;
 
         case PID::OUT:
-            // Host-to-device Status transaction
+            // Host-to-device Data transaction setup() is waiting on, otherwise
+            // it's the Status transaction
+            if (_rx_wait)
+            {
+                if (count > _req.wLength)
+                    count = _req.wLength;
+
+                memcpy(_data, p->buffer, count);
+                _dlen = count;
+
+                _rx_wait = false;
+                _rx_done = true;
+            }
+            // Data stage of a request already refused, in where the next
+            // Setup was to go
+            else if (p == _setup_pkt)
+            {
+                halt();
+            }
             break;
 
         case PID::IN:
@@ -260,7 +398,7 @@ void ControlPipe < EndPoint::N0 >::isr(dir_e dir, bank_e bank)
             break;
 
         default:
-            stall();
+            halt();
             break;
     }
 }
@@ -313,7 +451,27 @@ void ControlPipe < EndPoint::N0 >::setup(void)
 
     if ((type == RESERVED) || (type == VENDOR) || (recipient >= OTHER))
     {
-        stall();
+        halt();
+        return;
+    }
+
+    // Only class requests have a Data stage from the host and none need more
+    // than a packet.  Take it before handling the request.
+    if ((dir == OUT) && (_req.wLength != 0) && !_rx_done)
+    {
+        if (_rx_wait)
+            return;
+
+        if ((type != CLASS) || (_req.wLength > _status_pkt->size))
+        {
+            halt();
+            return;
+        }
+
+        _rx_wait = true;
+        _rx_bank ^= 1;
+        _bd[(OUT << 1) | _rx_bank]->set(_status_pkt->buffer, _status_pkt->size, DATA1);
+
         return;
     }
 
@@ -323,6 +481,15 @@ void ControlPipe < EndPoint::N0 >::setup(void)
     {
         success = MFC(_std_reqs[code])();
     }
+    else if ((type == CLASS) && (_req.wIndex == UsbDesc::Interface::cdc_comm_iface_number))
+    {
+        if (code == SET_LINE_CODING)
+            success = setLineCoding();
+        else if (code == GET_LINE_CODING)
+            success = getLineCoding();
+        else if (code == SET_CONTROL_LINE_STATE)
+            success = setControlLineState();
+    }
     else if (type == CLASS)
     {
         if (code == BOMSR)
@@ -331,13 +498,15 @@ void ControlPipe < EndPoint::N0 >::setup(void)
             success = getMaxLUN();
     }
 
+    _rx_done = false;
+
     if (!success)
     {
-        stall();
+        halt();
         return;
     }
 
-    // Not supporting SetDescriptor so the only OUT with data is SETUP
+    // Any Data stage from the host is already in so it's on to Status
     if (dir == OUT)
     {
         send(_status_pkt);
@@ -480,6 +649,20 @@ void ControlPipe < EndPoint::N0 >::tx(UsbPkt * p)
     }
 }
 
+// Request Error.  The host gets a STALL for the rest of the transfer and the
+// Setup that clears it has a BD to go into, which nothing else would give it.
+void ControlPipe < EndPoint::N0 >::halt(void)
+{
+    stall();
+
+    _state = STATUS;
+    _rx_wait = _rx_done = false;
+    _dataX = 0;
+
+    _rx_bank ^= 1;
+    _bd[(OUT << 1) | _rx_bank]->set(_setup_pkt->buffer, _setup_pkt->size, DATA0);
+}
+
 EndPoint * ControlPipe < EndPoint::N0 >::reqEP(void)
 {
     dir_e ep_dir;
@@ -542,7 +725,7 @@ bool ControlPipe < EndPoint::N0 >::getStatus(void)
     }
     else if (recipient == INTERFACE)
     {
-        if (_req.wIndex != UsbDesc::Interface::iface_number)
+        if (_req.wIndex >= UsbDesc::Configuration::num_ifaces)
             return false;
 
         // For some reason this is valid and zero is returned
@@ -708,9 +891,9 @@ bool ControlPipe < EndPoint::N0 >::getDescriptor(void)
         if (index != (UsbDesc::Configuration::conf_value - 1))
             return false;
 
-        static UsbDesc::BulkOnlyConfiguration boc;
-        _dlen = boc.conf.wTotalLength;
-        memcpy(_data, &boc, _dlen);
+        static UsbDesc::CompositeConfiguration cc;
+        _dlen = cc.conf.wTotalLength;
+        memcpy(_data, &cc, _dlen);
     }
 
     return true;
@@ -780,6 +963,7 @@ bool ControlPipe < EndPoint::N0 >::setConfiguration(void)
 
         _usb._state = Usb::CONFIGURED;
         _usb._iface.enable();
+        _usb._cdc.enable();
     }
     else if (_usb._state == Usb::CONFIGURED)
     {
@@ -789,8 +973,12 @@ bool ControlPipe < EndPoint::N0 >::setConfiguration(void)
             return false;
 
         _usb._iface.disable();
+        _usb._cdc.disable();
         if (_usb._state == Usb::CONFIGURED)
+        {
             _usb._iface.enable();
+            _usb._cdc.enable();
+        }
     }
 
     return true;
@@ -806,7 +994,7 @@ bool ControlPipe < EndPoint::N0 >::getInterface(void)
     if ((_usb._state == Usb::DEFAULT) || (_req.wValue != 0) || (_req.wLength != 1))
         return false;
 
-    if (_req.wIndex != UsbDesc::Interface::iface_number)
+    if (_req.wIndex >= UsbDesc::Configuration::num_ifaces)
         return false;
 
     _data[0] = UsbDesc::Interface::iface_alt;
@@ -826,12 +1014,12 @@ bool ControlPipe < EndPoint::N0 >::setInterface(void)
         return false;
 
     if ((_req.wValue != UsbDesc::Interface::iface_alt)
-            || (_req.wIndex != UsbDesc::Interface::iface_number))
+            || (_req.wIndex >= UsbDesc::Configuration::num_ifaces))
     {
         return false;
     }
 
-    // Only one interface and one alternate setting so don't need to do anything.
+    // Only one alternate setting for each interface so don't need to do anything.
 
     return true;
 }
@@ -905,15 +1093,90 @@ bool ControlPipe < EndPoint::N0 >::bomsr(void)
     return true;
 }
 
+bool ControlPipe < EndPoint::N0 >::setLineCoding(void)
+{
+    // Request Error
+    if ((_req.dir() != OUT) || (_req.recipient() != INTERFACE))
+        return false;
+
+    if ((_req.wValue != 0) || (_req.wLength != sizeof(CdcIface::LineCoding))
+            || (_dlen != sizeof(CdcIface::LineCoding)))
+    {
+        return false;
+    }
+
+    memcpy(&_usb._cdc.lineCoding(), _data, sizeof(CdcIface::LineCoding));
+
+    return true;
+}
+
+bool ControlPipe < EndPoint::N0 >::getLineCoding(void)
+{
+    // Request Error
+    if ((_req.dir() != IN) || (_req.recipient() != INTERFACE))
+        return false;
+
+    if ((_req.wValue != 0) || (_req.wLength == 0))
+        return false;
+
+    _dlen = sizeof(CdcIface::LineCoding);
+    memcpy(_data, &_usb._cdc.lineCoding(), _dlen);
+
+    return true;
+}
+
+bool ControlPipe < EndPoint::N0 >::setControlLineState(void)
+{
+    // Request Error
+    if ((_req.dir() != OUT) || (_req.recipient() != INTERFACE))
+        return false;
+
+    if (_req.wLength != 0)
+        return false;
+
+    _usb._cdc.lineState(_req.wValue);
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // BulkOnlyIface ///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 void BulkOnlyIface::process(void)
 {
+    // Whatever READ(10) data has gone out since last time can be let go,
+    // whichever state it's in now
+    uint16_t sent = _ep_in.spanSent();
+    if ((sent != 0) && (_scsi.commit(sent) < 0) && (_state == DATA))
+    {
+        _state = STATUS;
+        _status = FAILED;
+    }
+
+    // Between commands is when cached writes can go out
+    if (_state == COMMAND)
+        _scsi.idle();
+
     if (_state_actions[_state] != nullptr)
         MFC(_state_actions[_state])();
 }
 
+// Ready for the next CBW, BOT 3.1.  Nothing of the last command is left to go
+// out, spans especially since they point into the disk's buffer, or to be
+// taken for the next one.
+void BulkOnlyIface::reset(void)
+{
+    _ep_in.flush();
+
+    UsbPkt * p;
+    while (_ep_out.recv(p))
+        UsbPkt::release(p);
+
+    _state = COMMAND;
+    _discard = 0;
+    _scsi.reset();
+}
+
 void BulkOnlyIface::enable(void)
 {
     if (!_ep_out.enabled())
@@ -922,6 +1185,8 @@ void BulkOnlyIface::enable(void)
     if (!_ep_in.enabled())
         _ep_in.enable();
 
+    _ep_in.feed(this);
+
     if (!_scsi.ejected())
         _scsi.reset();
 
@@ -930,6 +1195,8 @@ void BulkOnlyIface::enable(void)
 
 void BulkOnlyIface::disable(void)
 {
+    flush();
+
     if (_ep_out.enabled())
         _ep_out.disable();
 
@@ -957,6 +1224,8 @@ void BulkOnlyIface::command(void)
     _tag = cbw->dCBWTag;
     _transfer_length = cbw->dCBWDataTransferLength;
     _transferred = 0;
+    _feed_failed = false;
+    _commands++;
 
     int ret = _scsi.request(cbw->CBWCB, cbw->bCBWCBLength);
 
@@ -975,11 +1244,33 @@ void BulkOnlyIface::command(void)
             _status = PASSED;
     }
 
+    // A failed command still has the Data stage the host is expecting.  It
+    // gets a STALL where it wants data, BOT 6.7.2, and what it sends is taken
+    // and dropped, BOT 6.7.3, so neither is mistaken for the next CBW.
+    if ((ret < 0) && (_transfer_length != 0))
+    {
+        if (_data_dir == EndPoint::IN)
+        {
+            _ep_in.stall();
+        }
+        else
+        {
+            _discard = _transfer_length;
+            _state = DATA;
+        }
+    }
+
     UsbPkt::release(p);
 }
 
 void BulkOnlyIface::data(void)
 {
+    if (_discard != 0)
+    {
+        discard();
+        return;
+    }
+
     int ret;
 
     if (_data_dir == EndPoint::OUT)
@@ -992,12 +1283,13 @@ void BulkOnlyIface::data(void)
         _state = STATUS;
         _status = (ret == SCSI_FAILED) ? FAILED : PHASE_ERROR;
     }
-    else if (ret != 0)
+    else
     {
         // Sanity check
         if ((uint32_t)ret > (_transfer_length - _transferred))
             ret = (int)(_transfer_length - _transferred);
 
+        // Spans are counted as they're fed
         _transferred += (uint32_t)ret;
 
         if ((_transferred == _transfer_length) || _scsi.done())
@@ -1008,65 +1300,151 @@ void BulkOnlyIface::data(void)
     }
 }
 
+// Takes everything the isr has queued since last time rather than a packet a
+// call so the OUT BDs get their packets back as soon as possible.
 int BulkOnlyIface::dataOut(void)
 {
     UsbPkt * p;
-    if (!_ep_out.peek(p))
-        return 0;
+    int total = 0;
 
-    uint16_t count;
-    if ((_transfer_length - _transferred) < p->count)
-        count = _transfer_length - _transferred;
-    else
-        count = p->count;
+    while (_ep_out.peek(p) && !_scsi.done())
+    {
+        uint32_t left = _transfer_length - _transferred - total;
+        if (left == 0)
+            break;
+
+        uint16_t count;
+        if (left < p->count)
+            count = left;
+        else
+            count = p->count;
+
+        int ret = _scsi.write(p->buffer, count);
+
+        if (ret != 0)
+        {
+            (void)_ep_out.recv(p);
+            UsbPkt::release(p);
+        }
 
-    int ret = _scsi.write(p->buffer, count);
+        if (ret < 0)
+            return ret;
+        else if (ret == 0)
+            break;
+
+        total += ret;
+    }
+
+    _copied += total;
+
+    return total;
+}
+
+// The residue stays the whole transfer since none of it was used
+void BulkOnlyIface::discard(void)
+{
+    UsbPkt * p;
 
-    if (ret != 0)
+    while ((_discard != 0) && _ep_out.recv(p))
     {
-        (void)_ep_out.recv(p);
+        _discard -= (p->count < _discard) ? p->count : _discard;
         UsbPkt::release(p);
     }
 
-    return ret;
+    if (_discard == 0)
+        _state = STATUS;
 }
 
 int BulkOnlyIface::dataIn(void)
 {
-    if (!_ep_in.canSend())
-        return 0;
+    if (_scsi.spanning())
+        return spanIn();
 
-    UsbPkt * p = UsbPkt::acquire();
-    if (p == nullptr)
+    int total = 0;
+
+    // Queue up as many as there are packets for, the isr keeps the BDs going
+    while (_ep_in.canSend() && !_scsi.done())
+    {
+        uint32_t left = _transfer_length - _transferred - total;
+        if (left == 0)
+            break;
+
+        UsbPkt * p = UsbPkt::acquire(_ep_in);
+        if (p == nullptr)
+            break;
+
+        uint16_t size;
+        if (left < p->size)
+            size = left;
+        else
+            size = p->size;
+
+        int ret = _scsi.read(p->buffer, size);
+
+        if (ret <= 0)
+        {
+            UsbPkt::release(p);
+
+            if (ret < 0)
+                return ret;
+
+            break;
+        }
+
+        p->count = (uint16_t)ret;
+        (void)_ep_in.send(p);  // Checked at top of loop
+
+        total += ret;
+    }
+
+    _copied += total;
+
+    return total;
+}
+
+// READ(10) data goes out of the SD card's DMA buffer with the BDs pointed
+// straight at it rather than being copied into packets first.  Once going the
+// bulk-in isr feeds itself, this only has to start it.
+int BulkOnlyIface::spanIn(void)
+{
+    _ep_in.refill();
+
+    return _feed_failed ? SCSI_FAILED : 0;
+}
+
+uint16_t BulkOnlyIface::feed(uint8_t const ** p)
+{
+    if ((_state != DATA) || (_data_dir != EndPoint::IN) || _feed_failed || !_scsi.spanning())
         return 0;
 
     uint16_t size;
-    if ((_transfer_length - _transferred) < p->size)
+    if ((_transfer_length - _transferred) < UsbPkt::size)
         size = _transfer_length - _transferred;
     else
-        size = p->size;
+        size = UsbPkt::size;
 
-    int ret = _scsi.read(p->buffer, size);
+    if (size == 0)
+        return 0;
 
+    int ret = _scsi.span(p, size);
     if (ret <= 0)
     {
-        UsbPkt::release(p);
-    }
-    else
-    {
-        p->count = (uint16_t)ret;
-        (void)_ep_in.send(p);  // Check done at beginning
+        _feed_failed = (ret < 0);
+        return 0;
     }
 
-    return ret;
+    _transferred += (uint32_t)ret;
+
+    return (uint16_t)ret;
 }
 
 void BulkOnlyIface::status(void)
 {
-    if (!_ep_in.canSend())
+    // Not until the host has cleared a stall from the Data stage
+    if (_ep_in.stalled() || !_ep_in.canSend())
         return;
 
-    UsbPkt * p = UsbPkt::acquire();
+    UsbPkt * p = UsbPkt::acquire(_ep_in);
     if (p == nullptr)
         return;
 
@@ -1076,12 +1454,102 @@ void BulkOnlyIface::status(void)
     csw.dCSWDataResidue = _transfer_length - _transferred;
     csw.bCSWStatus = _status;
 
+    _bytes += _transferred;
+
     p->set((uint8_t const *)&csw, sizeof(csw));
     (void)_ep_in.send(p);  // Check done at beginning
 
     _state = COMMAND;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// CdcIface ////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void CdcIface::process(void)
+{
+    // Nothing's done with what the host types, it just can't be left holding
+    // on to packets
+    UsbPkt * p;
+    while (_ep_out.recv(p))
+        UsbPkt::release(p);
+
+    // A packet at a time into whichever BD is free, never queued, so a host
+    // that isn't reading ties up two packets at most
+    while (open() && _ep_in.unqueued())
+    {
+        uint16_t len = _ring.consumeLen(UsbPkt::size);
+        if (len == 0)
+            return;
+
+        // A full packet with nothing after it leaves the host waiting for the
+        // rest of a transfer that isn't coming
+        if ((len == UsbPkt::size) && (_ring.consumeLen() == len))
+            len--;
+
+        if ((p = UsbPkt::acquire(_ep_in)) == nullptr)
+            return;
+
+        p->count = _ring.consume(p->buffer, len);
+        if (!_ep_in.send(p))
+        {
+            UsbPkt::release(p);
+            return;
+        }
+    }
+}
+
+void CdcIface::enable(void)
+{
+    if (!_ep_notify.enabled())
+        _ep_notify.enable();
+
+    if (!_ep_out.enabled())
+        _ep_out.enable();
+
+    if (!_ep_in.enabled())
+        _ep_in.enable();
+
+    _line_state = 0;
+}
+
+void CdcIface::disable(void)
+{
+    if (_ep_notify.enabled())
+        _ep_notify.disable();
+
+    if (_ep_out.enabled())
+        _ep_out.disable();
+
+    if (_ep_in.enabled())
+        _ep_in.disable();
+
+    _line_state = 0;
+}
+
+void CdcIface::lineState(uint16_t state)
+{
+    // Start fresh each time the port's opened
+    if (!open() && (state & _s_dtr))
+        _ring.clear();
+
+    _line_state = state;
+}
+
+uint16_t CdcIface::write(char const * str)
+{
+    if (!open())
+        return 0;
+
+    uint16_t len = strlen(str);
+    if (_ring.produce((uint8_t *)str, len) != len)
+    {
+        _dropped += len;
+        return 0;
+    }
+
+    return len;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Usb /////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -1140,6 +1608,11 @@ void Usb::process(void)
 {
     if (idle())
     {
+        // Host is gone so whatever it wrote has to be on the disk before
+        // anything else goes looking for it, nor is anyone left to read ahead for
+        _iface.flush();
+        _iface.park();
+
         if (suspended() && !_iface.active())
             _iface.reset();
 
@@ -1150,6 +1623,7 @@ void Usb::process(void)
 
     _ep0.process();
     _iface.process();
+    _cdc.process();
 
     NVIC::enable(IRQ_USBOTG);
 }
@@ -1192,6 +1666,14 @@ void Usb::isr(void)
     *_istat = 0xFF;
 }
 
+bool Usb::quiet(void) const
+{
+    if (!connected() || !_iface.parked())
+        return false;
+
+    return suspended() || ((msecs() - _iface.lastCommand()) >= _s_quiet_msecs);
+}
+
 void Usb::usbrst(void)
 {
     // Have to do this since upon ejecting Windows will send a request and reset
@@ -1201,6 +1683,13 @@ void Usb::usbrst(void)
     EndPoint::reset();
     _ep0.enable();
 
+    // Host has to open the port again
+    _cdc.lineState(0);
+
+    // Transceiver out of suspend, RESUMEEN goes with _inten below
+    *_usbctrl &= ~USB_USBCTRL_SUSP;
+    *_usbtrc0 &= ~USB_USBTRC0_USBRESMEN;
+
     // Clear any pending interrupts
     *_errstat = 0xFF;
     *_istat = 0xFF;
@@ -1292,6 +1781,17 @@ void Usb::sleep(void)
     // Puts device in SUSPENDED state.
     _suspended = true;
 
+    // USB 2.0 - 7.1.7.6 Suspending
+    //
+    // A device has to draw no more than 2.5 mA from the bus when suspended so
+    // the transceiver goes into its low power mode and the RESUME interrupt is
+    // turned on since SOFs, which would otherwise clear _suspended, won't come
+    // in until the host resumes the bus.  The asynchronous resume is for when
+    // the module's clock isn't running, doesn't hurt when it is.
+    *_usbtrc0 |= USB_USBTRC0_USBRESMEN;
+    *_usbctrl |= USB_USBCTRL_SUSP;
+    *_inten |= USB_INTEN_RESUMEEN;
+
     // USB 2.0 - 7.1.7.7 Resume
     //
     // A device with remote wakeup capability may not generate resume signaling
@@ -1310,19 +1810,18 @@ void Usb::sleep(void)
     // *_ctl |= USB_CTL_RESUME;
     // delay(5);  // Between 1 ms and 15 ms
     // *_ctl &= ~USB_CTL_RESUME;
-    //
-    // Enable RESUME interrupt only if remote wakeup is enabled
-    // *_inten |= USB_INTEN_RESUMEEN;
 }
 
 void Usb::resume(void)
 {
-    // Only set if remote wakeup is enabled.  The USB_ISTAT_RESUME flag can get
-    // set regardless of whether or not an interrupt is set to be generated.
-    // _suspended = false;
+    // The USB_ISTAT_RESUME flag can get set regardless of whether or not an
+    // interrupt is set to be generated so this can come in while not
+    // suspended, in which case there's nothing to undo.
+    _suspended = false;
 
-    // Disable RESUME interrupt only necessary if remote wakeup is enabled
-    // *_inten &= ~USB_INTEN_RESUMEEN;
+    *_inten &= ~USB_INTEN_RESUMEEN;
+    *_usbctrl &= ~USB_USBCTRL_SUSP;
+    *_usbtrc0 &= ~USB_USBTRC0_USBRESMEN;
 }
 
 void Usb::stall(void)
@@ -10,8 +10,11 @@
 #define BULK_IN_EP_NUM   EndPoint::N1
 #define BULK_OUT_EP_NUM  EndPoint::N1
 
-// Endpoint 0 and number of Bulk EP numbers
-#define EP_NUM_CNT  2
+#define CDC_NOTIFY_EP_NUM  EndPoint::N2
+#define CDC_DATA_EP_NUM    EndPoint::N3
+
+// Endpoint 0, the Bulk-Only EP number and the two CDC-ACM ones
+#define EP_NUM_CNT  4
 
 #define MAX_PKT_SIZE  MPS_64
 #define NUM_USB_PKTS  32
@@ -68,9 +71,9 @@
 #define USB_ADDR_ADDR(r) ((r) & 0x7F)
 #define USB_ADDR_LSEN    (1 << 7)
 
-#define USB_BDTPAGE1(addr)  (uint8_t)(((uint32_t)(addr) >> 8))
-#define USB_BDTPAGE2(addr)  (uint8_t)(((uint32_t)(addr) >> 16))
-#define USB_BDTPAGE3(addr)  (uint8_t)(((uint32_t)(addr) >> 24))
+#define USB_BDTPAGE1(addr)  (uint8_t)(((uintptr_t)(addr) >> 8))
+#define USB_BDTPAGE2(addr)  (uint8_t)(((uintptr_t)(addr) >> 16))
+#define USB_BDTPAGE3(addr)  (uint8_t)(((uintptr_t)(addr) >> 24))
 
 #define USB_ENDPTn_EPHSHK  (1 << 0)
 #define USB_ENDPTn_EPSTALL (1 << 1)
@@ -169,9 +172,13 @@ struct BD
     void clear(void) { desc = 0; addr = nullptr; }
     void stall(void) { desc |= BD_BDT_STALL | BD_OWN; }
     void unstall(void) { desc &= ~BD_BDT_STALL; }
+    bool stalled(void) const { return desc & BD_BDT_STALL; }
 
 } __attribute__ ((packed));
 
+// Four per endpoint, indexed (num << 2) | (dir << 1) | odd, see usb.cpp
+extern BD bdt[EP_NUM_CNT * 4];
+
 ////////////////////////////////////////////////////////////////////////////////
 // EndPoint ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -246,7 +253,9 @@ struct UsbDesc
         ENDPOINT,
         DEVICE_QUALIFIER,
         OTHER_SPEED_CONFIGURATION,
-        INTERFACE_POWER
+        INTERFACE_POWER,
+        INTERFACE_ASSOCIATION = 0x0B,
+        CS_INTERFACE = 0x24,  // Class-specific, i.e. CDC Functional Descriptors
     };
 
     // USB Device Class codes
@@ -323,9 +332,9 @@ struct UsbDesc
         uint8_t const bLength = sizeof(Device);
         uint8_t const bDescriptorType = DEVICE;
         uint16_t const bcdUSB = usb_version;
-        uint8_t const bDeviceClass = USE_IFACE_INFO;
-        uint8_t const bDeviceSubClass = USE_IFACE_INFO;
-        uint8_t const bDeviceProtocol = USE_IFACE_INFO;
+        uint8_t const bDeviceClass = MISC;
+        uint8_t const bDeviceSubClass = iad_subclass;
+        uint8_t const bDeviceProtocol = iad_protocol;
         uint8_t const bMaxPacketSize0 = MAX_PKT_SIZE;
         uint16_t const idVendor = vendor_id;
         uint16_t const idProduct = product_id;
@@ -340,11 +349,16 @@ struct UsbDesc
         // 1.1 full/low speed, 2.0 high speed - This is a full speed device
         static constexpr uint16_t const usb_version = 0x0101;    // Version 1.1
         static constexpr uint16_t const vendor_id = 0x16C0;      // Taken from Teensy code
-        static constexpr uint16_t const product_id = 0x0001;     // Arbitrary
+        static constexpr uint16_t const product_id = 0x0002;     // Arbitrary, changed with going composite
         static constexpr uint16_t const device_release = 0x0100; // 1.0
 
         static constexpr uint8_t const num_confs = 1;
 
+        // Tells the host there are Interface Association Descriptors to look
+        // for, needed for it to group the two CDC interfaces into one function
+        static constexpr uint8_t const iad_subclass = 0x02;
+        static constexpr uint8_t const iad_protocol = 0x01;
+
     } __attribute__ ((packed));
 
     struct Configuration
@@ -369,7 +383,7 @@ struct UsbDesc
 
         static constexpr uint8_t const attrs = RSVD_ONE;
         static constexpr uint8_t const max_power = 250;  // 500 mA
-        static constexpr uint8_t const num_ifaces = 1;
+        static constexpr uint8_t const num_ifaces = 3;
         static constexpr uint8_t const conf_value = 1;
 
         Configuration(uint16_t total_length) : wTotalLength(total_length) {}
@@ -412,10 +426,21 @@ struct UsbDesc
             MSP_VS = 0xFF,
         };
 
+        // CDC Subclass codes - only the one used
+        enum cdcs_e : uint8_t { ACM = 0x02 };
+
+        // CDC Protocol codes - only the one used
+        enum cdcp_e : uint8_t { NO_PROTOCOL, V250 };
+
         static constexpr uint8_t const iface_number = 0;
+        static constexpr uint8_t const cdc_comm_iface_number = 1;
+        static constexpr uint8_t const cdc_data_iface_number = 2;
         static constexpr uint8_t const iface_alt = 0;
 
         Interface(uint8_t num_eps) : bNumEndpoints{num_eps} {}
+        Interface(uint8_t num, uint8_t num_eps, uint8_t cls, uint8_t subclass, uint8_t protocol)
+            : bInterfaceNumber{num}, bNumEndpoints{num_eps}, bInterfaceClass{cls},
+              bInterfaceSubClass{subclass}, bInterfaceProtocol{protocol} {}
 
     } __attribute__ ((packed));
 
@@ -432,26 +457,125 @@ struct UsbDesc
 
         using num_e = EndPoint::num_e;
         using dir_e = EndPoint::dir_e;
+        using type_e = EndPoint::type_e;
 
         Endpoint(num_e num, dir_e dir) : bEndpointAddress((dir << 7) | num) {}
+        Endpoint(num_e num, dir_e dir, type_e type, uint8_t interval)
+            : bEndpointAddress((dir << 7) | num), bmAttributes{type}, bInterval{interval} {}
+
+    } __attribute__ ((packed));
+
+    // Interface Association Descriptor ECN
+    struct InterfaceAssociation
+    {
+        uint8_t const bLength = sizeof(InterfaceAssociation);
+        uint8_t const bDescriptorType = INTERFACE_ASSOCIATION;
+        uint8_t const bFirstInterface;
+        uint8_t const bInterfaceCount;
+        uint8_t const bFunctionClass;
+        uint8_t const bFunctionSubClass;
+        uint8_t const bFunctionProtocol;
+        uint8_t const iFunction = 0;
+
+        ////////////////////////////////////////////////////////////////////////
+
+        InterfaceAssociation(uint8_t first, uint8_t count, uint8_t cls, uint8_t subclass, uint8_t protocol)
+            : bFirstInterface{first}, bInterfaceCount{count}, bFunctionClass{cls},
+              bFunctionSubClass{subclass}, bFunctionProtocol{protocol} {}
+
+    } __attribute__ ((packed));
+
+    // CDC 1.2 - 5.2.3 Functional Descriptors
+    // Descriptor Subtypes
+    enum cdcfd_e : uint8_t
+    {
+        CDC_HEADER,
+        CDC_CALL_MANAGEMENT,
+        CDC_ACM,
+        CDC_UNION = 0x06,
+    };
+
+    struct CdcHeader
+    {
+        uint8_t const bFunctionLength = sizeof(CdcHeader);
+        uint8_t const bDescriptorType = CS_INTERFACE;
+        uint8_t const bDescriptorSubtype = CDC_HEADER;
+        uint16_t const bcdCDC = 0x0110;  // Version 1.1
+
+    } __attribute__ ((packed));
+
+    struct CdcCallManagement
+    {
+        uint8_t const bFunctionLength = sizeof(CdcCallManagement);
+        uint8_t const bDescriptorType = CS_INTERFACE;
+        uint8_t const bDescriptorSubtype = CDC_CALL_MANAGEMENT;
+        uint8_t const bmCapabilities = 0;  // Doesn't handle call management
+        uint8_t const bDataInterface = Interface::cdc_data_iface_number;
+
+    } __attribute__ ((packed));
+
+    struct CdcAcm
+    {
+        uint8_t const bFunctionLength = sizeof(CdcAcm);
+        uint8_t const bDescriptorType = CS_INTERFACE;
+        uint8_t const bDescriptorSubtype = CDC_ACM;
+        // Supports Set_Line_Coding, Set_Control_Line_State, Get_Line_Coding
+        uint8_t const bmCapabilities = 0x02;
+
+    } __attribute__ ((packed));
+
+    struct CdcUnion
+    {
+        uint8_t const bFunctionLength = sizeof(CdcUnion);
+        uint8_t const bDescriptorType = CS_INTERFACE;
+        uint8_t const bDescriptorSubtype = CDC_UNION;
+        uint8_t const bControlInterface = Interface::cdc_comm_iface_number;
+        uint8_t const bSubordinateInterface0 = Interface::cdc_data_iface_number;
 
     } __attribute__ ((packed));
 
-    struct BulkOnlyConfiguration
+    // Mass Storage Bulk-Only interface first so it stays interface 0, then a
+    // CDC-ACM serial port the counters go out on.  The notification endpoint
+    // is never sent on but has to be there.
+    struct CompositeConfiguration
     {
         Configuration const conf;
+
         Interface const iface;
         Endpoint const bulk_in;
         Endpoint const bulk_out;
 
+        InterfaceAssociation const cdc_iad;
+        Interface const cdc_comm;
+        CdcHeader const cdc_header;
+        CdcCallManagement const cdc_call_management;
+        CdcAcm const cdc_acm;
+        CdcUnion const cdc_union;
+        Endpoint const cdc_notify;
+        Interface const cdc_data;
+        Endpoint const cdc_out;
+        Endpoint const cdc_in;
+
         ////////////////////////////////////////////////////////////////////////
 
         static constexpr uint8_t const num_eps = 2;
+        static constexpr uint8_t const cdc_comm_num_eps = 1;
+        static constexpr uint8_t const cdc_data_num_eps = 2;
+        static constexpr uint8_t const cdc_notify_interval = 255;  // msecs
 
-        BulkOnlyConfiguration(void)
-            : conf(sizeof(BulkOnlyConfiguration)), iface(num_eps),
+        CompositeConfiguration(void)
+            : conf(sizeof(CompositeConfiguration)), iface(num_eps),
               bulk_in(BULK_IN_EP_NUM, EndPoint::IN),
-              bulk_out(BULK_OUT_EP_NUM, EndPoint::OUT) {}
+              bulk_out(BULK_OUT_EP_NUM, EndPoint::OUT),
+              cdc_iad(Interface::cdc_comm_iface_number, 2, CDC_CONTROL, Interface::ACM, Interface::V250),
+              cdc_comm(Interface::cdc_comm_iface_number, cdc_comm_num_eps,
+                      CDC_CONTROL, Interface::ACM, Interface::V250),
+              cdc_header(), cdc_call_management(), cdc_acm(), cdc_union(),
+              cdc_notify(CDC_NOTIFY_EP_NUM, EndPoint::IN, EndPoint::INTERRUPT, cdc_notify_interval),
+              cdc_data(Interface::cdc_data_iface_number, cdc_data_num_eps,
+                      CDC_DATA, Interface::NO_PROTOCOL, Interface::NO_PROTOCOL),
+              cdc_out(CDC_DATA_EP_NUM, EndPoint::OUT),
+              cdc_in(CDC_DATA_EP_NUM, EndPoint::IN) {}
 
     } __attribute__ ((packed));
 };
@@ -479,6 +603,7 @@ class UsbPacket
         uint16_t set(uint8_t const * data, uint16_t dlen);
 
         static uint8_t available(void) { return (_s_available == 0) ? 0 : N - __builtin_ctz(_s_available); }
+        static uint8_t free(void) { return __builtin_popcount(_s_available); }
         static constexpr uint16_t const size = S;
 
         UsbPacket(UsbPacket const &) = delete;
@@ -497,6 +622,11 @@ class UsbPacket
         static uint32_t volatile _s_need;
 
         static constexpr uint32_t const _s_max_available = 0xFFFFFFFF;
+
+        // Kept back from anything but control endpoints so bulk traffic can't
+        // leave EP0 without packets to answer the host with.
+        static constexpr uint8_t const _s_reserved = 4;
+        static bool allowed(EndPoint & ep) { return (ep._type == EndPoint::CONTROL) || (free() > _s_reserved); }
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -515,7 +645,7 @@ class StreamPipe : public EndPoint
 
         virtual void stall(void) { _bd[_bank]->stall(); }
         virtual void unstall(void) { _bd[_bank]->unstall(); EndPoint::unstall(); }
-        //virtual bool stalled(void);
+        virtual bool stalled(void) { return _bd[_bank]->stalled() || EndPoint::stalled(); }
 
         virtual bool peek(UsbPkt * & pkt) { return _pkt_queue.first(pkt); }
 
@@ -542,7 +672,7 @@ class StreamPipeOut : public StreamPipe
         virtual void isr(dir_e dir, bank_e bank) = 0;
 
         //virtual void stall(void);
-        //virtual void unstall(void);
+        virtual void unstall(void);
         //virtual bool stalled(void);
 
         //virtual bool peek(UsbPkt * & pkt);
@@ -563,13 +693,13 @@ class StreamPipeIn : public StreamPipe
         StreamPipeIn(num_e num, type_e type) : StreamPipe(num, type, IN) {}
 
         virtual void enable(void);
-        //virtual void disable(void);
+        virtual void disable(void);
         //virtual bool enabled(void);
 
         virtual void isr(dir_e dir, bank_e bank) = 0;
 
         //virtual void stall(void);
-        //virtual void unstall(void);
+        virtual void unstall(void);
         //virtual bool stalled(void);
 
         //virtual bool peek(UsbPkt * & pkt);
@@ -577,8 +707,40 @@ class StreamPipeIn : public StreamPipe
         virtual bool send(UsbPkt * pkt) = 0;
         virtual bool canSend(void);
 
+        // Nothing queued and the next BD free, i.e. a send goes straight out
+        bool unqueued(void) { return _pkt_queue.isEmpty() && (_bd[_bank]->addr == nullptr); }
+
+        // Sends straight out of data, e.g. a DMA buffer, rather than a packet.
+        // Only when nothing is queued ahead of it so it's in order.  The data
+        // has to stay put until spanSent() says it's gone.
+        virtual bool send(uint8_t const * data, uint16_t dlen) = 0;
+        bool canSendSpan(void) { return unqueued(); }
+        uint16_t spanSent(void);  // Bytes sent by the above since last called
+
+        // Hands out the next span to send, or 0 if there isn't one yet.  Called
+        // from isr() as soon as a BD frees up so both stay busy without waiting
+        // on the main loop.
+        class Feed
+        {
+            public:
+                virtual uint16_t feed(uint8_t const ** p) = 0;
+        };
+
+        void feed(Feed * f) { _feed = f; }
+        void refill(void);
+
+        // Drops whatever's queued or in a BD that hasn't gone out yet
+        void flush(void);
+
     protected:
         virtual bool give(UsbPkt * p) { return false; }
+
+        Feed * _feed = nullptr;
+
+        // Set for a BD pointed at a span rather than a packet
+        bool volatile _span[2] = { false, false };
+        uint32_t volatile _span_sent = 0;
+        uint32_t _span_taken = 0;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -634,6 +796,23 @@ class BulkPipe < N, EndPoint::IN > : public StreamPipeIn
 
         virtual bool send(UsbPkt * p);
         //virtual bool canSend(void);
+
+        virtual bool send(uint8_t const * data, uint16_t dlen);
+
+    protected:
+        BulkPipe(type_e type) : StreamPipeIn(N, type) {}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// InterruptPipe < IN > ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// At full speed it's no different from bulk as far as the BDs go, it's only
+// the host that polls it on a schedule instead of when it has bandwidth.
+template < EndPoint::num_e N >
+class InterruptPipe : public BulkPipe < N, EndPoint::IN >
+{
+    public:
+        InterruptPipe(void) : BulkPipe < N, EndPoint::IN > (EndPoint::INTERRUPT) {}
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -718,6 +897,14 @@ class ControlPipe < EndPoint::N0 > : public MessagePipe
             BOMSR,  // Bulk-Only Mass Storage Reset
         };
 
+        // CDC PSTN Request Codes - only what ACM with line coding needs
+        enum cdcrc_e : uint8_t
+        {
+            SET_LINE_CODING = 0x20,
+            GET_LINE_CODING,
+            SET_CONTROL_LINE_STATE,
+        };
+
         // Request Type
         enum rt_e : uint8_t { STANDARD, CLASS, VENDOR, RESERVED };
 
@@ -765,6 +952,11 @@ class ControlPipe < EndPoint::N0 > : public MessagePipe
         alignas(4) uint8_t _data[1024];
         bool volatile _set_address = false;
 
+        // Data stage of a class request from the host, e.g. SetLineCoding.
+        // Waiting on it then got it, the isr copies it into _data.
+        bool volatile _rx_wait = false;
+        bool volatile _rx_done = false;
+
         using state_action_t = void (ControlPipe::*)(void);
         state_action_t const _state_actions[3] =
         {
@@ -793,6 +985,7 @@ class ControlPipe < EndPoint::N0 > : public MessagePipe
 
         void setup(void);
         void data(void);
+        void halt(void);
 
         bool isFreeBD(dir_e dir, bank_e bank) { return _bd[(dir << 1) | bank]->addr == nullptr; }
         bool send(UsbPkt * p);
@@ -815,6 +1008,11 @@ class ControlPipe < EndPoint::N0 > : public MessagePipe
         bool getMaxLUN(void);
         bool bomsr(void);  // Bulk-Only Mass Storage Reset
 
+        // CDC-ACM Requests
+        bool setLineCoding(void);
+        bool getLineCoding(void);
+        bool setControlLineState(void);
+
         // Helpers to verify and return request endpoint
         EndPoint * reqEP(void);  // Checks for any endpoint type
         EndPoint * reqEP(type_e type);  // Checks for specific endpoint type
@@ -824,7 +1022,7 @@ class ControlPipe < EndPoint::N0 > : public MessagePipe
 ////////////////////////////////////////////////////////////////////////////////
 // BulkOnlyIface ///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-class BulkOnlyIface
+class BulkOnlyIface : public StreamPipeIn::Feed
 {
     public:
         enum status_e : uint8_t { PASSED, FAILED, PHASE_ERROR };
@@ -858,10 +1056,30 @@ class BulkOnlyIface
         BulkOnlyIface(void) = default;
 
         void process(void);
-        void reset(void) { _state = COMMAND; _scsi.reset(); }
+        void reset(void);
         void enable(void);
         void disable(void);
         bool active(void) const { return _scsi.active() && !_scsi.ejected(); }
+        void flush(void) { (void)_scsi.flush(); }
+
+        // Between commands with nothing open on the card
+        void park(void) { if (_state == COMMAND) _scsi.park(); }
+        bool parked(void) const { return (_state == COMMAND) && _scsi.parked(); }
+        uint32_t lastCommand(void) const { return _scsi.lastCommand(); }
+
+        void share(bool on) { _scsi.share(on); }
+        bool shared(void) const { return _scsi.shared(); }
+        void lend(bool on) { _scsi.lend(on); }
+        TExtents const & written(void) const { return _scsi.written(); }
+        void clean(void) { _scsi.clean(); }
+        // Running counts for gauging the data path - commands taken, bytes
+        // moved and how many of those were copied through a packet rather
+        // than sent straight out of the SD card's buffer
+        uint32_t commands(void) const { return _commands; }
+        uint32_t bytes(void) const { return _bytes; }
+        uint32_t copied(void) const { return _copied; }
+
+        virtual uint16_t feed(uint8_t const ** p);
 
     private:
         state_e _state = COMMAND;
@@ -869,7 +1087,12 @@ class BulkOnlyIface
         EndPoint::dir_e _data_dir;
         uint32_t _tag = 0;
         uint32_t _transfer_length = 0;
-        uint32_t _transferred = 0;
+        uint32_t volatile _transferred = 0;
+        bool volatile _feed_failed = false;
+        uint32_t _discard = 0;  // Bytes of a failed command's Data-Out left to drop
+        uint32_t _commands = 0;
+        uint32_t _bytes = 0;
+        uint32_t _copied = 0;
 
         using BulkOutEP = BulkPipe < BULK_OUT_EP_NUM, EndPoint::OUT >;
         using BulkInEP  = BulkPipe < BULK_IN_EP_NUM, EndPoint::IN >;
@@ -896,6 +1119,69 @@ class BulkOnlyIface
 
         int dataOut(void);
         int dataIn(void);
+        int spanIn(void);
+        void discard(void);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// CdcIface ////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// A serial port for text going to the host, e.g. counters.  What's written goes
+// into a ring and out from process() so writing never waits on the host, if the
+// ring's full the line is dropped instead.  Only takes anything while the host
+// has the port open so nothing stale is waiting for it when it does.
+class CdcIface
+{
+    public:
+        // CDC PSTN 6.3.11 - Line Coding Structure.  Means nothing over USB but
+        // the host wants back what it set.
+        struct LineCoding
+        {
+            uint32_t dwDTERate = 115200;
+            uint8_t bCharFormat = 0;  // 1 stop bit
+            uint8_t bParityType = 0;  // None
+            uint8_t bDataBits = 8;
+
+        } __attribute__ ((packed));
+
+        ////////////////////////////////////////////////////////////////////////
+
+        CdcIface(void) = default;
+
+        void process(void);
+        void enable(void);
+        void disable(void);
+
+        // Host has the port open, i.e. has set DTR
+        bool open(void) const { return _line_state & _s_dtr; }
+
+        // All or nothing, returns what was taken
+        uint16_t write(char const * str);
+        uint32_t dropped(void) const { return _dropped; }
+
+        LineCoding & lineCoding(void) { return _line_coding; }
+        void lineState(uint16_t state);
+
+    private:
+        class Ring : public ProducerConsumer < 1024 >
+        {
+            public:
+                // Never done, cleared each time the port's opened long before
+                // the counts could get there
+                Ring(void) { _total = 0xFFFFFFFF; }
+                void clear(void) { _produced = _consumed = 0; }
+        };
+
+        InterruptPipe < CDC_NOTIFY_EP_NUM > _ep_notify;
+        BulkPipe < CDC_DATA_EP_NUM, EndPoint::OUT > _ep_out;
+        BulkPipe < CDC_DATA_EP_NUM, EndPoint::IN > _ep_in;
+
+        Ring _ring;
+        LineCoding _line_coding;
+        uint16_t volatile _line_state = 0;
+        uint32_t _dropped = 0;
+
+        static constexpr uint16_t const _s_dtr = (1 << 0);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -919,13 +1205,41 @@ class Usb : public Module
         bool active(void) const { return !_iface.active() ? false : !idle(); }
         void reconnect(void) { _iface.reset(); }
 
+        // Card goes to the host read-only and only when lent, see Scsi::share().
+        // Only changes while nothing's connected.
+        void share(bool on) { if (!connected()) _iface.share(on); }
+        bool shared(void) const { return _iface.shared(); }
+        void lend(bool on) { _iface.lend(on); }
+
+        // Blocks the host has written since cleaned
+        TExtents const & written(void) const { return _iface.written(); }
+        void clean(void) { _iface.clean(); }
+
+        // Text for the CDC-ACM port, see CdcIface
+        bool logging(void) const { return !idle() && _cdc.open(); }
+        uint16_t log(char const * str) { return _cdc.write(str); }
+        uint32_t dropped(void) const { return _cdc.dropped(); }
+
+        // Bulk-Only commands and data moved either way, see BulkOnlyIface
+        uint32_t commands(void) const { return _iface.commands(); }
+        uint32_t bytes(void) const { return _iface.bytes(); }
+        uint32_t copied(void) const { return _iface.copied(); }
+
+        // Plugged in but nothing for the card to do, either suspended or
+        // there haven't been any commands for _s_quiet_msecs, so its bus can be
+        // switched off and the MCU can wait on interrupts
+        bool quiet(void) const;
+
     private:
         Usb(void);
 
+        static constexpr uint32_t const _s_quiet_msecs = 50;
+
         void setAddress(uint16_t address);
 
         DefaultPipe _ep0{*this};
         BulkOnlyIface _iface;
+        CdcIface _cdc;
 
         // Device States
         enum ds_e : uint8_t
@@ -1046,7 +1360,7 @@ UsbPacket < S, N > * UsbPacket < S, N >::acquire(void)
 template < uint16_t S, uint8_t N >
 UsbPacket < S, N > * UsbPacket < S, N >::acquire(EndPoint & ep)
 {
-    if (available())
+    if (available() && allowed(ep))
         return _acquire();
 
     if ((ep._type == EndPoint::CONTROL) || (ep._dir == EndPoint::OUT))
@@ -1095,6 +1409,10 @@ bool UsbPacket < S, N >::_give(UsbPacket * p)
     {
         if ((_s_ep_need[i] != 0) && (_s_eps[i] != nullptr))
         {
+            // Not counting this one, which is about to be given
+            if ((_s_eps[i]->_type != EndPoint::CONTROL) && (free() < _s_reserved))
+                continue;
+
             if (_s_eps[i]->give(p))
             {
                 _s_ep_need[i]--;
@@ -1169,14 +1487,26 @@ void BulkPipe < N, EndPoint::IN >::isr(dir_e dir, bank_e bank)
     // Get buffer descriptor for finished send
     BD * bd = _bd[bank];
 
-    UsbPkt * p = (UsbPkt *)bd->addr;
-    UsbPkt::release(p);
+    if (_span[bank])
+    {
+        _span[bank] = false;
+        _span_sent += bd->count();
+    }
+    else
+    {
+        UsbPkt::release((UsbPkt *)bd->addr);
+    }
 
     bd->clear();
 
-    // See if there are any packets in queue
+    UsbPkt * p;
+
+    // See if there are any packets in queue, otherwise keep any spans coming
     if (_pkt_queue.isEmpty())
+    {
+        refill();
         return;
+    }
 
     (void)_pkt_queue.dequeue(p);
 
@@ -1208,4 +1538,19 @@ bool BulkPipe < N, EndPoint::IN >::send(UsbPkt * p)
     return true;
 }
 
+template < EndPoint::num_e N >
+bool BulkPipe < N, EndPoint::IN >::send(uint8_t const * data, uint16_t dlen)
+{
+    if ((data == nullptr) || !canSendSpan())
+        return false;
+
+    _span[_bank] = true;
+    _bd[_bank]->set((uint8_t *)data, dlen, _dataX);
+
+    _dataX ^= 1;
+    _bank ^= 1;
+
+    return true;
+}
+
 #endif
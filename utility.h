@@ -8,6 +8,7 @@
 // Member Function Call
 #define MFC(member_func) ((*this).*(member_func))
 
+#ifdef __arm__
 // Sets the PRIMASK to 1, raising the execution priority to 0
 // effectively making the current executing handler uninterruptable
 // except by Reset, NMI and HardFault exceptions.
@@ -16,6 +17,11 @@
 // Sets PRIMASK to 0, thus setting execution priority back to what
 // it is configured as.
 #define __enable_irq()  __asm__ volatile ("CPSIE i":::"memory");
+#else
+// Host builds of the tests have no interrupts to hold off
+#define __disable_irq() __asm__ volatile ("":::"memory");
+#define __enable_irq()  __asm__ volatile ("":::"memory");
+#endif
 
 inline uint32_t msecs(void)
 {
@@ -477,9 +483,18 @@ class MinHeap
         T _nodes[S + 1];
 };
 
+// Single producer, single consumer ring buffer.  The producer and consumer are
+// expected to be in different contexts, e.g. a DMA ISR and the main loop, so
+// each side only ever writes its own count.  A count is published with a
+// release store after the data it covers is in place and the other side's count
+// is read with an acquire load, so no locking is needed.  BSIZE must be a power
+// of 2 so buffer offsets are a mask of the running counts.
 template < uint16_t BSIZE >
 class ProducerConsumer
 {
+    static_assert((BSIZE != 0) && ((BSIZE & (BSIZE - 1)) == 0),
+            "ProducerConsumer : BSIZE must be a power of 2");
+
     public:
         ProducerConsumer(void) = default;
 
@@ -492,13 +507,34 @@ class ProducerConsumer
         virtual uint16_t produce(uint8_t * data, uint16_t dlen, bool allow_trunc = false) final;
         virtual uint16_t consume(uint8_t * buf, uint16_t blen, bool allow_trunc = false) final;
 
-        virtual uint32_t consumed(void) const final { return _consumed; }
-        virtual uint32_t produced(void) const final { return _produced; }
+        // In place access.  Returns the length of the contiguous span at the
+        // current offset, at most len, and sets p to its start.  Nothing is
+        // handed over until publish() (producer) or commit() (consumer) is
+        // called with the amount actually used.  A consumer can peek past
+        // skip bytes it already has in hand but hasn't committed yet.
+        virtual uint16_t reserveContiguous(uint8_t ** p, uint16_t len = BSIZE) final;
+        virtual uint16_t peekContiguous(uint8_t const ** p, uint16_t len = BSIZE, uint16_t skip = 0) const final;
+        virtual void publish(uint16_t len) final { storeRelease(_produced, _produced + len); }
+        virtual void commit(uint16_t len) final { storeRelease(_consumed, _consumed + len); }
 
-        virtual bool consumeDone(void) const final { return _consumed == _total; }
-        virtual bool produceDone(void) const final { return _produced == _total; }
+        virtual uint32_t consumed(void) const final { return loadAcquire(_consumed); }
+        virtual uint32_t produced(void) const final { return loadAcquire(_produced); }
+
+        virtual bool consumeDone(void) const final { return consumed() == _total; }
+        virtual bool produceDone(void) const final { return produced() == _total; }
 
     protected:
+        static constexpr uint16_t const _s_mask = BSIZE - 1;
+        static uint16_t offset(uint32_t count) { return count & _s_mask; }
+
+        static uint32_t loadAcquire(uint32_t volatile const & count) {
+            return __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+        }
+
+        static void storeRelease(uint32_t volatile & count, uint32_t value) {
+            __atomic_store_n(&count, value, __ATOMIC_RELEASE);
+        }
+
         uint8_t _buffer[BSIZE];
         uint32_t volatile _produced = 0;
         uint32_t volatile _consumed = 0;
@@ -508,27 +544,22 @@ class ProducerConsumer
 template < uint16_t BSIZE >
 uint16_t ProducerConsumer < BSIZE >::produceLen(uint16_t len) const
 {
-    if (produceDone())
+    uint32_t produced = loadAcquire(_produced);
+    uint32_t consumed = loadAcquire(_consumed);
+
+    if (produced == _total)
         return 0;
 
     if (len > BSIZE)
         len = BSIZE;
 
-    if ((_produced + len) > _total)
-        len = _total - _produced;
+    if (len > (_total - produced))
+        len = _total - produced;
 
-    if (_produced > _consumed)
-    {
-        uint16_t poff = _produced % BSIZE;
-        uint16_t coff = _consumed % BSIZE;
-
-        if (poff == coff)
-            len = 0;
-        else if ((poff < coff) && ((poff + len) > coff))
-            len = coff - poff;
-        else if (((poff + len) > BSIZE) && (coff < ((poff + len) - BSIZE)))
-            len = (BSIZE - poff) + coff;
-    }
+    // Counts only ever increase so the difference is what's in the buffer
+    uint32_t space = BSIZE - (produced - consumed);
+    if (len > space)
+        len = space;
 
     return len;
 }
@@ -536,22 +567,18 @@ uint16_t ProducerConsumer < BSIZE >::produceLen(uint16_t len) const
 template < uint16_t BSIZE >
 uint16_t ProducerConsumer < BSIZE >::consumeLen(uint16_t len) const
 {
-    if (consumeDone() || (_consumed == _produced))
+    uint32_t consumed = loadAcquire(_consumed);
+    uint32_t produced = loadAcquire(_produced);
+
+    if (consumed == _total)
         return 0;
 
     if (len > BSIZE)
         len = BSIZE;
 
-    if ((_consumed + len) > _total)
-        len = _total - _consumed;
-
-    uint16_t poff = _produced % BSIZE;
-    uint16_t coff = _consumed % BSIZE;
-
-    if ((coff < poff) && ((coff + len) > poff))
-        len = poff - coff;
-    else if (((coff + len) > BSIZE) && (poff < ((coff + len) - BSIZE)))
-        len = (BSIZE - coff) + poff;
+    uint32_t avail = produced - consumed;
+    if (len > avail)
+        len = avail;
 
     return len;
 }
@@ -564,24 +591,18 @@ uint16_t ProducerConsumer < BSIZE >::produce(uint8_t * data, uint16_t dlen, bool
     if ((len == 0) || ((len != dlen) && !allow_trunc))
         return 0;
 
-    uint16_t poff = _produced % BSIZE;
-    uint16_t copied = len;
+    uint16_t poff = offset(_produced);
+    uint16_t cpy = BSIZE - poff;
 
-    if ((poff + len) > BSIZE)
-    {
-        uint16_t cpy = BSIZE - poff;
-        memcpy(_buffer + poff, data, cpy);
+    if (cpy > len)
+        cpy = len;
 
-        _produced += cpy;
-        data += cpy;
-        len -= cpy;
-        poff = 0;
-    }
+    memcpy(_buffer + poff, data, cpy);
+    memcpy(_buffer, data + cpy, len - cpy);
 
-    memcpy(_buffer + poff, data, len);
-    _produced += len;
+    publish(len);
 
-    return copied;
+    return len;
 }
 
 template < uint16_t BSIZE >
@@ -592,24 +613,271 @@ uint16_t ProducerConsumer < BSIZE >::consume(uint8_t * buf, uint16_t blen, bool
     if ((len == 0) || ((len != blen) && !allow_trunc))
         return 0;
 
-    uint16_t coff = _consumed % BSIZE;
-    uint16_t copied = len;
+    uint16_t coff = offset(_consumed);
+    uint16_t cpy = BSIZE - coff;
+
+    if (cpy > len)
+        cpy = len;
+
+    memcpy(buf, _buffer + coff, cpy);
+    memcpy(buf + cpy, _buffer, len - cpy);
+
+    commit(len);
+
+    return len;
+}
+
+template < uint16_t BSIZE >
+uint16_t ProducerConsumer < BSIZE >::reserveContiguous(uint8_t ** p, uint16_t len)
+{
+    uint16_t poff = offset(_produced);
+
+    len = produceLen(len);
+    if (len > (BSIZE - poff))
+        len = BSIZE - poff;
+
+    *p = _buffer + poff;
+
+    return len;
+}
+
+template < uint16_t BSIZE >
+uint16_t ProducerConsumer < BSIZE >::peekContiguous(uint8_t const ** p, uint16_t len, uint16_t skip) const
+{
+    uint16_t avail = consumeLen(BSIZE);
+    uint16_t coff = offset(_consumed + skip);
+
+    if (skip >= avail)
+        len = 0;
+    else if (len > (avail - skip))
+        len = avail - skip;
+
+    if (len > (BSIZE - coff))
+        len = BSIZE - coff;
+
+    *p = _buffer + coff;
+
+    return len;
+}
+
+// Pool of fixed size buffers for users that only need one for the duration of
+// an operation rather than holding a static buffer of their own.  Buffers are
+// reference counted so a lease can be shared and a buffer only goes back to
+// the pool once every holder has returned it.
+template < uint16_t BSIZE, uint8_t NUM >
+class BufferPool
+{
+    public:
+        static BufferPool & acquire(void) { static BufferPool pool; return pool; }
+
+        // Returns nullptr if all buffers are leased
+        uint8_t * lease(void);
+        void retain(uint8_t * buf);
+        void giveBack(uint8_t * buf);
+
+        uint8_t available(void) const { return NUM - _leased; }
+        uint8_t lowWater(void) const { return _low_water; }
+
+        // Scoped lease that returns the buffer on destruction.  Copies share the buffer.
+        class Lease
+        {
+            public:
+                Lease(void) : Lease(true) {}
+                explicit Lease(bool take) : _buf(take ? BufferPool::acquire().lease() : nullptr) {}
+                Lease(Lease const & lease) : _buf(lease._buf) { BufferPool::acquire().retain(_buf); }
+                ~Lease(void) { reset(); }
+
+                Lease & operator=(Lease const & lease)
+                {
+                    if (_buf == lease._buf)
+                        return *this;
+
+                    BufferPool::acquire().retain(lease._buf);
+                    reset();
+                    _buf = lease._buf;
+
+                    return *this;
+                }
+
+                bool valid(void) const { return _buf != nullptr; }
+                void reset(void) { BufferPool::acquire().giveBack(_buf); _buf = nullptr; }
+
+                uint8_t * get(void) const { return _buf; }
+                uint8_t (&block(void) const)[BSIZE] { return *(uint8_t (*)[BSIZE])_buf; }
+
+            private:
+                uint8_t * _buf;
+        };
+
+        BufferPool(BufferPool const &) = delete;
+        BufferPool & operator=(BufferPool const &) = delete;
+
+    private:
+        BufferPool(void) = default;
+
+        int8_t index(uint8_t const * buf) const
+        {
+            if ((buf < _buffers[0]) || (buf > _buffers[NUM - 1]) || (((buf - _buffers[0]) % BSIZE) != 0))
+                return -1;
+
+            return (buf - _buffers[0]) / BSIZE;
+        }
+
+        uint8_t _buffers[NUM][BSIZE] __attribute__ ((aligned (4)));
+        uint8_t _refs[NUM] = {};
+        uint8_t _leased = 0;
+        uint8_t _low_water = NUM;
+};
+
+// Leases may be taken from interrupt context so reference counts are updated
+// with interrupts disabled.
+template < uint16_t BSIZE, uint8_t NUM >
+uint8_t * BufferPool < BSIZE, NUM >::lease(void)
+{
+    uint8_t * buf = nullptr;
+
+    __disable_irq();
+
+    for (uint8_t i = 0; i < NUM; i++)
+    {
+        if (_refs[i] != 0)
+            continue;
+
+        _refs[i] = 1;
+        _leased++;
+        buf = _buffers[i];
+
+        if (available() < _low_water)
+            _low_water = available();
+
+        break;
+    }
+
+    __enable_irq();
+
+    return buf;
+}
+
+template < uint16_t BSIZE, uint8_t NUM >
+void BufferPool < BSIZE, NUM >::retain(uint8_t * buf)
+{
+    int8_t i = index(buf);
+    if (i < 0)
+        return;
+
+    __disable_irq();
+    _refs[i]++;
+    __enable_irq();
+}
+
+template < uint16_t BSIZE, uint8_t NUM >
+void BufferPool < BSIZE, NUM >::giveBack(uint8_t * buf)
+{
+    int8_t i = index(buf);
+    if (i < 0)
+        return;
+
+    __disable_irq();
+
+    if ((_refs[i] != 0) && (--_refs[i] == 0))
+        _leased--;
+
+    __enable_irq();
+}
+
+// Ranges of addresses, e.g. the blocks written to a disk, kept in order and
+// merged where they overlap or touch.  Only N are kept so when another won't
+// fit the two closest are joined along with the gap between them.  What's kept
+// always covers at least everything added.
+template < uint8_t N >
+class Extents
+{
+    public:
+        struct Extent
+        {
+            uint32_t start;
+            uint32_t end;  // One past the last
+        };
+
+        void add(uint32_t start, uint32_t len);
+        bool overlaps(uint32_t start, uint32_t len) const;
+
+        void clear(void) { _count = 0; }
+        bool empty(void) const { return _count == 0; }
+        uint8_t count(void) const { return _count; }
+        Extent const & operator [](uint8_t i) const { return _extents[i]; }
+
+    private:
+        static uint32_t end(uint32_t start, uint32_t len) {
+            return ((UINT32_MAX - start) < len) ? UINT32_MAX : (start + len);
+        }
+
+        // One more than kept to make room before joining
+        Extent _extents[N + 1];
+        uint8_t _count = 0;
+};
+
+template < uint8_t N >
+void Extents < N >::add(uint32_t start, uint32_t len)
+{
+    if (len == 0)
+        return;
+
+    Extent ext = { start, end(start, len) };
+
+    // First one that ends at or after where this starts, then however many it
+    // overlaps or touches from there
+    uint8_t i = 0;
+    while ((i < _count) && (_extents[i].end < ext.start))
+        i++;
+
+    uint8_t j = i;
+    for (; (j < _count) && (_extents[j].start <= ext.end); j++)
+    {
+        if (_extents[j].start < ext.start) ext.start = _extents[j].start;
+        if (_extents[j].end > ext.end) ext.end = _extents[j].end;
+    }
 
-    if ((coff + len) > BSIZE)
+    if (j == i)
+    {
+        memmove(&_extents[i + 1], &_extents[i], (_count - i) * sizeof(Extent));
+        _count++;
+    }
+    else if ((j - i) > 1)
     {
-        uint16_t cpy = BSIZE - coff;
-        memcpy(buf, _buffer + coff, cpy);
+        memmove(&_extents[i + 1], &_extents[j], (_count - j) * sizeof(Extent));
+        _count -= (j - i) - 1;
+    }
+
+    _extents[i] = ext;
+
+    if (_count <= N)
+        return;
 
-        _consumed += cpy;
-        buf += cpy;
-        len -= cpy;
-        coff = 0;
+    uint8_t k = 0;
+    for (uint8_t m = 1; m < (_count - 1); m++)
+    {
+        if ((_extents[m + 1].start - _extents[m].end) < (_extents[k + 1].start - _extents[k].end))
+            k = m;
     }
 
-    memcpy(buf, _buffer + coff, len);
-    _consumed += len;
+    _extents[k].end = _extents[k + 1].end;
+    memmove(&_extents[k + 1], &_extents[k + 2], (_count - (k + 2)) * sizeof(Extent));
+    _count--;
+}
+
+template < uint8_t N >
+bool Extents < N >::overlaps(uint32_t start, uint32_t len) const
+{
+    uint32_t e = end(start, len);
+
+    for (uint8_t i = 0; (i < _count) && (_extents[i].start < e); i++)
+    {
+        if (_extents[i].end > start)
+            return true;
+    }
 
-    return copied;
+    return false;
 }
 
 class Serializable